@@ -62,6 +62,34 @@
 #define MSX_SETPOINT   2
 #define MSX_FLOWPACED  3
 
+#define MSX_WALLTIME     0
+#define MSX_CPUTIME      1
+#define MSX_THREADREACT  2
+#define MSX_THREADMIX    3
+#define MSX_SEGMENTS     4
+#define MSX_PEAKSEGMENTS 5
+#define MSX_STEPS        6
+#define MSX_REJECTS      7
+#define MSX_NEWTONITERS  8
+#define MSX_REVERSALS    9
+#define MSX_SORTS        10
+#define MSX_REPAIRS      11
+#define MSX_REORDERS     12
+#define MSX_THREADS      13
+#define MSX_SEGSTEPS     14
+#define MSX_QUALSTEPS    15
+#define MSX_IMBALANCE    16
+#define MSX_MASSRATIO    17
+#define MSX_STOREDMASS   18
+
+#define MSX_HYDPHASE       0
+#define MSX_SORTPHASE      1
+#define MSX_REACTPHASE     2
+#define MSX_ADVECTPHASE    3
+#define MSX_TRANSPORTPHASE 4
+#define MSX_OUTPUTPHASE    5
+#define MSX_TOTALPHASE     6
+
 // --- declare MSX functions
 
 int  DLLEXPORT MSXopen(char *fname);
@@ -69,13 +97,18 @@ int  DLLEXPORT MSXsolveH(void);
 int  DLLEXPORT MSXusehydfile(char *fname);
 int  DLLEXPORT MSXsolveQ(void);
 int  DLLEXPORT MSXinit(int saveFlag);
+int  DLLEXPORT MSXreset(void);
 int  DLLEXPORT MSXstep(long *t, long *tleft);
 int  DLLEXPORT MSXsaveoutfile(char *fname);
 int  DLLEXPORT MSXsavemsxfile(char *fname);
+int  DLLEXPORT MSXsavesnapshot(char *fname);
+int  DLLEXPORT MSXsavestate(char *fname);
+int  DLLEXPORT MSXrestorestate(char *fname);
 int  DLLEXPORT MSXreport(void);
 int  DLLEXPORT MSXclose(void);
 
 int  DLLEXPORT MSXgetindex(int type, char *id, int *index);
+int  DLLEXPORT MSXgetindices(int type, int n, char *ids[], int *indices);
 int  DLLEXPORT MSXgetIDlen(int type, int index, int *len);
 int  DLLEXPORT MSXgetID(int type, int index, char *id, int len);
 int  DLLEXPORT MSXgetcount(int type, int *count);
@@ -89,6 +122,10 @@ int  DLLEXPORT MSXgetpatternlen(int pat, int *len);
 int  DLLEXPORT MSXgetpatternvalue(int pat, int period, double *value);
 int  DLLEXPORT MSXgetinitqual(int type, int index, int species, double *value);
 int  DLLEXPORT MSXgetqual(int type, int index, int species, double *value);
+int  DLLEXPORT MSXgetquals(int type, int species, double *values);
+int  DLLEXPORT MSXgetperiods(int *count);
+int  DLLEXPORT MSXgetseries(int type, int index, int species, double *values);
+int  DLLEXPORT MSXgetstats(int stat, int index, double *value);
 int  DLLEXPORT MSXgeterror(int code, char *msg, int len);
 
 int  DLLEXPORT MSXsetconstant(int index, double value);
@@ -98,6 +135,82 @@ int  DLLEXPORT MSXsetsource(int node, int species, int type, double level,
                int pat);
 int  DLLEXPORT MSXsetpatternvalue(int pat, int period, double value);
 int  DLLEXPORT MSXsetpattern(int pat, double mult[], int len);
+int  DLLEXPORT MSXsetoutput(int type, int index, int flag);
 int  DLLEXPORT MSXaddpattern(char *id);
 
+// --- declare MSX functions that load a hydraulics file once into memory
+//     so it can be shared, read-only, by any number of projects
+
+typedef struct ShydTimeline *MSX_Hydraulics;
+
+int  DLLEXPORT MSXloadhydraulics(MSX_Hydraulics *hh);
+int  DLLEXPORT MSXusehydraulics(MSX_Hydraulics hh);
+int  DLLEXPORT MSXfreehydraulics(MSX_Hydraulics *hh);
+
+// --- declare MSX functions that work on a project handle;
+//     each has the same meaning as the MSX function of like name
+
+typedef struct Sproject *MSX_Project;
+
+int  DLLEXPORT MSX_createproject(MSX_Project *ph);
+int  DLLEXPORT MSX_deleteproject(MSX_Project *ph);
+
+int  DLLEXPORT MSX_open(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_solveH(MSX_Project ph);
+int  DLLEXPORT MSX_usehydfile(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_loadhydraulics(MSX_Project ph, MSX_Hydraulics *hh);
+int  DLLEXPORT MSX_usehydraulics(MSX_Project ph, MSX_Hydraulics hh);
+int  DLLEXPORT MSX_solveQ(MSX_Project ph);
+int  DLLEXPORT MSX_init(MSX_Project ph, int saveFlag);
+int  DLLEXPORT MSX_reset(MSX_Project ph);
+int  DLLEXPORT MSX_step(MSX_Project ph, long *t, long *tleft);
+int  DLLEXPORT MSX_saveoutfile(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_savemsxfile(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_savesnapshot(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_savestate(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_restorestate(MSX_Project ph, char *fname);
+int  DLLEXPORT MSX_report(MSX_Project ph);
+int  DLLEXPORT MSX_close(MSX_Project ph);
+
+int  DLLEXPORT MSX_getindex(MSX_Project ph, int type, char *id, int *index);
+int  DLLEXPORT MSX_getindices(MSX_Project ph, int type, int n, char *ids[],
+               int *indices);
+int  DLLEXPORT MSX_getIDlen(MSX_Project ph, int type, int index, int *len);
+int  DLLEXPORT MSX_getID(MSX_Project ph, int type, int index, char *id, int len);
+int  DLLEXPORT MSX_getcount(MSX_Project ph, int type, int *count);
+int  DLLEXPORT MSX_getspecies(MSX_Project ph, int index, int *type,
+               char *units, double *aTol, double *rTol);
+int  DLLEXPORT MSX_getconstant(MSX_Project ph, int index, double *value);
+int  DLLEXPORT MSX_getparameter(MSX_Project ph, int type, int index,
+               int param, double *value);
+int  DLLEXPORT MSX_getsource(MSX_Project ph, int node, int species, int *type,
+               double *level, int *pat);
+int  DLLEXPORT MSX_getpatternlen(MSX_Project ph, int pat, int *len);
+int  DLLEXPORT MSX_getpatternvalue(MSX_Project ph, int pat, int period,
+               double *value);
+int  DLLEXPORT MSX_getinitqual(MSX_Project ph, int type, int index,
+               int species, double *value);
+int  DLLEXPORT MSX_getqual(MSX_Project ph, int type, int index, int species,
+               double *value);
+int  DLLEXPORT MSX_getquals(MSX_Project ph, int type, int species,
+               double *values);
+int  DLLEXPORT MSX_getperiods(MSX_Project ph, int *count);
+int  DLLEXPORT MSX_getseries(MSX_Project ph, int type, int index, int species,
+               double *values);
+int  DLLEXPORT MSX_getstats(MSX_Project ph, int stat, int index,
+               double *value);
+
+int  DLLEXPORT MSX_setconstant(MSX_Project ph, int index, double value);
+int  DLLEXPORT MSX_setparameter(MSX_Project ph, int type, int index,
+               int param, double value);
+int  DLLEXPORT MSX_setinitqual(MSX_Project ph, int type, int index,
+               int species, double value);
+int  DLLEXPORT MSX_setsource(MSX_Project ph, int node, int species, int type,
+               double level, int pat);
+int  DLLEXPORT MSX_setpatternvalue(MSX_Project ph, int pat, int period,
+               double value);
+int  DLLEXPORT MSX_setpattern(MSX_Project ph, int pat, double mult[], int len);
+int  DLLEXPORT MSX_setoutput(MSX_Project ph, int type, int index, int flag);
+int  DLLEXPORT MSX_addpattern(MSX_Project ph, char *id);
+
 #endif
@@ -24,16 +24,83 @@
 **  rate and equilbrium expressions that define their chemical behavior. The
 **  format of these files is described in the EPANET and EPANET-MSX Users
 **  Manuals, respectively.
+**
+**  In ensemble mode the console version runs each scenario listed in a
+**  scenario file, saving the results of each to its own binary output
+**  file. A scenario file holds lines of the following form, where the
+**  IDs are those of the EPANET and EPANET-MSX input files and anything
+**  after a semicolon is a comment:
+**
+**    SCENARIO   name
+**    SOURCE     type  nodeID  speciesID  strength  (patternID)
+**    QUALITY    GLOBAL  speciesID  value
+**    QUALITY    NODE  nodeID  speciesID  value
+**    QUALITY    LINK  linkID  speciesID  value
+**    PARAMETER  GLOBAL  paramID  value
+**    PARAMETER  PIPE  pipeID  paramID  value
+**    PARAMETER  TANK  tankID  paramID  value
+**    CONSTANT   constantID  value
+**
+**  Each SCENARIO line begins a new scenario whose changes to the inputs
+**  read from the EPANET-MSX file are given by the lines that follow it.
+**  A source's type is NONE, CONCEN, MASS, SETPOINT or FLOWPACED. The
+**  network's hydraulics are solved only once and are shared by all of
+**  the scenarios, which are run in parallel (when compiled with OpenMP)
+**  by a set of projects that are each reset between scenarios. Adding
+**  SUBSET YES to the [REPORT] section of the EPANET-MSX file keeps each
+**  scenario's output file small.
 *******************************************************************************/
 #define _CRT_SECURE_NO_DEPRECATE
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <float.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
 
 #include "epanet2.h"                   // EPANET toolkit header file
 #include "epanetmsx.h"                 // EPANET-MSX toolkit header file
 
+#define MAXLINE  1024                  // Max. # characters in a scenario line
+#define MAXTOKS  6                     // Max. # items on a scenario line
+#define MAXNAME  255                   // Max. # characters in a scenario item
+
+enum ChangeType {SOURCE_CHANGE, QUALITY_CHANGE, PARAMETER_CHANGE,
+                 CONSTANT_CHANGE};
+
+typedef struct                         // CHANGE MADE BY A SCENARIO
+{
+    int    kind;                       // type of change
+    int    type;                       // MSX_NODE or MSX_LINK (or source type)
+    int    index;                      // node, link or constant (0 = all)
+    int    item;                       // species or parameter
+    int    pat;                        // source time pattern
+    double value;                      // new value
+}   Schange;
+
+typedef struct                         // SCENARIO OF AN ENSEMBLE
+{
+    char    name[MAXNAME+1];           // scenario name
+    Schange *changes;                  // changes made to the inputs
+    int     nchanges;                  // number of changes
+    int     err;                       // error code of the scenario's run
+    int     periods;                   // number of periods saved
+}   Sscenario;
+
+static int Nnodes, Nlinks;             // numbers of network nodes and links
+
+static int  runEnsemble(int argc, char *argv[]);
+static int  readScenarios(char *fname, MSX_Project ph, Sscenario **scen,
+                          int *nscen);
+static int  parseChange(MSX_Project ph, char tok[][MAXNAME+1], int ntoks,
+                        Schange *change);
+static int  runScenario(MSX_Project ph, Sscenario *s, char *prefix);
+static int  applyChange(MSX_Project ph, Schange *change);
+static int  match(char *s, char *keyword);
+
 int main(int argc, char *argv[])
 /*
 **  Purpose:
@@ -54,6 +121,14 @@ int main(int argc, char *argv[])
 **       messages and output results
 **     - optionally, the name of an output file that will
 **       contain water quality results in binary format.
+**    For ensemble mode the arguments are instead:
+**     - the option -e
+**     - the name of a scenario file
+**     - the names of the EPANET input file, the EPANET-MSX input file
+**       and the report file as above
+**     - optionally, a prefix (such as a directory name) given to the
+**       binary output file of each scenario, which is named after the
+**       scenario with an extension of .out.
 */
 {
     int    err, done = 1;
@@ -62,6 +137,8 @@ int main(int argc, char *argv[])
 
 // --- check command line arguments
 
+    if ( argc >= 2 && strcmp(argv[1], "-e") == 0 )
+        return runEnsemble(argc, argv);
     if ( argc < 4 )
     {
         printf("\n Too few command line arguments.\n");
@@ -169,3 +246,428 @@ int main(int argc, char *argv[])
     printf("\n");
     return err;
 }
+
+//=============================================================================
+
+int runEnsemble(int argc, char *argv[])
+/*
+**  Purpose:
+**    runs each scenario of a scenario file and saves its results to
+**    its own binary output file.
+**
+**  Input:
+**    argc = number of command line arguments
+**    argv = array of command line arguments.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: a project is opened for each thread that runs scenarios, all
+**        before the first scenario is run, since opening a project
+**        reads the network from EPANET.
+*/
+{
+    int    i, p, err, nscen = 0, nprojects = 1;
+    char   *prefix = (argc >= 7) ? argv[6] : "";
+    MSX_Project    *ph;
+    MSX_Hydraulics hh = NULL;
+    Sscenario      *scen = NULL;
+
+    if ( argc < 6 )
+    {
+        printf("\n Too few command line arguments.\n");
+        return 0;
+    }
+#ifdef _OPENMP
+    nprojects = omp_get_max_threads();
+#endif
+    ph = (MSX_Project *) calloc(nprojects, sizeof(MSX_Project));
+    if ( ph == NULL ) return 0;
+
+// --- open EPANET file
+
+    printf("\n... EPANET-MSX Version 1.1\n");
+    printf("\n  o Processing EPANET input file");
+    err = ENopen(argv[3], argv[5], "");
+    if (err)
+    {
+        printf("\n\n... Cannot read EPANET file; error code = %d\n", err);
+        ENclose();
+        free(ph);
+        return 0;
+    }
+    ENgetcount(EN_NODECOUNT, &Nnodes);
+    ENgetcount(EN_LINKCOUNT, &Nlinks);
+    do
+    {
+    // --- open the first project, solve its hydraulics once for all
+    //     projects and read the scenarios
+
+        printf("\n  o Processing MSX input file   ");
+        err = MSX_createproject(&ph[0]);
+        if ( !err ) err = MSX_open(ph[0], argv[4]);
+        if (err)
+        {
+            printf("\n\n... Cannot read EPANET-MSX file; error code = %d\n", err);
+            break;
+        }
+        printf("\n  o Computing network hydraulics");
+        err = MSX_solveH(ph[0]);
+        if ( !err ) err = MSX_loadhydraulics(ph[0], &hh);
+        if ( !err ) err = MSX_usehydraulics(ph[0], hh);
+        if (err)
+        {
+            printf("\n\n... Cannot obtain network hydraulics; error code = %d\n", err);
+            break;
+        }
+        printf("\n  o Processing scenario file");
+        err = readScenarios(argv[2], ph[0], &scen, &nscen);
+        if ( err ) break;
+
+    // --- open a project for each of the other threads
+
+        if ( nprojects > nscen ) nprojects = nscen;
+        for (p = 1; p < nprojects; p++)
+        {
+            err = MSX_createproject(&ph[p]);
+            if ( !err ) err = MSX_open(ph[p], argv[4]);
+            if ( !err ) err = MSX_usehydraulics(ph[p], hh);
+            if ( err )
+            {
+                printf("\n\n... Cannot open EPANET-MSX project; error code = %d\n", err);
+                break;
+            }
+        }
+        if ( err ) break;
+
+    // --- run the scenarios, each thread with its own project
+
+        printf("\n  o Running %d scenarios on %d threads", nscen, nprojects);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, p) schedule(dynamic, 1) num_threads(nprojects)
+#endif
+        for (i = 0; i < nscen; i++)
+        {
+            p = 0;
+#ifdef _OPENMP
+            p = omp_get_thread_num();
+#endif
+            scen[i].err = runScenario(ph[p], &scen[i], prefix);
+        }
+
+    // --- list the outcome of each scenario
+
+        printf("\n");
+        for (i = 0; i < nscen; i++)
+        {
+            if ( scen[i].err )
+                printf("\n  o Scenario %s failed; error code = %d", scen[i].name,
+                       scen[i].err);
+            else printf("\n  o Scenario %s saved %d periods", scen[i].name,
+                        scen[i].periods);
+        }
+        for (i = nscen-1; i >= 0; i--)
+        {
+            if ( scen[i].err ) err = scen[i].err;
+        }
+
+    } while (0);
+
+//--- close all projects and the EPANET system
+
+    for (p = 0; p < nprojects; p++)
+    {
+        if ( ph[p] == NULL ) continue;
+        MSX_close(ph[p]);
+        MSX_deleteproject(&ph[p]);
+    }
+    MSXfreehydraulics(&hh);
+    for (i = 0; i < nscen; i++) free(scen[i].changes);
+    free(scen);
+    free(ph);
+    ENclose();
+    if ( !err ) printf("\n\n... EPANET-MSX completed successfully.");
+    printf("\n");
+    return err;
+}
+
+//=============================================================================
+
+int readScenarios(char *fname, MSX_Project ph, Sscenario **scen, int *nscen)
+/*
+**  Purpose:
+**    reads the scenarios of a scenario file.
+**
+**  Input:
+**    fname = name of the scenario file
+**    ph = project whose network and chemistry the scenarios change.
+**
+**  Output:
+**    scen = array of scenarios
+**    nscen = number of scenarios.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    int    n = 0, size = 0, lineno = 0, ntoks, err = 0;
+    char   line[MAXLINE+1], *c;
+    char   tok[MAXTOKS][MAXNAME+1];
+    FILE   *f;
+    Sscenario *s = NULL, *list = NULL;
+
+    if ( (f = fopen(fname, "rt")) == NULL )
+    {
+        printf("\n\n... Cannot open scenario file %s\n", fname);
+        return 1;
+    }
+    while ( !err && fgets(line, MAXLINE, f) != NULL )
+    {
+        lineno++;
+        if ( (c = strchr(line, ';')) != NULL ) *c = '\0';
+        ntoks = sscanf(line, "%255s %255s %255s %255s %255s %255s",
+                       tok[0], tok[1], tok[2], tok[3], tok[4], tok[5]);
+        if ( ntoks <= 0 ) continue;
+
+    // --- start a new scenario
+
+        if ( match(tok[0], "SCENARIO") )
+        {
+            if ( ntoks < 2 ) err = 1;
+            else if ( n == size )
+            {
+                size = size ? 2*size : 16;
+                list = (Sscenario *) realloc(*scen, size*sizeof(Sscenario));
+                if ( list == NULL ) err = 1;
+                else *scen = list;
+            }
+            if ( err ) break;
+            s = &(*scen)[n++];
+            memset(s, 0, sizeof(Sscenario));
+            strcpy(s->name, tok[1]);
+            continue;
+        }
+
+    // --- add a change to the current scenario
+
+        if ( s == NULL ) err = 1;
+        else
+        {
+            c = (char *) realloc(s->changes, (s->nchanges+1)*sizeof(Schange));
+            if ( c == NULL ) err = 1;
+            else
+            {
+                s->changes = (Schange *)c;
+                err = parseChange(ph, tok, ntoks, &s->changes[s->nchanges]);
+                if ( !err ) s->nchanges++;
+            }
+        }
+    }
+    fclose(f);
+    *nscen = n;
+    if ( err ) printf("\n\n... Invalid line %d in scenario file\n", lineno);
+    else if ( n == 0 ) printf("\n\n... No scenarios in scenario file\n");
+    return ( err || n == 0 );
+}
+
+//=============================================================================
+
+int parseChange(MSX_Project ph, char tok[][MAXNAME+1], int ntoks,
+                Schange *change)
+/*
+**  Purpose:
+**    finds the change to the inputs given by a line of a scenario file.
+**
+**  Input:
+**    ph = project whose inputs are changed
+**    tok = items on the line
+**    ntoks = number of items.
+**
+**  Output:
+**    change = the change given by the line.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    static char *sourceTypes[] = {"NONE", "CONCEN", "MASS", "SETPOINT",
+                                  "FLOWPACED"};
+    int  i, k, err = 0;
+    char *id;
+
+    memset(change, 0, sizeof(Schange));
+
+// --- SOURCE type nodeID speciesID strength (patternID)
+
+    if ( match(tok[0], "SOURCE") )
+    {
+        if ( ntoks < 5 ) return 1;
+        change->kind = SOURCE_CHANGE;
+        for (i = 0; i < 5 && !match(tok[1], sourceTypes[i]); i++);
+        if ( i == 5 ) return 1;
+        change->type = MSX_NOSOURCE + i;
+        err = MSX_getindex(ph, MSX_NODE, tok[2], &change->index);
+        if ( !err ) err = MSX_getindex(ph, MSX_SPECIES, tok[3], &change->item);
+        if ( !err && sscanf(tok[4], "%lf", &change->value) != 1 ) err = 1;
+        if ( !err && ntoks >= 6 )
+            err = MSX_getindex(ph, MSX_PATTERN, tok[5], &change->pat);
+        return err;
+    }
+
+// --- QUALITY GLOBAL|NODE|LINK (objectID) speciesID value
+//     or PARAMETER GLOBAL|PIPE|TANK (objectID) paramID value
+
+    if ( match(tok[0], "QUALITY") || match(tok[0], "PARAMETER") )
+    {
+        change->kind = match(tok[0], "QUALITY") ? QUALITY_CHANGE :
+                                                  PARAMETER_CHANGE;
+        k = 3;
+        if ( match(tok[1], "GLOBAL") )
+        {
+            change->type = MSX_NODE;
+            k = 2;
+        }
+        else if ( match(tok[1], "NODE") || match(tok[1], "TANK") )
+            change->type = MSX_NODE;
+        else if ( match(tok[1], "LINK") || match(tok[1], "PIPE") )
+            change->type = MSX_LINK;
+        else return 1;
+        if ( ntoks < k+2 ) return 1;
+        if ( k == 3 ) err = MSX_getindex(ph, change->type, tok[2], &change->index);
+        id = tok[k];
+        if ( !err ) err = MSX_getindex(ph, change->kind == QUALITY_CHANGE ?
+                          MSX_SPECIES : MSX_PARAMETER, id, &change->item);
+        if ( !err && sscanf(tok[k+1], "%lf", &change->value) != 1 ) err = 1;
+        return err;
+    }
+
+// --- CONSTANT constantID value
+
+    if ( match(tok[0], "CONSTANT") )
+    {
+        if ( ntoks < 3 ) return 1;
+        change->kind = CONSTANT_CHANGE;
+        err = MSX_getindex(ph, MSX_CONSTANT, tok[1], &change->index);
+        if ( !err && sscanf(tok[2], "%lf", &change->value) != 1 ) err = 1;
+        return err;
+    }
+    return 1;
+}
+
+//=============================================================================
+
+int runScenario(MSX_Project ph, Sscenario *s, char *prefix)
+/*
+**  Purpose:
+**    runs a scenario and saves its results to a binary output file.
+**
+**  Input:
+**    ph = project that runs the scenario
+**    s = the scenario
+**    prefix = prefix given to the name of the output file.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    int  i, err;
+    long t, tleft;
+    char *fname;
+
+// --- undo the changes of the project's previous scenario and make
+//     those of this one
+
+    err = MSX_reset(ph);
+    for (i = 0; i < s->nchanges && !err; i++) err = applyChange(ph, &s->changes[i]);
+    if ( err ) return err;
+
+// --- run the scenario
+
+    err = MSX_init(ph, 1);
+    if ( err ) return err;
+    do err = MSX_step(ph, &t, &tleft);
+    while ( !err && tleft > 0 );
+    if ( err ) return err;
+
+// --- save its results
+
+    err = MSX_getperiods(ph, &s->periods);
+    if ( err ) return err;
+    fname = (char *) malloc(strlen(prefix) + strlen(s->name) + 5);
+    if ( fname == NULL ) return 501;
+    sprintf(fname, "%s%s.out", prefix, s->name);
+    err = MSX_saveoutfile(ph, fname);
+    free(fname);
+    return err;
+}
+
+//=============================================================================
+
+int applyChange(MSX_Project ph, Schange *change)
+/*
+**  Purpose:
+**    makes a scenario's change to the inputs of a project.
+**
+**  Input:
+**    ph = project whose inputs are changed
+**    change = the change made.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    int j, err = 0;
+
+    switch ( change->kind )
+    {
+    case SOURCE_CHANGE:
+        return MSX_setsource(ph, change->index, change->item, change->type,
+                             change->value, change->pat);
+
+    case CONSTANT_CHANGE:
+        return MSX_setconstant(ph, change->index, change->value);
+
+    case QUALITY_CHANGE:
+        if ( change->index > 0 )
+            return MSX_setinitqual(ph, change->type, change->index,
+                                   change->item, change->value);
+        for (j = 1; j <= Nnodes && !err; j++)
+            err = MSX_setinitqual(ph, MSX_NODE, j, change->item, change->value);
+        for (j = 1; j <= Nlinks && !err; j++)
+            err = MSX_setinitqual(ph, MSX_LINK, j, change->item, change->value);
+        return err;
+
+    case PARAMETER_CHANGE:
+        if ( change->index > 0 )
+            return MSX_setparameter(ph, change->type, change->index,
+                                    change->item, change->value);
+        for (j = 1; j <= Nnodes && !err; j++)
+            err = MSX_setparameter(ph, MSX_NODE, j, change->item, change->value);
+        for (j = 1; j <= Nlinks && !err; j++)
+            err = MSX_setparameter(ph, MSX_LINK, j, change->item, change->value);
+        return err;
+    }
+    return 0;
+}
+
+//=============================================================================
+
+int match(char *s, char *keyword)
+/*
+**  Purpose:
+**    sees if a string matches a keyword, ignoring case.
+**
+**  Input:
+**    s = a string
+**    keyword = a keyword in upper case.
+**
+**  Returns:
+**    1 if the string matches the keyword or 0 if not.
+*/
+{
+    for ( ; *s && *keyword; s++, keyword++)
+    {
+        if ( toupper((unsigned char)*s) != *keyword ) return 0;
+    }
+    return ( *s == '\0' && *keyword == '\0' );
+}
@@ -4,103 +4,139 @@
 //   Implementation of a simple Hash Table for string storage & retrieval
 //
 //   Written by L. Rossman
-//   Last Updated on 6/19/03
+//   Last Updated on 10/14/26
 //
 //   The hash table data structure (HTable) is defined in "hash.h".
 //   Interface Functions:
-//      HTcreate() - creates a hash table
-//      HTinsert() - inserts a string & its index value into a hash table
-//      HTfind()   - retrieves the index value of a string from a table
-//      HTfree()   - frees a hash table
+//      HTcreate()      - creates a hash table
+//      HTcreateSized() - creates a hash table for a given number of keys
+//      HTinsert()      - inserts a string & its index value into a hash table
+//      HTfind()        - retrieves the index value of a string from a table
+//      HTfindKey()     - retrieves the table's copy of a string
+//      HTcount()       - returns the number of strings in a table
+//      HTfree()        - frees a hash table
+//
+//   The table uses open addressing with linear probing. Its size is a
+//   power of 2 that is doubled whenever it becomes half full, so lookups
+//   take a small, constant number of probes no matter how many strings
+//   it holds. Each entry keeps its string's full hash code so that most
+//   probes that miss are rejected without comparing strings.
 //-----------------------------------------------------------------------------
 
 #include <stdlib.h>
 #include <string.h>
 #include "hash.h"
 
-/* Use Fletcher's checksum to compute 2-byte hash of string */
+/* Use the FNV-1a hash, with a final mixing step, as a string's hash code */
 unsigned int hash(char *str)
 {
-    unsigned int sum1= 0, check1;
-    unsigned long sum2= 0L;
-	while(  '\0' != *str  )
+    unsigned int h = 2166136261u;
+    while ( '\0' != *str )
     {
-        sum1 += (*str);
+        h ^= (unsigned char)(*str);
+        h *= 16777619u;
         str++;
-        if (  255 <= sum1  ) sum1 -= 255;
-        sum2 += sum1;
     }
-    check1= sum2;
-    check1 %= 255;
-    check1= 255 - (sum1+check1) % 255;
-    sum1= 255 - (sum1+check1) % 255;
-    return( ( ( check1 << 8 )  |  sum1  ) % HTMAXSIZE);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Find the slot that holds a key or the empty slot where it belongs */
+static struct HTentry *probe(HTtable *ht, char *key, unsigned int code)
+{
+        unsigned int mask = ht->size - 1;
+        unsigned int i = code & mask;
+        struct HTentry *entry;
+        for (;;)
+        {
+            entry = &ht->entries[i];
+            if ( entry->key == NULL ) return entry;
+            if ( entry->code == code && strcmp(entry->key,key) == 0 ) return entry;
+            i = (i + 1) & mask;
+        }
+}
+
+/* Move a table's entries into one twice its size */
+static int grow(HTtable *ht)
+{
+        int i, oldsize = ht->size;
+        struct HTentry *old = ht->entries;
+        struct HTentry *entry;
+        struct HTentry *entries = (struct HTentry *)
+            calloc(2*oldsize, sizeof(struct HTentry));
+        if (entries == NULL) return(0);
+        ht->entries = entries;
+        ht->size = 2*oldsize;
+        for (i=0; i<oldsize; i++)
+        {
+            if ( old[i].key == NULL ) continue;
+            entry = probe(ht, old[i].key, old[i].code);
+            *entry = old[i];
+        }
+        free(old);
+        return(1);
 }
 
 HTtable *HTcreate()
 {
-        int i;
-        HTtable *ht = (HTtable *) calloc(HTMAXSIZE, sizeof(HTtable));
-        if (ht != NULL) for (i=0; i<HTMAXSIZE; i++) ht[i] = NULL;
+        return HTcreateSized(0);
+}
+
+HTtable *HTcreateSized(int n)
+{
+        int size = HTMINSIZE;
+        HTtable *ht;
+        while ( size < 2*n && size < (1 << 30) ) size *= 2;
+        ht = (HTtable *) malloc(sizeof(HTtable));
+        if (ht == NULL) return(NULL);
+        ht->entries = (struct HTentry *) calloc(size, sizeof(struct HTentry));
+        if (ht->entries == NULL)
+        {
+            free(ht);
+            return(NULL);
+        }
+        ht->size = size;
+        ht->count = 0;
         return(ht);
 }
 
 int     HTinsert(HTtable *ht, char *key, int data)
 {
-        unsigned int i = hash(key);
+        unsigned int code = hash(key);
         struct HTentry *entry;
-        if ( i >= HTMAXSIZE ) return(0);
-        entry = (struct HTentry *) malloc(sizeof(struct HTentry));
-        if (entry == NULL) return(0);
+        if ( 2*(ht->count+1) > ht->size && !grow(ht) ) return(0);
+        entry = probe(ht, key, code);
+        if ( entry->key == NULL ) ht->count++;
         entry->key = key;
         entry->data = data;
-        entry->next = ht[i];
-        ht[i] = entry;
+        entry->code = code;
         return(1);
 }
 
 int     HTfind(HTtable *ht, char *key)
 {
-        unsigned int i = hash(key);
-        struct HTentry *entry;
-        if ( i >= HTMAXSIZE ) return(NOTFOUND);
-        entry = ht[i];
-        while (entry != NULL)
-        {
-            if ( strcmp(entry->key,key) == 0 ) return(entry->data);
-            entry = entry->next;
-        }
-        return(NOTFOUND);
+        struct HTentry *entry = probe(ht, key, hash(key));
+        if ( entry->key == NULL ) return(NOTFOUND);
+        return(entry->data);
 }
 
 char    *HTfindKey(HTtable *ht, char *key)
 {
-        unsigned int i = hash(key);
-        struct HTentry *entry;
-        if ( i >= HTMAXSIZE ) return(NULL);
-        entry = ht[i];
-        while (entry != NULL)
-        {
-            if ( strcmp(entry->key,key) == 0 ) return(entry->key);
-            entry = entry->next;
-        }
-        return(NULL);
+        struct HTentry *entry = probe(ht, key, hash(key));
+        return(entry->key);
+}
+
+int     HTcount(HTtable *ht)
+{
+        return(ht->count);
 }
 
 void    HTfree(HTtable *ht)
 {
-        struct HTentry *entry,
-                       *nextentry;
-        int i;
-        for (i=0; i<HTMAXSIZE; i++)
-        {
-            entry = ht[i];
-            while (entry != NULL)
-            {
-                nextentry = entry->next;
-                free(entry);
-                entry = nextentry;
-            }
-        }
+        free(ht->entries);
         free(ht);
 }
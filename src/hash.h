@@ -4,21 +4,28 @@
 **
 */
 
-#define HTMAXSIZE 1999
+#define HTMINSIZE 64
 #define NOTFOUND  0
 
 struct HTentry
 {
 	char 	*key;
 	int 	data;
-	struct	HTentry *next;
+	unsigned int code;
 };
 
-typedef struct HTentry *HTtable;
+typedef struct HTtable
+{
+	int 	size;
+	int 	count;
+	struct	HTentry *entries;
+} HTtable;
 
 HTtable *HTcreate(void);
+HTtable *HTcreateSized(int);
 int     HTinsert(HTtable *, char *, int);
 int 	HTfind(HTtable *, char *);
 char    *HTfindKey(HTtable *, char *);
+int     HTcount(HTtable *);
 void	HTfree(HTtable *);
-	
+
@@ -41,6 +41,11 @@
 **	27 = log10
 **  28 = step (x<=0 ? 0 : 1)
 **	31 = ^
+**
+**   Compiled expressions use the same codes, where codes 7 & 8 push a
+**   number or a variable's value onto the stack. A binary operator whose
+**   right operand is a number has OP_NUMBER added to its code, and one
+**   whose right operand is a variable has OP_VARIABLE added to it.
 ******************************************************************************/
 #define _CRT_SECURE_NO_DEPRECATE
 
@@ -53,6 +58,8 @@
 #include "mathexpr.h"
 
 #define MAX_STACK_SIZE  1024
+#define OP_NUMBER       32
+#define OP_VARIABLE     64
 
 //***************************************************                          //1.1.00
 #define MAX_TERM_SIZE  1024
@@ -111,11 +118,27 @@ static ExprTree * getOp(int *);
 static ExprTree * getTree(void);
 static void       traverseTree(ExprTree *, MathExpr **);
 static void       deleteTree(ExprTree *);
+static int        getArity(int);
+static double     evalUnary(int, double);
+static double     evalBinary(int, double, double);
+static ExprTree * getCodeTree(MathExpr *);
+static void       foldTree(ExprTree *);
+static void       writeCode(ExprTree *, MathCode *);
+static ExprTree * copyTree(ExprTree *);
+static ExprTree * makeNumber(double);
+static ExprTree * makeOp(int, ExprTree *, ExprTree *);
+static int        isNumber(ExprTree *, double);
+static ExprTree * diffTree(ExprTree *, int);
+static ExprTree * diffFunc(int, ExprTree *);
 
 // Callback functions
 static int    (*getVariableIndex) (char *); // return index of named variable
 static double (*getVariableValue) (int);    // return value of indexed variable
 
+#ifdef _OPENMP
+#pragma omp threadprivate(Err, Bc, PrevLex, CurLex, Len, Pos, S, Token, Ivar, Fvalue, getVariableIndex)
+#endif
+
 //=============================================================================
 
 int  sametext(char *s1, char *s2)
@@ -686,6 +709,427 @@ double mathexpr_eval(MathExpr *expr, double (*getVariableValue) (int))
 
 //=============================================================================
 
+int getArity(int opcode)
+//  Returns the number of operands used by an operator (or -1 if the
+//  code is not evaluated)
+{
+    if ( opcode == 7 || opcode == 8 ) return 0;
+    if ( opcode >= 9 && opcode <= 30 ) return 1;
+    if ( (opcode >= 3 && opcode <= 6) || opcode == 31 ) return 2;
+    return -1;
+}
+
+//=============================================================================
+
+double evalUnary(int opcode, double r1)
+//  Applies a function or the negative sign to a value in the same way
+//  as mathexpr_eval
+{
+    switch (opcode)
+    {
+      case 9:  return -r1;
+      case 10: return cos(r1);
+      case 11: return sin(r1);
+      case 12: return tan(r1);
+      case 13: return 1.0/tan(r1);
+      case 14: return fabs(r1);
+      case 15:
+        if (r1 < 0.0) return -1.0;
+        else if (r1 > 0.0) return 1.0;
+        else return 0.0;
+      case 16: return sqrt(r1);
+      case 17:
+        if (r1 > 0) return log(r1);
+        else return 0;
+      case 18: return exp(r1);
+      case 19: return asin(r1);
+      case 20: return acos(r1);
+      case 21: return atan(r1);
+      case 22: return 1.57079632679489661923 - atan(r1);
+      case 23: return (exp(r1)-exp(-r1))/2.0;
+      case 24: return (exp(r1)+exp(-r1))/2.0;
+      case 25: return (exp(r1)-exp(-r1))/(exp(r1)+exp(-r1));
+      case 26: return (exp(r1)+exp(-r1))/(exp(r1)-exp(-r1));
+      case 27:
+        if (r1 > 0) return log10(r1);
+        else return 0;
+      case 28:
+        if (r1 <= 0.0) return 0.0;
+        else return 1.0;
+    }
+    return r1;
+}
+
+//=============================================================================
+
+double evalBinary(int opcode, double r2, double r1)
+//  Applies an arithmetic operator to a pair of values in the same way
+//  as mathexpr_eval (r2 being the left operand)
+{
+    switch (opcode)
+    {
+      case 3:  return r2 + r1;
+      case 4:  return r2 - r1;
+      case 5:  return r2 * r1;
+      case 6:  return r2 / r1;
+      case 31: return exp(r1*log(r2));
+    }
+    return r1;
+}
+
+//=============================================================================
+
+ExprTree * getCodeTree(MathExpr *expr)
+//  Rebuilds the binary tree of a tokenized (postfix) math expression
+{
+    ExprTree *stack[MAX_STACK_SIZE];
+    ExprTree *tree;
+    MathExpr *node;
+    int arity, top = 0;
+
+    Err = 0;
+    for (node = expr; node != NULL; node = node->next)
+    {
+        arity = getArity(node->opcode);
+        if ( arity < 0 ) continue;
+        if ( top < arity || (arity == 0 && top >= MAX_STACK_SIZE) )
+        {
+            Err = 1;
+            break;
+        }
+        tree = newNode();
+        if ( Err ) break;
+        tree->opcode = node->opcode;
+        tree->ivar = node->ivar;
+        tree->fvalue = node->fvalue;
+        if ( arity == 2 ) tree->right = stack[--top];
+        if ( arity >= 1 ) tree->left = stack[--top];
+        stack[top++] = tree;
+    }
+
+// --- an empty expression evaluates to 0
+
+    if ( !Err && top == 0 )
+    {
+        tree = newNode();
+        if ( !Err )
+        {
+            tree->opcode = 7;
+            stack[top++] = tree;
+        }
+    }
+    if ( !Err && top == 1 ) return stack[0];
+    while ( top > 0 ) deleteTree(stack[--top]);
+    return NULL;
+}
+
+//=============================================================================
+
+void foldTree(ExprTree *tree)
+//  Replaces each operation whose operands are all numbers with its value
+{
+    int arity;
+
+    if ( tree == NULL ) return;
+    foldTree(tree->left);
+    foldTree(tree->right);
+    arity = getArity(tree->opcode);
+    if ( arity == 1 && tree->left->opcode == 7 )
+    {
+        tree->fvalue = evalUnary(tree->opcode, tree->left->fvalue);
+    }
+    else if ( arity == 2 && tree->left->opcode == 7 && tree->right->opcode == 7 )
+    {
+        tree->fvalue = evalBinary(tree->opcode, tree->left->fvalue,
+                                  tree->right->fvalue);
+    }
+    else return;
+    tree->opcode = 7;
+    deleteTree(tree->left);
+    deleteTree(tree->right);
+    tree->left = NULL;
+    tree->right = NULL;
+}
+
+//=============================================================================
+
+void writeCode(ExprTree *tree, MathCode *code)
+//  Appends the instructions that evaluate a tree to a compiled expression
+{
+    ExprCode *op;
+    ExprTree *right;
+
+    if ( tree == NULL ) return;
+    right = tree->right;
+
+// --- a number or variable on the right of an operator is used directly
+//     rather than being pushed onto the stack
+
+    writeCode(tree->left, code);
+    if ( right && right->opcode != 7 && right->opcode != 8 )
+        writeCode(right, code);
+    op = &code->code[code->size++];
+    op->opcode = tree->opcode;
+    op->ivar = tree->ivar;
+    op->fvalue = tree->fvalue;
+    if ( right == NULL ) return;
+    if ( right->opcode == 7 )
+    {
+        op->opcode += OP_NUMBER;
+        op->fvalue = right->fvalue;
+    }
+    else if ( right->opcode == 8 )
+    {
+        op->opcode += OP_VARIABLE;
+        op->ivar = right->ivar;
+    }
+}
+
+//=============================================================================
+
+ExprTree * copyTree(ExprTree *tree)
+//  Makes a copy of a tree (or returns NULL if out of memory)
+{
+    ExprTree *copy;
+
+    if ( tree == NULL ) return NULL;
+    copy = newNode();
+    if ( copy == NULL ) return NULL;
+    copy->opcode = tree->opcode;
+    copy->ivar = tree->ivar;
+    copy->fvalue = tree->fvalue;
+    if ( tree->left )
+    {
+        copy->left = copyTree(tree->left);
+        if ( copy->left == NULL ) Err = 2;
+    }
+    if ( tree->right )
+    {
+        copy->right = copyTree(tree->right);
+        if ( copy->right == NULL ) Err = 2;
+    }
+    if ( Err )
+    {
+        deleteTree(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+//=============================================================================
+
+ExprTree * makeNumber(double x)
+//  Makes a tree holding a single number
+{
+    ExprTree *tree = newNode();
+    if ( tree )
+    {
+        tree->opcode = 7;
+        tree->fvalue = x;
+    }
+    return tree;
+}
+
+//=============================================================================
+
+int isNumber(ExprTree *tree, double x)
+//  Checks if a tree is the number x
+{
+    return tree && tree->opcode == 7 && tree->fvalue == x;
+}
+
+//=============================================================================
+
+ExprTree * makeOp(int opcode, ExprTree *left, ExprTree *right)
+//  Makes a tree that applies an operator to one or two sub-trees (which
+//  become part of it), dropping operations that have no effect and
+//  evaluating those whose operands are all numbers
+{
+    ExprTree *tree;
+    int arity = getArity(opcode);
+
+    if ( left == NULL || (arity == 2 && right == NULL) )
+    {
+        deleteTree(left);
+        deleteTree(right);
+        return NULL;
+    }
+    tree = NULL;
+    switch (opcode)
+    {
+      case 3:
+        if ( isNumber(left, 0.0) ) tree = right;
+        else if ( isNumber(right, 0.0) ) tree = left;
+        break;
+      case 4:
+        if ( isNumber(right, 0.0) ) tree = left;
+        else if ( isNumber(left, 0.0) )
+        {
+            deleteTree(left);
+            return makeOp(9, right, NULL);
+        }
+        break;
+      case 5:
+        if ( isNumber(left, 0.0) || isNumber(right, 0.0) )
+        {
+            deleteTree(left);
+            deleteTree(right);
+            return makeNumber(0.0);
+        }
+        if ( isNumber(left, 1.0) ) tree = right;
+        else if ( isNumber(right, 1.0) ) tree = left;
+        break;
+      case 6:
+        if ( isNumber(left, 0.0) ) tree = left;
+        else if ( isNumber(right, 1.0) ) tree = left;
+        break;
+      case 9:
+        if ( left->opcode == 9 )
+        {
+            tree = left->left;
+            free(left);
+            return tree;
+        }
+        break;
+      case 31:
+        if ( isNumber(right, 1.0) ) tree = left;
+        break;
+    }
+    if ( tree )
+    {
+        if ( tree != left ) deleteTree(left);
+        else deleteTree(right);
+        return tree;
+    }
+    tree = newNode();
+    if ( tree == NULL )
+    {
+        deleteTree(left);
+        deleteTree(right);
+        return NULL;
+    }
+    tree->opcode = opcode;
+    tree->left = left;
+    if ( arity == 2 ) tree->right = right;
+    foldTree(tree);
+    return tree;
+}
+
+//=============================================================================
+
+ExprTree * diffTree(ExprTree *tree, int ivar)
+//  Makes the tree of the derivative of a tree with respect to the
+//  variable with index ivar (or returns NULL if out of memory)
+{
+    ExprTree *u = tree->left;
+    ExprTree *v = tree->right;
+    ExprTree *du, *dv;
+
+    switch (tree->opcode)
+    {
+      case 7:
+        return makeNumber(0.0);
+
+      case 8:
+        return makeNumber(tree->ivar == ivar ? 1.0 : 0.0);
+
+      case 3:
+      case 4:
+        return makeOp(tree->opcode, diffTree(u, ivar), diffTree(v, ivar));
+
+      case 5:
+        return makeOp(3, makeOp(5, diffTree(u, ivar), copyTree(v)),
+                         makeOp(5, copyTree(u), diffTree(v, ivar)));
+
+      case 6:
+        return makeOp(4, makeOp(6, diffTree(u, ivar), copyTree(v)),
+                         makeOp(6, makeOp(5, copyTree(u), diffTree(v, ivar)),
+                                   makeOp(5, copyTree(v), copyTree(v))));
+
+      case 9:
+        return makeOp(9, diffTree(u, ivar), NULL);
+
+      case 31:
+
+    // --- u^v is evaluated as exp(v*log(u)), so its derivative is
+    //     u^v*(dv*log(u) + v*du/u), or v*u^(v-1)*du when v is constant
+
+        du = diffTree(u, ivar);
+        dv = diffTree(v, ivar);
+        if ( du == NULL || dv == NULL )
+        {
+            deleteTree(du);
+            deleteTree(dv);
+            return NULL;
+        }
+        if ( isNumber(dv, 0.0) )
+        {
+            deleteTree(dv);
+            return makeOp(5, makeOp(5, copyTree(v),
+                                       makeOp(31, copyTree(u),
+                                              makeOp(4, copyTree(v), makeNumber(1.0)))),
+                             du);
+        }
+        return makeOp(5, copyTree(tree),
+                         makeOp(3, makeOp(5, dv, makeOp(17, copyTree(u), NULL)),
+                                   makeOp(6, makeOp(5, copyTree(v), du), copyTree(u))));
+
+      case 15:
+      case 28:
+        return makeNumber(0.0);
+    }
+
+// --- a function f(u) has a derivative of f'(u)*du
+
+    du = diffTree(u, ivar);
+    if ( isNumber(du, 0.0) ) return du;
+    return makeOp(5, diffFunc(tree->opcode, u), du);
+}
+
+//=============================================================================
+
+ExprTree * diffFunc(int opcode, ExprTree *u)
+//  Makes the tree of the derivative of a math function with respect to
+//  its argument u
+{
+    ExprTree *f;
+
+    switch (opcode)
+    {
+      case 10: return makeOp(9, makeOp(11, copyTree(u), NULL), NULL);
+      case 11: return makeOp(10, copyTree(u), NULL);
+      case 12:
+        f = makeOp(10, copyTree(u), NULL);
+        return makeOp(6, makeNumber(1.0), makeOp(5, f, copyTree(f)));
+      case 13:
+        f = makeOp(11, copyTree(u), NULL);
+        return makeOp(6, makeNumber(-1.0), makeOp(5, f, copyTree(f)));
+      case 14: return makeOp(15, copyTree(u), NULL);
+      case 16: return makeOp(6, makeNumber(0.5), makeOp(16, copyTree(u), NULL));
+      case 17: return makeOp(6, makeNumber(1.0), copyTree(u));
+      case 18: return makeOp(18, copyTree(u), NULL);
+      case 19:
+      case 20:
+        f = makeOp(16, makeOp(4, makeNumber(1.0),
+                                 makeOp(5, copyTree(u), copyTree(u))), NULL);
+        return makeOp(6, makeNumber(opcode == 19 ? 1.0 : -1.0), f);
+      case 21:
+      case 22:
+        f = makeOp(3, makeNumber(1.0), makeOp(5, copyTree(u), copyTree(u)));
+        return makeOp(6, makeNumber(opcode == 21 ? 1.0 : -1.0), f);
+      case 23: return makeOp(24, copyTree(u), NULL);
+      case 24: return makeOp(23, copyTree(u), NULL);
+      case 25:
+      case 26:
+        f = makeOp(opcode, copyTree(u), NULL);
+        return makeOp(4, makeNumber(1.0), makeOp(5, f, copyTree(f)));
+      case 27: return makeOp(6, makeNumber(1.0/log(10.0)), copyTree(u));
+    }
+    return makeNumber(0.0);
+}
+
+//=============================================================================
+
 void mathexpr_delete(MathExpr *expr)
 {
     if (expr) mathexpr_delete(expr->next);
@@ -721,6 +1165,144 @@ MathExpr * mathexpr_create(char *formula, int (*getVar) (char *))
     return result;
 }
 
+//=============================================================================
+
+MathCode * mathexpr_compile(MathExpr *expr)
+//  Compiles a tokenized math expression into a list of instructions
+//  for mathexpr_run, with operations on numbers evaluated in advance
+{
+    ExprTree *tree;
+    MathExpr *node;
+    MathCode *code;
+    int n = 1;
+
+    for (node = expr; node != NULL; node = node->next) n++;
+    tree = getCodeTree(expr);
+    if ( tree == NULL ) return NULL;
+    foldTree(tree);
+    code = (MathCode *) malloc(sizeof(MathCode));
+    if ( code )
+    {
+        code->size = 0;
+        code->code = (ExprCode *) malloc(n*sizeof(ExprCode));
+        if ( code->code ) writeCode(tree, code);
+        else
+        {
+            free(code);
+            code = NULL;
+        }
+    }
+    deleteTree(tree);
+    return code;
+}
+
+//=============================================================================
+
+MathExpr * mathexpr_diff(MathExpr *expr, int ivar)
+//  Creates a tokenized math expression for the derivative of another one
+//  with respect to the variable with index ivar (or returns NULL if out
+//  of memory); a derivative that is always 0 is returned as the number 0
+{
+    ExprTree *tree, *dtree;
+    MathExpr *dexpr = NULL;
+    MathExpr *result = NULL;
+
+    tree = getCodeTree(expr);
+    if ( tree == NULL ) return NULL;
+    foldTree(tree);
+    dtree = diffTree(tree, ivar);
+    if ( dtree && !Err )
+    {
+        traverseTree(dtree, &dexpr);
+        while (dexpr)
+        {
+            result = dexpr;
+            dexpr = dexpr->prev;
+        }
+    }
+    deleteTree(tree);
+    deleteTree(dtree);
+    return result;
+}
+
+//=============================================================================
+
+double mathexpr_run(MathCode *code, double *x)
+//  Evaluates a compiled math expression, where x[] holds the value of
+//  each variable by index
+{
+    double stack[MAX_STACK_SIZE];
+    ExprCode *op = code->code;
+    ExprCode *end = op + code->size;
+    int top = 0;
+
+    stack[0] = 0.0;
+    for ( ; op < end; op++)
+    {
+        switch (op->opcode)
+        {
+          case 3:
+            top--;
+            stack[top] = stack[top] + stack[top+1];
+            break;
+          case 4:
+            top--;
+            stack[top] = stack[top] - stack[top+1];
+            break;
+          case 5:
+            top--;
+            stack[top] = stack[top] * stack[top+1];
+            break;
+          case 6:
+            top--;
+            stack[top] = stack[top] / stack[top+1];
+            break;
+          case 7:
+            stack[++top] = op->fvalue;
+            break;
+          case 8:
+            stack[++top] = x[op->ivar];
+            break;
+          case 9:
+            stack[top] = -stack[top];
+            break;
+          case 31:
+            top--;
+            stack[top] = evalBinary(31, stack[top], stack[top+1]);
+            break;
+
+          case 3+OP_NUMBER: stack[top] = stack[top] + op->fvalue; break;
+          case 4+OP_NUMBER: stack[top] = stack[top] - op->fvalue; break;
+          case 5+OP_NUMBER: stack[top] = stack[top] * op->fvalue; break;
+          case 6+OP_NUMBER: stack[top] = stack[top] / op->fvalue; break;
+          case 31+OP_NUMBER:
+            stack[top] = evalBinary(31, stack[top], op->fvalue);
+            break;
+
+          case 3+OP_VARIABLE: stack[top] = stack[top] + x[op->ivar]; break;
+          case 4+OP_VARIABLE: stack[top] = stack[top] - x[op->ivar]; break;
+          case 5+OP_VARIABLE: stack[top] = stack[top] * x[op->ivar]; break;
+          case 6+OP_VARIABLE: stack[top] = stack[top] / x[op->ivar]; break;
+          case 31+OP_VARIABLE:
+            stack[top] = evalBinary(31, stack[top], x[op->ivar]);
+            break;
+
+          default:
+            stack[top] = evalUnary(op->opcode, stack[top]);
+        }
+    }
+    return stack[top];
+}
+
+//=============================================================================
+
+void mathexpr_deleteCode(MathCode *code)
+{
+    if ( code == NULL ) return;
+    free(code->code);
+    free(code);
+}
+
 
 //=============================================================================
 
@@ -22,6 +22,21 @@ struct ExprNode
 };
 typedef struct ExprNode MathExpr;
 
+//  Instruction in a compiled math expression
+typedef struct
+{
+    int    opcode;                // operator code
+    int    ivar;                  // variable index
+    double fvalue;                // numerical value
+}   ExprCode;
+
+//  Compiled math expression
+typedef struct
+{
+    int      size;                // number of instructions
+    ExprCode *code;               // array of instructions
+}   MathCode;
+
 //  Creates a tokenized math expression from a string
 MathExpr* mathexpr_create(char* s, int (*getVar) (char *));
 
@@ -31,6 +46,19 @@ double mathexpr_eval(MathExpr* expr, double (*getVal) (int));
 //  Deletes a tokenized math expression
 void  mathexpr_delete(MathExpr* expr);
 
+//  Compiles a tokenized math expression into a flat list of instructions
+MathCode* mathexpr_compile(MathExpr* expr);
+
+//  Evaluates a compiled math expression given the values of its variables
+double mathexpr_run(MathCode* code, double* x);
+
+//  Creates a tokenized math expression for the derivative of another one
+//  with respect to the variable with a given index
+MathExpr* mathexpr_diff(MathExpr* expr, int ivar);
+
+//  Deletes a compiled math expression
+void  mathexpr_deleteCode(MathCode* code);
+
 // Returns reconstructed string version of a tokenized expression              //1.1.00
 char * mathexpr_getStr(MathExpr* expr, char* exprStr,
                        char * (*getVariableStr) (int, char *));
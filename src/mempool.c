@@ -54,6 +54,10 @@ typedef struct alloc_root_s
 
 static alloc_root_t *root;
 
+#ifdef _OPENMP
+#pragma omp threadprivate(root)
+#endif
+
 
 /*
 **  AllocHdr()
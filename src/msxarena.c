@@ -0,0 +1,677 @@
+/******************************************************************************
+**  MODULE:        MSXARENA.C
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Memory arena for the objects of a project, such as its
+**                 pipe and tank segments, that are made and discarded
+**                 many times during a run.
+**  COPYRIGHT:     Copyright (C) 2007 Feng Shang, Lewis Rossman, and James Uber.
+**                 All Rights Reserved. See license information in LICENSE.TXT.
+**  AUTHORS:       L. Rossman, US EPA - NRMRL
+**                 F. Shang, University of Cincinnati
+**                 J. Uber, University of Cincinnati
+**  VERSION:       1.1.00
+**  LAST UPDATE:   10/14/26
+**
+**  Each project owns its arenas, and each arena keeps a separate cache for
+**  every thread that can work on the project. A cache carves objects out
+**  of its own blocks of memory and keeps a free list for each size class
+**  of object, so threads allocate and free objects without waiting on one
+**  another. An object freed by one thread goes onto that thread's list.
+**  A thread whose list grows long hands a batch of its free objects to a
+**  shared depot, and a thread whose list runs dry takes a batch back from
+**  it before carving new memory, so objects freed on one thread are still
+**  reused by the others.
+**
+**  Size classes are registered when an arena is set up and are matched
+**  exactly, so objects of a class never waste any memory. Resetting an
+**  arena frees every object at once while keeping its blocks for reuse,
+**  and trimming it releases the blocks left unused since the last reset.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "msxarena.h"
+
+//  Constants
+//-----------
+#define ARENA_BLOCKSIZE   65536        // bytes in a block of memory
+#define ARENA_MAXCLASSES  8            // most size classes in an arena
+#define ARENA_BATCH       64           // free objects moved to or from the
+                                       //   depot at one time
+#define ARENA_ALIGN       8            // alignment of every object
+#define ARENA_PAD         64           // bytes between thread caches
+
+//  Data structures
+//-----------------
+typedef struct Sblock                  // BLOCK OF MEMORY
+{
+    struct Sblock *next;               // next block in the cache
+    char   *free;                      // next free byte in the block
+    char   *end;                       // end of the block
+}   Sblock;
+
+#define BLOCKHEADER  ((sizeof(Sblock) + 15) / 16 * 16)  // bytes before the
+                                                         //   carved memory
+
+typedef struct Sfree                   // FREE OBJECT
+{
+    struct Sfree *next;                // next object on the free list
+    struct Sfree *batch;               // next batch in the depot
+}   Sfree;
+
+typedef struct                         // A THREAD'S CACHE
+{
+    Sblock *first;                     // first block of memory
+    Sblock *current;                   // block being carved
+    Sfree  *free[ARENA_MAXCLASSES];    // free objects of each class
+    int     nfree[ARENA_MAXCLASSES];   // number of objects on each list
+    long    blocks;                    // number of blocks
+    double  reserved;                  // bytes held in blocks
+    double  inUse;                     // bytes handed out less bytes freed
+    double  allocs;                    // objects handed out
+    double  reused;                    // objects taken from a free list
+    char    pad[ARENA_PAD];            // keeps caches on separate lines
+}   Scache;
+
+struct Sarena                          // MEMORY ARENA
+{
+    int     nthreads;                  // number of thread caches
+    int     nclasses;                  // number of size classes
+    long    size[ARENA_MAXCLASSES];    // bytes in an object of each class
+    Sfree  *depot[ARENA_MAXCLASSES];   // batches of free objects of each
+                                       //   class that any thread can take
+    Scache *cache;                     // a cache for each thread plus one
+                                       //   shared by any other thread
+    double  peakReserved;              // most bytes ever held
+    double  peakInUse;                 // most bytes ever in use
+};
+
+//  Local functions
+//-----------------
+static int     cacheIndex(Sarena *arena);
+static void*   cacheAlloc(Sarena *arena, Scache *cache, int cls);
+static void    cacheFree(Sarena *arena, Scache *cache, int cls, void *p);
+static Sfree*  takeBatch(Sarena *arena, Scache *cache, int cls);
+static void    giveBatch(Sarena *arena, Scache *cache, int cls);
+static void*   carve(Scache *cache, long size);
+static Sblock* newBlock(long size);
+static char*   blockStart(Sblock *block);
+static void    sample(Sarena *arena);
+
+//=============================================================================
+
+Sarena* MSXarena_create()
+/*
+**  Purpose:
+**    creates a new memory arena.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    a pointer to the new arena (or NULL if out of memory).
+**
+**  Note: there is a cache for as many threads as OpenMP may use, or as
+**        there are processors if that is more.
+*/
+{
+    Sarena *arena;
+    int    n = 1;
+
+#ifdef _OPENMP
+    n = omp_get_max_threads();
+    if ( omp_get_num_procs() > n ) n = omp_get_num_procs();
+#endif
+    arena = (Sarena *) calloc(1, sizeof(Sarena));
+    if ( arena == NULL ) return NULL;
+    arena->cache = (Scache *) calloc(n + 1, sizeof(Scache));
+    if ( arena->cache == NULL )
+    {
+        free(arena);
+        return NULL;
+    }
+    arena->nthreads = n;
+    return arena;
+}
+
+//=============================================================================
+
+void MSXarena_delete(Sarena *arena)
+/*
+**  Purpose:
+**    frees all of the memory used by an arena.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+*/
+{
+    int    i;
+    Sblock *block, *next;
+
+    if ( arena == NULL ) return;
+    for (i = 0; i <= arena->nthreads; i++)
+    {
+        for (block = arena->cache[i].first; block != NULL; block = next)
+        {
+            next = block->next;
+            free(block);
+        }
+    }
+    free(arena->cache);
+    free(arena);
+}
+
+//=============================================================================
+
+int MSXarena_addClass(Sarena *arena, long size)
+/*
+**  Purpose:
+**    registers a size of object that will be allocated from an arena.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    size = bytes in an object.
+**
+**  Returns:
+**    the object's size class (or -1 if the arena has no room for
+**    another class).
+**
+**  Note: registering the same size more than once returns the same
+**        class. Objects are always allocated in a multiple of
+**        ARENA_ALIGN bytes.
+*/
+{
+    int cls;
+
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if ( size < (long)sizeof(Sfree) ) size = sizeof(Sfree);
+    for (cls = 0; cls < arena->nclasses; cls++)
+    {
+        if ( arena->size[cls] == size ) return cls;
+    }
+    if ( arena->nclasses == ARENA_MAXCLASSES ) return -1;
+    arena->size[cls] = size;
+    arena->nclasses++;
+    return cls;
+}
+
+//=============================================================================
+
+void* MSXarena_alloc(Sarena *arena, int cls)
+/*
+**  Purpose:
+**    allocates an object of a given size class from an arena.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    cls = the object's size class.
+**
+**  Returns:
+**    a pointer to the object (or NULL if out of memory).
+*/
+{
+    int  i = cacheIndex(arena);
+    void *p;
+
+    if ( i < arena->nthreads ) return cacheAlloc(arena, &arena->cache[i], cls);
+#ifdef _OPENMP
+#pragma omp critical(msxarenashared)
+#endif
+    p = cacheAlloc(arena, &arena->cache[i], cls);
+    return p;
+}
+
+//=============================================================================
+
+void MSXarena_free(Sarena *arena, int cls, void *p)
+/*
+**  Purpose:
+**    returns an object to its size class's free list.
+**
+**  Input:
+**    arena = pointer to the memory arena the object came from
+**    cls = the object's size class
+**    p = pointer to the object.
+*/
+{
+    int i;
+
+    if ( p == NULL ) return;
+    i = cacheIndex(arena);
+    if ( i < arena->nthreads )
+    {
+        cacheFree(arena, &arena->cache[i], cls, p);
+        return;
+    }
+#ifdef _OPENMP
+#pragma omp critical(msxarenashared)
+#endif
+    cacheFree(arena, &arena->cache[i], cls, p);
+}
+
+//=============================================================================
+
+void* MSXarena_raw(Sarena *arena, long size)
+/*
+**  Purpose:
+**    allocates memory from an arena that belongs to no size class.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    size = number of bytes needed.
+**
+**  Returns:
+**    a pointer to the memory (or NULL if out of memory).
+**
+**  Note: the memory can't be freed on its own; it is released when the
+**        arena is reset or deleted.
+*/
+{
+    int    i = cacheIndex(arena);
+    Scache *cache = &arena->cache[i];
+    void   *p;
+
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if ( i < arena->nthreads ) p = carve(cache, size);
+    else
+    {
+#ifdef _OPENMP
+#pragma omp critical(msxarenashared)
+#endif
+        p = carve(cache, size);
+    }
+    if ( p )
+    {
+        cache->allocs += 1.0;
+        cache->inUse += size;
+    }
+    return p;
+}
+
+//=============================================================================
+
+void MSXarena_reset(Sarena *arena)
+/*
+**  Purpose:
+**    frees every object in an arena at once, keeping its blocks of
+**    memory to be carved again.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+**
+**  Note: must not be called while other threads use the arena.
+*/
+{
+    int    i, cls;
+    Scache *cache;
+
+    sample(arena);
+    for (cls = 0; cls < ARENA_MAXCLASSES; cls++) arena->depot[cls] = NULL;
+    for (i = 0; i <= arena->nthreads; i++)
+    {
+        cache = &arena->cache[i];
+        cache->current = cache->first;
+        if ( cache->first ) cache->first->free = blockStart(cache->first);
+        for (cls = 0; cls < ARENA_MAXCLASSES; cls++)
+        {
+            cache->free[cls] = NULL;
+            cache->nfree[cls] = 0;
+        }
+        cache->inUse = 0.0;
+    }
+}
+
+//=============================================================================
+
+void MSXarena_trim(Sarena *arena)
+/*
+**  Purpose:
+**    releases the blocks of an arena that have not been carved since
+**    it was last reset.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+**
+**  Note: must not be called while other threads use the arena.
+*/
+{
+    int    i;
+    Scache *cache;
+    Sblock *block, *next;
+
+    sample(arena);
+    for (i = 0; i <= arena->nthreads; i++)
+    {
+        cache = &arena->cache[i];
+        if ( cache->current == NULL ) continue;
+        for (block = cache->current->next; block != NULL; block = next)
+        {
+            next = block->next;
+            cache->blocks--;
+            cache->reserved -= block->end - (char *)block;
+            free(block);
+        }
+        cache->current->next = NULL;
+    }
+}
+
+//=============================================================================
+
+void MSXarena_getStats(Sarena *arena, SarenaStats *stats)
+/*
+**  Purpose:
+**    retrieves the memory statistics of an arena.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+**
+**  Output:
+**    stats = the arena's memory statistics.
+**
+**  Note: the peak bytes in use is sampled whenever the arena is reset,
+**        trimmed, or has its statistics retrieved, while the peak bytes
+**        held is exact.
+*/
+{
+    int    i;
+    Scache *cache;
+
+    memset(stats, 0, sizeof(SarenaStats));
+    if ( arena == NULL ) return;
+    sample(arena);
+    for (i = 0; i <= arena->nthreads; i++)
+    {
+        cache = &arena->cache[i];
+        stats->blocks += cache->blocks;
+        stats->reserved += cache->reserved;
+        stats->inUse += cache->inUse;
+        stats->allocs += cache->allocs;
+        stats->reused += cache->reused;
+    }
+    stats->peakReserved = arena->peakReserved;
+    stats->peakInUse = arena->peakInUse;
+}
+
+//=============================================================================
+
+int cacheIndex(Sarena *arena)
+/*
+**  Purpose:
+**    finds the cache that the calling thread uses.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+**
+**  Returns:
+**    the index of the thread's cache.
+**
+**  Note: a thread numbered beyond the caches made for the arena uses
+**        the last cache, which is shared and must be locked.
+*/
+{
+#ifdef _OPENMP
+    int i = omp_get_thread_num();
+    if ( i < arena->nthreads ) return i;
+    return arena->nthreads;
+#else
+    return 0;
+#endif
+}
+
+//=============================================================================
+
+void* cacheAlloc(Sarena *arena, Scache *cache, int cls)
+/*
+**  Purpose:
+**    allocates an object of a given class from a thread's cache.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    cache = pointer to the thread's cache
+**    cls = the object's size class.
+**
+**  Returns:
+**    a pointer to the object (or NULL if out of memory).
+*/
+{
+    Sfree *f = cache->free[cls];
+
+// --- take the object from the free list, refilling it from the depot
+//     if it is empty
+
+    if ( f == NULL ) f = takeBatch(arena, cache, cls);
+    if ( f )
+    {
+        cache->free[cls] = f->next;
+        cache->nfree[cls]--;
+        cache->reused += 1.0;
+    }
+
+// --- otherwise carve a new object from the cache's blocks
+
+    else
+    {
+        f = (Sfree *) carve(cache, arena->size[cls]);
+        if ( f == NULL ) return NULL;
+    }
+    cache->allocs += 1.0;
+    cache->inUse += arena->size[cls];
+    return f;
+}
+
+//=============================================================================
+
+void cacheFree(Sarena *arena, Scache *cache, int cls, void *p)
+/*
+**  Purpose:
+**    places an object on the free list of a thread's cache.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    cache = pointer to the thread's cache
+**    cls = the object's size class
+**    p = pointer to the object.
+*/
+{
+    Sfree *f = (Sfree *) p;
+
+    f->next = cache->free[cls];
+    cache->free[cls] = f;
+    cache->nfree[cls]++;
+    cache->inUse -= arena->size[cls];
+    if ( cache->nfree[cls] >= 2 * ARENA_BATCH ) giveBatch(arena, cache, cls);
+}
+
+//=============================================================================
+
+Sfree* takeBatch(Sarena *arena, Scache *cache, int cls)
+/*
+**  Purpose:
+**    moves a batch of free objects from the depot to a thread's cache.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    cache = pointer to the thread's cache
+**    cls = the size class of the objects.
+**
+**  Returns:
+**    the first object of the batch (or NULL if the depot is empty).
+*/
+{
+    Sfree *f;
+
+    if ( arena->depot[cls] == NULL ) return NULL;
+#ifdef _OPENMP
+#pragma omp critical(msxarenadepot)
+#endif
+    {
+        f = arena->depot[cls];
+        if ( f ) arena->depot[cls] = f->batch;
+    }
+    if ( f )
+    {
+        cache->free[cls] = f;
+        cache->nfree[cls] = ARENA_BATCH;
+    }
+    return f;
+}
+
+//=============================================================================
+
+void giveBatch(Sarena *arena, Scache *cache, int cls)
+/*
+**  Purpose:
+**    moves a batch of free objects from a thread's cache to the depot.
+**
+**  Input:
+**    arena = pointer to a memory arena
+**    cache = pointer to the thread's cache
+**    cls = the size class of the objects.
+*/
+{
+    int   i;
+    Sfree *first = cache->free[cls];
+    Sfree *last = first;
+
+    for (i = 1; i < ARENA_BATCH; i++) last = last->next;
+    cache->free[cls] = last->next;
+    cache->nfree[cls] -= ARENA_BATCH;
+    last->next = NULL;
+#ifdef _OPENMP
+#pragma omp critical(msxarenadepot)
+#endif
+    {
+        first->batch = arena->depot[cls];
+        arena->depot[cls] = first;
+    }
+}
+
+//=============================================================================
+
+void* carve(Scache *cache, long size)
+/*
+**  Purpose:
+**    carves memory out of the blocks of a thread's cache.
+**
+**  Input:
+**    cache = pointer to the thread's cache
+**    size = number of bytes needed (a multiple of ARENA_ALIGN).
+**
+**  Returns:
+**    a pointer to the memory (or NULL if out of memory).
+**
+**  Note: blocks after the current one have not been carved since the
+**        arena was last reset, so they are reused before a new block
+**        is added.
+*/
+{
+    Sblock *block = cache->current;
+    char   *p;
+
+// --- move on to the next block if the current one is full
+
+    if ( block == NULL || block->free + size > block->end )
+    {
+        if ( block && block->next &&
+             blockStart(block->next) + size <= block->next->end )
+        {
+            block = block->next;
+            block->free = blockStart(block);
+        }
+
+    // --- otherwise add a new block after the current one
+
+        else
+        {
+            block = newBlock(size);
+            if ( block == NULL ) return NULL;
+            cache->blocks++;
+            cache->reserved += block->end - (char *)block;
+            if ( cache->current )
+            {
+                block->next = cache->current->next;
+                cache->current->next = block;
+            }
+            else
+            {
+                block->next = cache->first;
+                cache->first = block;
+            }
+        }
+        cache->current = block;
+    }
+    p = block->free;
+    block->free += size;
+    return p;
+}
+
+//=============================================================================
+
+Sblock* newBlock(long size)
+/*
+**  Purpose:
+**    allocates a new block of memory.
+**
+**  Input:
+**    size = bytes of the largest object the block must hold.
+**
+**  Returns:
+**    a pointer to the block (or NULL if out of memory).
+*/
+{
+    Sblock *block;
+    long   n = ARENA_BLOCKSIZE;
+
+    if ( (long)BLOCKHEADER + size > n ) n = (long)BLOCKHEADER + size;
+    block = (Sblock *) malloc(n);
+    if ( block == NULL ) return NULL;
+    block->next = NULL;
+    block->free = blockStart(block);
+    block->end = (char *)block + n;
+    return block;
+}
+
+//=============================================================================
+
+char* blockStart(Sblock *block)
+/*
+**  Purpose:
+**    finds where the memory carved from a block begins.
+**
+**  Input:
+**    block = pointer to a block of memory.
+**
+**  Returns:
+**    a pointer to the first byte after the block's header.
+*/
+{
+    return (char *)block + BLOCKHEADER;
+}
+
+//=============================================================================
+
+void sample(Sarena *arena)
+/*
+**  Purpose:
+**    updates the peak memory statistics of an arena.
+**
+**  Input:
+**    arena = pointer to a memory arena.
+*/
+{
+    int    i;
+    double reserved = 0.0, inUse = 0.0;
+
+    for (i = 0; i <= arena->nthreads; i++)
+    {
+        reserved += arena->cache[i].reserved;
+        inUse += arena->cache[i].inUse;
+    }
+    if ( reserved > arena->peakReserved ) arena->peakReserved = reserved;
+    if ( inUse > arena->peakInUse ) arena->peakInUse = inUse;
+}
@@ -0,0 +1,55 @@
+/************************************************************************
+**  MODULE:        MSXARENA.H
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Header file for the memory arena MSXARENA.C.
+**  VERSION:       1.1.00
+**  LAST UPDATE:   10/14/26
+**
+**  The type Sarena provides an opaque reference to a memory arena -
+**  only the arena routines know its structure.
+***********************************************************************/
+
+#ifndef MSXARENA_H
+#define MSXARENA_H
+
+typedef struct Sarena Sarena;
+
+typedef struct                         // ARENA MEMORY STATISTICS
+{
+    long    blocks;                    // blocks of memory held
+    double  reserved;                  // bytes held in those blocks
+    double  inUse;                     // bytes handed out and not freed
+    double  peakReserved;              // most bytes ever held
+    double  peakInUse;                 // most bytes ever in use (sampled)
+    double  allocs;                    // objects handed out
+    double  reused;                    // objects that came from a free list
+}   SarenaStats;
+
+// Creates an arena with a cache for each thread
+Sarena* MSXarena_create(void);
+
+// Frees all of an arena's memory
+void    MSXarena_delete(Sarena *arena);
+
+// Registers a size of object and returns its class (-1 if none left)
+int     MSXarena_addClass(Sarena *arena, long size);
+
+// Returns an object of a given class
+void*   MSXarena_alloc(Sarena *arena, int cls);
+
+// Returns an object to its class's free list
+void    MSXarena_free(Sarena *arena, int cls, void *p);
+
+// Returns memory that is only released when the arena is reset
+void*   MSXarena_raw(Sarena *arena, long size);
+
+// Makes all of an arena's memory free again, keeping its blocks
+void    MSXarena_reset(Sarena *arena);
+
+// Releases the blocks that hold no objects since the last reset
+void    MSXarena_trim(Sarena *arena);
+
+// Retrieves an arena's memory statistics
+void    MSXarena_getStats(Sarena *arena, SarenaStats *stats);
+
+#endif
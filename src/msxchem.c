@@ -22,12 +22,11 @@
 #include "rk5.h"
 #include "ros2.h"
 #include "newton.h"
+#include "msxutils.h"
 #include "msxfuncs.h"                                                          //1.1.00
-
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //  Constants
 //-----------
@@ -35,6 +34,10 @@ int    MAXIT = 20;                     // Max. number of iterations used
                                        // in nonlinear equation solver
 int    NUMSIG = 3;                     // Number of significant digits in
                                        // nonlinear equation solver error
+double DORMANT_TOL = 0.1;              // Fraction of aTol a dormant segment's
+                                       // concentrations may drift by
+int    MAXJACSIZE = 60;                // Max. size of a derivative written
+                                       // to compiled chemistry functions
 
 //  Local variables
 //-----------------
@@ -42,28 +45,39 @@ static Pseg   TheSeg;                  // Current water quality segment
 static int    TheLink;                 // Index of current link
 static int    TheNode;                 // Index of current node
 static int    TheTank;                 // Index of current tank                //1.1.00
-static int    NumSpecies;              // Total number of species
-static int    NumPipeRateSpecies;      // Number of species with pipe rates
-static int    NumTankRateSpecies;      // Number of species with tank rates
-static int    NumPipeFormulaSpecies;   // Number of species with pipe formulas
-static int    NumTankFormulaSpecies;   // Number of species with tank formulas
-static int    NumPipeEquilSpecies;     // Number of species with pipe equilibria
-static int    NumTankEquilSpecies;     // Number of species with tank equilibria
-static int    *PipeRateSpecies;        // Species governed by pipe reactions
-static int    *TankRateSpecies;        // Species governed by tank reactions
-static int    *PipeEquilSpecies;       // Species governed by pipe equilibria
-static int    *TankEquilSpecies;       // Species governed by tank equilibria
-static int    LastIndex[MAX_OBJECTS];  // Last index of given type of variable
-static double *Atol;                   // Absolute concentration tolerances
-static double *Rtol;                   // Relative concentration tolerances
+static int    TheElement;              // Rank of pipe or tank being reacted
 static double *Yrate;                  // Rate species concentrations
 static double *Yequil;                 // Equilibrium species concentrations
 static double HydVar[MAX_HYD_VARS];    // Values of hydraulic variables
 static double *F;                      // Function values                      //1.1.00
 static double *ChemC1;
+static double *SegC;                   // Double precision copy of a segment's
+                                       //   concentrations
+static int    WorkSize;                // Number of species the work arrays hold
+static double *BlockC;                 // Concentrations of a block of segments
+static double *BlockF;                 // Reaction rates of a block of segments
+static double *BlockP;                 // Parameters of a block of segments
+static double BlockH[MAX_HYD_VARS*MAXBATCH]; // Hydraulics of a block of segments
+static Pseg   BlockSeg[MAXBATCH];      // Segments in the block
+static int    BlockLink[MAXBATCH];     // Pipe of each segment in the block
+static char   BlockFailed[MAXBATCH];   // Segments whose equilibrium failed
+static int    BlockCount;              // Number of segments in the block
+static double *VarValue;               // Value of each variable by index
+static int    VarSize;                 // Number of variables VarValue holds
+static double *JacWork;                // Gradients of the intermediates
+static int    JacSize;                 // Number of values JacWork holds
+static double *Ywarm;                  // Last equilibrium solution found
+static double *Fwarm;                  // Equilibrium function values
+static int    WarmZone;                // Zone of Ywarm (0 if none)
+static int    WarmSize;                // Number of species in Ywarm
+static long   WarmStarts;              // Solves started from Ywarm
 
 #ifdef _OPENMP
-#pragma omp threadprivate(TheSeg, TheLink, TheNode, TheTank, Yrate, Yequil, HydVar, F, ChemC1)
+#pragma omp threadprivate(TheSeg, TheLink, TheNode, TheTank, TheElement, Yrate, Yequil, HydVar, F, ChemC1, SegC, WorkSize)
+#pragma omp threadprivate(BlockC, BlockF, BlockSeg, BlockFailed, VarValue, VarSize)
+#pragma omp threadprivate(BlockP, BlockH, BlockLink, BlockCount)
+#pragma omp threadprivate(JacWork, JacSize)
+#pragma omp threadprivate(Ywarm, Fwarm, WarmZone, WarmSize, WarmStarts)
 #endif
 
 //  Exported functions
@@ -71,7 +85,11 @@ static double *ChemC1;
 int    MSXchem_open(void);
 int    MSXchem_react(long dt);
 int    MSXchem_equil(int zone, double *c);
+int    MSXchem_equilSeg(int zone, Pseg seg);
+void   MSXchem_collectStats(void);
+int    MSXchem_element(void);
 char*  MSXchem_getVariableStr(int i, char *s);                                 //1.1.00
+char*  MSXchem_getBatchVariableStr(int i, char *s);
 void   MSXchem_close(void);
 
 // Imported functions
@@ -79,6 +97,9 @@ void   MSXchem_close(void);
 int    MSXcompiler_open(void);                                                 //1.1.00
 void   MSXcompiler_close(void);                                                //1.1.00
 double MSXerr_validate(double x, int index, int element, int exprType);        //1.1.00
+void   MSXerr_writeReactionErrorMsg(int errcode, int element, int index);
+void   MSXerr_writeCompilerWarning(int errcode);
+void   MSXqual_addThreadTime(double *times, double t);
 
 //  Local functions
 //-----------------
@@ -86,18 +107,53 @@ static void   setSpeciesChemistry(void);
 static void   setTankChemistry(void);
 static void   evalHydVariables(int k);
 static int    evalPipeReactions(int k, long dt);
+static int    evalPipeBatch(int k, double tstep, int *errlink);
+static int    reactPipeBlock(double tstep, int *errlink);
+static void   addReactedMass(int k, Pseg seg);
+static int    isDormant(Pseg seg, double tstep);
+static void   updateDrift(Pseg seg, double tstep);
 static int    evalTankReactions(int k, long dt);
 static int    evalPipeEquil(double *c);
 static int    evalTankEquil(double *c);
 static void   evalPipeFormulas(double *c);
 static void   evalTankFormulas(double *c);
-static double getPipeVariableValue(int i);
-static double getTankVariableValue(int i);
+static int    compileExpressions(void);
+static void   freeExpressions(void);
+static int*   getEvalOrder(int zone, int type);
+static void   addExprToOrder(MathExpr *expr, int zone, char *done, int *order);
+static void   addVarToOrder(int i, int zone, char *done, int *order);
+static void   setPipeVariables(void);
+static void   setTankVariables(void);
+static void   evalOrderedTerms(int *order, int zone);
 static void   getPipeDcDt(double t, double y[], int n, double deriv[]);
 static void   getTankDcDt(double t, double y[], int n, double deriv[]);
 static void   getPipeEquil(double t, double y[], int n, double f[]);
 static void   getTankEquil(double t, double y[], int n, double f[]);
+static int    openJacobians(void);
+static void   closeJacobians(void);
+static int    newJacobian(int zone, int type, Sjacobian **jacp);
+static int    addPartials(Sjacobian *jac, int row, MathExpr *expr, int *slot,
+                          char *used);
+static void   freeJacobian(Sjacobian **jacp);
+static MathExpr* getVarExpr(int i, int zone);
+static void   evalJacobian(Sjacobian *jac, double **a);
+static void   copyJacobian(int n, double **a);
+static void   getPipeRateJac(double t, double y[], int n, double **a);
+static void   getTankRateJac(double t, double y[], int n, double **a);
+static void   getPipeEquilJac(double t, double y[], int n, double **a);
+static void   getTankEquilJac(double t, double y[], int n, double **a);
+static void   warmStart(int zone, int n,
+                        void (*func)(double, double*, int, double*));
+static void   resetReuse(void);
+static void   addSolverStats(void);
 static int    isValidNumber(double x);                                         //(L.Rossman - 11/03/10)
+static int    workTooSmall(void);
+static int    openThreadWork(void);
+static void   closeThreadWork(void);
+static int    listReactingPipes(void);
+#ifdef _OPENMP
+static int    compareLinkCost(const void *a, const void *b);
+#endif
 
 
 //=============================================================================
@@ -123,58 +179,46 @@ int  MSXchem_open()
 
     // --- allocate memory
 
-    PipeRateSpecies = NULL;
-    TankRateSpecies = NULL;
-    PipeEquilSpecies = NULL;
-    TankEquilSpecies = NULL;
-    Atol = NULL;
-    Rtol = NULL;
-    Yrate = NULL;
-    Yequil = NULL;
-    NumSpecies = MSX.Nobjects[SPECIES];
-    m = NumSpecies + 1;
-    PipeRateSpecies = (int*)calloc(m, sizeof(int));
-    TankRateSpecies = (int*)calloc(m, sizeof(int));
-    PipeEquilSpecies = (int*)calloc(m, sizeof(int));
-    TankEquilSpecies = (int*)calloc(m, sizeof(int));
-    Atol = (double*)calloc(m, sizeof(double));
-    Rtol = (double*)calloc(m, sizeof(double));
-    CALL(errcode, MEMCHECK(PipeRateSpecies));
-    CALL(errcode, MEMCHECK(TankRateSpecies));
-    CALL(errcode, MEMCHECK(PipeEquilSpecies));
-    CALL(errcode, MEMCHECK(TankEquilSpecies));
-    CALL(errcode, MEMCHECK(Atol));
-    CALL(errcode, MEMCHECK(Rtol));
-
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-    Yrate = (double*)calloc(m, sizeof(double));
-    Yequil = (double*)calloc(m, sizeof(double));
-    F = (double*)calloc(m, sizeof(double));                             //1.1.00
-    ChemC1 = (double*)calloc(m, sizeof(double));
-#ifdef _OPENMP
-#pragma omp critical
-    {
-#endif
-        CALL(errcode, MEMCHECK(Yrate));
-        CALL(errcode, MEMCHECK(Yequil));
-        CALL(errcode, MEMCHECK(F));
-        CALL(errcode, MEMCHECK(ChemC1));
-#ifdef _OPENMP
-    }
-#endif
-#ifdef _OPENMP
-    }
-#endif
+    MSX.PipeRateSpecies = NULL;
+    MSX.TankRateSpecies = NULL;
+    MSX.PipeEquilSpecies = NULL;
+    MSX.TankEquilSpecies = NULL;
+    MSX.Atol = NULL;
+    MSX.Rtol = NULL;
+    MSX.ReactLinks = NULL;
+    MSX.PipeRateOrder = NULL;
+    MSX.TankRateOrder = NULL;
+    MSX.PipeEquilOrder = NULL;
+    MSX.TankEquilOrder = NULL;
+    MSX.PipeFormulaOrder = NULL;
+    MSX.TankFormulaOrder = NULL;
+    MSX.PipeRateJac = NULL;
+    MSX.TankRateJac = NULL;
+    MSX.PipeEquilJac = NULL;
+    MSX.TankEquilJac = NULL;
+    MSX.NumSpecies = MSX.Nobjects[SPECIES];
+    m = MSX.NumSpecies + 1;
+    MSX.PipeRateSpecies = (int*)calloc(m, sizeof(int));
+    MSX.TankRateSpecies = (int*)calloc(m, sizeof(int));
+    MSX.PipeEquilSpecies = (int*)calloc(m, sizeof(int));
+    MSX.TankEquilSpecies = (int*)calloc(m, sizeof(int));
+    MSX.Atol = (double*)calloc(m, sizeof(double));
+    MSX.Rtol = (double*)calloc(m, sizeof(double));
+    MSX.ReactLinks = (int*)calloc(MSX.Nobjects[LINK]+1, sizeof(int));
+    CALL(errcode, MEMCHECK(MSX.PipeRateSpecies));
+    CALL(errcode, MEMCHECK(MSX.TankRateSpecies));
+    CALL(errcode, MEMCHECK(MSX.PipeEquilSpecies));
+    CALL(errcode, MEMCHECK(MSX.TankEquilSpecies));
+    CALL(errcode, MEMCHECK(MSX.Atol));
+    CALL(errcode, MEMCHECK(MSX.Rtol));
+    CALL(errcode, MEMCHECK(MSX.ReactLinks));
     if ( errcode ) return errcode;
 
 // --- assign species to each type of chemical expression
 
     setSpeciesChemistry();
-    numPipeExpr = NumPipeRateSpecies + NumPipeFormulaSpecies + NumPipeEquilSpecies;
-    numTankExpr = NumTankRateSpecies + NumTankFormulaSpecies + NumTankEquilSpecies;
+    numPipeExpr = MSX.NumPipeRateSpecies + MSX.NumPipeFormulaSpecies + MSX.NumPipeEquilSpecies;
+    numTankExpr = MSX.NumTankRateSpecies + MSX.NumTankFormulaSpecies + MSX.NumTankEquilSpecies;
 
 // --- use pipe chemistry for tanks if latter was not supplied
 
@@ -188,50 +232,165 @@ int  MSXchem_open()
 
     numWallSpecies = 0;
     numBulkSpecies = 0;
-    for (m=1; m<=NumSpecies; m++)
+    for (m=1; m<=MSX.NumSpecies; m++)
     {
         if ( MSX.Species[m].type == WALL ) numWallSpecies++;
         if ( MSX.Species[m].type == BULK ) numBulkSpecies++;
     }
-    if ( numPipeExpr != NumSpecies )       return ERR_NUM_PIPE_EXPR;
+    if ( numPipeExpr != MSX.NumSpecies )       return ERR_NUM_PIPE_EXPR;
     if ( numTankExpr != numBulkSpecies   ) return ERR_NUM_TANK_EXPR;
 
-// --- open the ODE solver;
-//     arguments are max. number of ODE's,
-//     max. number of steps to be taken,
-//     1 if automatic step sizing used (or 0 if not used)
+// --- assign entries to MSX.LastIndex array
 
-    if ( MSX.Solver == RK5 )
+    MSX.LastIndex[SPECIES] = MSX.Nobjects[SPECIES];
+    MSX.LastIndex[TERM] = MSX.LastIndex[SPECIES] + MSX.Nobjects[TERM];
+    MSX.LastIndex[PARAMETER] = MSX.LastIndex[TERM] + MSX.Nobjects[PARAMETER];
+    MSX.LastIndex[CONSTANT] = MSX.LastIndex[PARAMETER] + MSX.Nobjects[CONSTANT];
+
+// --- size the work arrays and solvers of each thread for this project
+
+#ifdef _OPENMP
+#pragma omp parallel copyin(MSXcurrent)
     {
-        if ( rk5_open(NumSpecies, 1000, 1) == FALSE )
-            return ERR_INTEGRATOR_OPEN;
+        int err = openThreadWork();
+#pragma omp critical
+        {
+            CALL(errcode, err);
+        }
     }
-    if ( MSX.Solver == ROS2 )
+#else
+    errcode = openThreadWork();
+#endif
+    if ( errcode ) return errcode;
+
+// --- derive the Jacobians that compiled chemistry functions will evaluate
+
+    if ( MSX.Compiler && MSX.Jacobian == ANALYTIC_JACOBIAN )
     {
-        if ( ros2_open(NumSpecies, 1) == FALSE )
-            return ERR_INTEGRATOR_OPEN;
+        errcode = openJacobians();
+        if ( errcode ) return errcode;
     }
 
-// --- open the algebraic eqn. solver
+// --- compile chemistry function dynamic library if specified                 //1.1.00
 
-    m = MAX(NumPipeEquilSpecies, NumTankEquilSpecies);
-    if ( newton_open(m) == FALSE ) return ERR_NEWTON_OPEN;
+    if ( MSX.Compiler )
+    {
+        errcode = MSXcompiler_open();
 
-// --- assign entries to LastIndex array
+    // --- if no C compiler could build the library then use the
+    //     expression compiler below in its place
 
-    LastIndex[SPECIES] = MSX.Nobjects[SPECIES];
-    LastIndex[TERM] = LastIndex[SPECIES] + MSX.Nobjects[TERM];
-    LastIndex[PARAMETER] = LastIndex[TERM] + MSX.Nobjects[PARAMETER];
-    LastIndex[CONSTANT] = LastIndex[PARAMETER] + MSX.Nobjects[CONSTANT];
+        if ( errcode == ERR_COMPILE_FAILED || errcode == ERR_COMPILED_LOAD )
+        {
+            MSX.Compiler = NO_COMPILER;
+            MSXerr_writeCompilerWarning(errcode);
+            closeJacobians();
+            errcode = 0;
+        }
+        if ( errcode ) return errcode;
+    }
 
-// --- compile chemistry function dynamic library if specified                 //1.1.00
+// --- Jacobians missing from the library are found numerically
 
     if ( MSX.Compiler )
     {
-        errcode = MSXcompiler_open();
+        if ( MSX.MSXgetPipeRatesJac == NULL ) freeJacobian(&MSX.PipeRateJac);
+        if ( MSX.MSXgetTankRatesJac == NULL ) freeJacobian(&MSX.TankRateJac);
+        if ( MSX.MSXgetPipeEquilJac == NULL ) freeJacobian(&MSX.PipeEquilJac);
+        if ( MSX.MSXgetTankEquilJac == NULL ) freeJacobian(&MSX.TankEquilJac);
+    }
+
+// --- otherwise compile each expression into instructions for mathexpr_run
+
+    if ( !MSX.Compiler )
+    {
+        errcode = compileExpressions();
         if ( errcode ) return errcode;
+        if ( MSX.Jacobian == ANALYTIC_JACOBIAN ) errcode = openJacobians();
     }
-    return 0;
+    return errcode;
+}
+
+//=============================================================================
+
+void MSXchem_collectStats()
+/*
+**  Purpose:
+**    adds the work counted by each thread's chemistry solvers to the
+**    project's solver counters.
+**
+**  Input:
+**    none.
+**
+**  Note:
+**    Each thread adds its own counts at the end of MSXchem_react; this
+**    collects what they counted since then.
+*/
+{
+#ifdef _OPENMP
+#pragma omp parallel copyin(MSXcurrent)
+#endif
+    addSolverStats();
+}
+
+//=============================================================================
+
+int MSXchem_element()
+/*
+**  Purpose:
+**    identifies the pipe or tank whose reactions the calling thread is
+**    computing.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    the pipe's index, the number of links plus the tank's index, or
+**    one more than the number of links and tanks outside of reactions.
+**
+**  Note: ordered this way, the lowest rank belongs to the element whose
+**        error MSXchem_react reports.
+*/
+{
+    if ( TheElement > 0 ) return TheElement;
+    return MSX.Nobjects[LINK] + MSX.Nobjects[TANK] + 1;
+}
+
+//=============================================================================
+
+void addSolverStats()
+/*
+**  Purpose:
+**    adds (and clears) the work counted by the calling thread's
+**    chemistry solvers to the project's solver counters.
+**
+**  Input:
+**    none.
+*/
+{
+    long r[4], n[4], s[4];
+
+    ros2_getStats(&r[0], &r[1], &r[2], &r[3]);
+    newton_getStats(&n[0], &n[3], &n[1], &n[2]);
+    rk5_getSteps(&s[0], &s[1]);
+    ros2_getSteps(&s[2], &s[3]);
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+    {
+        MSX.SolverStats.rosJacobians += r[0];
+        MSX.SolverStats.rosReused += r[1];
+        MSX.SolverStats.rosFactors += r[2];
+        MSX.SolverStats.rosFactorsReused += r[3];
+        MSX.SolverStats.newtonSolves += n[0];
+        MSX.SolverStats.newtonJacobians += n[1];
+        MSX.SolverStats.newtonReused += n[2];
+        MSX.SolverStats.warmStarts += WarmStarts;
+        MSX.SolverStats.steps += s[0] + s[2];
+        MSX.SolverStats.rejects += s[1] + s[3];
+        MSX.SolverStats.newtonIters += n[3];
+    }
+    WarmStarts = 0;
 }
 
 //=============================================================================
@@ -246,23 +405,20 @@ void MSXchem_close()
 */
 {
     if (MSX.Compiler)	MSXcompiler_close();                                   //1.1.00
-    if (MSX.Solver == RK5) rk5_close();
-    if (MSX.Solver == ROS2) ros2_close();
-    newton_close();
-    FREE(PipeRateSpecies);
-    FREE(TankRateSpecies);
-    FREE(PipeEquilSpecies);
-    FREE(TankEquilSpecies);
-    FREE(Atol);
-    FREE(Rtol);
+    freeExpressions();
+    closeJacobians();
+    FREE(MSX.PipeRateSpecies);
+    FREE(MSX.TankRateSpecies);
+    FREE(MSX.PipeEquilSpecies);
+    FREE(MSX.TankEquilSpecies);
+    FREE(MSX.Atol);
+    FREE(MSX.Rtol);
+    FREE(MSX.ReactLinks);
 #ifdef _OPENMP
 #pragma omp parallel
     {
 #endif
-    FREE(ChemC1);
-    FREE(Yrate);
-    FREE(Yequil);
-    FREE(F);                                                                   //1.1.00
+    closeThreadWork();
 #ifdef _OPENMP
     }
 #endif
@@ -280,61 +436,201 @@ int MSXchem_react(long dt)
 **
 **  Returns:
 **    an error code or 0 if no error.
+**
+**  Note:
+**    Pipes and then tanks are processed in parallel. If several of them
+**    fail, the error of the one with the lowest index is returned (the
+**    same one a serial run would return) and its ID is written to the
+**    report file.
+**
+**    Pipes are handed out to threads in small chunks from a list sorted
+**    by the work each needed in the previous step, so that the most
+**    expensive pipes are started first.
+**
+**    When compiled Euler rates are used, each thread gathers the
+**    segments of the pipes it is handed into blocks of MAXBATCH
+**    segments, which may span several pipes, and reacts a block at a
+**    time once it is full and when its pipes run out.
 */
 {
-    int k, m;
-    int errcode = 0;
+    int i, k, m, err, errlink;
+    int n;                             // number of pipes to react
+#ifdef _OPENMP
+    int chunk;                         // pipes handed to a thread at a time
+#endif
+    int errcode = 0;                   // error code of first failed element
+    int errindex = 0;                  // index of first failed element
+    int errtype = LINK;                // type of first failed element
+    int pipeFailed = 0;                // non-zero if any pipe failed
+    double t0 = 0.0, busy;             // times spent by a thread reacting
+    double tstep = (double)dt / MSX.Ucf[RATE_UNITS];
+    int batched = MSX.Solver == EUL && MSX.Compiler && dt > 0;
 
 // --- save tolerances of pipe rate species
 
-    for (k=1; k<=NumPipeRateSpecies; k++)
+    for (k=1; k<=MSX.NumPipeRateSpecies; k++)
     {
-        m = PipeRateSpecies[k];
-        Atol[k] = MSX.Species[m].aTol;
-        Rtol[k] = MSX.Species[m].rTol;
+        m = MSX.PipeRateSpecies[k];
+        MSX.Atol[k] = MSX.Species[m].aTol;
+        MSX.Rtol[k] = MSX.Species[m].rTol;
     }
 
-// --- examine each link
-#ifdef _OPENMP 
-#pragma omp parallel for
+// --- list the pipes that react in order of decreasing cost
+
+    n = listReactingPipes();
+#ifdef _OPENMP
+    chunk = MAX(1, n / (64 * omp_get_max_threads()));
 #endif
-    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+
+#ifdef _OPENMP
+#pragma omp parallel private(i, k, m, err, errlink, t0, busy) copyin(MSXcurrent)
+    {
+#endif
+
+// --- make sure this thread's work arrays can hold the project's species
+
+    err = 0;
+    t0 = 0.0;
+    busy = 0.0;
+    TheElement = 0;
+    if ( workTooSmall() ) err = openThreadWork();
+    if ( err )
     {
-        // --- skip non-pipe links
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        {
+            if ( !errcode ) errcode = err;
+        }
+    }
+    resetReuse();
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
 
-        if (MSX.Link[k].len == 0.0) continue;
+// --- examine each reacting pipe
+
+    BlockCount = 0;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, chunk) nowait
+#endif
+    for (i = 1; i <= n; i++)
+    {
+        k = MSX.ReactLinks[i];
+        if ( workTooSmall() ) continue;
+        if ( MSX.Profiling ) t0 = MSXutils_wallClock();
 
         // --- evaluate hydraulic variables
 
-         evalHydVariables(k);
+        evalHydVariables(k);
+
+        // --- compute pipe reactions, keeping the lowest failed pipe
+
+        errlink = k;
+        if ( batched ) err = evalPipeBatch(k, tstep, &errlink);
+        else err = evalPipeReactions(k, dt);
+        if ( MSX.Profiling ) busy += MSXutils_wallClock() - t0;
+        if ( err )
+        {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if ( !errindex || errlink < errindex )
+                {
+                    errcode = err;
+                    errindex = errlink;
+                }
+            }
+        }
+    }
 
-         // --- compute pipe reactions
+// --- react the segments left in this thread's block
 
-         errcode = evalPipeReactions(k, dt);
-        //if (errcode) return errcode;
+    if ( batched && BlockCount > 0 )
+    {
+        if ( MSX.Profiling ) t0 = MSXutils_wallClock();
+        err = reactPipeBlock(tstep, &errlink);
+        if ( MSX.Profiling ) busy += MSXutils_wallClock() - t0;
+        if ( err )
+        {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if ( !errindex || errlink < errindex )
+                {
+                    errcode = err;
+                    errindex = errlink;
+                }
+            }
+        }
     }
-    if (errcode) return errcode;
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
 
 // --- save tolerances of tank rate species
 
-    for (k=1; k<=NumTankRateSpecies; k++)
+#ifdef _OPENMP
+#pragma omp single
+#endif
     {
-        m = TankRateSpecies[k];
-        Atol[k] = MSX.Species[m].aTol;
-        Rtol[k] = MSX.Species[m].rTol;
+        pipeFailed = errcode;
+        for (k=1; k<=MSX.NumTankRateSpecies; k++)
+        {
+            m = MSX.TankRateSpecies[k];
+            MSX.Atol[k] = MSX.Species[m].aTol;
+            MSX.Rtol[k] = MSX.Species[m].rTol;
+        }
     }
 
+// --- examine each tank unless a pipe failed
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
     for (k=1; k<=MSX.Nobjects[TANK]; k++)
     {
+        if ( pipeFailed || workTooSmall() ) continue;
+
     // --- skip reservoirs
 
         if (MSX.Tank[k].a == 0.0) continue;
 
-    // --- compute tank reactions
+    // --- compute tank reactions, keeping the lowest failed tank
 
-        errcode = evalTankReactions(k, dt);
-        if ( errcode ) return errcode;
+        if ( MSX.Profiling ) t0 = MSXutils_wallClock();
+        err = evalTankReactions(k, dt);
+        if ( MSX.Profiling ) busy += MSXutils_wallClock() - t0;
+        if ( err )
+        {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if ( errtype == LINK || k < errindex )
+                {
+                    errtype = TANK;
+                    errcode = err;
+                    errindex = k;
+                }
+            }
+        }
     }
+
+// --- add this thread's solver work and time to the project's counters
+
+    addSolverStats();
+    if ( MSX.Profiling ) MSXqual_addThreadTime(MSX.Profile.threadReact, busy);
+    TheElement = 0;
+#ifdef _OPENMP
+    }
+#endif
+
+// --- report the element on which the first error occurred
+
+    if ( errcode && errindex ) MSXerr_writeReactionErrorMsg(errcode, errtype, errindex);
     return errcode;
 }
 
@@ -357,14 +653,20 @@ int MSXchem_equil(int zone, double *c)
 */
 {
     int errcode = 0;
+    if ( workTooSmall() )
+    {
+        errcode = openThreadWork();
+        if ( errcode ) return errcode;
+    }
+    if ( TheElement == 0 ) resetReuse();
     if ( zone == LINK )
     {
-        if ( NumPipeEquilSpecies > 0 ) errcode = evalPipeEquil(c);
+        if ( MSX.NumPipeEquilSpecies > 0 ) errcode = evalPipeEquil(c);
         evalPipeFormulas(c);
     }
     if ( zone == NODE )
     {
-        if ( NumTankEquilSpecies > 0 ) errcode = evalTankEquil(c);
+        if ( MSX.NumTankEquilSpecies > 0 ) errcode = evalTankEquil(c);
         evalTankFormulas(c);
     }
     return errcode;
@@ -372,6 +674,43 @@ int MSXchem_equil(int zone, double *c)
 
 //=============================================================================
 
+int MSXchem_equilSeg(int zone, Pseg seg)
+/*
+**  Purpose:
+**    computes equilibrium concentrations within a WQ segment.
+**
+**  Input:
+**    zone = reaction zone (NODE or LINK)
+**    seg = a WQ segment of a pipe or tank
+**
+**  Output:
+**    updated value of seg->c[].
+**
+**  Returns:
+**    an error code or 0 if no errors.
+**
+**  Note: when segment concentrations are stored in single precision
+**        they are solved for in double precision on a copy.
+*/
+{
+#ifdef MSX_FLOAT_SEGS
+    int m, errcode;
+    if ( workTooSmall() )
+    {
+        errcode = openThreadWork();
+        if ( errcode ) return errcode;
+    }
+    for (m = 1; m <= MSX.NumSpecies; m++) SegC[m] = seg->c[m];
+    errcode = MSXchem_equil(zone, SegC);
+    for (m = 1; m <= MSX.NumSpecies; m++) seg->c[m] = (SEGREAL)SegC[m];
+    return errcode;
+#else
+    return MSXchem_equil(zone, seg->c);
+#endif
+}
+
+//=============================================================================
+
 char* MSXchem_getVariableStr(int i, char *s)                                   //1.1.00
 /*
 **  Purpose:
@@ -380,7 +719,7 @@ char* MSXchem_getVariableStr(int i, char *s)                                   /
 **    these functions
 **
 **  Input:
-**    i = variable's index in the LastIndex array
+**    i = variable's index in the MSX.LastIndex array
 **    s = string to hold variable's symbol
 **
 **  Output:
@@ -389,29 +728,29 @@ char* MSXchem_getVariableStr(int i, char *s)                                   /
 {
 // --- WQ species have index between 1 & # of species
 
-    if ( i <= LastIndex[SPECIES] ) sprintf(s, "c[%d]", i);
+    if ( i <= MSX.LastIndex[SPECIES] ) sprintf(s, "c[%d]", i);
 
 // --- intermediate term expressions come next
 
-    else if ( i <= LastIndex[TERM] )
+    else if ( i <= MSX.LastIndex[TERM] )
     {
-        i -= LastIndex[TERM-1];
+        i -= MSX.LastIndex[TERM-1];
         sprintf(s, "term(%d, c, k, p, h)", i);
     }
 
 // --- reaction parameter indexes come after that
 
-    else if ( i <= LastIndex[PARAMETER] )
+    else if ( i <= MSX.LastIndex[PARAMETER] )
     {
-        i -= LastIndex[PARAMETER-1];
+        i -= MSX.LastIndex[PARAMETER-1];
         sprintf(s, "p[%d]", i);
     }
 
 // --- followed by constants
 
-    else if ( i <= LastIndex[CONSTANT] )
+    else if ( i <= MSX.LastIndex[CONSTANT] )
     {
-        i -= LastIndex[CONSTANT-1];
+        i -= MSX.LastIndex[CONSTANT-1];
         sprintf(s, "k[%d]", i);
     }
 
@@ -419,7 +758,7 @@ char* MSXchem_getVariableStr(int i, char *s)                                   /
 
     else 
     {
-        i -= LastIndex[CONSTANT];
+        i -= MSX.LastIndex[CONSTANT];
         sprintf(s, "h[%d]", i);
     }
     return s;
@@ -427,6 +766,48 @@ char* MSXchem_getVariableStr(int i, char *s)                                   /
 
 //=============================================================================
 
+char* MSXchem_getBatchVariableStr(int i, char *s)
+/*
+**  Purpose:
+**    returns a string representation of a variable used in the batched
+**    pipe rate function appearing in the C source code file used to
+**    compile the chemistry functions
+**
+**  Input:
+**    i = variable's index in the MSX.LastIndex array
+**    s = string to hold variable's symbol
+**
+**  Output:
+**    returns a pointer to s
+**
+**  Note: species, terms, parameters and hydraulic variables are indexed
+**        by the segment j of the block being evaluated, since the block
+**        can hold segments of several pipes, while constants are shared
+**        by all segments.
+*/
+{
+    if ( i <= MSX.LastIndex[SPECIES] ) sprintf(s, "c[%d][j]", i);
+    else if ( i <= MSX.LastIndex[TERM] )
+    {
+        i -= MSX.LastIndex[TERM-1];
+        sprintf(s, "t[%d][j]", i);
+    }
+    else if ( i <= MSX.LastIndex[PARAMETER] )
+    {
+        i -= MSX.LastIndex[PARAMETER-1];
+        sprintf(s, "p[%d][j]", i);
+    }
+    else if ( i <= MSX.LastIndex[CONSTANT] ) MSXchem_getVariableStr(i, s);
+    else
+    {
+        i -= MSX.LastIndex[CONSTANT];
+        sprintf(s, "h[%d][j]", i);
+    }
+    return s;
+}
+
+//=============================================================================
+
 void setSpeciesChemistry()
 /*
 **  Purpose:
@@ -441,44 +822,44 @@ void setSpeciesChemistry()
 */
 {
     int m;
-    NumPipeRateSpecies = 0;
-    NumPipeFormulaSpecies = 0;
-    NumPipeEquilSpecies = 0;
-    NumTankRateSpecies = 0;
-    NumTankFormulaSpecies = 0;
-    NumTankEquilSpecies = 0;
-    for (m=1; m<=NumSpecies; m++)
+    MSX.NumPipeRateSpecies = 0;
+    MSX.NumPipeFormulaSpecies = 0;
+    MSX.NumPipeEquilSpecies = 0;
+    MSX.NumTankRateSpecies = 0;
+    MSX.NumTankFormulaSpecies = 0;
+    MSX.NumTankEquilSpecies = 0;
+    for (m=1; m<=MSX.NumSpecies; m++)
     {
         switch ( MSX.Species[m].pipeExprType )
         {
           case RATE:
-            NumPipeRateSpecies++;
-            PipeRateSpecies[NumPipeRateSpecies] = m;
+            MSX.NumPipeRateSpecies++;
+            MSX.PipeRateSpecies[MSX.NumPipeRateSpecies] = m;
             break;
 
           case FORMULA:
-            NumPipeFormulaSpecies++;
+            MSX.NumPipeFormulaSpecies++;
             break;
 
           case EQUIL:
-            NumPipeEquilSpecies++;
-            PipeEquilSpecies[NumPipeEquilSpecies] = m;
+            MSX.NumPipeEquilSpecies++;
+            MSX.PipeEquilSpecies[MSX.NumPipeEquilSpecies] = m;
             break;
         }
         switch ( MSX.Species[m].tankExprType )
         {
           case RATE:
-            NumTankRateSpecies++;
-            TankRateSpecies[NumTankRateSpecies] = m;
+            MSX.NumTankRateSpecies++;
+            MSX.TankRateSpecies[MSX.NumTankRateSpecies] = m;
             break;
 
           case FORMULA:
-            NumTankFormulaSpecies++;
+            MSX.NumTankFormulaSpecies++;
             break;
 
           case EQUIL:
-            NumTankEquilSpecies++;
-            TankEquilSpecies[NumTankEquilSpecies] = m;
+            MSX.NumTankEquilSpecies++;
+            MSX.TankEquilSpecies[MSX.NumTankEquilSpecies] = m;
             break;
         }
     }
@@ -500,21 +881,21 @@ void setTankChemistry()
 */
 {
     int m;
-    for (m=1; m<=NumSpecies; m++)
+    for (m=1; m<=MSX.NumSpecies; m++)
     {
         MSX.Species[m].tankExpr = MSX.Species[m].pipeExpr;
         MSX.Species[m].tankExprType = MSX.Species[m].pipeExprType;
     }
-    NumTankRateSpecies = NumPipeRateSpecies;
-    for (m=1; m<=NumTankRateSpecies; m++)
+    MSX.NumTankRateSpecies = MSX.NumPipeRateSpecies;
+    for (m=1; m<=MSX.NumTankRateSpecies; m++)
     {
-        TankRateSpecies[m] = PipeRateSpecies[m];
+        MSX.TankRateSpecies[m] = MSX.PipeRateSpecies[m];
     }
-    NumTankFormulaSpecies = NumPipeFormulaSpecies;
-    NumTankEquilSpecies = NumPipeEquilSpecies;
-    for (m=1; m<=NumTankEquilSpecies; m++)
+    MSX.NumTankFormulaSpecies = MSX.NumPipeFormulaSpecies;
+    MSX.NumTankEquilSpecies = MSX.NumPipeEquilSpecies;
+    for (m=1; m<=MSX.NumTankEquilSpecies; m++)
     {
-        TankEquilSpecies[m] = PipeEquilSpecies[m];
+        MSX.TankEquilSpecies[m] = MSX.PipeEquilSpecies[m];
     }
 }
 
@@ -603,16 +984,30 @@ int evalPipeReactions(int k, long dt)
     int i, m;
     int errcode = 0, ierr = 0;
     double tstep = (double)dt / MSX.Ucf[RATE_UNITS];
+    double teff = tstep;
     double c, dh;
+    double cost = 0.0;
 
 // --- start with the most downstream pipe segment
 
     TheLink = k;
+    TheElement = k;
+    resetReuse();
     TheSeg = MSX.FirstSeg[TheLink];
     while ( TheSeg )
     {
+
+    // --- defer the reactions of a dormant segment
+
+        if ( MSX.LazyReact && dt > 0 && isDormant(TheSeg, tstep) )
+        {
+            TheSeg->idle += tstep;
+            TheSeg = TheSeg->prev;
+            continue;
+        }
+        teff = tstep + TheSeg->idle;
  
-        for (m = 1; m <= NumSpecies; m++)
+        for (m = 1; m <= MSX.NumSpecies; m++)
         {
             ChemC1[m] = TheSeg->c[m];
             TheSeg->lastc[m] = TheSeg->c[m];
@@ -626,9 +1021,9 @@ int evalPipeReactions(int k, long dt)
 
         // --- place current concentrations of species that react in vector Yrate
 
-            for (i=1; i<=NumPipeRateSpecies; i++)
+            for (i=1; i<=MSX.NumPipeRateSpecies; i++)
             {
-                m = PipeRateSpecies[i];
+                m = MSX.PipeRateSpecies[i];
                 Yrate[i] = TheSeg->c[m];
             }
         
@@ -636,11 +1031,11 @@ int evalPipeReactions(int k, long dt)
 
             if ( MSX.Solver == EUL )
             {
-                getPipeDcDt(0, Yrate, NumPipeRateSpecies, Yrate);
-                for (i=1; i<=NumPipeRateSpecies; i++)
+                getPipeDcDt(0, Yrate, MSX.NumPipeRateSpecies, Yrate);
+                for (i=1; i<=MSX.NumPipeRateSpecies; i++)
                 {
-                    m = PipeRateSpecies[i];
-                    c = TheSeg->c[m] + Yrate[i]*tstep;
+                    m = MSX.PipeRateSpecies[i];
+                    c = TheSeg->c[m] + Yrate[i]*teff;
                     TheSeg->c[m] = MAX(c, 0.0);
                 }
             }
@@ -653,67 +1048,318 @@ int evalPipeReactions(int k, long dt)
             // --- Runge-Kutta integrator
 
                 if ( MSX.Solver == RK5 )
-                    ierr = rk5_integrate(Yrate, NumPipeRateSpecies, 0, tstep,
-                                         &dh, Atol, Rtol, getPipeDcDt);
+                    ierr = rk5_integrate(Yrate, MSX.NumPipeRateSpecies, 0, teff,
+                                         &dh, MSX.Atol, MSX.Rtol, getPipeDcDt);
 
             // --- Rosenbrock integrator
 
                 if ( MSX.Solver == ROS2 )
-                    ierr = ros2_integrate(Yrate, NumPipeRateSpecies, 0, tstep,
-                                          &dh, Atol, Rtol, getPipeDcDt);
+                    ierr = ros2_integrate(Yrate, MSX.NumPipeRateSpecies, 0, teff,
+                                          &dh, MSX.Atol, MSX.Rtol, getPipeDcDt,
+                                          MSX.PipeRateJac ? getPipeRateJac : NULL);
 
             // --- save new concentration values of the species that reacted
 
-                for (m=1; m<=NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
-                for (i=1; i<=NumPipeRateSpecies; i++)
+                for (m=1; m<=MSX.NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
+                for (i=1; i<=MSX.NumPipeRateSpecies; i++)
                 {
-                    m = PipeRateSpecies[i];
+                    m = MSX.PipeRateSpecies[i];
                     TheSeg->c[m] = MAX(Yrate[i], 0.0);
                 }
                 TheSeg->hstep = dh;
             }
             if ( ierr < 0 ) return 
                 ERR_INTEGRATOR;
+            if ( MSX.LazyReact ) updateDrift(TheSeg, teff);
         }
 
+    // --- count the work done on the segment (number of rate evaluations)
+
+        cost += MAX(ierr, 1);
+
     // --- compute new equilibrium concentrations within segment
 
-        errcode = MSXchem_equil(LINK, TheSeg->c);
+        errcode = MSXchem_equilSeg(LINK, TheSeg);
         if ( errcode ) return errcode;
 
     // --- move to the segment upstream of the current one
-        for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
-        {
-            if (MSX.Species[m].type == BULK)
-            {
-                MSX.Link[k].reacted[m] += TheSeg->v * (TheSeg->c[m] - TheSeg->lastc[m]) * LperFT3;
-            }
-            else if (MSX.Link[k].diam > 0)
-            {
-                MSX.Link[k].reacted[m] += TheSeg->v * 4.0 / MSX.Link[k].diam * MSX.Ucf[AREA_UNITS] * (TheSeg->c[m] - TheSeg->lastc[m]);
-            }
-            TheSeg->lastc[m] = TheSeg->c[m];
-        }
+
+        addReactedMass(k, TheSeg);
         TheSeg = TheSeg->prev;
     }
+    MSX.Link[k].cost = cost;
     return errcode;
 }
 
 //=============================================================================
 
-int evalTankReactions(int k, long dt)
+int evalPipeBatch(int k, double tstep, int *errlink)
 /*
 **  Purpose:
-**    updates species concentrations in a given storage tank
-**    after reactions occur over time step dt.
+**    adds the WQ segments of a pipe to the calling thread's block of
+**    segments that react over a time step using the Euler integrator
+**    and compiled chemistry functions.
 **
 **  Input:
-**    k = tank index
-**    dt = time step (sec).
+**    k = link index
+**    tstep = time step (in rate units).
 **
 **  Output:
-**    updates values in the concentration vector Tank[k].c[]
-**    for tank k.
+**    errlink = index of the lowest pipe whose segment failed to react.
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Note: each segment is added with its own copy of the pipe's parameters
+**        and hydraulic variables, so that a block can hold segments of
+**        several pipes. The block is reacted by reactPipeBlock as soon
+**        as it fills up.
+*/
+{
+    int m, v, n, err, link;
+    int errcode = 0;
+    int np = MSX.Nobjects[PARAMETER];
+    double *param = MSX.Link[k].param;
+
+// --- start with the most downstream pipe segment
+
+    TheLink = k;
+    TheElement = k;
+    MSX.Link[k].cost = 0.0;
+    for (TheSeg = MSX.FirstSeg[k]; TheSeg; TheSeg = TheSeg->prev)
+    {
+        if ( MSX.LazyReact && isDormant(TheSeg, tstep) )
+        {
+            TheSeg->idle += tstep;
+            continue;
+        }
+
+    // --- add the segment's concentrations to the block
+    //     (with equilibrium species updated if full coupling in use)
+
+        n = BlockCount;
+        for (m = 1; m <= MSX.NumSpecies; m++)
+        {
+            ChemC1[m] = TheSeg->c[m];
+            TheSeg->lastc[m] = TheSeg->c[m];
+        }
+        BlockFailed[n] = 0;
+        if ( MSX.Coupling == FULL_COUPLING )
+        {
+            resetReuse();
+            if ( MSXchem_equil(LINK, ChemC1) > 0 ) BlockFailed[n] = 1;
+        }
+        for (m = 1; m <= MSX.NumSpecies; m++)
+            BlockC[m*MAXBATCH + n] = ChemC1[m];
+        for (v = 1; v <= np; v++) BlockP[v*MAXBATCH + n] = param[v];
+        for (v = 1; v < MAX_HYD_VARS; v++) BlockH[v*MAXBATCH + n] = HydVar[v];
+        BlockSeg[n] = TheSeg;
+        BlockLink[n] = k;
+        BlockCount = n + 1;
+        MSX.Link[k].cost += 1.0;
+
+    // --- react the block once it is full (which leaves TheLink and
+    //     HydVar set for this pipe, whose segment was added last)
+
+        if ( BlockCount == MAXBATCH )
+        {
+            err = reactPipeBlock(tstep, &link);
+            if ( err && (!errcode || link < *errlink) )
+            {
+                errcode = err;
+                *errlink = link;
+            }
+        }
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+int reactPipeBlock(double tstep, int *errlink)
+/*
+**  Purpose:
+**    updates species concentrations in each WQ segment of the calling
+**    thread's block after reactions occur over a time step using the
+**    Euler integrator and compiled chemistry functions.
+**
+**  Input:
+**    tstep = time step (in rate units).
+**
+**  Output:
+**    errlink = index of the lowest pipe whose segment failed to react.
+**
+**  Returns:
+**    an error code or 0 if no error.
+**
+**  Note: the rates of the block's segments are found with a single
+**        call to the compiled function MSXgetPipeRatesBatch, which is
+**        written as a loop over the segments that the compiler can
+**        vectorize. Results are the same as those of evalPipeReactions.
+*/
+{
+    int i, j, m, v, err;
+    int n = BlockCount;
+    int errcode = 0;
+    double c, x;
+    Pseg seg;
+
+// --- evaluate the reaction rates of the whole block
+
+    BlockCount = 0;
+    if ( n == 0 ) return 0;
+    MSX.MSXgetPipeRatesBatch(n, BlockC, MSX.K, BlockP, BlockH, BlockF);
+
+// --- take an Euler step in each segment of the block
+
+    for (j = 0; j < n; j++)
+    {
+        seg = BlockSeg[j];
+        TheElement = BlockLink[j];
+        for (i=1; i<=MSX.NumPipeRateSpecies; i++)
+        {
+            m = MSX.PipeRateSpecies[i];
+            if ( BlockFailed[j] ) x = 0.0;
+            else x = MSXerr_validate(BlockF[m*MAXBATCH + j], m, LINK, RATE);
+            c = seg->c[m] + x*(tstep + seg->idle);
+            seg->c[m] = MAX(c, 0.0);
+        }
+        if ( MSX.LazyReact ) updateDrift(seg, tstep + seg->idle);
+
+    // --- compute new equilibrium concentrations within segment
+    //     (using the hydraulic variables of the segment's pipe)
+
+        if ( BlockLink[j] != TheLink )
+        {
+            TheLink = BlockLink[j];
+            for (v = 1; v < MAX_HYD_VARS; v++) HydVar[v] = BlockH[v*MAXBATCH + j];
+        }
+        resetReuse();
+        err = MSXchem_equilSeg(LINK, seg);
+        if ( err )
+        {
+            if ( !errcode || TheLink < *errlink )
+            {
+                errcode = err;
+                *errlink = TheLink;
+            }
+            continue;
+        }
+        addReactedMass(TheLink, seg);
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+int isDormant(Pseg seg, double tstep)
+/*
+**  Purpose:
+**    checks if the reactions of a pipe segment can be deferred over
+**    the current time step.
+**
+**  Input:
+**    seg = a WQ segment of a pipe
+**    tstep = time step (in rate units).
+**
+**  Returns:
+**    1 if the segment is dormant, 0 if it must be reacted.
+**
+**  Note: a segment is dormant while the change its concentrations
+**        last showed, extended over all the time deferred, stays below
+**        DORMANT_TOL times each species' absolute tolerance. Mixing
+**        with other water (which leaves c[] different from lastc[])
+**        or a call for all segments to catch up ends this.
+*/
+{
+    int m;
+
+    if ( MSX.WakeSegs || seg->drift < 0.0 ) return 0;
+    if ( seg->drift * (seg->idle + tstep) >= DORMANT_TOL ) return 0;
+    for (m = 1; m <= MSX.NumSpecies; m++)
+    {
+        if ( seg->c[m] != seg->lastc[m] ) return 0;
+    }
+    return 1;
+}
+
+//=============================================================================
+
+void updateDrift(Pseg seg, double tstep)
+/*
+**  Purpose:
+**    finds how quickly the reacting species of a pipe segment change
+**    after it has been reacted over a time step.
+**
+**  Input:
+**    seg = a WQ segment of a pipe
+**    tstep = time step reacted over (in rate units).
+**
+**  Output:
+**    updates seg->drift and clears seg->idle.
+*/
+{
+    int i, m;
+    double d, drift = 0.0;
+
+    for (i = 1; i <= MSX.NumPipeRateSpecies; i++)
+    {
+        m = MSX.PipeRateSpecies[i];
+        d = fabs(seg->c[m] - seg->lastc[m]);
+        if ( MSX.Species[m].aTol > 0.0 ) d /= MSX.Species[m].aTol;
+        drift = MAX(drift, d);
+    }
+    if ( tstep > 0.0 ) seg->drift = drift / tstep;
+    seg->idle = 0.0;
+}
+
+//=============================================================================
+
+void addReactedMass(int k, Pseg seg)
+/*
+**  Purpose:
+**    adds the mass of each species produced by reaction within a pipe
+**    segment to the pipe's total.
+**
+**  Input:
+**    k = link index
+**    seg = a WQ segment of the pipe
+**
+**  Output:
+**    updates MSX.Link[k].reacted[] and the segment's lastc[].
+*/
+{
+    int m;
+
+    for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+    {
+        if (MSX.Species[m].type == BULK)
+        {
+            MSX.Link[k].reacted[m] += seg->v * (seg->c[m] - seg->lastc[m]) * LperFT3;
+        }
+        else if (MSX.Link[k].diam > 0)
+        {
+            MSX.Link[k].reacted[m] += seg->v * 4.0 / MSX.Link[k].diam * MSX.Ucf[AREA_UNITS] * (seg->c[m] - seg->lastc[m]);
+        }
+        seg->lastc[m] = seg->c[m];
+    }
+}
+
+//=============================================================================
+
+int evalTankReactions(int k, long dt)
+/*
+**  Purpose:
+**    updates species concentrations in a given storage tank
+**    after reactions occur over time step dt.
+**
+**  Input:
+**    k = tank index
+**    dt = time step (sec).
+**
+**  Output:
+**    updates values in the concentration vector Tank[k].c[]
+**    for tank k.
 **
 **  Returns:
 **    an error code or 0 if no error.
@@ -730,11 +1376,13 @@ int evalTankReactions(int k, long dt)
 
     TheTank = k;
     TheNode = MSX.Tank[k].node;
+    TheElement = MSX.Nobjects[LINK] + k;
+    resetReuse();
     i = MSX.Nobjects[LINK] + k;
     TheSeg = MSX.FirstSeg[i];
     while ( TheSeg )
     {
-        for (m = 1; m <= NumSpecies; m++)
+        for (m = 1; m <= MSX.NumSpecies; m++)
         {
             ChemC1[m] = TheSeg->c[m];
             TheSeg->lastc[m] = TheSeg->c[m];
@@ -747,9 +1395,9 @@ int evalTankReactions(int k, long dt)
         {
 
         // --- place current concentrations of species that react in vector Yrate
-            for (i=1; i<=NumTankRateSpecies; i++)
+            for (i=1; i<=MSX.NumTankRateSpecies; i++)
             {
-                m = TankRateSpecies[i];
+                m = MSX.TankRateSpecies[i];
   //              Yrate[i] = MSX.Tank[k].c[m];
                 Yrate[i] = TheSeg->c[m];
             }
@@ -758,10 +1406,10 @@ int evalTankReactions(int k, long dt)
 
             if ( MSX.Solver == EUL )
             {
-                getTankDcDt(0, Yrate, NumTankRateSpecies, Yrate);
-                for (i=1; i<=NumTankRateSpecies; i++)
+                getTankDcDt(0, Yrate, MSX.NumTankRateSpecies, Yrate);
+                for (i=1; i<=MSX.NumTankRateSpecies; i++)
                 {
-                    m = TankRateSpecies[i];
+                    m = MSX.TankRateSpecies[i];
                     c = TheSeg->c[m] + Yrate[i]*tstep;
                     TheSeg->c[m] = MAX(c, 0.0);
                 }
@@ -775,21 +1423,22 @@ int evalTankReactions(int k, long dt)
             // --- Runge-Kutta integrator
 
                 if ( MSX.Solver == RK5 )
-                    ierr = rk5_integrate(Yrate, NumTankRateSpecies, 0, tstep,
-                                         &dh, Atol, Rtol, getTankDcDt);
+                    ierr = rk5_integrate(Yrate, MSX.NumTankRateSpecies, 0, tstep,
+                                         &dh, MSX.Atol, MSX.Rtol, getTankDcDt);
 
             // --- Rosenbrock integrator
 
                 if ( MSX.Solver == ROS2 )
-                    ierr = ros2_integrate(Yrate, NumTankRateSpecies, 0, tstep,
-                                          &dh, Atol, Rtol, getTankDcDt);
+                    ierr = ros2_integrate(Yrate, MSX.NumTankRateSpecies, 0, tstep,
+                                          &dh, MSX.Atol, MSX.Rtol, getTankDcDt,
+                                          MSX.TankRateJac ? getTankRateJac : NULL);
 
             // --- save new concentration values of the species that reacted
 
-                for (m=1; m<=NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
-                for (i=1; i<=NumTankRateSpecies; i++)
+                for (m=1; m<=MSX.NumSpecies; m++) TheSeg->c[m] = ChemC1[m];
+                for (i=1; i<=MSX.NumTankRateSpecies; i++)
                 {
-                    m = TankRateSpecies[i];
+                    m = MSX.TankRateSpecies[i];
                     TheSeg->c[m] = MAX(Yrate[i], 0.0);
                 }
                 TheSeg->hstep = dh;
@@ -800,7 +1449,7 @@ int evalTankReactions(int k, long dt)
 
     // --- compute new equilibrium concentrations within segment
 
-        errcode = MSXchem_equil(NODE, TheSeg->c);
+        errcode = MSXchem_equilSeg(NODE, TheSeg);
         if ( errcode ) return errcode;
 
     // --- move to the next tank segment
@@ -837,21 +1486,25 @@ int evalPipeEquil(double *c)
 {
     int i, m;
     int errcode;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
-    for (i=1; i<=NumPipeEquilSpecies; i++)
+    for (m=1; m<=MSX.NumSpecies; m++) ChemC1[m] = c[m];
+    for (i=1; i<=MSX.NumPipeEquilSpecies; i++)
     {
-        m = PipeEquilSpecies[i];
+        m = MSX.PipeEquilSpecies[i];
         Yequil[i] = c[m];
     }
-    errcode = newton_solve(Yequil, NumPipeEquilSpecies, MAXIT, NUMSIG,
-                           getPipeEquil);
+    if ( MSX.ReuseJac ) warmStart(LINK, MSX.NumPipeEquilSpecies, getPipeEquil);
+    errcode = newton_solve(Yequil, MSX.NumPipeEquilSpecies, MAXIT, NUMSIG,
+                           getPipeEquil, MSX.PipeEquilJac ? getPipeEquilJac : NULL);
     if ( errcode < 0 ) return ERR_NEWTON;
-    for (i=1; i<=NumPipeEquilSpecies; i++)
+    for (i=1; i<=MSX.NumPipeEquilSpecies; i++)
     {
-        m = PipeEquilSpecies[i];
+        m = MSX.PipeEquilSpecies[i];
         c[m] = Yequil[i];
         ChemC1[m] = c[m];
+        Ywarm[i] = Yequil[i];
     }
+    WarmZone = LINK;
+    WarmSize = MSX.NumPipeEquilSpecies;
     return 0;
 }
 
@@ -875,21 +1528,25 @@ int evalTankEquil(double *c)
 {
     int i, m;
     int errcode;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
-    for (i=1; i<=NumTankEquilSpecies; i++)
+    for (m=1; m<=MSX.NumSpecies; m++) ChemC1[m] = c[m];
+    for (i=1; i<=MSX.NumTankEquilSpecies; i++)
     {
-        m = TankEquilSpecies[i];
+        m = MSX.TankEquilSpecies[i];
         Yequil[i] = c[m];
     }
-    errcode = newton_solve(Yequil, NumTankEquilSpecies, MAXIT, NUMSIG,
-                           getTankEquil);
+    if ( MSX.ReuseJac ) warmStart(TANK, MSX.NumTankEquilSpecies, getTankEquil);
+    errcode = newton_solve(Yequil, MSX.NumTankEquilSpecies, MAXIT, NUMSIG,
+                           getTankEquil, MSX.TankEquilJac ? getTankEquilJac : NULL);
     if ( errcode < 0 ) return ERR_NEWTON;
-    for (i=1; i<=NumTankEquilSpecies; i++)
+    for (i=1; i<=MSX.NumTankEquilSpecies; i++)
     {
-        m = TankEquilSpecies[i];
+        m = MSX.TankEquilSpecies[i];
         c[m] = Yequil[i];
         ChemC1[m] = c[m];
+        Ywarm[i] = Yequil[i];
     }
+    WarmZone = TANK;
+    WarmSize = MSX.NumTankEquilSpecies;
     return 0;
 }
 
@@ -911,28 +1568,25 @@ void evalPipeFormulas(double *c)
 */
 {
     int m;
-    double x;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
+    for (m=1; m<=MSX.NumSpecies; m++) ChemC1[m] = c[m];
 
 // --- use compiled functions if available
 
     if ( MSX.Compiler )
     {
-	    MSXgetPipeFormulas(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar);
-        for (m=1; m<=NumSpecies; m++)
+	    MSX.MSXgetPipeFormulas(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar);
+        for (m=1; m<=MSX.NumSpecies; m++)
         {
             c[m] = ChemC1[m];
         }
     	return;
     }
 
-    for (m=1; m<=NumSpecies; m++)
+    setPipeVariables();
+    evalOrderedTerms(MSX.PipeFormulaOrder, LINK);
+    for (m=1; m<=MSX.NumSpecies; m++)
     {
-        if ( MSX.Species[m].pipeExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX.Species[m].pipeExpr, getPipeVariableValue);
-			c[m] = MSXerr_validate(x, m, LINK, FORMULA);
-        }
+        if ( MSX.Species[m].pipeExprType == FORMULA ) c[m] = VarValue[m];
     }
 }
 
@@ -954,168 +1608,324 @@ void evalTankFormulas(double *c)
 */
 {
     int m;
-    double x;
-    for (m=1; m<=NumSpecies; m++) ChemC1[m] = c[m];
+    for (m=1; m<=MSX.NumSpecies; m++) ChemC1[m] = c[m];
 
 // --- use compiled functions if available 
 
     if ( MSX.Compiler )
     {
-	    MSXgetTankFormulas(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar);
-        for (m=1; m<=NumSpecies; m++)
+	    MSX.MSXgetTankFormulas(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar);
+        for (m=1; m<=MSX.NumSpecies; m++)
         {
             c[m] = ChemC1[m];
         }
     	return;
     }
 
-    for (m=1; m<=NumSpecies; m++)
+    setTankVariables();
+    evalOrderedTerms(MSX.TankFormulaOrder, TANK);
+    for (m=1; m<=MSX.NumSpecies; m++)
     {
-        if ( MSX.Species[m].tankExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX.Species[m].tankExpr, getTankVariableValue);
-			c[m] = MSXerr_validate(x, m, TANK, FORMULA);
-        }
+        if ( MSX.Species[m].tankExprType == FORMULA ) c[m] = VarValue[m];
     }
 }
 
 //=============================================================================
 
-double getPipeVariableValue(int i)
+int compileExpressions()
 /*
 **  Purpose:
-**    finds the value of a species, a parameter, or a constant for 
-**    the pipe link being analyzed.
+**    compiles the chemistry expressions of each species and intermediate
+**    term and finds the order in which the terms and formulas used by
+**    each kind of expression are evaluated.
 **
 **  Input:
-**    i = variable index.
+**    none.
 **
 **  Returns:
-**    the current value of the indexed variable.
+**    an error code (0 if no error).
+**
+**  Note: this is only done when the chemistry functions are not being
+**        compiled into a dynamic library with a C compiler.
 */
 {
-	double x;
+    int i;
 
-// --- WQ species have index i between 1 & # of species
-//     and their current values are stored in vector ChemC1 
-
-    if ( i <= LastIndex[SPECIES] )
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++)
     {
-    // --- if species represented by a formula then evaluate it
-
-        if ( MSX.Species[i].pipeExprType == FORMULA )
+        if ( MSX.Species[i].pipeExpr )
         {
-			x = mathexpr_eval(MSX.Species[i].pipeExpr, getPipeVariableValue);
-            return MSXerr_validate(x, i, LINK, FORMULA);                       //1.1.00
+            MSX.Species[i].pipeCode = mathexpr_compile(MSX.Species[i].pipeExpr);
+            if ( MSX.Species[i].pipeCode == NULL ) return ERR_MEMORY;
+        }
+        if ( MSX.Species[i].tankExpr )
+        {
+            MSX.Species[i].tankCode = mathexpr_compile(MSX.Species[i].tankExpr);
+            if ( MSX.Species[i].tankCode == NULL ) return ERR_MEMORY;
         }
-
-    // --- otherwise return the current concentration
-
-        else return ChemC1[i];
     }
-
-// --- intermediate term expressions come next
-
-    else if ( i <= LastIndex[TERM] )
+    for (i=1; i<=MSX.Nobjects[TERM]; i++)
     {
-        i -= LastIndex[TERM-1];
-		x = mathexpr_eval(MSX.Term[i].expr, getPipeVariableValue);
-        return MSXerr_validate(x, i, 0, TERM);                                 //1.1.00
+        MSX.Term[i].code = mathexpr_compile(MSX.Term[i].expr);
+        if ( MSX.Term[i].code == NULL ) return ERR_MEMORY;
     }
+    MSX.PipeRateOrder = getEvalOrder(LINK, RATE);
+    MSX.TankRateOrder = getEvalOrder(TANK, RATE);
+    MSX.PipeEquilOrder = getEvalOrder(LINK, EQUIL);
+    MSX.TankEquilOrder = getEvalOrder(TANK, EQUIL);
+    MSX.PipeFormulaOrder = getEvalOrder(LINK, FORMULA);
+    MSX.TankFormulaOrder = getEvalOrder(TANK, FORMULA);
+    if ( MSX.PipeRateOrder == NULL || MSX.TankRateOrder == NULL ||
+         MSX.PipeEquilOrder == NULL || MSX.TankEquilOrder == NULL ||
+         MSX.PipeFormulaOrder == NULL || MSX.TankFormulaOrder == NULL )
+        return ERR_MEMORY;
+    return 0;
+}
 
-// --- reaction parameter indexes come after that
-
-    else if ( i <= LastIndex[PARAMETER] )
-    {
-        i -= LastIndex[PARAMETER-1];
-        return MSX.Link[TheLink].param[i];
-    }
+//=============================================================================
 
-// --- followed by constants
+void freeExpressions()
+/*
+**  Purpose:
+**    frees the compiled chemistry expressions and evaluation orders.
+**
+**  Input:
+**    none.
+*/
+{
+    int i;
 
-    else if ( i <= LastIndex[CONSTANT] )
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++)
     {
-        i -= LastIndex[CONSTANT-1];
-        return MSX.Const[i].value;
+        mathexpr_deleteCode(MSX.Species[i].pipeCode);
+        mathexpr_deleteCode(MSX.Species[i].tankCode);
+        MSX.Species[i].pipeCode = NULL;
+        MSX.Species[i].tankCode = NULL;
     }
-
-// --- and finally by hydraulic variables
-    else 
+    for (i=1; i<=MSX.Nobjects[TERM]; i++)
     {
-        i -= LastIndex[CONSTANT];
-        if (i < MAX_HYD_VARS) return HydVar[i];
-        else return 0.0;
+        mathexpr_deleteCode(MSX.Term[i].code);
+        MSX.Term[i].code = NULL;
     }
+    FREE(MSX.PipeRateOrder);
+    FREE(MSX.TankRateOrder);
+    FREE(MSX.PipeEquilOrder);
+    FREE(MSX.TankEquilOrder);
+    FREE(MSX.PipeFormulaOrder);
+    FREE(MSX.TankFormulaOrder);
 }
 
 //=============================================================================
 
-double getTankVariableValue(int i)
+int* getEvalOrder(int zone, int type)
 /*
 **  Purpose:
-**    finds the value of a species, a parameter, or a constant for 
-**    the current node being analyzed.
+**    lists the intermediate terms and formula species used by one kind
+**    of chemistry expression in the order they must be evaluated.
 **
 **  Input:
-**    i = variable index.
+**    zone = reaction zone (LINK or TANK)
+**    type = type of expression (RATE, EQUIL or FORMULA)
 **
 **  Returns:
-**    the current value of the indexed variable.
+**    an array holding the number of items in element 0 followed by
+**    the variable index of each item (or NULL if out of memory).
 **
-**  Modified to check for NaN values (L.Rossman - 11/03/10).
+**  Note: an item always comes after the items its own expression uses,
+**        so each one need only be evaluated once per function call.
+**        For FORMULA expressions the formula species themselves are
+**        included in the list.
 */
 {
-    int j;
-	double x;
+    int  m, exprType;
+    int  *order;
+    char *done;
+
+    order = (int *) calloc(MSX.LastIndex[TERM]+1, sizeof(int));
+    done = (char *) calloc(MSX.LastIndex[TERM]+1, sizeof(char));
+    if ( order == NULL || done == NULL )
+    {
+        FREE(order);
+        FREE(done);
+        return NULL;
+    }
+    for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
+    {
+        if ( zone == LINK ) exprType = MSX.Species[m].pipeExprType;
+        else                exprType = MSX.Species[m].tankExprType;
+        if ( exprType != type ) continue;
+        if ( type == FORMULA ) addVarToOrder(m, zone, done, order);
+        else if ( zone == LINK )
+            addExprToOrder(MSX.Species[m].pipeExpr, zone, done, order);
+        else
+            addExprToOrder(MSX.Species[m].tankExpr, zone, done, order);
+    }
+    FREE(done);
+    return order;
+}
+
+//=============================================================================
 
-// --- WQ species have index i between 1 & # of species
-//     and their current values are stored in vector ChemC1
+void addExprToOrder(MathExpr *expr, int zone, char *done, int *order)
+/*
+**  Purpose:
+**    adds the terms and formula species used by an expression to an
+**    evaluation order.
+**
+**  Input:
+**    expr = a tokenized math expression
+**    zone = reaction zone (LINK or TANK)
+**    done = flags marking the variables already in the order
+**    order = the evaluation order being built.
+*/
+{
+    MathExpr *node;
 
-    if ( i <= LastIndex[SPECIES] )
+    for (node = expr; node != NULL; node = node->next)
     {
-    // --- if species represented by a formula then evaluate it
+        if ( node->opcode == 8 ) addVarToOrder(node->ivar, zone, done, order);
+    }
+}
 
-        if ( MSX.Species[i].tankExprType == FORMULA )
-        {
-			x = mathexpr_eval(MSX.Species[i].tankExpr, getTankVariableValue);
-            return MSXerr_validate(x, i, TANK, FORMULA);                       //1.1.00
-        }
+//=============================================================================
 
-    // --- otherwise return the current concentration
+void addVarToOrder(int i, int zone, char *done, int *order)
+/*
+**  Purpose:
+**    adds a variable to an evaluation order, after the variables that
+**    its own expression uses, if it is a term or a formula species.
+**
+**  Input:
+**    i = variable index
+**    zone = reaction zone (LINK or TANK)
+**    done = flags marking the variables already in the order
+**    order = the evaluation order being built.
+*/
+{
+    MathExpr *expr;
 
-        else return ChemC1[i];
+    if ( i > MSX.LastIndex[TERM] || done[i] ) return;
+    if ( i <= MSX.LastIndex[SPECIES] )
+    {
+        if ( zone == LINK )
+        {
+            if ( MSX.Species[i].pipeExprType != FORMULA ) return;
+            expr = MSX.Species[i].pipeExpr;
+        }
+        else
+        {
+            if ( MSX.Species[i].tankExprType != FORMULA ) return;
+            expr = MSX.Species[i].tankExpr;
+        }
     }
+    else expr = MSX.Term[i-MSX.LastIndex[TERM-1]].expr;
+    done[i] = 1;
+    addExprToOrder(expr, zone, done, order);
+    order[0]++;
+    order[order[0]] = i;
+}
 
-// --- intermediate term expressions come next
+//=============================================================================
+
+void setPipeVariables()
+/*
+**  Purpose:
+**    places the values of the species, parameters, constants and
+**    hydraulic variables of the pipe being analyzed into VarValue.
+**
+**  Input:
+**    none.
+**
+**  Note: species concentrations are taken from ChemC1.
+*/
+{
+    int i;
+    double *x = VarValue;
+    double *param = MSX.Link[TheLink].param;
 
-    else if ( i <= LastIndex[TERM] )
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++) x[i] = ChemC1[i];
+    x += MSX.LastIndex[TERM];
+    for (i=1; i<=MSX.Nobjects[PARAMETER]; i++)
     {
-        i -= LastIndex[TERM-1];
-		x = mathexpr_eval(MSX.Term[i].expr, getTankVariableValue);
-        return MSXerr_validate(x, i, 0, TERM);                                 //1.1.00
+        if ( param ) x[i] = param[i];
+        else         x[i] = 0.0;
     }
+    x += MSX.Nobjects[PARAMETER];
+    for (i=1; i<=MSX.Nobjects[CONSTANT]; i++) x[i] = MSX.Const[i].value;
+    x += MSX.Nobjects[CONSTANT];
+    for (i=1; i<MAX_HYD_VARS; i++) x[i] = HydVar[i];
+}
+
+//=============================================================================
 
-// --- next come reaction parameters associated with Tank nodes
+void setTankVariables()
+/*
+**  Purpose:
+**    places the values of the species, parameters and constants of the
+**    tank being analyzed into VarValue.
+**
+**  Input:
+**    none.
+**
+**  Note: species concentrations are taken from ChemC1. Hydraulic
+**        variables have no meaning for tanks and are set to 0.
+*/
+{
+    int i, j;
+    double *x = VarValue;
 
-    else if (i <= LastIndex[PARAMETER] )
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++) x[i] = ChemC1[i];
+    x += MSX.LastIndex[TERM];
+    j = MSX.Node[TheNode].tank;
+    for (i=1; i<=MSX.Nobjects[PARAMETER]; i++)
     {
-        i -= LastIndex[PARAMETER-1];
-        j = MSX.Node[TheNode].tank;
-        if ( j > 0 )
-        {
-            return MSX.Tank[j].param[i];
-        }
-        else return 0.0;
+        if ( j > 0 ) x[i] = MSX.Tank[j].param[i];
+        else         x[i] = 0.0;
     }
+    x += MSX.Nobjects[PARAMETER];
+    for (i=1; i<=MSX.Nobjects[CONSTANT]; i++) x[i] = MSX.Const[i].value;
+    x += MSX.Nobjects[CONSTANT];
+    for (i=1; i<MAX_HYD_VARS; i++) x[i] = 0.0;
+}
 
-// --- and then come constants
+//=============================================================================
+
+void evalOrderedTerms(int *order, int zone)
+/*
+**  Purpose:
+**    evaluates the terms and formula species of an evaluation order,
+**    placing their values in VarValue.
+**
+**  Input:
+**    order = an evaluation order made by getEvalOrder
+**    zone = reaction zone (LINK or TANK).
+*/
+{
+    int i, j;
+    double x;
 
-    else if (i <= LastIndex[CONSTANT] )
+    for (i=1; i<=order[0]; i++)
     {
-        i -= LastIndex[CONSTANT-1];
-        return MSX.Const[i].value;
+        j = order[i];
+        if ( j <= MSX.LastIndex[SPECIES] )
+        {
+            if ( zone == LINK )
+            {
+                x = mathexpr_run(MSX.Species[j].pipeCode, VarValue);
+                VarValue[j] = MSXerr_validate(x, j, LINK, FORMULA);
+            }
+            else
+            {
+                x = mathexpr_run(MSX.Species[j].tankCode, VarValue);
+                VarValue[j] = MSXerr_validate(x, j, TANK, FORMULA);
+            }
+        }
+        else
+        {
+            x = mathexpr_run(MSX.Term[j-MSX.LastIndex[TERM-1]].code, VarValue);
+            VarValue[j] = MSXerr_validate(x, j-MSX.LastIndex[TERM-1], 0, TERM);
+        }
     }
-    else return 0.0;
 }
 
 //=============================================================================
@@ -1142,7 +1952,7 @@ void getPipeDcDt(double t, double y[], int n, double deriv[])
 
     for (i=1; i<=n; i++)
     {
-        m = PipeRateSpecies[i];
+        m = MSX.PipeRateSpecies[i];
         ChemC1[m] = y[i];
     }
 
@@ -1161,10 +1971,10 @@ void getPipeDcDt(double t, double y[], int n, double deriv[])
 
     if ( MSX.Compiler )
     {
-	    MSXgetPipeRates(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar, F);
+	    MSX.MSXgetPipeRates(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar, F);
         for (i=1; i<=n; i++)
         {
-            m = PipeRateSpecies[i];
+            m = MSX.PipeRateSpecies[i];
             deriv[i] = MSXerr_validate(F[m], m, LINK, RATE);                   //1.1.00
         }
 	    return;
@@ -1172,10 +1982,12 @@ void getPipeDcDt(double t, double y[], int n, double deriv[])
 
 // --- evaluate each pipe reaction expression
 
+    setPipeVariables();
+    evalOrderedTerms(MSX.PipeRateOrder, LINK);
     for (i=1; i<=n; i++)
     {
-        m = PipeRateSpecies[i];
-		x = mathexpr_eval(MSX.Species[m].pipeExpr, getPipeVariableValue);
+        m = MSX.PipeRateSpecies[i];
+        x = mathexpr_run(MSX.Species[m].pipeCode, VarValue);
         deriv[i] = MSXerr_validate(x, m, LINK, RATE);                          //1.1.00
     }
 }
@@ -1204,7 +2016,7 @@ void getTankDcDt(double t, double y[], int n, double deriv[])
 
     for (i=1; i<=n; i++)
     {
-        m = TankRateSpecies[i];
+        m = MSX.TankRateSpecies[i];
         ChemC1[m] = y[i];
     }
 
@@ -1223,10 +2035,10 @@ void getTankDcDt(double t, double y[], int n, double deriv[])
 
     if ( MSX.Compiler )
     {
-	    MSXgetTankRates(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar, F);
+	    MSX.MSXgetTankRates(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar, F);
         for (i=1; i<=n; i++)
         {
-            m = TankRateSpecies[i];
+            m = MSX.TankRateSpecies[i];
             deriv[i] = MSXerr_validate(F[m], m, TANK, RATE);                   //1.1.00
         }
 	    return;
@@ -1234,10 +2046,12 @@ void getTankDcDt(double t, double y[], int n, double deriv[])
 
 // --- evaluate each tank reaction expression
 
+    setTankVariables();
+    evalOrderedTerms(MSX.TankRateOrder, TANK);
     for (i=1; i<=n; i++)
     {
-        m = TankRateSpecies[i];
-		x = mathexpr_eval(MSX.Species[m].tankExpr, getTankVariableValue);
+        m = MSX.TankRateSpecies[i];
+        x = mathexpr_run(MSX.Species[m].tankCode, VarValue);
         deriv[i] = MSXerr_validate(x, m, TANK, RATE);                          //1.1.00
     }
 }
@@ -1266,7 +2080,7 @@ void getPipeEquil(double t, double y[], int n, double f[])
 
     for (i=1; i<=n; i++)
     {
-        m = PipeEquilSpecies[i];
+        m = MSX.PipeEquilSpecies[i];
         ChemC1[m] = y[i];
     }
 
@@ -1274,10 +2088,10 @@ void getPipeEquil(double t, double y[], int n, double f[])
 
     if ( MSX.Compiler )
     {
-	    MSXgetPipeEquil(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar, F);
+	    MSX.MSXgetPipeEquil(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar, F);
         for (i=1; i<=n; i++)
         {
-            m = PipeEquilSpecies[i];
+            m = MSX.PipeEquilSpecies[i];
 		    f[i] = MSXerr_validate(F[m], m, LINK, EQUIL);                      //1.1.00
         }
     	return;
@@ -1285,10 +2099,12 @@ void getPipeEquil(double t, double y[], int n, double f[])
 
 // --- evaluate each pipe equilibrium expression
 
+    setPipeVariables();
+    evalOrderedTerms(MSX.PipeEquilOrder, LINK);
     for (i=1; i<=n; i++)
     {
-        m = PipeEquilSpecies[i];
-		x = mathexpr_eval(MSX.Species[m].pipeExpr, getPipeVariableValue);
+        m = MSX.PipeEquilSpecies[i];
+        x = mathexpr_run(MSX.Species[m].pipeCode, VarValue);
 		f[i] = MSXerr_validate(x, m, LINK, EQUIL);                             //1.1.00
     }
 }
@@ -1317,7 +2133,7 @@ void getTankEquil(double t, double y[], int n, double f[])
 
     for (i=1; i<=n; i++)
     {
-        m = TankEquilSpecies[i];
+        m = MSX.TankEquilSpecies[i];
         ChemC1[m] = y[i];
     }
 
@@ -1325,10 +2141,10 @@ void getTankEquil(double t, double y[], int n, double f[])
 
     if ( MSX.Compiler )
     {
-	    MSXgetTankEquil(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar, F);
+	    MSX.MSXgetTankEquil(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar, F);
         for (i=1; i<=n; i++)
         {
-            m = TankEquilSpecies[i];
+            m = MSX.TankEquilSpecies[i];
 		    f[i] = MSXerr_validate(F[m], m, TANK, EQUIL);                      //1.1.00
         }
 	    return;
@@ -1336,10 +2152,731 @@ void getTankEquil(double t, double y[], int n, double f[])
 
 // --- evaluate each tank equilibrium expression
 
+    setTankVariables();
+    evalOrderedTerms(MSX.TankEquilOrder, TANK);
     for (i=1; i<=n; i++)
     {
-        m = TankEquilSpecies[i];
-		x = mathexpr_eval(MSX.Species[m].tankExpr, getTankVariableValue);
+        m = MSX.TankEquilSpecies[i];
+        x = mathexpr_run(MSX.Species[m].tankCode, VarValue);
 		f[i] = MSXerr_validate(x, m, TANK, EQUIL);                             //1.1.00
     }
 }
+
+//=============================================================================
+
+int openJacobians()
+/*
+**  Purpose:
+**    derives the analytic Jacobian of each chemistry system solved by an
+**    integrator or by the equilibrium solver.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    a Jacobian is left NULL, so that the solver finds it numerically,
+**    when its system has no unknowns or when its rate functions also
+**    depend on equilibrium species through full coupling.
+*/
+{
+    int errcode = 0;
+
+    if ( MSX.Solver == ROS2 )
+    {
+        if ( MSX.Coupling != FULL_COUPLING || MSX.NumPipeEquilSpecies == 0 )
+            CALL(errcode, newJacobian(LINK, RATE, &MSX.PipeRateJac));
+        if ( MSX.Coupling != FULL_COUPLING || MSX.NumTankEquilSpecies == 0 )
+            CALL(errcode, newJacobian(TANK, RATE, &MSX.TankRateJac));
+    }
+    CALL(errcode, newJacobian(LINK, EQUIL, &MSX.PipeEquilJac));
+    CALL(errcode, newJacobian(TANK, EQUIL, &MSX.TankEquilJac));
+    return errcode;
+}
+
+//=============================================================================
+
+void closeJacobians()
+/*
+**  Purpose:
+**    frees the analytic Jacobians of the chemistry systems.
+**
+**  Input:
+**    none.
+*/
+{
+    freeJacobian(&MSX.PipeRateJac);
+    freeJacobian(&MSX.TankRateJac);
+    freeJacobian(&MSX.PipeEquilJac);
+    freeJacobian(&MSX.TankEquilJac);
+}
+
+//=============================================================================
+
+int newJacobian(int zone, int type, Sjacobian **jacp)
+/*
+**  Purpose:
+**    derives the analytic Jacobian of one chemistry system.
+**
+**  Input:
+**    zone = reaction zone (LINK or TANK)
+**    type = type of expression (RATE or EQUIL)
+**
+**  Output:
+**    jacp = the system's Jacobian (or NULL if it has none).
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    The system's functions are differentiated with respect to each
+**    variable they use directly. Terms and formula species that depend
+**    on the unknowns are intermediates whose own gradients are found
+**    from their derivatives in the order they are evaluated, and the
+**    chain rule through them is applied when the Jacobian is evaluated.
+**    Every other variable is a constant, so only structurally nonzero
+**    partials are kept. Compiled chemistry functions treat formula
+**    species as constants, and a Jacobian with a derivative too large
+**    to be written to their source code is found numerically instead.
+*/
+{
+    int  i, j, k, n, bound, errcode = 0;
+    int  *unknowns, *order, *slot;
+    char *used;
+    MathExpr *expr, *node;
+    Sjacobian *jac;
+
+// --- identify the system's unknowns
+
+    *jacp = NULL;
+    if ( type == RATE )
+    {
+        n = (zone == LINK) ? MSX.NumPipeRateSpecies : MSX.NumTankRateSpecies;
+        unknowns = (zone == LINK) ? MSX.PipeRateSpecies : MSX.TankRateSpecies;
+    }
+    else
+    {
+        n = (zone == LINK) ? MSX.NumPipeEquilSpecies : MSX.NumTankEquilSpecies;
+        unknowns = (zone == LINK) ? MSX.PipeEquilSpecies : MSX.TankEquilSpecies;
+    }
+    if ( n == 0 ) return 0;
+
+// --- allocate the Jacobian and work arrays
+
+    jac = (Sjacobian *) calloc(1, sizeof(Sjacobian));
+    order = getEvalOrder(zone, type);
+    slot = (int *) calloc(MSX.LastIndex[TERM]+1, sizeof(int));
+    used = (char *) calloc(MSX.LastIndex[TERM]+1, sizeof(char));
+    if ( jac == NULL || order == NULL || slot == NULL || used == NULL )
+    {
+        FREE(jac);
+        FREE(order);
+        FREE(slot);
+        FREE(used);
+        return ERR_MEMORY;
+    }
+    jac->n = n;
+
+// --- number the unknowns and the intermediates that depend on them
+
+    for (i=1; i<=n; i++) slot[unknowns[i]] = i;
+    for (k=1; k<=order[0]; k++)
+    {
+        j = order[k];
+        if ( MSX.Compiler && j <= MSX.LastIndex[SPECIES] ) continue;
+        for (node = getVarExpr(j, zone); node != NULL; node = node->next)
+        {
+            if ( node->opcode == 8 && node->ivar <= MSX.LastIndex[TERM] &&
+                 slot[node->ivar] != 0 ) break;
+        }
+        if ( node ) slot[j] = -(++jac->nint);
+    }
+
+// --- bound the number of partials by the number of variable references
+
+    bound = 0;
+    for (j=1; j<=MSX.LastIndex[TERM]; j++)
+    {
+        if ( slot[j] == 0 ) continue;
+        for (node = getVarExpr(j, zone); node != NULL; node = node->next)
+        {
+            if ( node->opcode == 8 ) bound++;
+        }
+    }
+    jac->partial = (Spartial *) calloc(bound+1, sizeof(Spartial));
+    if ( jac->partial == NULL ) errcode = ERR_MEMORY;
+
+// --- differentiate the intermediates in their order of evaluation
+//     and then the system's functions
+
+    for (k=1; k<=order[0] && !errcode; k++)
+    {
+        j = order[k];
+        if ( slot[j] < 0 )
+            errcode = addPartials(jac, slot[j], getVarExpr(j, zone), slot, used);
+    }
+    for (i=1; i<=n && !errcode; i++)
+    {
+        expr = getVarExpr(unknowns[i], zone);
+        errcode = addPartials(jac, i, expr, slot, used);
+    }
+    FREE(order);
+    FREE(slot);
+    FREE(used);
+    if ( errcode )
+    {
+        freeJacobian(&jac);
+        return errcode;
+    }
+
+// --- check that compiled derivatives fit in the source code's buffers
+
+    if ( MSX.Compiler )
+    {
+        for (k=0; k<jac->npartials; k++)
+        {
+            n = 0;
+            for (node = jac->partial[k].expr; node != NULL; node = node->next) n++;
+            if ( n > MAXJACSIZE )
+            {
+                freeJacobian(&jac);
+                return 0;
+            }
+        }
+    }
+    *jacp = jac;
+    return 0;
+}
+
+//=============================================================================
+
+int addPartials(Sjacobian *jac, int row, MathExpr *expr, int *slot, char *used)
+/*
+**  Purpose:
+**    adds the nonzero partial derivatives of an expression to a Jacobian.
+**
+**  Input:
+**    jac = the Jacobian being built
+**    row = the expression's row in the Jacobian (see Spartial)
+**    expr = a tokenized math expression
+**    slot = column of each variable in the Jacobian (0 if a constant)
+**    used = work array of flags cleared for each variable.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int errcode = 0;
+    MathExpr *node, *d;
+    Spartial *p;
+
+    for (node = expr; node != NULL && !errcode; node = node->next)
+    {
+        if ( node->opcode != 8 || node->ivar > MSX.LastIndex[TERM] ) continue;
+        if ( slot[node->ivar] == 0 || used[node->ivar] ) continue;
+        used[node->ivar] = 1;
+        d = mathexpr_diff(expr, node->ivar);
+        if ( d == NULL )
+        {
+            errcode = ERR_MEMORY;
+            break;
+        }
+        if ( d->next == NULL && d->opcode == 7 && d->fvalue == 0.0 )
+        {
+            mathexpr_delete(d);
+            continue;
+        }
+        p = &jac->partial[jac->npartials++];
+        p->row = row;
+        p->col = slot[node->ivar];
+        p->expr = d;
+        p->code = mathexpr_compile(d);
+        if ( p->code == NULL ) errcode = ERR_MEMORY;
+    }
+    for (node = expr; node != NULL; node = node->next)
+    {
+        if ( node->opcode == 8 && node->ivar <= MSX.LastIndex[TERM] )
+            used[node->ivar] = 0;
+    }
+    return errcode;
+}
+
+//=============================================================================
+
+void freeJacobian(Sjacobian **jacp)
+/*
+**  Purpose:
+**    frees an analytic Jacobian.
+**
+**  Input:
+**    jacp = the Jacobian (which is set to NULL).
+*/
+{
+    int k;
+    Sjacobian *jac = *jacp;
+
+    if ( jac == NULL ) return;
+    for (k=0; k<jac->npartials; k++)
+    {
+        mathexpr_delete(jac->partial[k].expr);
+        mathexpr_deleteCode(jac->partial[k].code);
+    }
+    FREE(jac->partial);
+    FREE(jac);
+    *jacp = NULL;
+}
+
+//=============================================================================
+
+MathExpr* getVarExpr(int i, int zone)
+/*
+**  Purpose:
+**    returns the chemistry expression of a species or of a term.
+**
+**  Input:
+**    i = variable index
+**    zone = reaction zone (LINK or TANK).
+*/
+{
+    if ( i > MSX.LastIndex[SPECIES] ) return MSX.Term[i-MSX.LastIndex[TERM-1]].expr;
+    if ( zone == LINK ) return MSX.Species[i].pipeExpr;
+    return MSX.Species[i].tankExpr;
+}
+
+//=============================================================================
+
+void evalJacobian(Sjacobian *jac, double **a)
+/*
+**  Purpose:
+**    evaluates an analytic Jacobian from the values of the variables
+**    in VarValue.
+**
+**  Input:
+**    jac = an analytic Jacobian.
+**
+**  Output:
+**    a[1..n][1..n] = the Jacobian matrix.
+**
+**  Note:
+**    row p of JacWork receives the gradient of intermediate p with
+**    respect to the unknowns.
+*/
+{
+    int i, k, n = jac->n, w = jac->n + 1;
+    double x, *g, *dx;
+    Spartial *p;
+
+    for (i=1; i<=n; i++)
+    {
+        for (k=1; k<=n; k++) a[i][k] = 0.0;
+    }
+    for (i=w; i<(jac->nint+1)*w; i++) JacWork[i] = 0.0;
+    for (k=0; k<jac->npartials; k++)
+    {
+        p = &jac->partial[k];
+        x = mathexpr_run(p->code, VarValue);
+        if ( !isValidNumber(x) ) continue;
+        if ( p->row > 0 ) g = a[p->row];
+        else              g = JacWork - p->row*w;
+        if ( p->col > 0 ) g[p->col] += x;
+        else
+        {
+            dx = JacWork - p->col*w;
+            for (i=1; i<=n; i++) g[i] += x * dx[i];
+        }
+    }
+}
+
+//=============================================================================
+
+void copyJacobian(int n, double **a)
+/*
+**  Purpose:
+**    copies a Jacobian found by a compiled chemistry function from
+**    JacWork into a matrix.
+**
+**  Input:
+**    n = number of unknowns.
+**
+**  Output:
+**    a[1..n][1..n] = the Jacobian matrix.
+*/
+{
+    int i, k;
+    double x;
+
+    for (i=1; i<=n; i++)
+    {
+        for (k=1; k<=n; k++)
+        {
+            x = JacWork[i*(n+1) + k];
+            a[i][k] = isValidNumber(x) ? x : 0.0;
+        }
+    }
+}
+
+//=============================================================================
+
+void getPipeRateJac(double t, double y[], int n, double **a)
+/*
+**  Purpose:
+**    finds the Jacobian of the reaction rates of a pipe's reacting species.
+**
+**  Input:
+**    t = current time (not used)
+**    y[] = vector of reacting species concentrations
+**    n = number of reacting species.
+**
+**  Output:
+**    a[1..n][1..n] = Jacobian matrix of the reaction rates.
+*/
+{
+    int i;
+
+    for (i=1; i<=n; i++) ChemC1[MSX.PipeRateSpecies[i]] = y[i];
+    if ( MSX.Compiler )
+    {
+        MSX.MSXgetPipeRatesJac(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar,
+                               JacWork);
+        copyJacobian(n, a);
+        return;
+    }
+    setPipeVariables();
+    evalOrderedTerms(MSX.PipeRateOrder, LINK);
+    evalJacobian(MSX.PipeRateJac, a);
+}
+
+//=============================================================================
+
+void getTankRateJac(double t, double y[], int n, double **a)
+/*
+**  Purpose:
+**    finds the Jacobian of the reaction rates of a tank's reacting species.
+**
+**  Input:
+**    t = current time (not used)
+**    y[] = vector of reacting species concentrations
+**    n = number of reacting species.
+**
+**  Output:
+**    a[1..n][1..n] = Jacobian matrix of the reaction rates.
+*/
+{
+    int i;
+
+    for (i=1; i<=n; i++) ChemC1[MSX.TankRateSpecies[i]] = y[i];
+    if ( MSX.Compiler )
+    {
+        MSX.MSXgetTankRatesJac(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar,
+                               JacWork);
+        copyJacobian(n, a);
+        return;
+    }
+    setTankVariables();
+    evalOrderedTerms(MSX.TankRateOrder, TANK);
+    evalJacobian(MSX.TankRateJac, a);
+}
+
+//=============================================================================
+
+void getPipeEquilJac(double t, double y[], int n, double **a)
+/*
+**  Purpose:
+**    finds the Jacobian of the equilibrium expressions of pipe chemistry.
+**
+**  Input:
+**    t = current time (not used)
+**    y[] = vector of equilibrium species concentrations
+**    n = number of equilibrium species.
+**
+**  Output:
+**    a[1..n][1..n] = Jacobian matrix of the equilibrium functions.
+*/
+{
+    int i;
+
+    for (i=1; i<=n; i++) ChemC1[MSX.PipeEquilSpecies[i]] = y[i];
+    if ( MSX.Compiler )
+    {
+        MSX.MSXgetPipeEquilJac(ChemC1, MSX.K, MSX.Link[TheLink].param, HydVar,
+                               JacWork);
+        copyJacobian(n, a);
+        return;
+    }
+    setPipeVariables();
+    evalOrderedTerms(MSX.PipeEquilOrder, LINK);
+    evalJacobian(MSX.PipeEquilJac, a);
+}
+
+//=============================================================================
+
+void getTankEquilJac(double t, double y[], int n, double **a)
+/*
+**  Purpose:
+**    finds the Jacobian of the equilibrium expressions of tank chemistry.
+**
+**  Input:
+**    t = current time (not used)
+**    y[] = vector of equilibrium species concentrations
+**    n = number of equilibrium species.
+**
+**  Output:
+**    a[1..n][1..n] = Jacobian matrix of the equilibrium functions.
+*/
+{
+    int i;
+
+    for (i=1; i<=n; i++) ChemC1[MSX.TankEquilSpecies[i]] = y[i];
+    if ( MSX.Compiler )
+    {
+        MSX.MSXgetTankEquilJac(ChemC1, MSX.K, MSX.Tank[TheTank].param, HydVar,
+                               JacWork);
+        copyJacobian(n, a);
+        return;
+    }
+    setTankVariables();
+    evalOrderedTerms(MSX.TankEquilOrder, TANK);
+    evalJacobian(MSX.TankEquilJac, a);
+}
+
+//=============================================================================
+
+void resetReuse()
+/*
+**  Purpose:
+**    discards the calling thread's saved Jacobians and last equilibrium
+**    solution, and sets how often its solvers may reuse Jacobians.
+**
+**  Input:
+**    none.
+**
+**  Note: this is done before the reactions of each pipe or tank, so
+**        that solves only reuse work done for the same element by the
+**        same thread. Which pipes and tanks a thread is given varies
+**        from run to run, so results would otherwise depend on the
+**        number of threads. Segments in a block of the batched Euler
+**        kernel can come from any pipes and are each solved afresh, as
+**        are nodes mixed outside of the reaction step.
+*/
+{
+    ros2_setReuse(MSX.ReuseJac);
+    newton_setReuse(MSX.ReuseJac);
+    WarmZone = 0;
+}
+
+//=============================================================================
+
+void warmStart(int zone, int n, void (*func)(double, double*, int, double*))
+/*
+**  Purpose:
+**    starts an equilibrium solve from the last solution found in the
+**    same zone (usually that of the previous segment or step) if it
+**    satisfies the equilibrium equations more closely than the values
+**    in Yequil do.
+**
+**  Input:
+**    zone = reaction zone (LINK or TANK)
+**    n = number of equilibrium species
+**    func = function that evaluates the equilibrium equations.
+**
+**  Output:
+**    Yequil[] = starting values of the equilibrium species.
+*/
+{
+    int i;
+    double r0 = 0.0, r1 = 0.0;
+
+    if ( WarmZone != zone || WarmSize != n ) return;
+    func(0.0, Yequil, n, Fwarm);
+    for (i=1; i<=n; i++) r0 += Fwarm[i] * Fwarm[i];
+    func(0.0, Ywarm, n, Fwarm);
+    for (i=1; i<=n; i++) r1 += Fwarm[i] * Fwarm[i];
+    if ( r1 < r0 )
+    {
+        for (i=1; i<=n; i++) Yequil[i] = Ywarm[i];
+        WarmStarts++;
+    }
+}
+
+//=============================================================================
+
+int isValidNumber(double x)
+/*
+**  Purpose:
+**    checks if a number is finite.
+*/
+{
+    return isfinite(x);
+}
+
+//=============================================================================
+
+int workTooSmall()
+/*
+**  Purpose:
+**    checks if the calling thread's work arrays are too small for the
+**    current project.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    1 if the work arrays must be enlarged, 0 otherwise.
+*/
+{
+    return WorkSize < MSX.NumSpecies ||
+           VarSize < MSX.LastIndex[CONSTANT] + MAX_HYD_VARS ||
+           JacSize < (MSX.LastIndex[TERM] + 1) * (MSX.NumSpecies + 1);
+}
+
+//=============================================================================
+
+int openThreadWork()
+/*
+**  Purpose:
+**    sizes the calling thread's work arrays and solvers to hold all of
+**    the current project's species.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note:
+**    Work space is only ever grown so that threads can move between
+**    projects of different sizes without re-allocating each time.
+*/
+{
+    int m = MAX(WorkSize, MSX.NumSpecies);
+    int n = MAX(VarSize, MSX.LastIndex[CONSTANT] + MAX_HYD_VARS);
+    int j = MAX(JacSize, (MSX.LastIndex[TERM] + 1) * (MSX.NumSpecies + 1));
+    int errcode = 0;
+
+    if ( !workTooSmall() ) return 0;
+    closeThreadWork();
+    m = m + 1;
+    Yrate = (double*)calloc(m, sizeof(double));
+    Yequil = (double*)calloc(m, sizeof(double));
+    F = (double*)calloc(m, sizeof(double));
+    ChemC1 = (double*)calloc(m, sizeof(double));
+    SegC = (double*)calloc(m, sizeof(double));
+    BlockC = (double*)calloc(m*MAXBATCH, sizeof(double));
+    BlockF = (double*)calloc(m*MAXBATCH, sizeof(double));
+    BlockP = (double*)calloc(n*MAXBATCH, sizeof(double));
+    VarValue = (double*)calloc(n, sizeof(double));
+    JacWork = (double*)calloc(j, sizeof(double));
+    Ywarm = (double*)calloc(m, sizeof(double));
+    Fwarm = (double*)calloc(m, sizeof(double));
+    CALL(errcode, MEMCHECK(Yrate));
+    CALL(errcode, MEMCHECK(Yequil));
+    CALL(errcode, MEMCHECK(F));
+    CALL(errcode, MEMCHECK(ChemC1));
+    CALL(errcode, MEMCHECK(SegC));
+    CALL(errcode, MEMCHECK(BlockC));
+    CALL(errcode, MEMCHECK(BlockF));
+    CALL(errcode, MEMCHECK(BlockP));
+    CALL(errcode, MEMCHECK(VarValue));
+    CALL(errcode, MEMCHECK(JacWork));
+    CALL(errcode, MEMCHECK(Ywarm));
+    CALL(errcode, MEMCHECK(Fwarm));
+    if ( errcode ) return errcode;
+
+// --- open the ODE solvers and algebraic eqn. solver;
+//     arguments are max. number of ODE's,
+//     max. number of steps to be taken,
+//     1 if automatic step sizing used (or 0 if not used)
+
+    m = m - 1;
+    if ( rk5_open(m, 1000, 1) == FALSE ) return ERR_INTEGRATOR_OPEN;
+    if ( ros2_open(m, 1) == FALSE ) return ERR_INTEGRATOR_OPEN;
+    if ( newton_open(m) == FALSE ) return ERR_NEWTON_OPEN;
+    WorkSize = m;
+    VarSize = n;
+    JacSize = j;
+    return 0;
+}
+
+//=============================================================================
+
+void closeThreadWork()
+/*
+**  Purpose:
+**    frees the calling thread's work arrays and solvers.
+**
+**  Input:
+**    none.
+*/
+{
+    FREE(Yrate);
+    FREE(Yequil);
+    FREE(F);
+    FREE(ChemC1);
+    FREE(SegC);
+    FREE(BlockC);
+    FREE(BlockF);
+    FREE(BlockP);
+    FREE(VarValue);
+    FREE(JacWork);
+    FREE(Ywarm);
+    FREE(Fwarm);
+    WarmZone = 0;
+    rk5_close();
+    ros2_close();
+    newton_close();
+    WorkSize = 0;
+    VarSize = 0;
+    JacSize = 0;
+}
+
+//=============================================================================
+
+int listReactingPipes()
+/*
+**  Purpose:
+**    lists the pipes that hold water quality segments in MSX.ReactLinks,
+**    ordered from most to least work done in the last reaction step.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    the number of pipes listed.
+*/
+{
+    int k, n = 0;
+    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+    {
+        if ( MSX.Link[k].len == 0.0 ) continue;
+        if ( MSX.FirstSeg[k] == NULL ) continue;
+        MSX.ReactLinks[++n] = k;
+    }
+
+// --- ordering only matters when pipes are shared among threads
+
+#ifdef _OPENMP
+    if ( omp_get_max_threads() > 1 )
+        qsort(&MSX.ReactLinks[1], n, sizeof(int), compareLinkCost);
+#endif
+    return n;
+}
+
+//=============================================================================
+
+#ifdef _OPENMP
+int compareLinkCost(const void *a, const void *b)
+/*
+**  Purpose:
+**    qsort comparison function that orders links by decreasing cost
+**    (and by index when costs are equal).
+*/
+{
+    int i = *(const int *)a;
+    int j = *(const int *)b;
+    if ( MSX.Link[i].cost > MSX.Link[j].cost ) return -1;
+    if ( MSX.Link[i].cost < MSX.Link[j].cost ) return 1;
+    return i - j;
+}
+#endif
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include "msxtypes.h"
 #include "msxfuncs.h"
 #include "msxutils.h"
@@ -30,22 +31,27 @@
   #define WINDOWS
 #endif
 
-//  Local variables
-//-----------------
-char *Fname;                 // Prefix used for all file names
-char TempName[L_tmpnam];
-char srcFile[MAXFNAME];      // Name of source code file
-char objFile[MAXFNAME];      // Name of object file
-char libFile[MAXFNAME];      // Name of library file
-int  Compiled;               // Flag for compilation step
-
-//  External variables
-//--------------------
-extern MSXproject  MSX;       // MSX project data
+#ifdef WINDOWS
+  #define LIBEXT ".dll"
+  #define DIRSEP "\\"
+#else
+  #define LIBEXT ".so"
+  #define DIRSEP "/"
+#endif
+
+// --- outcomes of a search of the compiled library cache
+
+enum CacheResultType {CACHE_NONE,      // cache can't be used
+                      CACHE_HIT,       // library already in cache
+                      CACHE_BUILD};    // library must be built for cache
+
+#define CACHE_WAIT  100                // msec between polls of a cache lock
+#define CACHE_TRIES 600                // max. polls before a lock is stale
 
 //  Imported functions
 //--------------------
 char * MSXchem_getVariableStr(int i, char *s);
+char * MSXchem_getBatchVariableStr(int i, char *s);
 
 //  Exported functions
 //--------------------
@@ -55,6 +61,12 @@ void MSXcompiler_close(void);
 //  Local functions
 //-----------------
 static void  writeSrcFile(FILE* f);
+static void  writeBatchRates(FILE* f);
+static void  writeTermsUsedBy(FILE* f, MathExpr* expr, char* done);
+static void  writeJacobian(FILE* f, char* name, Sjacobian* jac);
+static int   getCacheFile(char* fmt, char* cacheFile);
+static int   findCacheFile(char* cacheFile, char* lockFile);
+static int   addCacheFile(char* cacheFile);
 
 //=============================================================================
 
@@ -71,78 +83,122 @@ int MSXcompiler_open()
 **    an error code (0 if no error).
 */
 {
-    char cmd[256];
+    char  cmd[3*MAXFNAME];
+    char  cacheFile[MAXFNAME+1];
+    char  lockFile[MAXFNAME+1];
+    char  buildFile[MAXFNAME];
+    char* fmt = NULL;
     FILE* f;
-    int   err;
+    int   err, n;
+    int   cache = CACHE_NONE;
 
 // --- initialize
 
-    Fname = NULL;
-    Compiled = FALSE;
+    MSX.CompiledChem.Fname = NULL;
+    MSX.CompiledChem.Compiled = FALSE;
+    MSX.CompiledChem.Cached = FALSE;
 
 // --- get the name of a temporary file with directory path stripped from it
 //     and replace any '.' characters in it (for the Borland compiler to work)
 
-    Fname = MSXutils_getTempName(TempName) ;
+    MSX.CompiledChem.Fname = MSXutils_getTempName(MSX.CompiledChem.TempName) ;
 
 // --- assign names to source code and compiled files
 
-    strcpy(srcFile, Fname);
-    strcat(srcFile, ".c");
-    strcpy(objFile, Fname);
-    strcat(objFile, ".o");
+    strcpy(MSX.CompiledChem.srcFile, MSX.CompiledChem.Fname);
+    strcat(MSX.CompiledChem.srcFile, ".c");
+    strcpy(MSX.CompiledChem.objFile, MSX.CompiledChem.Fname);
+    strcat(MSX.CompiledChem.objFile, ".o");
 #ifdef WINDOWS
-    strcpy(libFile, Fname);
-    strcat(libFile, ".dll");
+    strcpy(MSX.CompiledChem.libFile, MSX.CompiledChem.Fname);
 #else
-    strcpy(libFile, "lib");
-    strcat(libFile, Fname);
-    strcat(libFile, ".so");
+    strcpy(MSX.CompiledChem.libFile, "./lib");
+    strcat(MSX.CompiledChem.libFile, MSX.CompiledChem.Fname);
 #endif
+    strcat(MSX.CompiledChem.libFile, LIBEXT);
 
 // --- write the chemistry functions to the source code file
 
-    f = fopen(srcFile, "wt");
+    f = fopen(MSX.CompiledChem.srcFile, "wt");
     if ( f == NULL ) return ERR_COMPILE_FAILED;
     writeSrcFile(f);
     fclose(f);
 
-// --- compile the source code file to a dynamic link library file
+// --- select the command line that compiles the source code file
+//     (its arguments are the library and source file names)
 
 #ifdef WINDOWS
-    if ( MSX.Compiler == VC )
+    if ( MSX.Compiler == VC ) fmt = "CL /O2 /LD /nologo /Fe\"%s\" \"%s\"";
+    else if ( MSX.Compiler == GC ) fmt = "gcc -O3 -shared -o \"%s\" \"%s\" -lm";
+#else
+    if ( MSX.Compiler == GC ) fmt = "gcc -O3 -fPIC -shared -o \"%s\" \"%s\" -lm";
+#endif
+
+// --- look for a library compiled from the same source in the cache
+//     directory; if there is none then build one there under the
+//     temporary file name
+
+    if ( fmt && MSX.CacheDir[0] && getCacheFile(fmt, cacheFile) )
     {
-	sprintf(cmd, "CL /O2 /LD /nologo %s", srcFile);
-        err = MSXfuncs_run(cmd);
+        cache = findCacheFile(cacheFile, lockFile);
+        if ( cache == CACHE_HIT )
+        {
+            strcpy(MSX.CompiledChem.libFile, cacheFile);
+            MSX.CompiledChem.Cached = TRUE;
+        }
+        else if ( cache == CACHE_BUILD )
+        {
+            n = snprintf(buildFile, sizeof(buildFile), "%s%s%s%s",
+                         MSX.CacheDir, DIRSEP, MSX.CompiledChem.Fname, LIBEXT);
+            if ( n > 0 && n < (int)sizeof(buildFile) )
+                strcpy(MSX.CompiledChem.libFile, buildFile);
+            else
+            {
+                remove(lockFile);
+                cache = CACHE_NONE;
+            }
+        }
     }
 
-    else if ( MSX.Compiler == GC )
+// --- compile the source code file to a dynamic link library file
+
+    if ( MSX.CompiledChem.Cached ) err = 0;
+    else if ( fmt == NULL ) err = 1;
+    else
     {
-	sprintf(cmd, "gcc -c -O3 %s", srcFile);
-	err = MSXfuncs_run(cmd);
-	sprintf(cmd, "gcc -lm -shared -o %s %s", libFile, objFile);
-	err = MSXfuncs_run(cmd);
-    }
-    else return ERR_COMPILE_FAILED;
+        sprintf(cmd, fmt, MSX.CompiledChem.libFile, MSX.CompiledChem.srcFile);
+#ifdef WINDOWS
+        err = MSXfuncs_run(cmd);
 #else
-    if ( MSX.Compiler == GC )
-    {
-        sprintf(cmd, "gcc -c -fPIC -O3 %s", srcFile);
-        err = system(cmd);
-        sprintf(cmd, "gcc -lm -shared -o %s %s", libFile, objFile);
         err = system(cmd);
-    }
-    else return ERR_COMPILE_FAILED;
 #endif
-    Compiled = (err == 0);                                                     // ttaxon - 9/7/10
+    }
+
+// --- move a newly built library into the cache and release the lock
+//     that kept other processes from building it at the same time
+
+    if ( cache == CACHE_BUILD )
+    {
+        if ( err == 0 && addCacheFile(cacheFile) )
+        {
+            strcpy(MSX.CompiledChem.libFile, cacheFile);
+            MSX.CompiledChem.Cached = TRUE;
+        }
+        remove(lockFile);
+    }
+    MSX.CompiledChem.Compiled = (err == 0);                                    // ttaxon - 9/7/10
 
 // --- load the compiled chemistry functions from the library file
 
-    if ( Compiled)                                                             // ttaxon - 9/7/10
+    if ( MSX.CompiledChem.Compiled)                                            // ttaxon - 9/7/10
     {
-        err = MSXfuncs_load(libFile);
-        if ( err == 1 ) return ERR_COMPILE_FAILED;
-        if ( err == 2 ) return ERR_COMPILED_LOAD;
+        err = MSXfuncs_load(MSX.CompiledChem.libFile);
+        if ( err )
+        {
+            MSXcompiler_close();
+            if ( err == 1 ) return ERR_COMPILE_FAILED;
+            return ERR_COMPILED_LOAD;
+        }
     }
     else                                                                       // ttaxon - 9/7/10   
     {
@@ -167,22 +223,176 @@ void MSXcompiler_close()
 **    none.
 */
 {
-    char cmd[256];
-    if ( Compiled ) MSXfuncs_free();
-    if ( Fname )
+    char cmd[2*MAXFNAME];
+    if ( MSX.CompiledChem.Compiled ) MSXfuncs_free();
+    if ( MSX.CompiledChem.Fname )
     {
 #ifdef WINDOWS
         // --- delete all files created from compilation
         //     (VC++ creates more than just an obj and dll file)
-        sprintf(cmd, "cmd /c del %s.*", Fname);
+        sprintf(cmd, "cmd /c del %s.*", MSX.CompiledChem.Fname);
         MSXfuncs_run(cmd);
+        if ( MSX.CacheDir[0] )
+        {
+            sprintf(cmd, "cmd /c del \"%s\\%s.*\"", MSX.CacheDir,
+                    MSX.CompiledChem.Fname);
+            MSXfuncs_run(cmd);
+        }
 #else
-        remove(TempName);
-        remove(srcFile);
-        remove(objFile);
-        remove(libFile);
+        remove(MSX.CompiledChem.TempName);
+        remove(MSX.CompiledChem.srcFile);
+        remove(MSX.CompiledChem.objFile);
+        if ( !MSX.CompiledChem.Cached ) remove(MSX.CompiledChem.libFile);
 #endif
     }
+    MSX.CompiledChem.Compiled = FALSE;
+    MSX.CompiledChem.Cached = FALSE;
+    MSX.CompiledChem.Fname = NULL;
+}
+
+//=============================================================================
+
+int getCacheFile(char* fmt, char* cacheFile)
+/*
+**  Purpose:
+**    names the cached library file built from the current source code file
+**
+**  Input:
+**    fmt = format of the command line used to compile the source file
+**
+**  Output:
+**    cacheFile = path of the library file in the cache directory
+**
+**  Returns:
+**    TRUE if the path (and that of its lock file) fits in a file name,
+**    FALSE otherwise.
+**
+**  Note: the name contains a 64-bit FNV-1a hash of the source code
+**        (which includes all species, terms and expressions) and of
+**        the compiler command, so a library is only reused for an
+**        identical chemistry built with identical compiler flags.
+*/
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned char buf[4096];
+    size_t n, i;
+    int    len;
+    char   *c;
+    FILE   *f;
+
+    for (c = fmt; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    f = fopen(MSX.CompiledChem.srcFile, "rb");
+    if ( f )
+    {
+        while ( (n = fread(buf, 1, sizeof(buf), f)) > 0 )
+        {
+            for (i = 0; i < n; i++)
+            {
+                hash ^= buf[i];
+                hash *= 1099511628211ULL;
+            }
+        }
+        fclose(f);
+    }
+    len = snprintf(cacheFile, MAXFNAME+1, "%s%smsx%08lx%08lx%s", MSX.CacheDir,
+                   DIRSEP, (unsigned long)(hash >> 32),
+                   (unsigned long)(hash & 0xFFFFFFFF), LIBEXT);
+    return len > 0 && len + 4 <= MAXFNAME;
+}
+
+//=============================================================================
+
+int findCacheFile(char* cacheFile, char* lockFile)
+/*
+**  Purpose:
+**    checks if a library file exists in the cache and, if not, obtains
+**    the right to build it
+**
+**  Input:
+**    cacheFile = path of the library file in the cache directory
+**
+**  Output:
+**    lockFile = path of the lock file created for cacheFile
+**
+**  Returns:
+**    CACHE_HIT if the library exists, CACHE_BUILD if it should be built
+**    and added to the cache, or CACHE_NONE if the cache can't be used.
+**
+**  Note: a process builds a library only after creating its lock file
+**        (so CACHE_BUILD means that the caller owns the lock and must
+**        remove it); other processes wait for that library to appear
+**        rather than compile it too. A lock still held after CACHE_TRIES
+**        polls is taken to be left by a crashed process and is removed
+**        once; if the lock can't then be created the library is built
+**        outside of the cache.
+*/
+{
+    int   i;
+    FILE* f;
+
+    strcpy(lockFile, cacheFile);
+    strcat(lockFile, ".lck");
+    for (i = 0; i <= CACHE_TRIES; i++)
+    {
+        if ( i == CACHE_TRIES ) remove(lockFile);
+        f = fopen(cacheFile, "rb");
+        if ( f )
+        {
+            fclose(f);
+            return CACHE_HIT;
+        }
+        f = fopen(lockFile, "wx");
+        if ( f )
+        {
+            fclose(f);
+
+        // --- the library may have been added since it was looked for
+
+            f = fopen(cacheFile, "rb");
+            if ( f == NULL ) return CACHE_BUILD;
+            fclose(f);
+            remove(lockFile);
+            return CACHE_HIT;
+        }
+        if ( errno != EEXIST ) return CACHE_NONE;
+        if ( i < CACHE_TRIES ) MSXfuncs_wait(CACHE_WAIT);
+    }
+    return CACHE_NONE;
+}
+
+//=============================================================================
+
+int addCacheFile(char* cacheFile)
+/*
+**  Purpose:
+**    moves a newly compiled library file into the cache
+**
+**  Input:
+**    cacheFile = path of the library file in the cache directory
+**
+**  Returns:
+**    TRUE if cacheFile now exists, FALSE otherwise.
+**
+**  Note: the library is built under a temporary name in the cache
+**        directory and then renamed, so other processes never see
+**        a partially written file.
+*/
+{
+    FILE* f;
+
+    if ( rename(MSX.CompiledChem.libFile, cacheFile) == 0 ) return TRUE;
+
+// --- another process may have added the same library first
+
+    f = fopen(cacheFile, "rb");
+    if ( f == NULL ) return FALSE;
+    fclose(f);
+    remove(MSX.CompiledChem.libFile);
+    return TRUE;
 }
 
 //=============================================================================
@@ -241,26 +451,34 @@ void  writeSrcFile(FILE* f)
 " void  DLLEXPORT  MSXgetTankEquil(double *, double *, double *, double *, double *); \n"
 " void  DLLEXPORT  MSXgetPipeFormulas(double *, double *, double *, double *); \n"
 " void  DLLEXPORT  MSXgetTankFormulas(double *, double *, double *, double *); \n"
-" double term(int, double *, double *, double *, double *); \n";
+" static double term(int, double *, double *, double *, double *); \n";
+
+    char batchHeaders[] =
+
+" \n"
+" #define MSXBATCH %d \n"
+" void  DLLEXPORT  MSXgetPipeRatesBatch(int, double [][MSXBATCH], double *, \n"
+"                                      double [][MSXBATCH], double [][MSXBATCH], \n"
+"                                      double [][MSXBATCH]); \n";
 
     char mathFuncs[] = 
 
-    " double coth(double); \n"
-    " double cot(double); \n"
-    " double acot(double); \n"
-    " double step(double); \n"
-    " double sgn(double); \n"
+    " static double coth(double); \n"
+    " static double cot(double); \n"
+    " static double acot(double); \n"
+    " static double step(double); \n"
+    " static double sgn(double); \n"
     " \n"
-    " double coth(double x) { \n"
+    " static double coth(double x) { \n"
     "   return (exp(x) + exp(-x)) / (exp(x) - exp(-x)); } \n"
-    " double cot(double x) { \n"
+    " static double cot(double x) { \n"
     "   return 1.0 / tan(x); } \n"
-    " double acot(double x) { \n"
+    " static double acot(double x) { \n"
     "   return 1.57079632679489661923 - atan(x); } \n"
-    " double step(double x) { \n"
+    " static double step(double x) { \n"
     "   if (x <= 0.0) return 0.0; \n"
     "   return 1.0; } \n"
-    " double sgn(double x) { \n"
+    " static double sgn(double x) { \n"
     "   if (x < 0.0) return -1.0; \n"
     "   if (x > 0.0) return 1.0; \n"
     "   return 0.0; } \n";
@@ -269,12 +487,13 @@ void  writeSrcFile(FILE* f)
 // --- write headers & non-intrinsic math functions to file
 
     fprintf(f, "%s", headers);
+    fprintf(f, batchHeaders, MAXBATCH);
     fprintf(f, "%s", mathFuncs);
 
 // --- write term functions
 
     fprintf(f,
-"\n double term(int i, double c[], double k[], double p[], double h[])\n { \n");
+"\n static double term(int i, double c[], double k[], double p[], double h[])\n { \n");
     if ( MSX.Nobjects[TERM] > 0 )
     {
        fprintf(f, "     switch(i) { \n");
@@ -358,5 +577,172 @@ void  writeSrcFile(FILE* f)
                 MSXchem_getVariableStr));
     }
     fprintf(f, " }\n");
+
+// --- write the batched version of the pipe rate functions
+
+    writeBatchRates(f);
+
+// --- write the Jacobians of the chemistry systems that have analytic ones
+
+    writeJacobian(f, "MSXgetPipeRatesJac", MSX.PipeRateJac);
+    writeJacobian(f, "MSXgetTankRatesJac", MSX.TankRateJac);
+    writeJacobian(f, "MSXgetPipeEquilJac", MSX.PipeEquilJac);
+    writeJacobian(f, "MSXgetTankEquilJac", MSX.TankEquilJac);
     fprintf(f, "\n");
 }
+
+//=============================================================================
+
+void  writeBatchRates(FILE* f)
+/*
+**  Purpose:
+**    writes a function that evaluates the pipe reaction rates for a
+**    block of up to MSXBATCH pipe segments.
+**
+**  Input:
+**    f = pointer to the source code file
+**
+**  Returns:
+**    none.
+**
+**  Note: every statement is written inside a single loop over the
+**        segments of the block, with c[m][j] and f[m][j] holding the
+**        concentration and rate of species m in segment j, so that the
+**        compiler can vectorize the loop. Parameters p[i][j] and
+**        hydraulic variables h[i][j] are also held for each segment,
+**        since a block can hold segments of several pipes. Intermediate terms are held
+**        in t[i][j] and are evaluated once per segment, in an order in
+**        which each term comes after the terms it uses.
+*/
+{
+    int i;
+    char e[1024];
+    char *done;
+
+    fprintf(f,
+"\n void DLLEXPORT MSXgetPipeRatesBatch(int n, double c[][MSXBATCH], double k[],\n"
+"                                      double p[][MSXBATCH], double h[][MSXBATCH],\n"
+"                                      double f[][MSXBATCH])\n { \n"
+"     int j; \n");
+    if ( MSX.Nobjects[TERM] > 0 )
+        fprintf(f, "     double t[%d][MSXBATCH]; \n", MSX.Nobjects[TERM]+1);
+    fprintf(f, "     for (j = 0; j < n; j++) \n     { \n");
+
+// --- write the terms used by the pipe rate expressions
+
+    done = (char *) calloc(MSX.Nobjects[TERM]+1, sizeof(char));
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++)
+    {
+        if ( MSX.Species[i].pipeExprType == RATE && done != NULL )
+            writeTermsUsedBy(f, MSX.Species[i].pipeExpr, done);
+    }
+    FREE(done);
+
+// --- write the pipe rate expressions
+
+    for (i=1; i<=MSX.Nobjects[SPECIES]; i++)
+    {
+        if ( MSX.Species[i].pipeExprType == RATE )
+            fprintf(f, "         f[%d][j] = %s; \n", i, mathexpr_getStr(MSX.Species[i].pipeExpr, e,
+                MSXchem_getBatchVariableStr));
+    }
+    fprintf(f, "     } \n }\n");
+}
+
+//=============================================================================
+
+void  writeJacobian(FILE* f, char* name, Sjacobian* jac)
+/*
+**  Purpose:
+**    writes a function that evaluates the analytic Jacobian of a
+**    chemistry system.
+**
+**  Input:
+**    f = pointer to the source code file
+**    name = name of the function
+**    jac = the system's analytic Jacobian (or NULL if it has none)
+**
+**  Returns:
+**    none.
+**
+**  Note: the partial derivative of function r with respect to unknown
+**        m is placed in j[r*(n+1)+m], n being the number of unknowns.
+**        The gradient of intermediate term q with respect to the
+**        unknowns is built up in d[q*(n+1)+1] to d[q*(n+1)+n] from the
+**        partials, which are written in order of evaluation, so that
+**        a partial with respect to a term can apply the chain rule.
+*/
+{
+    int  k, w, row, col;
+    char e[1024];
+    char *a;
+    Spartial *p;
+
+    if ( jac == NULL ) return;
+    w = jac->n + 1;
+    fprintf(f,
+"\n void DLLEXPORT %s(double c[], double k[], double p[], double h[], double j[])\n { \n"
+"     int i; \n"
+"     double x; \n", name);
+    if ( jac->nint > 0 ) fprintf(f, "     double d[%d]; \n", (jac->nint+1)*w);
+    fprintf(f, "     for (i = 0; i < %d; i++) j[i] = 0.0; \n", w*w);
+    if ( jac->nint > 0 )
+        fprintf(f, "     for (i = 0; i < %d; i++) d[i] = 0.0; \n", (jac->nint+1)*w);
+    for (k=0; k<jac->npartials; k++)
+    {
+        p = &jac->partial[k];
+        row = (p->row > 0) ? p->row*w : -p->row*w;
+        a = (p->row > 0) ? "j" : "d";
+        fprintf(f, "     x = %s; \n", mathexpr_getStr(p->expr, e,
+            MSXchem_getVariableStr));
+        if ( p->col > 0 ) fprintf(f, "     %s[%d] += x; \n", a, row + p->col);
+        else
+        {
+            col = -p->col*w;
+            fprintf(f, "     for (i = 1; i < %d; i++) %s[%d+i] += x * d[%d+i]; \n",
+                    w, a, row, col);
+        }
+    }
+    fprintf(f, " }\n");
+}
+
+//=============================================================================
+
+void  writeTermsUsedBy(FILE* f, MathExpr* expr, char* done)
+/*
+**  Purpose:
+**    writes the statements that evaluate each intermediate term used by
+**    an expression, after those of the terms that it uses in turn.
+**
+**  Input:
+**    f = pointer to the source code file
+**    expr = a tokenized math expression
+**    done = flags marking the terms already written
+**
+**  Returns:
+**    none.
+*/
+{
+    int i;
+    char e[1024];
+    MathExpr *node;
+
+    for (node = expr; node != NULL; node = node->next)
+    {
+    // --- skip tokens that are not variables or are not terms
+
+        if ( node->opcode != 8 ) continue;
+        i = node->ivar;
+        if ( i <= MSX.LastIndex[SPECIES] || i > MSX.LastIndex[TERM] ) continue;
+        i -= MSX.LastIndex[TERM-1];
+        if ( done[i] ) continue;
+
+    // --- write the terms this one uses and then the term itself
+    //     (circular references were ruled out when the input was read)
+
+        done[i] = 1;
+        writeTermsUsedBy(f, MSX.Term[i].expr, done);
+        fprintf(f, "         t[%d][j] = %s; \n", i, mathexpr_getStr(MSX.Term[i].expr, e,
+            MSXchem_getBatchVariableStr));
+    }
+}
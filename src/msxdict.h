@@ -20,10 +20,16 @@ static char *MsxSectWords[] = {"[TITLE", "[SPECIE",  "[COEFF",  "[TERM",
                                "[PIPE",  "[TANK",    "[SOURCE", "[QUALITY",
                                "[PARAM", "[PATTERN", "[OPTION", 
                                "[REPORT", NULL};
-static char *ReportWords[]  = {"NODE", "LINK", "SPECIE", "FILE", "PAGESIZE", NULL};
+static char *ReportWords[]  = {"NODE", "LINK", "SPECIE", "FILE", "PAGESIZE",
+                               "SUBSET", NULL};
 static char *OptionTypeWords[] = {"AREA_UNITS", "RATE_UNITS", "SOLVER", "COUPLING",
-                                  "TIMESTEP", "RTOL", "ATOL", "COMPILER", NULL};  //1.1.00
+                                  "TIMESTEP", "RTOL", "ATOL", "COMPILER",        //1.1.00
+                                  "CACHE", "OUTPUT", "MAXSEGMENTS", "LAZY",
+                                  "JACOBIAN", "REUSE", "PROFILE", "MASSCHECK",
+                                  "REACTSTEP", NULL};
 static char *CompilerWords[]   = {"NONE", "VC", "GC", NULL};                      //1.1.00
+static char *OutFormatWords[]  = {"STANDARD", "COLUMNAR", NULL};
+static char *JacobianWords[]   = {"NUMERICAL", "ANALYTIC", NULL};
 static char *SourceTypeWords[] = {"CONC", "MASS", "SETPOINT", "FLOW", NULL};      //(FS-01/10/2008 To fix bug 11)
 static char *MixingTypeWords[] = {"MIXED", "2COMP", "FIFO", "LIFO", NULL};
 static char *MassUnitsWords[]  = {"MG", "UG", "MOLE", "MMOL", NULL};
@@ -18,14 +18,8 @@
 #include "msxtypes.h"
 #include "epanet2.h"
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Local variables
 //-----------------
-static int   mathError;                // math error flag
-static char  mathErrorMsg[1024];       // math error message
 static char* elementTxt[] =            // see ObjectType in msxtypes.h
     {"", "pipe", "tank"};
 static char* exprTypeTxt[] =           // see ExpressionType in msxtypes.h
@@ -37,7 +31,12 @@ void   MSXerr_clearMathError(void);
 int    MSXerr_mathError(void);
 double MSXerr_validate(double x, int index, int element, int exprType);
 void   MSXerr_writeMathErrorMsg(void);
+void   MSXerr_writeReactionErrorMsg(int errcode, int element, int index);
+void   MSXerr_writeCompilerWarning(int errcode);
 
+//  Imported functions
+//--------------------
+int    MSXchem_element(void);
 
 //=============================================================================
 
@@ -47,8 +46,9 @@ void MSXerr_clearMathError()
 **    clears the math error flag.
 */
 {
-	mathError = 0;
-	strcpy(mathErrorMsg, "");
+	MSX.MathError = 0;
+	MSX.MathErrorElement = 0;
+	strcpy(MSX.MathErrorMsg, "");
 }
 
 //=============================================================================
@@ -59,7 +59,7 @@ int  MSXerr_mathError()
 **    returns the current state of the math error flag.
 */
 {
-    return mathError;
+    return MSX.MathError;
 }
 
 //=============================================================================
@@ -70,7 +70,52 @@ void MSXerr_writeMathErrorMsg()
 **    writes math error message to EPANET report file.
 */
 {
-	ENwriteline(mathErrorMsg);
+	ENwriteline(MSX.MathErrorMsg);
+	ENwriteline("");
+}
+
+//=============================================================================
+
+void MSXerr_writeReactionErrorMsg(int errcode, int element, int index)
+/*
+**  Purpose:
+**    writes the pipe or tank in which a reaction error occurred to the
+**    EPANET report file.
+**
+**  Input:
+**    errcode = error code returned by the reaction solver
+**    element = LINK for a pipe element or TANK for a tank element
+**    index = index of the pipe or tank
+*/
+{
+	char id[MAXID+1];
+	char msg[MAXMSG+1];
+
+	if ( element == TANK ) ENgetnodeid(MSX.Tank[index].node, id);
+	else ENgetlinkid(index, id);
+	snprintf(msg, MAXMSG+1, "Error %d occurred while computing reactions in %s %s.",
+		errcode, elementTxt[element], id);
+	ENwriteline(msg);
+	ENwriteline("");
+}
+
+//=============================================================================
+
+void MSXerr_writeCompilerWarning(int errcode)
+/*
+**  Purpose:
+**    writes a warning to the EPANET report file that the chemistry
+**    functions could not be compiled into a shared library.
+**
+**  Input:
+**    errcode = error code returned by the chemistry compiler
+*/
+{
+	char msg[MAXMSG+1];
+
+	sprintf(msg, "WARNING: Error %d occurred while compiling the chemistry "
+		"functions; they will be evaluated internally instead.", errcode);
+	ENwriteline(msg);
 	ENwriteline("");
 }
 
@@ -91,29 +136,42 @@ double  MSXerr_validate(double x, int index, int element, int exprType)
 **    the value of x if it's a valid number or 0 otherwise.
 */
 {
+	int rank;
+
 	// return x if it's a valid number
 	if (x == x) return x;
 
 	// return 0 if the math error flag has previously been set
 	// (we only want the first math error identified since others
-	//  may have propagated from it)
-	if (mathError) return 0.0;
-
-	// construct a math error message
-	if ( exprType == TERM )
-	{
-		sprintf(mathErrorMsg,
-		"Ilegal math operation occurred for term:\n  %s",
-		MSX.Term[index].id);
-	}
-	else
+	//  may have propagated from it; threads reacting different pipes
+	//  take turns writing the message, which is kept for the pipe or
+	//  tank of lowest rank so that it names the same element as a
+	//  serial run would, as MSXchem_react does for reaction errors)
+	rank = MSXchem_element();
+#ifdef _OPENMP
+#pragma omp critical (MSXerr_mathError)
+#endif
 	{
-		sprintf(mathErrorMsg,
-		"Ilegal math operation occurred in %s %s expression for specie:\n  %s",
-		elementTxt[element], exprTypeTxt[exprType], MSX.Species[index].id);
+		if ( !MSX.MathError || rank < MSX.MathErrorElement )
+		{
+			// construct a math error message
+			if ( exprType == TERM )
+			{
+				sprintf(MSX.MathErrorMsg,
+				"Ilegal math operation occurred for term:\n  %s",
+				MSX.Term[index].id);
+			}
+			else
+			{
+				sprintf(MSX.MathErrorMsg,
+				"Ilegal math operation occurred in %s %s expression for specie:\n  %s",
+				elementTxt[element], exprTypeTxt[exprType], MSX.Species[index].id);
+			}
+
+			// set the math error flag
+			MSX.MathError = 1;
+			MSX.MathErrorElement = rank;
+		}
 	}
-
-	// set the math error flag and return 0
-	mathError = 1;
 	return 0.0;
 }
@@ -27,10 +27,6 @@
 #include "msxdict.h"
 #include "epanet2.h"
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Exported functions
 //--------------------
 int MSXfile_save(FILE *f);
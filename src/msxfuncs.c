@@ -27,13 +27,12 @@
 
 #ifdef WINDOWS
 #include <windows.h>
-HMODULE hDLL;
 #else
   #include <dlfcn.h>
-  void *hDLL; 
+  #include <unistd.h>
 #endif
 
-#include "msxfuncs.h"
+#include "msxtypes.h"
 
 //=============================================================================
 
@@ -51,34 +50,49 @@ int MSXfuncs_load(char * libName)
 {
 
 #ifdef WINDOWS
-	hDLL = LoadLibraryA(libName);
+    HMODULE hDLL = LoadLibraryA(libName);
 	if (hDLL == NULL) return 1;
-
-	MSXgetPipeRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetPipeRates");
-    MSXgetTankRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetTankRates");
-    MSXgetPipeEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetPipeEquil");
-    MSXgetTankEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetTankEquil");
-    MSXgetPipeFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetPipeFormulas");
-    MSXgetTankFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetTankFormulas");
+    MSX.CompiledChem.hDLL = hDLL;
+
+	MSX.MSXgetPipeRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetPipeRates");
+    MSX.MSXgetTankRates    = (MSXGETRATES)    GetProcAddress(hDLL, "MSXgetTankRates");
+    MSX.MSXgetPipeEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetPipeEquil");
+    MSX.MSXgetTankEquil    = (MSXGETEQUIL)    GetProcAddress(hDLL, "MSXgetTankEquil");
+    MSX.MSXgetPipeFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetPipeFormulas");
+    MSX.MSXgetTankFormulas = (MSXGETFORMULAS) GetProcAddress(hDLL, "MSXgetTankFormulas");
+    MSX.MSXgetPipeRatesBatch = (MSXGETBATCHRATES) GetProcAddress(hDLL, "MSXgetPipeRatesBatch");
+    MSX.MSXgetPipeRatesJac = (MSXGETJACOBIAN) GetProcAddress(hDLL, "MSXgetPipeRatesJac");
+    MSX.MSXgetTankRatesJac = (MSXGETJACOBIAN) GetProcAddress(hDLL, "MSXgetTankRatesJac");
+    MSX.MSXgetPipeEquilJac = (MSXGETJACOBIAN) GetProcAddress(hDLL, "MSXgetPipeEquilJac");
+    MSX.MSXgetTankEquilJac = (MSXGETJACOBIAN) GetProcAddress(hDLL, "MSXgetTankEquilJac");
 
 #else
-    hDLL = dlopen(libName, RTLD_LAZY);
+    void *hDLL = dlopen(libName, RTLD_LAZY);
     if (hDLL == NULL) return 1;
+    MSX.CompiledChem.hDLL = hDLL;
 	
-    MSXgetPipeRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetPipeRates");
-    MSXgetTankRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetTankRates");
-    MSXgetPipeEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetPipeEquil");
-    MSXgetTankEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetTankEquil");
-    MSXgetPipeFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetPipeFormulas");
-    MSXgetTankFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetTankFormulas");
+    MSX.MSXgetPipeRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetPipeRates");
+    MSX.MSXgetTankRates    = (MSXGETRATES)    dlsym(hDLL, "MSXgetTankRates");
+    MSX.MSXgetPipeEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetPipeEquil");
+    MSX.MSXgetTankEquil    = (MSXGETEQUIL)    dlsym(hDLL, "MSXgetTankEquil");
+    MSX.MSXgetPipeFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetPipeFormulas");
+    MSX.MSXgetTankFormulas = (MSXGETFORMULAS) dlsym(hDLL, "MSXgetTankFormulas");
+    MSX.MSXgetPipeRatesBatch = (MSXGETBATCHRATES) dlsym(hDLL, "MSXgetPipeRatesBatch");
+    MSX.MSXgetPipeRatesJac = (MSXGETJACOBIAN) dlsym(hDLL, "MSXgetPipeRatesJac");
+    MSX.MSXgetTankRatesJac = (MSXGETJACOBIAN) dlsym(hDLL, "MSXgetTankRatesJac");
+    MSX.MSXgetPipeEquilJac = (MSXGETJACOBIAN) dlsym(hDLL, "MSXgetPipeEquilJac");
+    MSX.MSXgetTankEquilJac = (MSXGETJACOBIAN) dlsym(hDLL, "MSXgetTankEquilJac");
 #endif
 
-    if (NULL == MSXgetPipeRates || NULL == MSXgetTankRates ||
-        NULL == MSXgetPipeEquil || NULL == MSXgetTankEquil ||
-        NULL == MSXgetPipeFormulas || NULL == MSXgetTankFormulas)
+// --- all but the Jacobian functions (without which Jacobians are found
+//     numerically) must be in the library
+
+    if (NULL == MSX.MSXgetPipeRates || NULL == MSX.MSXgetTankRates ||
+        NULL == MSX.MSXgetPipeEquil || NULL == MSX.MSXgetTankEquil ||
+        NULL == MSX.MSXgetPipeFormulas || NULL == MSX.MSXgetTankFormulas ||
+        NULL == MSX.MSXgetPipeRatesBatch)
     {
         MSXfuncs_free();
-        hDLL = NULL;
         return 2;
     }
     return 0;
@@ -99,10 +113,11 @@ void MSXfuncs_free()
 */
 {
 #ifdef WINDOWS
-    if (hDLL) FreeLibrary(hDLL);
+    if (MSX.CompiledChem.hDLL) FreeLibrary((HMODULE)MSX.CompiledChem.hDLL);
 #else
-    if (hDLL) dlclose(hDLL);
+    if (MSX.CompiledChem.hDLL) dlclose(MSX.CompiledChem.hDLL);
 #endif
+    MSX.CompiledChem.hDLL = NULL;
 }
 
 //=============================================================================
@@ -165,3 +180,23 @@ int MSXfuncs_run(char* cmdLine)
 #endif
 }
 
+//=============================================================================
+
+void MSXfuncs_wait(int msec)
+/*
+**  Purpose:
+**    suspends execution of the calling process
+**
+**  Input:
+**    msec = number of milliseconds to wait
+**
+**  Returns:
+**    none
+*/
+{
+#ifdef WINDOWS
+    Sleep(msec);
+#else
+    usleep(1000 * msec);
+#endif
+}
@@ -17,19 +17,29 @@ typedef void (*MSXGETRATES)(double *, double *, double * , double *, double *);
 typedef void (*MSXGETEQUIL)(double *, double *, double * , double *, double *);
 typedef void (*MSXGETFORMULAS)(double *, double *, double *, double *);
 
-// Declare each chemistry function
-MSXGETRATES    MSXgetPipeRates;
-MSXGETRATES    MSXgetTankRates;
-MSXGETEQUIL    MSXgetPipeEquil;
-MSXGETEQUIL    MSXgetTankEquil;
-MSXGETFORMULAS MSXgetPipeFormulas;
-MSXGETFORMULAS MSXgetTankFormulas;
+// Pointer to a function that evaluates pipe rates for a block of n segments;
+// the concentrations and rates of species m in segment j are stored in
+// element [m*MAXBATCH + j] of its first and last arguments, and the
+// parameter and hydraulic variable i of segment j in element
+// [i*MAXBATCH + j] of the two arguments that come before the last one
+typedef void (*MSXGETBATCHRATES)(int, double *, double *, double *, double *,
+                                 double *);
+
+// Pointer to a function that evaluates the Jacobian of a chemistry system;
+// the partial derivative of function r with respect to unknown m is stored
+// in element [r*(n+1) + m] of its last argument, n being the number of
+// unknowns
+typedef void (*MSXGETJACOBIAN)(double *, double *, double *, double *, double *);
 
 // Functions that load and free the chemistry functions
+// (the loaded functions are stored with the current MSX project)
 int  MSXfuncs_load(char *);
 void MSXfuncs_free(void);
 
 // Function that executes a command line program
 int MSXfuncs_run(char * );
 
+// Function that suspends the calling process for a number of milliseconds
+void MSXfuncs_wait(int );
+
 #endif
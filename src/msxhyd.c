@@ -0,0 +1,626 @@
+/******************************************************************************
+**  MODULE:        MSXHYD.C
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Random access reader for the EPANET hydraulics file used
+**                 by the EPANET Multi-Species Extension toolkit.
+**  COPYRIGHT:     Copyright (C) 2007 Feng Shang, Lewis Rossman, and James Uber.
+**                 All Rights Reserved. See license information in LICENSE.TXT.
+**  AUTHORS:       L. Rossman, US EPA - NRMRL
+**                 F. Shang, University of Cincinnati
+**                 J. Uber, University of Cincinnati
+**  VERSION:       1.1.00
+**  LAST UPDATE:   10/14/26
+**
+**  Every hydraulic period occupies a record of the same size in the file:
+**  the period's starting time, nodal demands and heads, link flows, link
+**  status and settings, and the time step to the next period. Opening the
+**  file records the starting time of each period so that any period can
+**  be read directly. The file is mapped into memory when the platform
+**  allows it, and the next period's record is then prefetched while the
+**  current one is in use; otherwise each record is read with one fread.
+**
+**  The hydraulics file can also be loaded once into a shared timeline
+**  (ShydTimeline) that holds every period's demands, heads, flows and
+**  flow directions in memory. The timeline is never changed after it is
+**  loaded, so any number of projects can read from it at the same time
+**  in place of a hydraulics file. It counts the projects using it and is
+**  only freed once its handle has been released and none of them remain.
+******************************************************************************/
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+// --- define WINDOWS
+
+#undef WINDOWS
+#ifdef _WIN32
+  #define WINDOWS
+#endif
+#ifdef __WIN32__
+  #define WINDOWS
+#endif
+#ifdef WIN32
+  #define WINDOWS
+#endif
+
+#ifdef WINDOWS
+  #include <windows.h>
+  #include <io.h>
+#else
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#include "msxtypes.h"
+
+//  Imported variables
+//--------------------
+extern const double Q_STAGNANT;        // stagnant flow tolerance (msxqual.c)
+
+//  Exported functions
+//--------------------
+int   MSXhyd_open(char *fname);
+int   MSXhyd_seek(long t);
+int   MSXhyd_read(long *hydtime, long *hydstep);
+char* MSXhyd_getFlowDir(void);
+void  MSXhyd_close(void);
+int   MSXhyd_load(ShydTimeline **timeline);
+int   MSXhyd_attach(ShydTimeline *timeline);
+void  MSXhyd_free(ShydTimeline *timeline);
+
+//  Local functions
+//-----------------
+static int   readPeriod(int p, REAL4 *d, REAL4 *h, REAL4 *q, long *hydtime,
+                        long *hydstep);
+static int   buildIndex(void);
+static void  mapFile(void);
+static void  unmapFile(void);
+static void  prefetch(int p);
+static void  detachTimeline(void);
+static void  freeTimeline(ShydTimeline *timeline);
+
+//=============================================================================
+
+int  MSXhyd_open(char *fname)
+/*
+**  Purpose:
+**    opens a hydraulics file and indexes its hydraulic periods.
+**
+**  Input:
+**    fname = name of the hydraulics file
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    INT4 magic;
+    INT4 version;
+    INT4 n;
+
+// --- open hydraulics file (in place of any shared hydraulics)
+
+    detachTimeline();
+    MSX.HydFile.file = fopen(fname, "rb");
+    if (!MSX.HydFile.file) return ERR_OPEN_HYD_FILE;
+
+// --- check that file is really a hydraulics file for current project
+
+    fread(&magic, sizeof(INT4), 1, MSX.HydFile.file);
+    if ( magic != MAGICNUMBER ) return ERR_READ_HYD_FILE;
+    fread(&version, sizeof(INT4), 1, MSX.HydFile.file);
+    fread(&n, sizeof(INT4), 1, MSX.HydFile.file);
+    if ( n != MSX.Nobjects[NODE] ) return ERR_READ_HYD_FILE;
+    fread(&n, sizeof(INT4), 1, MSX.HydFile.file);
+    if ( n != MSX.Nobjects[LINK] ) return ERR_READ_HYD_FILE;
+    fseek(MSX.HydFile.file, 3*sizeof(INT4), SEEK_CUR);
+
+// --- read length of simulation period covered by file
+
+    fread(&MSX.Dur, sizeof(INT4), 1, MSX.HydFile.file);
+    MSX.HydOffset = ftell(MSX.HydFile.file);
+
+// --- index the hydraulic periods that follow
+
+    return buildIndex();
+}
+
+//=============================================================================
+
+int  MSXhyd_seek(long t)
+/*
+**  Purpose:
+**    positions the reader at the hydraulic period in effect at a given time.
+**
+**  Input:
+**    t = time into the simulation (sec)
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note: the period is found by a binary search of the period index,
+**        so no records are read to get to it.
+*/
+{
+    int  lo, hi, mid;
+    long *time = MSX.HydIndex.Time;
+
+    hi = MSX.HydIndex.Nperiods - 1;
+    if ( MSX.HydTimeline )
+    {
+        time = MSX.HydTimeline->Time;
+        hi = MSX.HydTimeline->Nperiods - 1;
+    }
+    if ( hi < 0 ) return ERR_READ_HYD_FILE;
+    lo = 0;
+    while ( lo < hi )
+    {
+        mid = (lo + hi + 1) / 2;
+        if ( time[mid] <= t ) lo = mid;
+        else hi = mid - 1;
+    }
+    MSX.HydIndex.Period = lo;
+    prefetch(lo);
+    return 0;
+}
+
+//=============================================================================
+
+int  MSXhyd_read(long *hydtime, long *hydstep)
+/*
+**  Purpose:
+**    reads the nodal demands & heads and link flows of the next hydraulic
+**    period into MSX.D, MSX.H, and MSX.Q.
+**
+**  Input:
+**    none.
+**
+**  Output:
+**    hydtime = starting time of the period (sec)
+**    hydstep = time step until the next period (sec)
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    ShydTimeline *ht = MSX.HydTimeline;
+    int  p = MSX.HydIndex.Period;
+    int  nn = MSX.Nobjects[NODE];
+    int  nl = MSX.Nobjects[LINK];
+
+// --- copy the period from the shared hydraulics if they're used
+
+    if ( ht )
+    {
+        if ( p < 0 || p >= ht->Nperiods ) return ERR_READ_HYD_FILE;
+        memcpy(MSX.D+1, ht->D + p*(nn+1) + 1, nn*sizeof(REAL4));
+        memcpy(MSX.H+1, ht->H + p*(nn+1) + 1, nn*sizeof(REAL4));
+        memcpy(MSX.Q+1, ht->Q + p*(nl+1) + 1, nl*sizeof(REAL4));
+        *hydtime = ht->Time[p];
+        *hydstep = ht->Step[p];
+        MSX.HydIndex.Period = p + 1;
+        return 0;
+    }
+
+// --- otherwise read it from the hydraulics file
+
+    if ( p < 0 || p >= MSX.HydIndex.Nperiods ) return ERR_READ_HYD_FILE;
+    MSX.HydIndex.Period = p + 1;
+    return readPeriod(p, MSX.D, MSX.H, MSX.Q, hydtime, hydstep);
+}
+
+//=============================================================================
+
+char*  MSXhyd_getFlowDir()
+/*
+**  Purpose:
+**    retrieves the flow direction of each link in the period most
+**    recently read from the shared hydraulics.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    pointer to an array of FlowDirection values indexed by link,
+**    or NULL if the hydraulics are read from a file.
+*/
+{
+    ShydTimeline *ht = MSX.HydTimeline;
+    int p = MSX.HydIndex.Period - 1;
+
+    if ( ht == NULL || p < 0 || p >= ht->Nperiods ) return NULL;
+    return ht->FlowDir + p*(ht->Nlinks+1);
+}
+
+//=============================================================================
+
+int  readPeriod(int p, REAL4 *d, REAL4 *h, REAL4 *q, long *hydtime,
+                long *hydstep)
+/*
+**  Purpose:
+**    reads the record of a hydraulic period from the hydraulics file.
+**
+**  Input:
+**    p = index of the hydraulic period
+**
+**  Output:
+**    d = nodal demands (indexed from 1)
+**    h = nodal heads (indexed from 1)
+**    q = link flows (indexed from 1)
+**    hydtime = starting time of the period (sec)
+**    hydstep = time step until the next period (sec)
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int   nn = MSX.Nobjects[NODE];
+    int   nl = MSX.Nobjects[LINK];
+    char  *rec;
+    INT4  n;
+
+// --- locate the period's record in the mapped file or read it into
+//     the record buffer
+
+    if ( MSX.HydIndex.Map )
+    {
+        rec = MSX.HydIndex.Map + MSX.HydOffset + p * MSX.HydIndex.RecordSize;
+    }
+    else
+    {
+        rec = MSX.HydIndex.Buf;
+        fseek(MSX.HydFile.file, MSX.HydOffset + p * MSX.HydIndex.RecordSize,
+              SEEK_SET);
+        if ( fread(rec, 1, MSX.HydIndex.RecordSize, MSX.HydFile.file) <
+             (size_t)MSX.HydIndex.RecordSize ) return ERR_READ_HYD_FILE;
+    }
+
+// --- have the next record brought into memory while this one is used
+
+    prefetch(p + 1);
+
+// --- copy the record's contents (link status and settings are skipped)
+
+    memcpy(&n, rec, sizeof(INT4));
+    *hydtime = (long)n;
+    rec += sizeof(INT4);
+    memcpy(d+1, rec, nn*sizeof(REAL4));
+    rec += nn*sizeof(REAL4);
+    memcpy(h+1, rec, nn*sizeof(REAL4));
+    rec += nn*sizeof(REAL4);
+    memcpy(q+1, rec, nl*sizeof(REAL4));
+    rec += 3*nl*sizeof(REAL4);
+    memcpy(&n, rec, sizeof(INT4));
+    *hydstep = (long)n;
+    return 0;
+}
+
+//=============================================================================
+
+void  MSXhyd_close()
+/*
+**  Purpose:
+**    closes the hydraulics file and frees its period index, or stops
+**    using any shared hydraulics.
+**
+**  Input:
+**    none.
+*/
+{
+    detachTimeline();
+    unmapFile();
+    FREE(MSX.HydIndex.Time);
+    FREE(MSX.HydIndex.Buf);
+    MSX.HydIndex.Nperiods = 0;
+    MSX.HydIndex.Period = 0;
+    if ( MSX.HydFile.file ) fclose(MSX.HydFile.file);
+    MSX.HydFile.file = NULL;
+}
+
+//=============================================================================
+
+int  MSXhyd_load(ShydTimeline **timeline)
+/*
+**  Purpose:
+**    loads every period of the current hydraulics file into a new
+**    shared hydraulic timeline.
+**
+**  Input:
+**    none.
+**
+**  Output:
+**    *timeline = pointer to the new timeline (or NULL on error)
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    ShydTimeline *ht;
+    int  p, k, nn, nl, errcode = 0;
+    double q;
+
+    *timeline = NULL;
+    if ( MSX.HydTimeline || MSX.HydFile.file == NULL )
+        return ERR_READ_HYD_FILE;
+
+// --- allocate the timeline's arrays; each period's values are
+//     indexed from 1 like the project's D, H and Q arrays
+
+    nn = MSX.Nobjects[NODE];
+    nl = MSX.Nobjects[LINK];
+    ht = (ShydTimeline *) calloc(1, sizeof(ShydTimeline));
+    if ( ht == NULL ) return ERR_MEMORY;
+    ht->Nnodes = nn;
+    ht->Nlinks = nl;
+    ht->Nperiods = MSX.HydIndex.Nperiods;
+    ht->Dur = MSX.Dur;
+    ht->Time = (long *) calloc(ht->Nperiods, sizeof(long));
+    ht->Step = (long *) calloc(ht->Nperiods, sizeof(long));
+    ht->D = (REAL4 *) calloc(ht->Nperiods*(nn+1), sizeof(REAL4));
+    ht->H = (REAL4 *) calloc(ht->Nperiods*(nn+1), sizeof(REAL4));
+    ht->Q = (REAL4 *) calloc(ht->Nperiods*(nl+1), sizeof(REAL4));
+    ht->FlowDir = (char *) calloc(ht->Nperiods*(nl+1), sizeof(char));
+    CALL(errcode, MEMCHECK(ht->Time));
+    CALL(errcode, MEMCHECK(ht->Step));
+    CALL(errcode, MEMCHECK(ht->D));
+    CALL(errcode, MEMCHECK(ht->H));
+    CALL(errcode, MEMCHECK(ht->Q));
+    CALL(errcode, MEMCHECK(ht->FlowDir));
+
+// --- read each period and find its flow directions
+
+    for (p = 0; p < ht->Nperiods && !errcode; p++)
+    {
+        errcode = readPeriod(p, ht->D + p*(nn+1), ht->H + p*(nn+1),
+                             ht->Q + p*(nl+1), &ht->Time[p], &ht->Step[p]);
+        for (k = 1; k <= nl; k++)
+        {
+            q = ht->Q[p*(nl+1) + k];
+            if ( fabs(q) < Q_STAGNANT ) ht->FlowDir[p*(nl+1) + k] = ZERO_FLOW;
+            else if ( q > 0.0 ) ht->FlowDir[p*(nl+1) + k] = POSITIVE;
+            else ht->FlowDir[p*(nl+1) + k] = NEGATIVE;
+        }
+    }
+    if ( errcode ) freeTimeline(ht);
+    else *timeline = ht;
+    return errcode;
+}
+
+//=============================================================================
+
+int  MSXhyd_attach(ShydTimeline *timeline)
+/*
+**  Purpose:
+**    has the current project read its hydraulics from a shared timeline.
+**
+**  Input:
+**    timeline = pointer to a shared hydraulic timeline
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    if ( timeline == NULL ) return ERR_READ_HYD_FILE;
+    if ( timeline->Nnodes != MSX.Nobjects[NODE] ||
+         timeline->Nlinks != MSX.Nobjects[LINK] ) return ERR_READ_HYD_FILE;
+    MSXhyd_close();
+#ifdef _OPENMP
+#pragma omp critical (MSXhyd_timeline)
+#endif
+    timeline->Users++;
+    MSX.HydTimeline = timeline;
+    MSX.Dur = timeline->Dur;
+    return 0;
+}
+
+//=============================================================================
+
+void  MSXhyd_free(ShydTimeline *timeline)
+/*
+**  Purpose:
+**    releases the handle of a shared hydraulic timeline.
+**
+**  Input:
+**    timeline = pointer to a shared hydraulic timeline
+**
+**  Note: the timeline's memory is freed now if no project is using it,
+**        or else when the last project using it stops doing so.
+*/
+{
+    int unused;
+
+    if ( timeline == NULL ) return;
+#ifdef _OPENMP
+#pragma omp critical (MSXhyd_timeline)
+#endif
+    {
+        timeline->Released = TRUE;
+        unused = (timeline->Users == 0);
+    }
+    if ( unused ) freeTimeline(timeline);
+}
+
+//=============================================================================
+
+void  detachTimeline()
+/*
+**  Purpose:
+**    stops the current project from using any shared hydraulic timeline.
+**
+**  Input:
+**    none.
+**
+**  Note: a timeline whose handle was already released is freed when
+**        its last project detaches from it.
+*/
+{
+    ShydTimeline *ht = MSX.HydTimeline;
+    int unused;
+
+    if ( ht == NULL ) return;
+    MSX.HydTimeline = NULL;
+#ifdef _OPENMP
+#pragma omp critical (MSXhyd_timeline)
+#endif
+    {
+        ht->Users--;
+        unused = (ht->Released && ht->Users == 0);
+    }
+    if ( unused ) freeTimeline(ht);
+}
+
+//=============================================================================
+
+void  freeTimeline(ShydTimeline *timeline)
+/*
+**  Purpose:
+**    frees the memory used by a shared hydraulic timeline.
+**
+**  Input:
+**    timeline = pointer to a shared hydraulic timeline
+*/
+{
+    FREE(timeline->Time);
+    FREE(timeline->Step);
+    FREE(timeline->D);
+    FREE(timeline->H);
+    FREE(timeline->Q);
+    FREE(timeline->FlowDir);
+    free(timeline);
+}
+
+//=============================================================================
+
+int  buildIndex()
+/*
+**  Purpose:
+**    finds the starting time of each hydraulic period in the file.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int  p;
+    long offset;
+    INT4 n;
+
+// --- find the size of each period's record and how many records follow
+//     the file's header
+
+    MSX.HydIndex.RecordSize = (2 + 2*MSX.Nobjects[NODE] +
+                               3*MSX.Nobjects[LINK]) * sizeof(INT4);
+    fseek(MSX.HydFile.file, 0, SEEK_END);
+    MSX.HydIndex.Size = ftell(MSX.HydFile.file);
+    MSX.HydIndex.Nperiods = (int)((MSX.HydIndex.Size - MSX.HydOffset) /
+                                  MSX.HydIndex.RecordSize);
+    MSX.HydIndex.Period = 0;
+    if ( MSX.HydIndex.Nperiods <= 0 ) return ERR_READ_HYD_FILE;
+
+// --- allocate the index and a record buffer
+
+    MSX.HydIndex.Time = (long *) calloc(MSX.HydIndex.Nperiods, sizeof(long));
+    MSX.HydIndex.Buf = (char *) malloc(MSX.HydIndex.RecordSize);
+    if ( MSX.HydIndex.Time == NULL || MSX.HydIndex.Buf == NULL )
+        return ERR_MEMORY;
+
+// --- map the file into memory and read each period's starting time
+
+    mapFile();
+    for (p = 0; p < MSX.HydIndex.Nperiods; p++)
+    {
+        offset = MSX.HydOffset + p * MSX.HydIndex.RecordSize;
+        if ( MSX.HydIndex.Map ) memcpy(&n, MSX.HydIndex.Map + offset,
+                                       sizeof(INT4));
+        else
+        {
+            fseek(MSX.HydFile.file, offset, SEEK_SET);
+            if ( fread(&n, sizeof(INT4), 1, MSX.HydFile.file) < 1 )
+                return ERR_READ_HYD_FILE;
+        }
+        MSX.HydIndex.Time[p] = (long)n;
+    }
+    return 0;
+}
+
+//=============================================================================
+
+void  mapFile()
+/*
+**  Purpose:
+**    maps the contents of the hydraulics file into memory.
+**
+**  Input:
+**    none.
+**
+**  Note: MSX.HydIndex.Map remains NULL if the file can't be mapped
+**        (e.g., if it is too large for the address space), in which
+**        case records are read from the file instead.
+*/
+{
+#ifdef WINDOWS
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(MSX.HydFile.file));
+    HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if ( hMap == NULL ) return;
+    MSX.HydIndex.Map = (char *) MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if ( MSX.HydIndex.Map == NULL ) CloseHandle(hMap);
+    else MSX.HydIndex.hMap = hMap;
+#else
+    void *map = mmap(NULL, MSX.HydIndex.Size, PROT_READ, MAP_SHARED,
+                     fileno(MSX.HydFile.file), 0);
+    if ( map != MAP_FAILED ) MSX.HydIndex.Map = (char *) map;
+#endif
+}
+
+//=============================================================================
+
+void  unmapFile()
+/*
+**  Purpose:
+**    removes the memory mapping of the hydraulics file.
+**
+**  Input:
+**    none.
+*/
+{
+    if ( MSX.HydIndex.Map == NULL ) return;
+#ifdef WINDOWS
+    UnmapViewOfFile(MSX.HydIndex.Map);
+    CloseHandle((HANDLE)MSX.HydIndex.hMap);
+#else
+    munmap(MSX.HydIndex.Map, MSX.HydIndex.Size);
+#endif
+    MSX.HydIndex.Map = NULL;
+    MSX.HydIndex.hMap = NULL;
+}
+
+//=============================================================================
+
+void  prefetch(int p)
+/*
+**  Purpose:
+**    asks the operating system to start reading a period's record into
+**    memory before it is needed.
+**
+**  Input:
+**    p = index of a hydraulic period
+**
+**  Note: this only applies to a mapped file on systems that support
+**        madvise(); the read-ahead takes place in the background.
+*/
+{
+#if !defined(WINDOWS) && defined(MADV_WILLNEED)
+    long page, offset;
+
+    if ( MSX.HydIndex.Map == NULL || p >= MSX.HydIndex.Nperiods ) return;
+    page = sysconf(_SC_PAGESIZE);
+    if ( page <= 0 ) return;
+    offset = MSX.HydOffset + p * MSX.HydIndex.RecordSize;
+    madvise(MSX.HydIndex.Map + offset / page * page,
+            MSX.HydIndex.RecordSize + offset % page, MADV_WILLNEED);
+#endif
+}
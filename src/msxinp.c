@@ -31,16 +31,16 @@
 #define MAXTOKS  40                    // Max. items per line of input
 #define SEPSTR  " \t\n\r"              // Token separator characters
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Local variables
 //-----------------
 static char *Tok[MAXTOKS];             // String tokens from line of input
 static int  Ntokens;                   // Number of tokens in line of input
 static double **TermArray;             // Incidence array used to check Terms  //1.1.00
 
+#ifdef _OPENMP
+#pragma omp threadprivate(Tok, Ntokens, TermArray)
+#endif
+
 enum InpErrorCodes {                   // Error codes (401 - 409)
     INP_ERR_FIRST        = 400,
     ERR_LINE_LENGTH,
@@ -701,6 +701,61 @@ int parseOption()
     	  MSX.Compiler = k;
 	  break;
 
+      case CACHE_OPTION:                   // leave room for cached file names
+          if ( strlen(Tok[1]) > MAXFNAME - 32 ) return ERR_LINE_LENGTH;
+          strcpy(MSX.CacheDir, Tok[1]);
+          break;
+
+      case OUTPUT_OPTION:
+          k = MSXutils_findmatch(Tok[1], OutFormatWords);
+          if ( k < 0 ) return ERR_KEYWORD;
+          MSX.OutFormat = k;
+          break;
+
+      case MAXSEGS_OPTION:
+          k = atoi(Tok[1]);
+          if ( k < 0 ) return ERR_NUMBER;
+          MSX.MaxSegs = k;
+          break;
+
+      case LAZY_OPTION:
+          if ( MSXutils_strcomp(Tok[1], YES) ) MSX.LazyReact = TRUE;
+          else if ( MSXutils_strcomp(Tok[1], NO) ) MSX.LazyReact = FALSE;
+          else return ERR_KEYWORD;
+          break;
+
+      case JACOBIAN_OPTION:
+          k = MSXutils_findmatch(Tok[1], JacobianWords);
+          if ( k < 0 ) return ERR_KEYWORD;
+          MSX.Jacobian = k;
+          break;
+
+      case REUSE_OPTION:                   // results differ slightly from those
+                                           //   without reuse (within RTOL and
+                                           //   ATOL) but not with thread count
+          k = atoi(Tok[1]);
+          if ( k < 0 ) return ERR_NUMBER;
+          MSX.ReuseJac = k;
+          break;
+
+      case PROFILE_OPTION:
+          if ( MSXutils_strcomp(Tok[1], YES) ) MSX.Profiling = TRUE;
+          else if ( MSXutils_strcomp(Tok[1], NO) ) MSX.Profiling = FALSE;
+          else return ERR_KEYWORD;
+          break;
+
+      case MASSCHECK_OPTION:
+          if ( MSXutils_strcomp(Tok[1], YES) ) MSX.MassCheck = TRUE;
+          else if ( MSXutils_strcomp(Tok[1], NO) ) MSX.MassCheck = FALSE;
+          else return ERR_KEYWORD;
+          break;
+
+      case REACTSTEP_OPTION:
+          k = atoi(Tok[1]);
+          if ( k < 0 ) return ERR_NUMBER;
+          MSX.ReactStep = k;
+          break;
+
     }
     return 0;
 }
@@ -945,7 +1000,7 @@ int parseQuality()
 **    an error code (0 if no error)
 */
 {
-    int err, i, j, k, m;
+    int i, j, k, m;
     double x;
 
 // --- determine if quality value is global or object-specific
@@ -987,8 +1042,8 @@ int parseQuality()
 
     else if ( i == 2 )
     {
-        err = ENgetnodeindex(Tok[1], &j);
-        if ( err ) return ERR_NAME;
+        j = MSXproj_findObject(NODE, Tok[1]);
+        if ( j <= 0 ) return ERR_NAME;
         if ( MSX.Species[m].type == BULK ) MSX.Node[j].c0[m] = x;
     }
 
@@ -996,8 +1051,8 @@ int parseQuality()
 
     else if ( i == 3 )
     {
-        err = ENgetlinkindex(Tok[1], &j);
-        if ( err ) return ERR_NAME;
+        j = MSXproj_findObject(LINK, Tok[1]);
+        if ( j <= 0 ) return ERR_NAME;
         MSX.Link[j].c0[m] = x;
     }
     return 0;
@@ -1017,7 +1072,7 @@ int parseParameter()
 **    an error code (0 if no error)
 */
 {
-    int err, i, j;
+    int i, j;
     double x;
 
 // --- get parameter name
@@ -1033,8 +1088,8 @@ int parseParameter()
 
     if ( MSXutils_match(Tok[0], "PIPE") )
     {
-        err = ENgetlinkindex(Tok[1], &j);
-        if ( err ) return ERR_NAME;
+        j = MSXproj_findObject(LINK, Tok[1]);
+        if ( j <= 0 ) return ERR_NAME;
         MSX.Link[j].param[i] = x;
     }
 
@@ -1042,8 +1097,8 @@ int parseParameter()
 
     else if ( MSXutils_match(Tok[0], "TANK") )
     {
-        err = ENgetnodeindex(Tok[1], &j);
-        if ( err ) return ERR_NAME;
+        j = MSXproj_findObject(NODE, Tok[1]);
+        if ( j <= 0 ) return ERR_NAME;
         j = MSX.Node[j].tank;
         if ( j > 0 ) MSX.Tank[j].param[i] = x;
     }
@@ -1065,7 +1120,7 @@ int parseSource()
 **    an error code (0 if no error)
 */
 {
-    int err, i, j, k, m;
+    int i, j, k, m;
     double  x;
     Psource source;
 
@@ -1077,8 +1132,8 @@ int parseSource()
 
 // --- get node index
 
-    err = ENgetnodeindex(Tok[1], &j);
-    if ( err ) return ERR_NAME;
+    j = MSXproj_findObject(NODE, Tok[1]);
+    if ( j <= 0 ) return ERR_NAME;
 
 //  --- get species index
 
@@ -1185,7 +1240,7 @@ int parsePattern()
 
 int parseReport()
 {
-    int  i, j, k, err;
+    int  i, j, k;
 
 // --- get keyword
 
@@ -1208,8 +1263,8 @@ int parseReport()
         }
         else for (i=1; i<Ntokens; i++)
         {
-            err = ENgetnodeindex(Tok[i], &j);
-            if ( err ) return ERR_NAME;
+            j = MSXproj_findObject(NODE, Tok[i]);
+            if ( j <= 0 ) return ERR_NAME;
             MSX.Node[j].rpt = 1;
         }
         break;
@@ -1226,8 +1281,8 @@ int parseReport()
         }
         else for (i=1; i<Ntokens; i++)
         {
-            err = ENgetlinkindex(Tok[i], &j);
-            if ( err ) return ERR_NAME;
+            j = MSXproj_findObject(LINK, Tok[i]);
+            if ( j <= 0 ) return ERR_NAME;
             MSX.Link[j].rpt = 1;
         }
         break;
@@ -1261,6 +1316,14 @@ int parseReport()
         case 4:
         if ( !MSXutils_getInt(Tok[1], &MSX.PageSize) ) return ERR_NUMBER;
         break;
+
+    // --- keyword is SUBSET: YES saves only reported results to output file
+
+        case 5:
+        if ( MSXutils_strcomp(Tok[1], YES) ) MSX.OutSubset = TRUE;
+        else if ( MSXutils_strcomp(Tok[1], NO) ) MSX.OutSubset = FALSE;
+        else return ERR_KEYWORD;
+        break;
     }
     return 0;
 }
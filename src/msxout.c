@@ -9,7 +9,13 @@
 **                 F. Shang, University of Cincinnati
 **                 J. Uber, University of Cincinnati
 **  VERSION:       1.1.00
-**  LAST UPDATE:   7/31/07
+**  LAST UPDATE:   10/14/26
+**
+**  When the SUBSET YES option appears in the [REPORT] section only the
+**  results of the reported species at the reported nodes and links are
+**  saved. The file's header then lists the indices of the nodes, links
+**  and species saved, and each period's results cover just those objects
+**  in that order.
 ******************************************************************************/
 #define _CRT_SECURE_NO_DEPRECATE
 
@@ -18,17 +24,80 @@
 #include <stdlib.h>
 #include <math.h>
 
-#include "msxtypes.h"
+// --- define WINDOWS
+
+#undef WINDOWS
+#ifdef _WIN32
+  #define WINDOWS
+#endif
+#ifdef __WIN32__
+  #define WINDOWS
+#endif
+#ifdef WIN32
+  #define WINDOWS
+#endif
+
+#ifdef WINDOWS
+  #include <windows.h>
+  #include <process.h>
+#else
+  #include <pthread.h>
+#endif
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
+#include "msxtypes.h"
 
-//  Local variables
-//-----------------
-static long  ResultsOffset;            // Offset byte where results begin
-static long  NodeBytesPerPeriod;       // Bytes per time period used by all nodes
-static long  LinkBytesPerPeriod;       // Bytes per time period used by all links
+//  Constants
+//-----------
+#define CHUNK_BYTES       4194304      // Target size of a columnar file chunk
+#define MAX_CHUNK_PERIODS 256          // Most periods in a columnar file chunk
+
+//  Results writer
+//----------------
+//  Each period's results are placed in one of two buffers. A background
+//  thread writes a filled buffer to the output file while the other one
+//  is filled with the next period's results, so the solver only waits
+//  when the disk falls a whole reporting period behind. When a time
+//  statistic is reported nothing is written until the end of the run;
+//  instead each period's results update a running statistic. For a
+//  columnar output file the results of several periods are gathered in
+//  a chunk, by value, before being written.
+typedef struct
+{
+   REAL4  *Buf[2];                     // Results of a period for all objects
+   double *Stats[2];                   // Running statistics of all results
+   REAL4  *Chunk;                      // Results of a chunk of periods
+   int    ChunkPeriods;                // Periods per chunk
+   int    Nchunk;                      // Periods placed in the chunk
+   int    Size;                        // Number of values in a buffer
+   int    Cur;                         // Buffer filled by the solver
+   int    Full;                        // Buffer waiting to be written
+   int    Pending;                     // TRUE if a buffer awaits writing
+   int    Quit;                        // TRUE if the thread should end
+   int    Err;                         // TRUE if a write failed
+   int    Threaded;                    // TRUE if the writer thread runs
+   FILE   *File;                       // File written to
+#ifdef WINDOWS
+   CRITICAL_SECTION   Lock;
+   CONDITION_VARIABLE Cond;
+   HANDLE             Thread;
+#else
+   pthread_mutex_t    Lock;
+   pthread_cond_t     Cond;
+   pthread_t          Thread;
+#endif
+}  SresultWriter;
+
+#ifdef WINDOWS
+  #define LOCK(w)    EnterCriticalSection(&(w)->Lock)
+  #define UNLOCK(w)  LeaveCriticalSection(&(w)->Lock)
+  #define WAIT(w)    SleepConditionVariableCS(&(w)->Cond, &(w)->Lock, INFINITE)
+  #define SIGNAL(w)  WakeAllConditionVariable(&(w)->Cond)
+#else
+  #define LOCK(w)    pthread_mutex_lock(&(w)->Lock)
+  #define UNLOCK(w)  pthread_mutex_unlock(&(w)->Lock)
+  #define WAIT(w)    pthread_cond_wait(&(w)->Cond, &(w)->Lock)
+  #define SIGNAL(w)  pthread_cond_broadcast(&(w)->Cond)
+#endif
 
 //  Imported functions
 //--------------------
@@ -41,14 +110,30 @@ int   MSXout_open(void);
 int   MSXout_saveInitialResults(void);
 int   MSXout_saveResults(void);
 int   MSXout_saveFinalResults(void);
+int   MSXout_flush(void);
+void  MSXout_close(void);
+int   MSXout_checkFile(void);
 float MSXout_getNodeQual(int k, int j, int m);
 float MSXout_getLinkQual(int k, int j, int m);
+int   MSXout_getSeries(int objType, int j, int m, REAL4 *x);
 
 //  Local functions
 //-----------------
 static int   saveStatResults(void);
-static void  getStatResults(int objType, int m, double* stats1,
-             double* stats2, REAL4* x);
+static int   buildOutSet(int type);
+static int   getResultIndex(int objType, int j, int m);
+static SresultWriter* openWriter(void);
+static void  fillBuffer(REAL4* x);
+static void  updateStats(SresultWriter* w);
+static int   writePeriod(SresultWriter* w, REAL4* x);
+static int   writeChunk(SresultWriter* w);
+static void  saveChunkIndex(void);
+static long  getOffset(int k, int i);
+#ifdef WINDOWS
+static unsigned __stdcall runWriter(void* arg);
+#else
+static void* runWriter(void* arg);
+#endif
 
 
 //=============================================================================
@@ -67,6 +152,7 @@ int MSXout_open()
 {
 // --- close output file if already opened
 
+    MSXout_close();
     if (MSX.OutFile.file != NULL) fclose(MSX.OutFile.file); 
 
 // --- try to open the file
@@ -76,19 +162,15 @@ int MSXout_open()
         return ERR_OPEN_OUT_FILE;
     }
 
-// --- open a scratch output file for statistics
+// --- results are written directly to the output file (time statistics
+//     are accumulated in memory, so no scratch file is needed)
 
-    if ( MSX.Statflag == SERIES ) MSX.TmpOutFile.file = MSX.OutFile.file;
-    else if ( (MSX.TmpOutFile.file = fopen(MSX.TmpOutFile.name, "w+b")) == NULL)
-    {
-        return ERR_OPEN_OUT_FILE;
-    }
+    MSX.TmpOutFile.file = MSX.OutFile.file;
 
 // --- write initial results to file
 
     MSX.Nperiods = 0;
-    MSXout_saveInitialResults();
-    return 0;
+    return MSXout_saveInitialResults();
 }
 
 //=============================================================================
@@ -105,12 +187,26 @@ int MSXout_saveInitialResults()
 **    an error code (or 0 if no error).
 */
 {
-    int   m;
+    int   i, m, types[] = {NODE, LINK, SPECIES};
     INT4  n;
     INT4  magic = MAGICNUMBER;
     INT4  version = VERSION;
+    long  bytes;
     FILE* f = MSX.OutFile.file;
 
+// --- list the objects whose results are saved
+
+    for (i = 0; i < 3; i++)
+    {
+        if ( buildOutSet(types[i]) ) return ERR_MEMORY;
+    }
+
+    if ( MSX.OutFormat == COLUMNAR_FORMAT ) version = VERSION_COLUMNAR;
+    if ( MSX.OutSubset )
+    {
+        if ( MSX.OutFormat == COLUMNAR_FORMAT ) version = VERSION_COLUMNAR_SUBSET;
+        else version = VERSION_SUBSET;
+    }
     rewind(f);
     fwrite(&magic, sizeof(INT4), 1, f);                     //Magic number
     fwrite(&version, sizeof(INT4), 1, f);                   //Version number
@@ -132,9 +228,30 @@ int MSXout_saveInitialResults()
     {                                                       //Species mass units
         fwrite(&MSX.Species[m].units, sizeof(char), MAXUNITS, f);
     }
-    ResultsOffset = ftell(f);
-    NodeBytesPerPeriod = MSX.Nobjects[NODE]*MSX.Nobjects[SPECIES]*sizeof(REAL4);
-    LinkBytesPerPeriod = MSX.Nobjects[LINK]*MSX.Nobjects[SPECIES]*sizeof(REAL4);
+    if ( MSX.OutSubset ) for (i = 0; i < 3; i++)
+    {
+        n = (INT4)MSX.OutSet[types[i]].n;
+        fwrite(&n, sizeof(INT4), 1, f);                     //Number saved
+        for (m = 0; m < MSX.OutSet[types[i]].n; m++)
+        {
+            n = (INT4)MSX.OutSet[types[i]].index[m];
+            fwrite(&n, sizeof(INT4), 1, f);                 //Index of each
+        }
+    }
+    MSX.ResultsOffset = ftell(f);
+    MSX.NodeBytesPerPeriod = MSX.OutSet[NODE].n*MSX.OutSet[SPECIES].n*sizeof(REAL4);
+    MSX.LinkBytesPerPeriod = MSX.OutSet[LINK].n*MSX.OutSet[SPECIES].n*sizeof(REAL4);
+
+// --- size the chunks of a columnar file
+
+    MSX.ChunkPeriods = 1;
+    if ( MSX.OutFormat == COLUMNAR_FORMAT )
+    {
+        bytes = MSX.NodeBytesPerPeriod + MSX.LinkBytesPerPeriod;
+        MSX.ChunkPeriods = CHUNK_BYTES / MAX(bytes, 1);
+        MSX.ChunkPeriods = MAX(MSX.ChunkPeriods, 1);
+        MSX.ChunkPeriods = MIN(MSX.ChunkPeriods, MAX_CHUNK_PERIODS);
+    }
     return 0;
 }
     
@@ -145,10 +262,9 @@ int MSXout_saveResults()
 /*
 **  Purpose:
 **    saves computed species concentrations for each node and link at the
-**    current time period to the temporary MSX binary output file (which
-**    will be the same as the permanent MSX binary file if time series
-**    values were specified as the reported statistic, which is the
-**    default case).
+**    current time period to the MSX binary output file (or updates the
+**    running time statistic of each one if time series values were not
+**    specified as the reported statistic).
 **
 **  Input:
 **    none.
@@ -157,25 +273,51 @@ int MSXout_saveResults()
 **    an error code (or 0 if no error).
 */
 {
-    int   m, j;
-    REAL4 x;
+    SresultWriter* w = (SresultWriter *)MSX.Writer;
 
-    for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
+// --- create the results writer for a new output file
+
+    if ( w == NULL )
     {
-        for (j=1; j<=MSX.Nobjects[NODE]; j++)
-        {
-            x = (REAL4)MSXqual_getNodeQual(j, m);
-            fwrite(&x, sizeof(REAL4), 1, MSX.TmpOutFile.file);
-        }
+        w = openWriter();
+        if ( w == NULL ) return ERR_MEMORY;
     }
-    for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
+
+// --- place all results for the period in the current buffer
+
+    fillBuffer(w->Buf[w->Cur]);
+
+// --- update the running statistics if no time series is saved
+
+    if ( MSX.Statflag != SERIES )
     {
-        for (j=1; j<=MSX.Nobjects[LINK]; j++)
-        {
-            x = (REAL4)MSXqual_getLinkQual(j, m);
-            fwrite(&x, sizeof(REAL4), 1, MSX.TmpOutFile.file);
-        }
+        updateStats(w);
+        return 0;
+    }
+
+// --- write the buffer directly if there is no writer thread
+
+    if ( !w->Threaded )
+    {
+        if ( writePeriod(w, w->Buf[w->Cur]) ) w->Err = TRUE;
+        return w->Err ? ERR_IO_OUT_FILE : 0;
     }
+
+// --- otherwise wait for the writer thread to finish with the other
+//     buffer and then hand this one over to it
+
+    LOCK(w);
+    while ( w->Pending ) WAIT(w);
+    if ( w->Err )
+    {
+        UNLOCK(w);
+        return ERR_IO_OUT_FILE;
+    }
+    w->Full = w->Cur;
+    w->Pending = TRUE;
+    SIGNAL(w);
+    UNLOCK(w);
+    w->Cur = 1 - w->Cur;
     return 0;
 }
 
@@ -186,6 +328,8 @@ int MSXout_saveFinalResults()
 **  Purpose:
 **    saves any statistical results plus the following information to the end
 **    of the MSX binary output file:
+**    - for a columnar file, the byte offset where each chunk of results
+**      begins, the number of chunks and the number of periods per chunk,
 **    - byte offset into file where WQ results for each time period begins,
 **    - total number of time periods written to the file,
 **    - any error code generated by the analysis (0 if there were no errors),
@@ -201,15 +345,23 @@ int MSXout_saveFinalResults()
     INT4  n;
     INT4  magic = MAGICNUMBER;
     int   err = 0;
+    SresultWriter* w = (SresultWriter *)MSX.Writer;
+
+// --- finish writing the results of each period
+
+    err = MSXout_flush();
+    if ( !err && w != NULL ) err = writeChunk(w);
 
 // --- save statistical results to the file
 
-    if ( MSX.Statflag != SERIES ) err = saveStatResults();
+    if ( !err && MSX.Statflag != SERIES ) err = saveStatResults();
+    MSXout_close();
     if ( err > 0 ) return err;
 
 // --- write closing records to the file
 
-    n = (INT4)ResultsOffset;
+    if ( MSX.OutFormat == COLUMNAR_FORMAT ) saveChunkIndex();
+    n = (INT4)MSX.ResultsOffset;
     fwrite(&n, sizeof(INT4), 1, MSX.OutFile.file);
     n = (INT4)MSX.Nperiods;
     fwrite(&n, sizeof(INT4), 1, MSX.OutFile.file);
@@ -221,6 +373,99 @@ int MSXout_saveFinalResults()
 
 //=============================================================================
 
+int MSXout_flush()
+/*
+**  Purpose:
+**    waits until all results handed to the writer thread are written.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+*/
+{
+    SresultWriter* w = (SresultWriter *)MSX.Writer;
+    int err;
+
+    if ( w == NULL ) return 0;
+    if ( w->Threaded ) LOCK(w);
+    while ( w->Threaded && w->Pending ) WAIT(w);
+    err = w->Err ? ERR_IO_OUT_FILE : 0;
+    if ( w->Threaded ) UNLOCK(w);
+    return err;
+}
+
+//=============================================================================
+
+void MSXout_close()
+/*
+**  Purpose:
+**    finishes writing results, stops the writer thread, and frees the
+**    results writer.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    none.
+*/
+{
+    SresultWriter* w = (SresultWriter *)MSX.Writer;
+
+    if ( w == NULL ) return;
+    if ( w->Threaded )
+    {
+        LOCK(w);
+        w->Quit = TRUE;
+        SIGNAL(w);
+        UNLOCK(w);
+#ifdef WINDOWS
+        WaitForSingleObject(w->Thread, INFINITE);
+        CloseHandle(w->Thread);
+        DeleteCriticalSection(&w->Lock);
+#else
+        pthread_join(w->Thread, NULL);
+        pthread_cond_destroy(&w->Cond);
+        pthread_mutex_destroy(&w->Lock);
+#endif
+    }
+    FREE(w->Buf[0]);
+    FREE(w->Buf[1]);
+    FREE(w->Stats[0]);
+    FREE(w->Stats[1]);
+    FREE(w->Chunk);
+    free(w);
+    MSX.Writer = NULL;
+}
+
+//=============================================================================
+
+int MSXout_checkFile()
+/*
+**  Purpose:
+**    checks that the MSX binary output file holds the complete results
+**    of a run.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+*/
+{
+    INT4  magic = 0;
+
+    if ( MSX.OutFile.file == NULL ) return ERR_OPEN_OUT_FILE;
+    if ( MSXout_flush() ) return ERR_IO_OUT_FILE;
+    fseek(MSX.OutFile.file, -(long)sizeof(INT4), SEEK_END);
+    fread(&magic, sizeof(INT4), 1, MSX.OutFile.file);
+    if ( magic != MAGICNUMBER ) return ERR_IO_OUT_FILE;
+    return 0;
+}
+
+//=============================================================================
+
 float MSXout_getNodeQual(int k, int j, int m)
 /*
 **  Purpose:
@@ -232,12 +477,14 @@ float MSXout_getNodeQual(int k, int j, int m)
 **    m = species index.
 **
 **  Returns:
-**    the requested species concentration. 
+**    the requested species concentration (0 if it was not saved).
 */
 {
     REAL4 c;
-    long bp = ResultsOffset + k * (NodeBytesPerPeriod + LinkBytesPerPeriod);
-    bp += ((m-1)*MSX.Nobjects[NODE] + (j-1)) * sizeof(REAL4);
+    long bp;
+    int  i = getResultIndex(NODE, j, m);
+    if ( i < 0 ) return 0.0f;
+    bp = getOffset(k, i);
     fseek(MSX.OutFile.file, bp, SEEK_SET);
     fread(&c, sizeof(REAL4), 1, MSX.OutFile.file);
     return (float)c;
@@ -256,12 +503,14 @@ float MSXout_getLinkQual(int k, int j, int m)
 **    m = species index.
 **
 **  Returns:
-**    the requested species concentration. 
+**    the requested species concentration (0 if it was not saved).
 */
 {
     REAL4 c;
-    long bp = ResultsOffset + ((k+1)*NodeBytesPerPeriod) + (k*LinkBytesPerPeriod);
-    bp += ((m-1)*MSX.Nobjects[LINK] + (j-1)) * sizeof(REAL4);
+    long bp;
+    int  i = getResultIndex(LINK, j, m);
+    if ( i < 0 ) return 0.0f;
+    bp = getOffset(k, i);
     fseek(MSX.OutFile.file, bp, SEEK_SET);
     fread(&c, sizeof(REAL4), 1, MSX.OutFile.file);
     return (float)c;
@@ -269,6 +518,49 @@ float MSXout_getLinkQual(int k, int j, int m)
 
 //=============================================================================
 
+int MSXout_getSeries(int objType, int j, int m, REAL4 *x)
+/*
+**  Purpose:
+**    retrieves the results of all time periods for a specific node or
+**    link from the MSX binary output file.
+**
+**  Input:
+**    objType = type of object (NODE or LINK)
+**    j = node or link index
+**    m = species index.
+**
+**  Output:
+**    x = the species concentration in each time period.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+**
+**  Note: a columnar file needs one read per chunk of periods instead
+**        of one read per period. The series of an object or species
+**        left out of a subset of results is all zeros.
+*/
+{
+    int  i, k, n = 1;
+
+    i = getResultIndex(objType, j, m);
+    if ( i < 0 )
+    {
+        for (k = 0; k < MSX.Nperiods; k++) x[k] = 0.0f;
+        return ERR_INVALID_OBJECT_INDEX;
+    }
+    for (k = 0; k < MSX.Nperiods; k += n)
+    {
+        if ( MSX.OutFormat == COLUMNAR_FORMAT )
+            n = MIN(MSX.ChunkPeriods, MSX.Nperiods - k);
+        fseek(MSX.OutFile.file, getOffset(k, i), SEEK_SET);
+        if ( fread(&x[k], sizeof(REAL4), n, MSX.OutFile.file) < (size_t)n )
+            return ERR_IO_OUT_FILE;
+    }
+    return 0;
+}
+
+//=============================================================================
+
 int  saveStatResults()
 /*
 **  Purpose:
@@ -282,124 +574,444 @@ int  saveStatResults()
 **    an error code (or 0 if no error).
 */
 {
-    int     m, err = 0;
-    REAL4*  x = NULL;
-    double* stats1 = NULL;
-    double* stats2 = NULL;
-
-// --- create arrays used to store statistics results
+    int     i;
+    SresultWriter* w = (SresultWriter *)MSX.Writer;
+    REAL4*  x;
+    double* stats1;
+    double* stats2;
 
-    if ( MSX.Nperiods <= 0 ) return err;
-    m = MAX(MSX.Nobjects[NODE], MSX.Nobjects[LINK]);
-    x = (REAL4 *) calloc(m+1, sizeof(REAL4));
-    stats1 = (double *) calloc(m+1, sizeof(double));
-    stats2 = (double *) calloc(m+1, sizeof(double));
+    if ( MSX.Nperiods <= 0 || w == NULL ) return 0;
+    x = w->Buf[0];
+    stats1 = w->Stats[0];
+    stats2 = w->Stats[1];
 
-// --- get desired statistic for each node & link and save to binary file
+// --- place final stat value for each node & link in x
 
-    if ( x && stats1 && stats2 )
+    for (i = 0; i < w->Size; i++)
     {
-        for (m = 1; m <= MSX.Nobjects[SPECIES]; m++ )
-        {
-            getStatResults(NODE, m, stats1, stats2, x);
-            fwrite(x+1, sizeof(REAL4), MSX.Nobjects[NODE], MSX.OutFile.file);
-        }
-        for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
-        {
-            getStatResults(LINK, m, stats1, stats2, x);    
-            fwrite(x+1, sizeof(REAL4), MSX.Nobjects[LINK], MSX.OutFile.file);
-        }
-        MSX.Nperiods = 1;
+        if ( MSX.Statflag == AVGERAGE )
+            x[i] = (REAL4)(stats1[i] / (double)MSX.Nperiods);
+        else if ( MSX.Statflag == RANGE )
+            x[i] = (REAL4)fabs(stats2[i] - stats1[i]);
+        else if ( MSX.Statflag == MAXIMUM )
+            x[i] = (REAL4)stats2[i];
+        else x[i] = (REAL4)stats1[i];
     }
-    else err = ERR_MEMORY;
 
-// --- free allocated arrays
+// --- save them to the binary file as a single reporting period
 
-    FREE(x);
-    FREE(stats1);
-    FREE(stats2);
-    return err;
+    if ( fwrite(x, sizeof(REAL4), w->Size, MSX.OutFile.file) <
+         (size_t)w->Size ) return ERR_IO_OUT_FILE;
+    MSX.Nperiods = 1;
+    return 0;
 }
 
 //=============================================================================
 
-void getStatResults(int objType, int m, double * stats1, double * stats2,
-                    REAL4 * x)
+int  buildOutSet(int type)
 /*
 **  Purpose:
-**    reads all results for a given type of object from the temporary
-**    binary output file and computes the required statistic (average,
-**    min., max., or range) for each object.
+**    lists the nodes, links or species whose results are saved to the
+**    output file.
 **
 **  Input:
-**    objType = type of object (nodes or links)
-**    m = species index
-**    stats1, stats2 = work arrays used to hold intermediate values
-**    x = array used to store results read from file.
+**    type = type of object (NODE, LINK or SPECIES).
 **
-**  Output:
-**    x = array that contains computed statistic for each object.
+**  Returns:
+**    an error code (or 0 if no error).
+**
+**  Note: all objects are saved unless SUBSET YES was specified, in which
+**        case only those whose reporting flag is set are saved.
 */
 {
-    int  j, k;
-    int  n = MSX.Nobjects[objType];
-    long bp;
-
-// --- initialize work arrays
-    
+    int     j, rpt;
+    int     n = MSX.Nobjects[type];
+    SoutSet *set = &MSX.OutSet[type];
+
+    FREE(set->index);
+    FREE(set->pos);
+    set->n = 0;
+    set->index = (int *) calloc(n+1, sizeof(int));
+    set->pos = (int *) calloc(n+1, sizeof(int));
+    if ( set->index == NULL || set->pos == NULL ) return ERR_MEMORY;
     for (j = 1; j <= n; j++)
     {
-        stats1[j] = 0.0;
-        stats2[j] = 0.0; 
+        if ( type == NODE ) rpt = MSX.Node[j].rpt;
+        else if ( type == LINK ) rpt = MSX.Link[j].rpt;
+        else rpt = MSX.Species[j].rpt;
+        if ( MSX.OutSubset && !rpt ) continue;
+        set->index[set->n] = j;
+        set->n++;
+        set->pos[j] = set->n;
     }
+    return 0;
+}
 
-// --- for all time periods
+//=============================================================================
 
-    for (k = 0; k < MSX.Nperiods; k++)
+int  getResultIndex(int objType, int j, int m)
+/*
+**  Purpose:
+**    finds where the result of a species at a node or link lies among
+**    all results saved for a period.
+**
+**  Input:
+**    objType = type of object (NODE or LINK)
+**    j = node or link index
+**    m = species index.
+**
+**  Returns:
+**    the index of the result (or -1 if it was not saved).
+*/
+{
+    int p = MSX.OutSet[objType].pos ? MSX.OutSet[objType].pos[j] : 0;
+    int s = MSX.OutSet[SPECIES].pos ? MSX.OutSet[SPECIES].pos[m] : 0;
+
+    if ( p == 0 || s == 0 ) return -1;
+    if ( objType == NODE ) return (s-1)*MSX.OutSet[NODE].n + (p-1);
+    return MSX.OutSet[SPECIES].n*MSX.OutSet[NODE].n +
+           (s-1)*MSX.OutSet[LINK].n + (p-1);
+}
+
+//=============================================================================
+
+SresultWriter* openWriter()
+/*
+**  Purpose:
+**    creates a results writer for the scratch output file and starts
+**    its writer thread.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    a pointer to the new writer (or NULL if out of memory).
+**
+**  Note: results are written by the calling thread if the writer
+**        thread can't be started. No thread is needed when a time
+**        statistic is reported, since results are then only written
+**        once the run is over.
+*/
+{
+    SresultWriter* w;
+
+    w = (SresultWriter *) calloc(1, sizeof(SresultWriter));
+    if ( w == NULL ) return NULL;
+    w->Size = (MSX.OutSet[NODE].n + MSX.OutSet[LINK].n) *
+              MSX.OutSet[SPECIES].n;
+    w->Buf[0] = (REAL4 *) calloc(w->Size+1, sizeof(REAL4));
+    w->File = MSX.TmpOutFile.file;
+    w->ChunkPeriods = MSX.ChunkPeriods;
+    MSX.Writer = w;
+    if ( MSX.Statflag != SERIES )
+    {
+        w->Stats[0] = (double *) calloc(w->Size+1, sizeof(double));
+        w->Stats[1] = (double *) calloc(w->Size+1, sizeof(double));
+        if ( w->Buf[0] && w->Stats[0] && w->Stats[1] ) return w;
+    }
+    else
+    {
+        w->Buf[1] = (REAL4 *) calloc(w->Size+1, sizeof(REAL4));
+        if ( MSX.OutFormat == COLUMNAR_FORMAT )
+        {
+            w->Chunk = (REAL4 *) calloc(w->Size*w->ChunkPeriods+1,
+                                        sizeof(REAL4));
+            if ( w->Chunk == NULL ) FREE(w->Buf[1]);
+        }
+    }
+    if ( w->Buf[0] == NULL || w->Buf[1] == NULL )
     {
+        MSXout_close();
+        return NULL;
+    }
+
+#ifdef WINDOWS
+    InitializeCriticalSection(&w->Lock);
+    InitializeConditionVariable(&w->Cond);
+    w->Thread = (HANDLE)_beginthreadex(NULL, 0, runWriter, w, 0, NULL);
+    if ( w->Thread ) w->Threaded = TRUE;
+    else DeleteCriticalSection(&w->Lock);
+#else
+    if ( pthread_mutex_init(&w->Lock, NULL) == 0 )
+    {
+        if ( pthread_cond_init(&w->Cond, NULL) == 0 )
+        {
+            if ( pthread_create(&w->Thread, NULL, runWriter, w) == 0 )
+                w->Threaded = TRUE;
+            else pthread_cond_destroy(&w->Cond);
+        }
+        if ( !w->Threaded ) pthread_mutex_destroy(&w->Lock);
+    }
+#endif
+    return w;
+}
 
-    // --- position file at start of time period
+//=============================================================================
 
-        bp = k*(NodeBytesPerPeriod + LinkBytesPerPeriod);
-        if ( objType == NODE )
+void fillBuffer(REAL4* x)
+/*
+**  Purpose:
+**    places the current concentration of each species at each node and
+**    link in the order they are saved to the output file.
+**
+**  Input:
+**    none.
+**
+**  Output:
+**    x = all saved node results by species followed by all saved link
+**        results by species.
+**
+**  Note: concentrations are only found for the objects and species
+**        saved, so a link left out of a subset is never averaged.
+*/
+{
+    int  i, j, m;
+    int  ns = MSX.OutSet[SPECIES].n;
+    int  nn = MSX.OutSet[NODE].n;
+    int  nl = MSX.OutSet[LINK].n;
+    int  *species = MSX.OutSet[SPECIES].index;
+    int  *nodes = MSX.OutSet[NODE].index;
+    int  *links = MSX.OutSet[LINK].index;
+    int  nodeValues = ns * nn;
+    int  n = ns * (nn + nl);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j, m) schedule(static) copyin(MSXcurrent)
+#endif
+    for (i = 0; i < n; i++)
+    {
+        if ( i < nodeValues )
         {
-            bp += (m-1) * MSX.Nobjects[NODE] * sizeof(REAL4);
+            m = species[i / nn];
+            j = nodes[i % nn];
+            x[i] = (REAL4)MSXqual_getNodeQual(j, m);
         }
-        if ( objType == LINK)
+        else
         {
-            bp += NodeBytesPerPeriod + 
-                  (m-1) * MSX.Nobjects[LINK] * sizeof(REAL4);
+            m = species[(i - nodeValues) / nl];
+            j = links[(i - nodeValues) % nl];
+            x[i] = (REAL4)MSXqual_getLinkQual(j, m);
         }
-        fseek(MSX.TmpOutFile.file, bp, SEEK_SET);
+    }
+}
 
-    // --- read concentrations and update stats for all objects
+//=============================================================================
 
-        fread(x+1, sizeof(REAL4), n, MSX.TmpOutFile.file);
-        if ( MSX.Statflag == AVGERAGE )
-        { 
-            for (j = 1; j <= n; j++) stats1[j] += x[j];
+void updateStats(SresultWriter* w)
+/*
+**  Purpose:
+**    updates the running time statistic of each result with the results
+**    of the current reporting period.
+**
+**  Input:
+**    w = results writer whose current buffer holds the period's results.
+**
+**  Returns:
+**    none.
+**
+**  Note: for averages Stats[0] is the sum of results over all periods;
+**        otherwise Stats[0] and Stats[1] are the smallest and largest
+**        results seen so far.
+*/
+{
+    int     i;
+    int     n = w->Size;
+    int     stat = MSX.Statflag;
+    int     first = (MSX.Nperiods == 0);
+    REAL4*  x = w->Buf[w->Cur];
+    double* stats1 = w->Stats[0];
+    double* stats2 = w->Stats[1];
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(static) copyin(MSXcurrent)
+#endif
+    for (i = 0; i < n; i++)
+    {
+        if ( stat == AVGERAGE )
+        {
+            if ( first ) stats1[i] = 0.0;
+            stats1[i] += x[i];
         }
-        else for (j = 1; j <= n; j++)
+        else if ( first )
         {
-            stats1[j] = MIN(stats1[j], x[j]); 
-            stats2[j] = MAX(stats2[j], x[j]); 
+            stats1[i] = x[i];
+            stats2[i] = x[i];
         }
+        else
+        {
+            stats1[i] = MIN(stats1[i], x[i]);
+            stats2[i] = MAX(stats2[i], x[i]);
+        }
+    }
+}
+
+//=============================================================================
+
+int writePeriod(SresultWriter* w, REAL4* x)
+/*
+**  Purpose:
+**    writes the results of a period to the output file, or places them
+**    in the current chunk of a columnar file.
+**
+**  Input:
+**    w = results writer
+**    x = all results of the period.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+*/
+{
+    int i;
+    int k = w->ChunkPeriods;
+
+    if ( w->Chunk == NULL )
+    {
+        if ( fwrite(x, sizeof(REAL4), w->Size, w->File) < (size_t)w->Size )
+            return ERR_IO_OUT_FILE;
+        return 0;
     }
+    for (i = 0; i < w->Size; i++) w->Chunk[i*k + w->Nchunk] = x[i];
+    w->Nchunk++;
+    if ( w->Nchunk == k ) return writeChunk(w);
+    return 0;
+}
+
+//=============================================================================
 
-// --- place final stat value for each object in x
+int writeChunk(SresultWriter* w)
+/*
+**  Purpose:
+**    writes the results placed in the current chunk of a columnar file.
+**
+**  Input:
+**    w = results writer.
+**
+**  Returns:
+**    an error code (or 0 if no error).
+**
+**  Note: the values of each result are stored next to each other, so
+**        those of a partly filled chunk are first moved together.
+*/
+{
+    int    i;
+    int    k = w->ChunkPeriods;
+    int    p = w->Nchunk;
+    size_t n = (size_t)p * w->Size;
 
-    if ( MSX.Statflag == AVGERAGE )
+    if ( w->Chunk == NULL || p == 0 ) return 0;
+    if ( p < k ) for (i = 1; i < w->Size; i++)
     {
-        for ( j = 1; j <= n; j++) stats1[j] /= (double)MSX.Nperiods;
+        memmove(&w->Chunk[i*p], &w->Chunk[i*k], p*sizeof(REAL4));
     }
-    if ( MSX.Statflag == RANGE )
+    w->Nchunk = 0;
+    if ( fwrite(w->Chunk, sizeof(REAL4), n, w->File) < n )
+        return ERR_IO_OUT_FILE;
+    return 0;
+}
+
+//=============================================================================
+
+void saveChunkIndex()
+/*
+**  Purpose:
+**    saves the byte offset of each chunk of a columnar file followed by
+**    the number of chunks and of periods per chunk.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    none.
+*/
+{
+    int   c;
+    int   k = MSX.ChunkPeriods;
+    int   nchunks = (MSX.Nperiods + k - 1) / k;
+    INT4  n;
+
+    for (c = 0; c < nchunks; c++)
     {
-        for ( j = 1; j <= n; j++)
-            stats1[j] = fabs(stats2[j] - stats1[j]);
+        n = (INT4)getOffset(c*k, 0);
+        fwrite(&n, sizeof(INT4), 1, MSX.OutFile.file);
     }
-    if ( MSX.Statflag == MAXIMUM)
+    n = (INT4)nchunks;
+    fwrite(&n, sizeof(INT4), 1, MSX.OutFile.file);
+    n = (INT4)k;
+    fwrite(&n, sizeof(INT4), 1, MSX.OutFile.file);
+}
+
+//=============================================================================
+
+long getOffset(int k, int i)
+/*
+**  Purpose:
+**    finds where a result of a given time period is stored in the MSX
+**    binary output file.
+**
+**  Input:
+**    k = time period index
+**    i = index of the result among all results of a period (all saved
+**        node results by species followed by all saved link results by
+**        species).
+**
+**  Returns:
+**    the byte offset of the result.
+*/
+{
+    int  c, p, kc;
+    long size = (MSX.NodeBytesPerPeriod + MSX.LinkBytesPerPeriod) /
+                sizeof(REAL4);
+
+    if ( MSX.OutFormat != COLUMNAR_FORMAT )
     {
-        for ( j = 1; j <= MSX.Nobjects[NODE]; j++) stats1[j] = stats2[j]; 
+        return MSX.ResultsOffset + (k*size + i) * sizeof(REAL4);
     }
-    for (j = 1; j <= n; j++) x[j] = (REAL4)stats1[j];
+
+// --- chunk c holds kc periods with all values of a result together
+
+    c = k / MSX.ChunkPeriods;
+    p = k % MSX.ChunkPeriods;
+    kc = MIN(MSX.ChunkPeriods, MSX.Nperiods - c*MSX.ChunkPeriods);
+    return MSX.ResultsOffset + ((long)c*MSX.ChunkPeriods*size +
+           (long)i*kc + p) * sizeof(REAL4);
+}
+
+//=============================================================================
+
+#ifdef WINDOWS
+unsigned __stdcall runWriter(void* arg)
+#else
+void* runWriter(void* arg)
+#endif
+/*
+**  Purpose:
+**    writes each buffer of results handed over by the solver to the
+**    output file until told to quit.
+**
+**  Input:
+**    arg = pointer to the results writer.
+**
+**  Returns:
+**    none.
+*/
+{
+    SresultWriter* w = (SresultWriter *)arg;
+    REAL4* x;
+    int    err;
+
+    LOCK(w);
+    for (;;)
+    {
+        while ( !w->Pending && !w->Quit ) WAIT(w);
+        if ( !w->Pending ) break;
+        x = w->Buf[w->Full];
+        UNLOCK(w);
+        err = writePeriod(w, x);
+        LOCK(w);
+        if ( err ) w->Err = TRUE;
+        w->Pending = FALSE;
+        SIGNAL(w);
+    }
+    UNLOCK(w);
+    return 0;
 }
@@ -22,17 +22,16 @@
 
 #include "msxtypes.h"
 #include "msxutils.h"
-//#include "mempool.h"
-#include "hash.h"
-
-//  Exported variables
-//--------------------
-MSXproject  MSX;                            // MSX project data
+#include "epanet2.h"
+//#include "hash.h"
 
 //  Local variables
 //-----------------
-static alloc_handle_t  *HashPool;           // Memory pool for hash tables
-static HTtable  *Htable[MAX_OBJECTS];       // Hash tables for object ID names
+static MSXproject  DefaultProject;          // Project used by the legacy API
+
+//  Exported variables
+//--------------------
+MSXproject  *MSXcurrent = &DefaultProject;  // Project bound to calling thread
 
 static char * Errmsg[] =
     {"unknown error code.",
@@ -60,7 +59,9 @@ static char * Errmsg[] =
 
      "Error 522 - could not compile chemistry functions.",                     //1.1.00
      "Error 523 - could not load functions from compiled chemistry file.",     //1.1.00
-	 "Error 524 - illegal math operation."};                                   //1.1.00
+	 "Error 524 - illegal math operation.",                                    //1.1.00
+     "Error 525 - snapshot file is invalid or does not match the network.",
+     "Error 526 - checkpoint file is invalid or does not match the project."};
 
 //  Imported functions
 //--------------------
@@ -68,6 +69,10 @@ int    MSXinp_countMsxObjects(void);
 int    MSXinp_countNetObjects(void);
 int    MSXinp_readNetData(void);
 int    MSXinp_readMsxData(void);
+void   MSXhyd_close(void);
+void   MSXout_close(void);
+int    MSXsnap_isSnapshot(char *fname);
+int    MSXsnap_read(char *fname, int (*createObjects)(void));
 
 //  Exported functions
 //--------------------
@@ -76,6 +81,9 @@ int    MSXproj_addObject(int type, char *id, int n);
 int    MSXproj_findObject(int type, char *id);
 char * MSXproj_findID(int type, char *id);
 char * MSXproj_getErrmsg(int errcode);
+MSXproject * MSXproj_setCurrent(MSXproject *project);
+int    MSXproj_saveBaseline(void);
+void   MSXproj_restoreBaseline(void);
 
 //  Local functions
 //-----------------
@@ -83,10 +91,13 @@ static void   setDefaults(void);
 static int    convertUnits(void);
 static int    createObjects(void);
 static void   deleteObjects(void);
+static void   deleteBaseline(void);
 static int    createHashTables(void);
 static void   deleteHashTables(void);
 
 static int    openRptFile(void);                                               //(LR-11/20/07)
+static int    openSnapshot(char *fname);
+static int    buildNetIndex(int type);
 
 static int  buildadjlists();
 static void freeadjlists();
@@ -116,6 +127,7 @@ int  MSXproj_open(char *fname)
 // --- open the MSX input file
 
     strcpy(MSX.MsxFile.name, fname);
+    if ( MSXsnap_isSnapshot(fname) ) return openSnapshot(fname);
     if ((MSX.MsxFile.file = fopen(fname,"rt")) == NULL) return ERR_OPEN_MSX_FILE;
 
 // --- create hash tables to look up object ID names
@@ -160,6 +172,32 @@ int  MSXproj_open(char *fname)
 
 //=============================================================================
 
+int  openSnapshot(char *fname)
+/*
+**  Purpose:
+**    opens an EPANET-MSX project saved as a binary snapshot.
+**
+**  Input:
+**    fname = name of the snapshot file
+**
+**  Returns:
+**    an error code (0 if no error)
+**
+**  Note: the snapshot's data are already in internal units and
+**        include the nodal adjacency lists.
+*/
+{
+    int errcode = 0;
+
+    CALL(errcode, createHashTables());
+    CALL(errcode, MSXsnap_read(fname, createObjects));
+    if ( strcmp(MSX.RptFile.name, "") ) CALL(errcode, openRptFile());
+    if ( !errcode ) MSX.ProjectOpened = TRUE;
+    return errcode;
+}
+
+//=============================================================================
+
 void MSXproj_close()
 /*
 **  Purpose:
@@ -172,7 +210,8 @@ void MSXproj_close()
     // --- close all files
 
     if ( MSX.RptFile.file ) fclose(MSX.RptFile.file);                          //(LR-11/20/07, to fix bug 08)
-    if ( MSX.HydFile.file ) fclose(MSX.HydFile.file);
+    MSXhyd_close();
+    MSXout_close();
     if ( MSX.TmpOutFile.file && MSX.TmpOutFile.file != MSX.OutFile.file )
         fclose(MSX.TmpOutFile.file);
     if ( MSX.OutFile.file ) fclose(MSX.OutFile.file);
@@ -222,12 +261,13 @@ int   MSXproj_addObject(int type, char *id, int n)
 //     a copy of the object's ID string
 
     len = strlen(id) + 1;
-    newID = (char *) Alloc(len*sizeof(char));
+    newID = (char *) MSXarena_raw(MSX.HashArena, len*sizeof(char));
+    if ( newID == NULL ) return -1;
     strcpy(newID, id);
 
 // --- insert object's ID into the hash table for that type of object
 
-    result = HTinsert(Htable[type], newID, n);
+    result = HTinsert(MSX.Htable[type], newID, n);
     if ( result == 0 ) result = -1;
     return result;
 }
@@ -245,9 +285,13 @@ int   MSXproj_findObject(int type, char *id)
 **
 **  Returns:
 **    index of object with given ID, or -1 if ID not found.
+**
+**  Note: the tables of node and link IDs are filled in from EPANET's
+**        network the first time one of them is searched.
 */
 {
-    return HTfind(Htable[type], id);
+    if ( buildNetIndex(type) ) return -1;
+    return HTfind(MSX.Htable[type], id);
 }
 
 //=============================================================================
@@ -265,7 +309,8 @@ char * MSXproj_findID(int type, char *id)
 **    pointer to location where object's ID string is stored.
 */
 {
-    return HTfindKey(Htable[type], id);
+    if ( buildNetIndex(type) ) return NULL;
+    return HTfindKey(MSX.Htable[type], id);
 }
 
 //=============================================================================
@@ -288,6 +333,166 @@ char * MSXproj_getErrmsg(int errcode)
 
 //=============================================================================
 
+MSXproject * MSXproj_setCurrent(MSXproject *project)
+/*
+**  Purpose:
+**    binds a project to the calling thread so that it is the one
+**    accessed through MSX.
+**
+**  Input:
+**    project = pointer to a project (NULL binds the default project).
+**
+**  Returns:
+**    pointer to the project that was previously bound.
+*/
+{
+    MSXproject *previous = MSXcurrent;
+    if ( project == NULL ) project = &DefaultProject;
+    MSXcurrent = project;
+    return previous;
+}
+
+//=============================================================================
+
+int  MSXproj_saveBaseline()
+/*
+**  Purpose:
+**    saves a copy of the initial concentrations, water quality sources,
+**    reaction parameters and constants read from the input file.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int     i, j;
+    int     ns = MSX.Nobjects[SPECIES] + 1;
+    int     np = MSX.Nobjects[PARAMETER] + 1;
+    Psource source;
+    Sbaseline *b = &MSX.Baseline;
+
+    deleteBaseline();
+    for (i=1; i<=MSX.Nobjects[NODE]; i++)
+    {
+        for (source = MSX.Node[i].sources; source; source = source->next)
+            b->Nsources++;
+    }
+    b->NodeC0 = (double *) calloc((MSX.Nobjects[NODE]+1)*ns, sizeof(double));
+    b->LinkC0 = (double *) calloc((MSX.Nobjects[LINK]+1)*ns, sizeof(double));
+    b->LinkParam = (double *) calloc((MSX.Nobjects[LINK]+1)*np, sizeof(double));
+    b->TankParam = (double *) calloc((MSX.Nobjects[TANK]+1)*np, sizeof(double));
+    b->Const = (double *) calloc(MSX.Nobjects[CONSTANT]+1, sizeof(double));
+    b->Sources = (struct Ssource *) calloc(b->Nsources+1, sizeof(struct Ssource));
+    b->SourceNode = (int *) calloc(b->Nsources+1, sizeof(int));
+    if ( !b->NodeC0 || !b->LinkC0 || !b->LinkParam || !b->TankParam ||
+         !b->Const || !b->Sources || !b->SourceNode ) return ERR_MEMORY;
+
+    for (i=1; i<=MSX.Nobjects[NODE]; i++)
+        memcpy(&b->NodeC0[i*ns], MSX.Node[i].c0, ns*sizeof(double));
+    for (i=1; i<=MSX.Nobjects[LINK]; i++)
+    {
+        memcpy(&b->LinkC0[i*ns], MSX.Link[i].c0, ns*sizeof(double));
+        memcpy(&b->LinkParam[i*np], MSX.Link[i].param, np*sizeof(double));
+    }
+    for (i=1; i<=MSX.Nobjects[TANK]; i++)
+        memcpy(&b->TankParam[i*np], MSX.Tank[i].param, np*sizeof(double));
+    for (i=1; i<=MSX.Nobjects[CONSTANT]; i++) b->Const[i] = MSX.Const[i].value;
+    j = 0;
+    for (i=1; i<=MSX.Nobjects[NODE]; i++)
+    {
+        for (source = MSX.Node[i].sources; source; source = source->next)
+        {
+            b->Sources[j] = *source;
+            b->SourceNode[j] = i;
+            j++;
+        }
+    }
+    return 0;
+}
+
+//=============================================================================
+
+void  MSXproj_restoreBaseline()
+/*
+**  Purpose:
+**    restores the initial concentrations, water quality sources, reaction
+**    parameters and constants saved by MSXproj_saveBaseline.
+**
+**  Input:
+**    none.
+**
+**  Note: sources added since the baseline was saved are kept in each
+**        node's list of sources but made into ones of no type (as
+**        MSXsetsource does for MSX_NOSOURCE) and no strength.
+*/
+{
+    int     i, j;
+    int     ns = MSX.Nobjects[SPECIES] + 1;
+    int     np = MSX.Nobjects[PARAMETER] + 1;
+    Psource source;
+    Sbaseline *b = &MSX.Baseline;
+
+    if ( b->NodeC0 == NULL ) return;
+    for (i=1; i<=MSX.Nobjects[NODE]; i++)
+    {
+        memcpy(MSX.Node[i].c0, &b->NodeC0[i*ns], ns*sizeof(double));
+        for (source = MSX.Node[i].sources; source; source = source->next)
+        {
+            source->type = (char)(-1);
+            source->c0 = 0.0;
+            source->pat = 0;
+        }
+    }
+    for (i=1; i<=MSX.Nobjects[LINK]; i++)
+    {
+        memcpy(MSX.Link[i].c0, &b->LinkC0[i*ns], ns*sizeof(double));
+        memcpy(MSX.Link[i].param, &b->LinkParam[i*np], np*sizeof(double));
+    }
+    for (i=1; i<=MSX.Nobjects[TANK]; i++)
+        memcpy(MSX.Tank[i].param, &b->TankParam[i*np], np*sizeof(double));
+    for (i=1; i<=MSX.Nobjects[CONSTANT]; i++) MSX.Const[i].value = b->Const[i];
+
+// --- each saved source is still in its node's list of sources
+
+    for (j=0; j<b->Nsources; j++)
+    {
+        source = MSX.Node[b->SourceNode[j]].sources;
+        while ( source && source->species != b->Sources[j].species )
+            source = source->next;
+        if ( source == NULL ) continue;
+        source->type = b->Sources[j].type;
+        source->c0 = b->Sources[j].c0;
+        source->pat = b->Sources[j].pat;
+    }
+}
+
+//=============================================================================
+
+void deleteBaseline()
+/*
+**  Purpose:
+**    frees the copy of the inputs read from the input file.
+**
+**  Input:
+**    none.
+*/
+{
+    Sbaseline *b = &MSX.Baseline;
+
+    FREE(b->NodeC0);
+    FREE(b->LinkC0);
+    FREE(b->LinkParam);
+    FREE(b->TankParam);
+    FREE(b->Const);
+    FREE(b->Sources);
+    FREE(b->SourceNode);
+    b->Nsources = 0;
+}
+
+//=============================================================================
+
 void setDefaults()
 /*
 **  Purpose:
@@ -301,9 +506,17 @@ void setDefaults()
     MSX.RptFile.file = NULL;                                                   //(LR-11/20/07)
     MSX.HydFile.file = NULL;
     MSX.HydFile.mode = USED_FILE;
+    MSX.HydIndex.Nperiods = 0;
+    MSX.HydIndex.Period = 0;
+    MSX.HydIndex.Time = NULL;
+    MSX.HydIndex.Map = NULL;
+    MSX.HydIndex.Buf = NULL;
+    MSX.HydIndex.hMap = NULL;
+    MSX.HydTimeline = NULL;
     MSX.OutFile.file = NULL;
     MSX.OutFile.mode = SCRATCH_FILE;
     MSX.TmpOutFile.file = NULL;
+    MSX.Writer = NULL;
     MSXutils_getTempName(MSX.OutFile.name);                                    //1.1.00
     MSXutils_getTempName(MSX.TmpOutFile.name);                                 //1.1.00
     strcpy(MSX.RptFile.name, "");
@@ -318,9 +531,22 @@ void setDefaults()
     MSX.Solver = EUL;
     MSX.Coupling = NO_COUPLING;
     MSX.Compiler = NO_COMPILER;                                                //1.1.00
+    MSX.CacheDir[0] = '\0';
+    MSX.OutFormat = STANDARD_FORMAT;
+    MSX.MaxSegs = 0;
+    MSX.LazyReact = FALSE;
+    MSX.Jacobian = NUMERICAL_JACOBIAN;
+    MSX.ReuseJac = 0;
+    memset(&MSX.SolverStats, 0, sizeof(SsolverStats));
+    MSX.Profiling = FALSE;
+    MSX.MassCheck = FALSE;
+    MSX.OutSubset = FALSE;
+    memset(&MSX.Profile, 0, sizeof(Sprofile));
+    MSX.WakeSegs = FALSE;
     MSX.AreaUnits = FT2;
     MSX.RateUnits = DAYS;
     MSX.Qstep = 300;
+    MSX.ReactStep = 0;
     MSX.Rstep = 3600;
     MSX.Rstart = 0;
     MSX.Dur = 0;
@@ -507,6 +733,8 @@ int createObjects()
     {
         MSX.Species[i].pipeExpr     = NULL;
         MSX.Species[i].tankExpr     = NULL;
+        MSX.Species[i].pipeCode     = NULL;
+        MSX.Species[i].tankCode     = NULL;
         MSX.Species[i].pipeExprType = NO_EXPR;
         MSX.Species[i].tankExprType = NO_EXPR;
         MSX.Species[i].precision    = 2;
@@ -515,7 +743,11 @@ int createObjects()
 
 // --- initialize math expressions for each intermediate term
 
-    for (i=1; i<=MSX.Nobjects[TERM]; i++) MSX.Term[i].expr = NULL;
+    for (i=1; i<=MSX.Nobjects[TERM]; i++)
+    {
+        MSX.Term[i].expr = NULL;
+        MSX.Term[i].code = NULL;
+    }
     return 0;
 }
 
@@ -589,6 +821,19 @@ void deleteObjects()
     FREE(MSX.Q);
     FREE(MSX.C0);
 
+// --- free the copy of the inputs read from the input file
+
+    deleteBaseline();
+
+// --- free the lists of objects saved to the output file
+
+    for (i=0; i<MAX_OBJECTS; i++)
+    {
+        FREE(MSX.OutSet[i].index);
+        FREE(MSX.OutSet[i].pos);
+        MSX.OutSet[i].n = 0;
+    }
+
 // --- delete all nodes, links, and tanks
 
     FREE(MSX.Node);
@@ -641,14 +886,59 @@ int createHashTables()
 
     for (j = 0; j < MAX_OBJECTS ; j++)
     {
-         Htable[j] = HTcreate();
-         if ( Htable[j] == NULL ) return ERR_MEMORY;
+         MSX.Htable[j] = HTcreate();
+         if ( MSX.Htable[j] == NULL ) return ERR_MEMORY;
     }
 
-// --- initialize the memory pool used to store object ID's
+// --- initialize the memory arena used to store object ID's
+
+    MSX.HashArena = MSXarena_create();
+    if ( MSX.HashArena == NULL ) return ERR_MEMORY;
+    return 0;
+}
+
+//=============================================================================
+
+int buildNetIndex(int type)
+/*
+**  Purpose:
+**    adds the ID names of all of the network's nodes or links to the
+**    hash table for that type of object if it is still empty.
+**
+**  Input:
+**    type = object type.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int  i, n, len;
+    char id[MAXLINE+1];
+    char *newID;
+
+    if ( type != NODE && type != LINK ) return 0;
+    if ( MSX.Htable[type] == NULL ) return ERR_MEMORY;
+    n = MSX.Nobjects[type];
+    if ( n == 0 || HTcount(MSX.Htable[type]) > 0 ) return 0;
+
+// --- replace the empty table with one sized for all of the objects
+
+    HTfree(MSX.Htable[type]);
+    MSX.Htable[type] = HTcreateSized(n);
+    if ( MSX.Htable[type] == NULL ) return ERR_MEMORY;
+
+// --- insert each object's ID, stored in the hash tables' memory arena
 
-    HashPool = AllocInit();
-    if ( HashPool == NULL ) return ERR_MEMORY;
+    for (i = 1; i <= n; i++)
+    {
+        if ( type == NODE ) ENgetnodeid(i, id);
+        else                ENgetlinkid(i, id);
+        len = strlen(id) + 1;
+        newID = (char *) MSXarena_raw(MSX.HashArena, len*sizeof(char));
+        if ( newID == NULL ) return ERR_MEMORY;
+        strcpy(newID, id);
+        if ( !HTinsert(MSX.Htable[type], newID, i) ) return ERR_MEMORY;
+    }
     return 0;
 }
 
@@ -669,16 +959,14 @@ void deleteHashTables()
 
     for (j = 0; j < MAX_OBJECTS; j++)
     {
-        if ( Htable[j] != NULL ) HTfree(Htable[j]);
+        if ( MSX.Htable[j] != NULL ) HTfree(MSX.Htable[j]);
+        MSX.Htable[j] = NULL;
     }
 
-// --- free the object ID memory pool
+// --- free the object ID memory arena
 
-    if ( HashPool )
-    {
-        AllocSetPool(HashPool);
-        AllocFreePool();
-    }
+    MSXarena_delete(MSX.HashArena);
+    MSX.HashArena = NULL;
 }
 
 // New function added (LR-11/20/07, to fix bug 08)
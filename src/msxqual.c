@@ -16,6 +16,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "msxtypes.h"
 //#include "mempool.h"
@@ -28,9 +31,18 @@
 #define   DOWN_NODE(x) ( (MSX.FlowDir[(x)]==POSITIVE) ? MSX.Link[(x)].n2 : MSX.Link[(x)].n1 )
 #define   LINKVOL(k)   ( 0.785398*MSX.Link[(k)].len*SQR(MSX.Link[(k)].diam) )
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
+// Smallest level of sorted nodes whose nodes are mixed in parallel
+//
+#define   MINLEVELSIZE 64
+
+// Fraction (as 1/x) of all nodes that an incremental re-sort may
+// visit before a full sort is made instead
+//
+#define   MAXREPAIRFRACTION 4
+
+// Mass balance terms of a node mixed in parallel
+//
+enum NodeMassType {RESERVOIR_IN, SOURCE_IN, NODE_OUT, MAX_NODE_MASS};
 
 //  Local variables
 //-----------------
@@ -52,6 +64,7 @@ int    MSXchem_open(void);
 void   MSXchem_close(void);
 int    MSXchem_react(long dt);
 int    MSXchem_equil(int zone, double *c);
+void   MSXchem_collectStats(void);
 
 extern void   MSXtank_mix1(int i, double vin, double *massin, double vnet);
 extern void   MSXtank_mix2(int i, double vin, double *massin, double vnet);
@@ -60,6 +73,10 @@ extern void   MSXtank_mix4(int i, double vIn, double *massin, double vnet);
 
 int    MSXout_open(void);
 int    MSXout_saveResults(void);
+int    MSXhyd_seek(long t);
+int    MSXhyd_read(long *hydtime, long *hydstep);
+int    MSXsnap_readState(char *fname, long *htime);
+char*  MSXhyd_getFlowDir(void);
 int    MSXout_saveFinalResults(void);
 
 void   MSXerr_clearMathError(void);                                            //1.1.00
@@ -70,15 +87,21 @@ char*  MSXerr_writeMathErrorMsg(void);                                         /
 //--------------------
 int    MSXqual_open(void);
 int    MSXqual_init(void);
+int    MSXqual_restore(char *fname);
 int    MSXqual_step(long *t, long *tleft);
 int    MSXqual_close(void);
 double MSXqual_getNodeQual(int j, int m);
 double MSXqual_getLinkQual(int k, int m);
-int    MSXqual_isSame(double c1[], double c2[]);
+void   MSXqual_getLinkQuals(int k, int m1, int m2, double x[], int stride);
+int    MSXqual_isSame(SEGREAL c1[], double c2[]);
 void   MSXqual_removeSeg(Pseg seg);
 Pseg   MSXqual_getFreeSeg(double v, double c[]);
 void   MSXqual_addSeg(int k, Pseg seg);
+void   MSXqual_addThreadTime(double *times, double t);
+void   MSXqual_updateProfile(void);
+void   MSXqual_updateMassBalance(void);
 void   MSXqual_reversesegs(int k);
+int    MSXqual_newOrder(SnodeOrder* order);
 
 //  Local functions
 //-----------------
@@ -89,19 +112,48 @@ static int    flowdirchanged(void);
 static void   advectSegs(long dt);
 static void   getNewSegWallQual(int k, long dt, Pseg seg);
 static void   shiftSegWallQual(int k, long dt);
-static void   sourceInput(int n, double vout, long dt);
+static void   sourceInput(int n, double vout, long dt, double* nodemass);
 static void   addSource(int n, Psource source, double v, long dt);
 static double getSourceQual(Psource source);
 static void   removeAllSegs(int k);
+static void   coarsenSegs(void);
+static void   wakeSegs(long t);
+static void   mergeSegs(int k);
+static double segDifference(Pseg seg1, Pseg seg2);
+static int    packSegs(void);
+static Pseg   newSeg(Sarena *arena);
 
 static void topological_transport(long dt);
-static void findnodequal(int n, double volin, double* massin, double volout, long tstep);
+#ifdef _OPENMP
+static void level_transport(long dt);
+#endif
+static void mixnode(int n, long dt, double* massin, double* nodemass);
+static void timedMixnode(int n, long dt, double* massin, double* nodemass,
+                         double* busy);
+static void findnodequal(int n, double volin, double* massin, double volout, long tstep,
+                         double* nodemass);
+static void addmassflow(double* nodemass, int type, int m, double mass);
 static void noflowqual(int n);
 static void evalnodeinflow(int, long, double*, double*);
 static void evalnodeoutflow(int k, double* upnodequal, long tstep);
 static int sortNodes();
 static int selectnonstacknode(int numsorted, int* indegree);
+static void levelNodes(void);
+static int orderNodes(int reset);
+static unsigned int flowdirhash(void);
+static int findOrder(unsigned int hash);
+static void saveOrder(unsigned int hash);
+static void freeOrder(SnodeOrder* order);
+static int repairOrder(void);
+static int promoteNodes(int u, int v, int* budget);
+static int comparePos(const void* a, const void* b);
 static void findstoredmass(double* mass);
+static double findreactedmass(int m);
+static void checkMassBalance(void);
+static void resetProfile(void);
+static void startPhase(double t[2]);
+static void stopPhase(int phase, double t[2]);
+static double samplePeakSegs(void);
 
 //=============================================================================
 
@@ -132,6 +184,8 @@ int  MSXqual_open()
     MSX.NewSeg = NULL;
     MSX.FlowDir = NULL;
     MSX.MassIn = NULL;
+    MSX.SegArena = NULL;
+    MSX.SpareArena = NULL;
 
 
     // --- open the chemistry system
@@ -139,10 +193,25 @@ int  MSXqual_open()
     errcode = MSXchem_open();
     if (errcode > 0) return errcode;
 
-    // --- allocate a memory pool for pipe segments
+    // --- allocate memory arenas for pipe segments
+
+    MSX.SegArena = MSXarena_create();
+    if (MSX.SegArena == NULL) return ERR_MEMORY;
+    MSX.SpareArena = MSXarena_create();
+    if (MSX.SpareArena == NULL) return ERR_MEMORY;
+    n = sizeof(struct Sseg) + 2*(MSX.Nobjects[SPECIES]+1)*sizeof(SEGREAL);
+    MSX.SegClass = MSXarena_addClass(MSX.SegArena, n);
+    MSXarena_addClass(MSX.SpareArena, n);
+
+// --- allocate room for the time each thread spends on the run's work
 
-    MSX.QualPool = AllocInit();
-    if (MSX.QualPool == NULL) return ERR_MEMORY;
+    n = 1;
+#ifdef _OPENMP
+    n = omp_get_max_threads();
+#endif
+    MSX.Profile.nthreads = n;
+    MSX.Profile.threadReact = (double *) calloc(n, sizeof(double));
+    MSX.Profile.threadMix = (double *) calloc(n, sizeof(double));
 
 // --- allocate memory used for species concentrations
 
@@ -154,6 +223,8 @@ int  MSXqual_open()
     MSX.MassBalance.reacted = (double*)calloc(MSX.Nobjects[SPECIES] + 1, sizeof(double));
     MSX.MassBalance.final   = (double*)calloc(MSX.Nobjects[SPECIES] + 1, sizeof(double));
     MSX.MassBalance.ratio   = (double*)calloc(MSX.Nobjects[SPECIES] + 1, sizeof(double));
+    MSX.MassBalance.imbalance = (double*)calloc(MSX.Nobjects[SPECIES] + 1, sizeof(double));
+    MSX.MassBalance.imbalanceTime = (long*)calloc(MSX.Nobjects[SPECIES] + 1, sizeof(long));
 // --- allocate memory used for pointers to the first, last,
 //     and new WQ segments in each link and tank
 
@@ -176,6 +247,22 @@ int  MSXqual_open()
 
     // Allocate memory for topologically sorted nodes
     MSX.SortedNodes = (int*)calloc(n, sizeof(int));
+    MSX.LevelNodes = (int*)calloc(n, sizeof(int));
+    MSX.LevelStart = (int*)calloc(n + 1, sizeof(int));
+    MSX.Nlevels = 0;
+    MSX.NodeMass = NULL;
+
+    // Allocate scratch space used to sort nodes and a cache of
+    // orderings for recurring flow directions
+    MSX.SortPos = (int*)calloc(n, sizeof(int));
+    MSX.SortWork = (int*)calloc(3 * n, sizeof(int));
+    MSX.SortMark = (char*)calloc(n, sizeof(char));
+    MSX.LinkMark = (char*)calloc(MSX.Nobjects[LINK] + 1, sizeof(char));
+    MSX.ChangedLinks = (int*)calloc(MSX.Nobjects[LINK] + 1, sizeof(int));
+    MSX.Nchanged = 0;
+    MSX.SortAcyclic = FALSE;
+    MSX.OrderCache = (SnodeOrder*)calloc(ORDERCACHESIZE, sizeof(SnodeOrder));
+    MSX.OrderClock = 0;
 
 // --- check for successful memory allocation
 
@@ -187,12 +274,24 @@ int  MSXqual_open()
     CALL(errcode, MEMCHECK(MSX.MassIn));
     CALL(errcode, MEMCHECK(MSX.SourceIn));
     CALL(errcode, MEMCHECK(MSX.SortedNodes));
+    CALL(errcode, MEMCHECK(MSX.LevelNodes));
+    CALL(errcode, MEMCHECK(MSX.LevelStart));
+    CALL(errcode, MEMCHECK(MSX.SortPos));
+    CALL(errcode, MEMCHECK(MSX.SortWork));
+    CALL(errcode, MEMCHECK(MSX.SortMark));
+    CALL(errcode, MEMCHECK(MSX.LinkMark));
+    CALL(errcode, MEMCHECK(MSX.ChangedLinks));
+    CALL(errcode, MEMCHECK(MSX.OrderCache));
+    CALL(errcode, MEMCHECK(MSX.Profile.threadReact));
+    CALL(errcode, MEMCHECK(MSX.Profile.threadMix));
     CALL(errcode, MEMCHECK(MSX.MassBalance.initial));
     CALL(errcode, MEMCHECK(MSX.MassBalance.inflow));
     CALL(errcode, MEMCHECK(MSX.MassBalance.outflow));
     CALL(errcode, MEMCHECK(MSX.MassBalance.reacted));
     CALL(errcode, MEMCHECK(MSX.MassBalance.final));
     CALL(errcode, MEMCHECK(MSX.MassBalance.ratio));
+    CALL(errcode, MEMCHECK(MSX.MassBalance.imbalance));
+    CALL(errcode, MEMCHECK(MSX.MassBalance.imbalanceTime));
 
 // --- check if wall species are present
 
@@ -273,21 +372,26 @@ int  MSXqual_init()
     if ( n > 0 ) MSX.Rptflag = 1;
     if ( MSX.Rptflag ) MSX.Saveflag = 1;
 
-// --- reset memory pool
+// --- free all segments, forget the node orderings of any earlier run
+//     and clear the counts of the run's work
 
-    AllocSetPool(MSX.QualPool);
-    MSX.FreeSeg = NULL;
-    AllocReset();
+    MSXarena_reset(MSX.SegArena);
+    for (i = 0; i < ORDERCACHESIZE; i++) freeOrder(&MSX.OrderCache[i]);
+    MSX.OrderClock = 0;
+    resetProfile();
 
-// --- re-position hydraulics file
+// --- re-position hydraulics file at its first period
 
-    fseek(MSX.HydFile.file, MSX.HydOffset, SEEK_SET);
+    CALL(errcode, MSXhyd_seek(0));
 
 // --- set elapsed times to zero
 
     MSX.Htime = 0;                         //Hydraulic solution time
     MSX.Qtime = 0;                         //Quality routing time
     MSX.Rtime = MSX.Rstart;                //Reporting time
+    MSX.ReactBlock = 0;                    //Current reaction step
+    MSX.ReactLeft = 0;                     //Transport left in reaction step
+    MSX.Rfirst = MSX.Rstart;               //First time saved to output file
     MSX.Nperiods = 0;                      //Number fo reporting periods
 
     for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
@@ -298,10 +402,57 @@ int  MSXqual_init()
         MSX.MassBalance.outflow[m] = 0.0;
         MSX.MassBalance.reacted[m] = 0.0;
         MSX.MassBalance.ratio[m] = 0.0;
+        MSX.MassBalance.imbalance[m] = 0.0;
+        MSX.MassBalance.imbalanceTime[m] = 0;
     }
 // --- open binary output file if results are to be saved
 
-    if ( MSX.Saveflag ) errcode = MSXout_open();
+    if ( !errcode && MSX.Saveflag ) errcode = MSXout_open();
+    return errcode;
+}
+
+//=============================================================================
+
+int  MSXqual_restore(char *fname)
+/*
+**  Purpose:
+**     replaces the state of a newly initialized WQ routing system with
+**     one saved to a checkpoint file.
+**
+**  Input:
+**    fname = name of the checkpoint file.
+**
+**  Returns:
+**    an error code (or 0 if no errors).
+**
+**  Note: the hydraulics in effect at the checkpoint's time are read
+**        again and must end at the same time as they did when it was
+**        saved. The nodes keep the order they were mixed in when it was
+**        saved, since nodes joined by links with negligible flow can be
+**        mixed in more than one order. Results saved to the output file
+**        begin at its next reporting time. If the state can't be
+**        restored the system is initialized again.
+*/
+{
+    long htime = 0;
+    int  errcode = 0;
+
+// --- free all segments and read the checkpoint in their place
+
+    MSXarena_reset(MSX.SegArena);
+    CALL(errcode, MSXsnap_readState(fname, &htime));
+    MSX.Rfirst = MSX.Rtime;
+    MSX.Htime = MSX.Qtime;
+
+// --- retrieve the hydraulic period in effect
+
+    if ( !errcode && htime > MSX.Qtime )
+    {
+        CALL(errcode, MSXhyd_seek(MSX.Qtime));
+        CALL(errcode, getHydVars());
+        if ( !errcode && MSX.Htime != htime ) errcode = ERR_CHECKPOINT;
+    }
+    if ( errcode ) MSXqual_init();
     return errcode;
 }
 
@@ -328,13 +479,11 @@ int MSXqual_step(long *t, long *tleft)
 */
 {
     long dt, hstep, tstep;
-    int  k, errcode = 0, flowchanged;
-    int m;
-    double smassin, smassout, sreacted;
-// --- set the shared memory pool to the water quality pool
-//     and the overall time step to nominal WQ time step
+    int  errcode = 0, flowchanged;
+    double tstep0[2], tphase[2];
+// --- set the overall time step to nominal WQ time step
 
-    AllocSetPool(MSX.QualPool);
+    startPhase(tstep0);
     tstep = MSX.Qstep;
 
 // --- repeat until the end of the time step
@@ -360,7 +509,9 @@ int MSXqual_step(long *t, long *tleft)
         // --- retrieve new hydraulic solution
             if (MSX.Qtime == MSX.Htime)
             {
+                startPhase(tphase);
                 CALL(errcode, getHydVars());
+                stopPhase(HYDRAULICS_PHASE, tphase);
                 if (MSX.Qtime < MSX.Dur)
                 {
                     // --- initialize pipe segments (at time 0) or else re-orient segments
@@ -375,15 +526,22 @@ int MSXqual_step(long *t, long *tleft)
 
                     if (flowchanged)
                     {
-                        CALL(errcode, sortNodes());
+                        startPhase(tphase);
+                        CALL(errcode, orderNodes(MSX.Qtime == 0));
+                        stopPhase(SORT_PHASE, tphase);
                     }
+
+                    // --- lay out each pipe's segments contiguously again
+                    if (MSX.Qtime > 0) CALL(errcode, packSegs());
                 }
             }
 
         // --- report results if its time to do so
             if (MSX.Saveflag && MSX.Qtime == MSX.Rtime)
             {
+                startPhase(tphase);
                 CALL(errcode, MSXout_saveResults());
+                stopPhase(OUTPUT_PHASE, tphase);
                 MSX.Rtime += MSX.Rstep;
                 MSX.Nperiods++;
             }
@@ -408,59 +566,19 @@ int MSXqual_step(long *t, long *tleft)
     *t = MSX.Qtime;
     *tleft = MSX.Dur - MSX.Qtime;
 
+// --- update the mass balance on each whole hour and at the end of the
+//     run (or check it after every step if asked to)
+
+    if ( MSX.MassCheck ) checkMassBalance();
+    if ( *t % 3600 == 0 || *tleft <= 0 ) MSXqual_updateMassBalance();
+
 // --- if there's no time remaining, then save the final records to output file
 
-    findstoredmass(MSX.MassBalance.final);
-    if (*t % 3600 == 0)
-    {
-        for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
-        {
-            sreacted = 0.0;
-            for (k = 1; k <= MSX.Nobjects[LINK]; k++)
-                sreacted += MSX.Link[k].reacted[m];
-            for (k = 1; k <= MSX.Nobjects[TANK]; k++)
-                sreacted += MSX.Tank[k].reacted[m];
-
-            MSX.MassBalance.reacted[m] = sreacted;
-            smassin = MSX.MassBalance.initial[m] + MSX.MassBalance.inflow[m];
-            smassout = MSX.MassBalance.outflow[m] + MSX.MassBalance.final[m];
-            if (sreacted < 0)  //loss
-                smassout -= sreacted;
-            else
-                smassin += sreacted;
-            if (smassin == 0)
-                MSX.MassBalance.ratio[m] = 1.0;
-            else
-                MSX.MassBalance.ratio[m] = smassout / smassin;
-        }
-    }
     if ( *tleft <= 0 && MSX.Saveflag )
     {   
-        for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
-        {
-            sreacted = 0.0;
-            for (k = 1; k <= MSX.Nobjects[LINK]; k++)
-                sreacted += MSX.Link[k].reacted[m];
-            for (k = 1; k <= MSX.Nobjects[TANK]; k++)
-                sreacted += MSX.Tank[k].reacted[m];
-
-            MSX.MassBalance.reacted[m] = sreacted;
-            smassin = MSX.MassBalance.initial[m] + MSX.MassBalance.inflow[m];
-            smassout = MSX.MassBalance.outflow[m]+MSX.MassBalance.final[m];
-            if (sreacted < 0)  //loss
-                smassout -= sreacted;
-            else
-                smassin += sreacted;
-            if (smassin == 0)
-                MSX.MassBalance.ratio[m] = 1.0;
-            else
-                MSX.MassBalance.ratio[m] = smassout / smassin;
-
-        //    printf("SPECIES %s: %f %f %f\n", MSX.Species[m].id, smassout, smassin, MSX.MassBalance.ratio[m]);
-
-        }
         CALL(errcode, MSXout_saveFinalResults());
     }
+    stopPhase(TOTAL_PHASE, tstep0);
     return errcode;
 }
 
@@ -535,6 +653,44 @@ double  MSXqual_getLinkQual(int k, int m)
 
 //=============================================================================
 
+void  MSXqual_getLinkQuals(int k, int m1, int m2, double x[], int stride)
+/*
+**   Purpose:
+**     computes average quality in link k of a range of species with a
+**     single pass through the link's segments.
+**
+**   Input:
+**     k = link index
+**     m1, m2 = first and last species index
+**     stride = distance in x between the results of successive species.
+**
+**   Output:
+**     x = average quality of species m placed at x[(m-m1)*stride].
+*/
+{
+    int     m;
+    double  vsum = 0.0;
+    Pseg    seg;
+
+    for (m = m1; m <= m2; m++) x[(m-m1)*stride] = 0.0;
+    seg = MSX.FirstSeg[k];
+    while (seg != NULL)
+    {
+        vsum += seg->v;
+        for (m = m1; m <= m2; m++)
+            x[(m-m1)*stride] += (seg->c[m])*(seg->v);
+        seg = seg->prev;
+    }
+    for (m = m1; m <= m2; m++)
+    {
+        if (vsum > 0.0) x[(m-m1)*stride] /= vsum;
+        else x[(m-m1)*stride] = (MSXqual_getNodeQual(MSX.Link[k].n1, m) +
+                                 MSXqual_getNodeQual(MSX.Link[k].n2, m)) / 2.0;
+    }
+}
+
+//=============================================================================
+
 int MSXqual_close()
 /*
 **   Purpose:
@@ -547,7 +703,7 @@ int MSXqual_close()
 **     error code (0 if no error).
 */
 {
-    int errcode = 0;
+    int i, errcode = 0;
     if (!MSX.ProjectOpened) return 0;
     MSXchem_close();
 
@@ -557,19 +713,36 @@ int MSXqual_close()
     FREE(MSX.NewSeg);
     FREE(MSX.FlowDir);
     FREE(MSX.SortedNodes);
-    FREE(MSX.MassIn);
-    FREE(MSX.SourceIn);
-    if ( MSX.QualPool)
+    FREE(MSX.LevelNodes);
+    FREE(MSX.LevelStart);
+    FREE(MSX.NodeMass);
+    FREE(MSX.SortPos);
+    FREE(MSX.SortWork);
+    FREE(MSX.SortMark);
+    FREE(MSX.LinkMark);
+    FREE(MSX.ChangedLinks);
+    if (MSX.OrderCache)
     {
-        AllocSetPool(MSX.QualPool);
-        AllocFreePool();
+        for (i = 0; i < ORDERCACHESIZE; i++) freeOrder(&MSX.OrderCache[i]);
     }
+    FREE(MSX.OrderCache);
+    FREE(MSX.MassIn);
+    FREE(MSX.SourceIn);
+    MSXarena_delete(MSX.SegArena);
+    MSXarena_delete(MSX.SpareArena);
+    MSX.SegArena = NULL;
+    MSX.SpareArena = NULL;
+    FREE(MSX.Profile.threadReact);
+    FREE(MSX.Profile.threadMix);
+    MSX.Profile.nthreads = 0;
     FREE(MSX.MassBalance.initial);
     FREE(MSX.MassBalance.inflow);
     FREE(MSX.MassBalance.outflow);
     FREE(MSX.MassBalance.reacted);
     FREE(MSX.MassBalance.final);
     FREE(MSX.MassBalance.ratio);
+    FREE(MSX.MassBalance.imbalance);
+    FREE(MSX.MassBalance.imbalanceTime);
 
     MSX.QualityOpened = FALSE;
     return errcode;
@@ -577,7 +750,7 @@ int MSXqual_close()
 
 //=============================================================================
 
-int  MSXqual_isSame(double c1[], double c2[])
+int  MSXqual_isSame(SEGREAL c1[], double c2[])
 /*
 **   Purpose:
 **     checks if two sets of concentrations are the same
@@ -622,31 +795,12 @@ int  getHydVars()
 {
     int  errcode = 0;
     long hydtime, hydstep;
-    INT4 n;
-
-// --- read hydraulic time, demands, heads, and flows from the file
-
-    if (fread(&n, sizeof(INT4), 1, MSX.HydFile.file) < 1)
-        return ERR_READ_HYD_FILE;
-    hydtime = (long)n;
-    n = MSX.Nobjects[NODE];
-    if (fread(MSX.D+1, sizeof(REAL4), n, MSX.HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
-    if (fread(MSX.H+1, sizeof(REAL4), n, MSX.HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
-    n = MSX.Nobjects[LINK];
-    if (fread(MSX.Q+1, sizeof(REAL4), n, MSX.HydFile.file) < (unsigned)n)
-        return ERR_READ_HYD_FILE;
-
-// --- skip over link status and settings
 
-    fseek(MSX.HydFile.file, 2*n*sizeof(REAL4), SEEK_CUR);
+// --- read hydraulic time, demands, heads, flows, and the time step
+//     until the next hydraulic event from the hydraulics file
 
-// --- read time step until next hydraulic event
-
-    if (fread(&n, sizeof(INT4), 1, MSX.HydFile.file) < 1)
-        return ERR_READ_HYD_FILE;
-    hydstep = (long)n;
+    errcode = MSXhyd_read(&hydtime, &hydstep);
+    if ( errcode ) return errcode;
 
 // --- update elapsed time until next hydraulic event
 
@@ -680,10 +834,27 @@ int  transport(long tstep)
 **
 **  Returns:
 **    an error code or 0 if no error.
+**
+**  Note: when the REACTSTEP option is longer than the quality time step
+**        it is rounded up to a whole number of quality steps, and the
+**        reactions are split around the transport steps that a reaction
+**        step spans: half of them are applied before the first transport
+**        step and the rest after the last. A reaction step never runs
+**        past the next hydraulic event or the end of the simulation, so
+**        reported results are always fully reacted. The integrators
+**        choose their own steps within it under the ATOL and RTOL limits
+**        (except EUL, which takes it as a single step).
 */
 {
-    long qtime, dt;
+    long qtime, dt, rstep, now, left;
     int  errcode = 0;
+    double t[2];
+
+// --- find the reaction time step (a whole number of quality steps)
+
+    rstep = MSX.Qstep;
+    if ( MSX.ReactStep > MSX.Qstep )
+        rstep = (MSX.ReactStep + MSX.Qstep - 1) / MSX.Qstep * MSX.Qstep;
 
 // --- repeat until time step is exhausted
 
@@ -694,12 +865,45 @@ int  transport(long tstep)
            qtime < tstep)
     {                                       // Qstep is nominal quality time step
         dt = MIN(MSX.Qstep, tstep-qtime);   // get actual time step
+        now = MSX.Qtime + qtime;            // time at start of step
         qtime += dt;                        // update amount of input tstep taken
-        errcode = MSXchem_react(dt);        // react species in each pipe & tank
+        wakeSegs(MSX.Qtime + qtime);        // bring dormant segments up to date?
+        startPhase(t);
+        if ( rstep == MSX.Qstep )
+            errcode = MSXchem_react(dt);    // react species in each pipe & tank
+        else if ( MSX.ReactLeft <= 0 )
+        {                                   // start a new reaction step
+            left = MSX.Htime - now;
+            if ( MSX.Dur > now ) left = MIN(left, MSX.Dur - now);
+            MSX.ReactBlock = MAX(dt, MIN(rstep, left));
+            MSX.ReactLeft = MSX.ReactBlock;
+            errcode = MSXchem_react(MSX.ReactBlock / 2);
+        }
+        stopPhase(REACT_PHASE, t);
         if ( errcode ) return errcode;
+        startPhase(t);
         advectSegs(dt);                     // advect segments in each pipe
+        stopPhase(ADVECT_PHASE, t);
         
+        startPhase(t);
         topological_transport(dt);          //replace accumulate, updateNodes, sourceInput and release
+        stopPhase(TRANSPORT_PHASE, t);
+
+        if ( rstep > MSX.Qstep )            // finish a reaction step
+        {
+            MSX.ReactLeft -= dt;
+            if ( MSX.ReactLeft <= 0 )
+            {
+                startPhase(t);
+                errcode = MSXchem_react(MSX.ReactBlock - MSX.ReactBlock/2);
+                stopPhase(REACT_PHASE, t);
+                if ( errcode ) return errcode;
+            }
+        }
+        if (MSX.MaxSegs > 0) coarsenSegs(); // keep pipes within segment limit
+        MSX.Profile.segSteps +=             // record the segments in use
+            samplePeakSegs();
+        MSX.Profile.qualSteps++;
 
 		if (MSXerr_mathError())             // check for any math error        //1.1.00
 		{
@@ -724,14 +928,17 @@ void  initSegs()
 {
     int     j, k, m;
     double  v;
+    char    *dir = MSXhyd_getFlowDir();
 
 // --- examine each link
 
     for (k=1; k<=MSX.Nobjects[LINK]; k++)
     {
-    // --- establish flow direction
+    // --- establish flow direction (shared hydraulics supply it)
 
-        if (fabs(MSX.Q[k]) < Q_STAGNANT)
+        if (dir)
+            MSX.FlowDir[k] = (FlowDirection)dir[k];
+        else if (fabs(MSX.Q[k]) < Q_STAGNANT)
             MSX.FlowDir[k] = ZERO_FLOW;
         else if (MSX.Q[k] > 0.0)
             MSX.FlowDir[k] = POSITIVE;
@@ -819,16 +1026,19 @@ int  flowdirchanged()
 {
     int    k, flowchanged=0;
     FlowDirection  newdir;
+    char   *dir = MSXhyd_getFlowDir();
  
 
 // --- examine each link
 
+    MSX.Nchanged = 0;
     for (k=1; k<=MSX.Nobjects[LINK]; k++)
     {
-    // --- find new flow direction
+    // --- find new flow direction (shared hydraulics supply it)
 
         newdir = POSITIVE;
-        if (fabs(MSX.Q[k]) < Q_STAGNANT) 
+        if (dir) newdir = (FlowDirection)dir[k];
+        else if (fabs(MSX.Q[k]) < Q_STAGNANT) 
             newdir = ZERO_FLOW;
         else if (MSX.Q[k] < 0.0) newdir = NEGATIVE;
 
@@ -838,10 +1048,12 @@ int  flowdirchanged()
         if (newdir*MSX.FlowDir[k] < 0)
         {
             MSXqual_reversesegs(k);
+            MSX.Profile.reversals++;
         }
         if (newdir != MSX.FlowDir[k])
         {
             flowchanged = 1;            
+            MSX.ChangedLinks[MSX.Nchanged++] = k;
         }
         MSX.FlowDir[k] = newdir;
     }
@@ -1051,7 +1263,7 @@ void shiftSegWallQual(int k, long dt)
 
 //=============================================================================
 
-void sourceInput(int n, double volout, long dt)
+void sourceInput(int n, double volout, long dt, double* nodemass)
 /*
 **  Purpose:
 **    computes contribution (if any) of mass additions from WQ
@@ -1094,9 +1306,9 @@ void sourceInput(int n, double volout, long dt)
     // --- compute a new chemical equilibrium at the source node
     MSXchem_equil(NODE, MSX.Node[n].c);
  
-    for (m = 1; m <= MSX.Nobjects[m]; m++)
+    for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
     {
-        MSX.MassBalance.inflow[m] += MSX.SourceIn[m] * LperFT3;
+        addmassflow(nodemass, SOURCE_IN, m, MSX.SourceIn[m] * LperFT3);
     }
 }
 
@@ -1237,71 +1449,260 @@ void  removeAllSegs(int k)
 }
 
 void topological_transport(long dt)
+/*
+**--------------------------------------------------------------
+**   Input:   dt = current WQ time step (sec)
+**   Output:  none
+**   Purpose: mixes the flow entering each node in topological
+**            order and releases it into the node's outflow links.
+**   Note:    large networks are mixed one level of sorted nodes
+**            at a time, with the nodes of a level shared among
+**            threads (see level_transport).
+**--------------------------------------------------------------
+*/
 {
-    int j, n, k, m;
-    double volin, volout; 
-    Padjlist  alink;
+    int j;
+    double busy = 0.0;
 
+#ifdef _OPENMP
+    if (omp_get_max_threads() > 1 && MSX.Nlevels > 0 &&
+        MSX.Nobjects[NODE] >= MINLEVELSIZE * MSX.Nlevels)
+    {
+        level_transport(dt);
+        return;
+    }
+#endif
 
     // Analyze each node in topological order
     for (j = 1; j <= MSX.Nobjects[NODE]; j++)
     {
-        // ... index of node to be processed
-        n = MSX.SortedNodes[j];
+        timedMixnode(MSX.SortedNodes[j], dt, MSX.MassIn, NULL, &busy);
+    }
+    if (MSX.Profiling) MSXqual_addThreadTime(MSX.Profile.threadMix, busy);
+}
+
+
+#ifdef _OPENMP
+void level_transport(long dt)
+/*
+**--------------------------------------------------------------
+**   Input:   dt = current WQ time step (sec)
+**   Output:  none
+**   Purpose: mixes the flow entering each node one level of
+**            sorted nodes at a time, sharing the nodes of each
+**            level among threads.
+**   Note:    no two nodes of a level share a link, so they can
+**            be mixed at the same time. Tanks and nodes with
+**            sources are mixed by a single thread since they use
+**            shared work arrays and source patterns. Each node's
+**            mass balance terms are saved and added up afterwards
+**            in sorted order, so results match those of a serial
+**            run exactly.
+**--------------------------------------------------------------
+*/
+{
+    int     i, j, m, n, lev, first, last;
+    int     ns = MSX.Nobjects[SPECIES];
+    int     size = MAX_NODE_MASS * (ns + 1);
+    double  *massin = NULL, *nodemass;
+
+    // Allocate room for each node's mass balance terms and for
+    // each thread's mass inflow
+    if (MSX.NodeMass == NULL)
+    {
+        MSX.NodeMass = (double*)calloc((MSX.Nobjects[NODE] + 1) * size,
+                                       sizeof(double));
+    }
+    massin = (double*)calloc(omp_get_max_threads() * (ns + 1), sizeof(double));
+    if (MSX.NodeMass == NULL || massin == NULL)
+    {
+        FREE(massin);
+        for (j = 1; j <= MSX.Nobjects[NODE]; j++)
+            mixnode(MSX.SortedNodes[j], dt, MSX.MassIn, NULL);
+        return;
+    }
 
-        // ... zero out mass & flow volumes for this node
-        volin = 0.0;
-        volout = 0.0;
-        memset(MSX.MassIn, 0, (MSX.Nobjects[SPECIES] + 1) * sizeof(double));
-        memset(MSX.SourceIn, 0, (MSX.Nobjects[SPECIES] + 1) * sizeof(double));
+#pragma omp parallel private(i, n, lev, first, last) copyin(MSXcurrent)
+    {
+    double* threadmassin = massin + omp_get_thread_num() * (ns + 1);
+    double  busy = 0.0;                // time this thread spends mixing
 
-        // ... examine each link with flow into the node
-        for (alink = MSX.Adjlist[n]; alink != NULL; alink = alink->next)
+    for (lev = 1; lev <= MSX.Nlevels; lev++)
+    {
+        first = MSX.LevelStart[lev];
+        last = MSX.LevelStart[lev + 1] - 1;
+
+        // ... mix the level's junctions without sources in parallel
+        if (last - first + 1 >= MINLEVELSIZE)
         {
-            // ... k is index of next link incident on node n
-            k = alink->link;
+#pragma omp for schedule(static)
+            for (i = first; i <= last; i++)
+            {
+                n = MSX.LevelNodes[i];
+                if (MSX.Node[n].tank > 0 || MSX.Node[n].sources) continue;
+                timedMixnode(n, dt, threadmassin, MSX.NodeMass + n * size, &busy);
+            }
+#pragma omp single
+            for (i = first; i <= last; i++)
+            {
+                n = MSX.LevelNodes[i];
+                if (MSX.Node[n].tank > 0 || MSX.Node[n].sources)
+                    timedMixnode(n, dt, threadmassin, MSX.NodeMass + n * size, &busy);
+            }
+        }
 
-            // ... link has flow into node - add it to node's inflow
-            //     (m is index of link's downstream node)
-            m = MSX.Link[k].n2;
-            if (MSX.FlowDir[k] < 0) m = MSX.Link[k].n1;
-            if (m == n)
+        // ... mix all nodes of a small level on one thread
+        else
+        {
+#pragma omp single
+            for (i = first; i <= last; i++)
             {
-                evalnodeinflow(k, dt, &volin, MSX.MassIn);
+                n = MSX.LevelNodes[i];
+                timedMixnode(n, dt, threadmassin, MSX.NodeMass + n * size, &busy);
             }
+        }
+    }
+    if (MSX.Profiling) MSXqual_addThreadTime(MSX.Profile.threadMix, busy);
+    }
+    FREE(massin);
 
-            // ... link has flow out of node - add it to node's outflow
-            else volout += fabs(MSX.Q[k]);
+    // Add each node's mass balance terms in sorted order
+    for (j = 1; j <= MSX.Nobjects[NODE]; j++)
+    {
+        nodemass = MSX.NodeMass + MSX.SortedNodes[j] * size;
+        for (m = 1; m <= ns; m++)
+        {
+            MSX.MassBalance.inflow[m] += nodemass[RESERVOIR_IN * (ns + 1) + m];
+            MSX.MassBalance.inflow[m] += nodemass[SOURCE_IN * (ns + 1) + m];
+            MSX.MassBalance.outflow[m] += nodemass[NODE_OUT * (ns + 1) + m];
         }
+    }
+}
+#endif
+
+
+void timedMixnode(int n, long dt, double* massin, double* nodemass,
+                  double* busy)
+/*
+**--------------------------------------------------------------
+**   Input:   n = node index
+**            dt = current WQ time step (sec)
+**            massin = work array for the node's mass inflow
+**            nodemass = array that receives the node's mass
+**                       balance terms
+**            busy = time the calling thread has spent mixing
+**   Output:  busy = updated time spent mixing (when profiling)
+**   Purpose: mixes the flow entering a node, timing it if the
+**            run is being profiled.
+**--------------------------------------------------------------
+*/
+{
+    double t0;
+
+    if (!MSX.Profiling)
+    {
+        mixnode(n, dt, massin, nodemass);
+        return;
+    }
+    t0 = MSXutils_wallClock();
+    mixnode(n, dt, massin, nodemass);
+    *busy += MSXutils_wallClock() - t0;
+}
+
+
+void mixnode(int n, long dt, double* massin, double* nodemass)
+/*
+**--------------------------------------------------------------
+**   Input:   n = node index
+**            dt = current WQ time step (sec)
+**            massin = work array for the node's mass inflow
+**            nodemass = array that receives the node's mass
+**                       balance terms (or NULL to add them to
+**                       the system's mass balance)
+**   Output:  none
+**   Purpose: mixes the flow entering a node and releases it into
+**            the node's outflow links.
+**--------------------------------------------------------------
+*/
+{
+    int k, m;
+    double volin, volout;
+    Padjlist  alink;
 
-        // ... if node is a junction, add on any external outflow (e.g., demands)
-        if (MSX.Node[n].tank == 0)
+    // ... zero out mass & flow volumes for this node
+    volin = 0.0;
+    volout = 0.0;
+    memset(massin, 0, (MSX.Nobjects[SPECIES] + 1) * sizeof(double));
+    if (nodemass)
+    {
+        memset(nodemass, 0,
+               MAX_NODE_MASS * (MSX.Nobjects[SPECIES] + 1) * sizeof(double));
+    }
+
+    // ... examine each link with flow into the node
+    for (alink = MSX.Adjlist[n]; alink != NULL; alink = alink->next)
+    {
+        // ... k is index of next link incident on node n
+        k = alink->link;
+
+        // ... link has flow into node - add it to node's inflow
+        //     (m is index of link's downstream node)
+        m = MSX.Link[k].n2;
+        if (MSX.FlowDir[k] < 0) m = MSX.Link[k].n1;
+        if (m == n)
         {
-            volout += fmax(0.0, MSX.D[n]);
+            evalnodeinflow(k, dt, &volin, massin);
         }
 
-        // ... convert from outflow rate to volume
-        volout *= dt;
+        // ... link has flow out of node - add it to node's outflow
+        else volout += fabs(MSX.Q[k]);
+    }
+
+    // ... if node is a junction, add on any external outflow (e.g., demands)
+    if (MSX.Node[n].tank == 0)
+    {
+        volout += fmax(0.0, MSX.D[n]);
+    }
+
+    // ... convert from outflow rate to volume
+    volout *= dt;
 
-        // ... find the concentration of flow leaving the node
-        findnodequal(n, volin, MSX.MassIn, volout, dt);
+    // ... find the concentration of flow leaving the node
+    findnodequal(n, volin, massin, volout, dt, nodemass);
 
-        // ... examine each link with flow out of the node
-        for (alink = MSX.Adjlist[n]; alink != NULL; alink = alink->next)
+    // ... examine each link with flow out of the node
+    for (alink = MSX.Adjlist[n]; alink != NULL; alink = alink->next)
+    {
+        // ... link k incident on node n has upstream node m equal to n
+        k = alink->link;
+        m = MSX.Link[k].n1;
+        if (MSX.FlowDir[k] < 0) m = MSX.Link[k].n2;
+        if (m == n)
         {
-            // ... link k incident on node n has upstream node m equal to n
-            k = alink->link;
-            m = MSX.Link[k].n1;
-            if (MSX.FlowDir[k] < 0) m = MSX.Link[k].n2;
-            if (m == n)
-            {
-                // ... send flow at new node concen. into link
-                evalnodeoutflow(k, MSX.Node[n].c, dt);
-            }
+            // ... send flow at new node concen. into link
+            evalnodeoutflow(k, MSX.Node[n].c, dt);
         }
-        
     }
+}
 
+
+void addmassflow(double* nodemass, int type, int m, double mass)
+/*
+**--------------------------------------------------------------
+**   Input:   nodemass = mass balance terms of a node (or NULL)
+**            type = type of mass balance term
+**            m = species index
+**            mass = mass of species m
+**   Output:  none
+**   Purpose: adds mass flowing into or out of the network to the
+**            system's mass balance, or saves it as one of a
+**            node's mass balance terms.
+**--------------------------------------------------------------
+*/
+{
+    if (nodemass) nodemass[type * (MSX.Nobjects[SPECIES] + 1) + m] += mass;
+    else if (type == NODE_OUT) MSX.MassBalance.outflow[m] += mass;
+    else MSX.MassBalance.inflow[m] += mass;
 }
 
 
@@ -1349,6 +1750,7 @@ void evalnodeoutflow(int k, double * upnodequal, long tstep)
                 if (MSX.Species[m].type == BULK)
                    seg->c[m] = (seg->c[m]*seg->v+upnodequal[m]*v)/(seg->v+v);
             }
+            seg->idle = seg->idle*seg->v/(seg->v+v);   // new water has none
             seg->v += v;
 
             MSXqual_removeSeg(MSX.NewSeg[k]);
@@ -1423,8 +1825,7 @@ void  evalnodeinflow(int k, long tstep, double* volin, double* massin)
             if (MSX.FirstSeg[k] == NULL) MSX.LastSeg[k] = NULL;
 
             // ... recycle the used up segment
-            seg->prev = MSX.FreeSeg;
-            MSX.FreeSeg = seg;
+            MSXqual_removeSeg(seg);
         }
 
         // ... otherwise just reduce this segment's volume
@@ -1433,7 +1834,8 @@ void  evalnodeinflow(int k, long tstep, double* volin, double* massin)
 }
 
 
-void findnodequal(int n, double volin, double* massin, double volout, long tstep)
+void findnodequal(int n, double volin, double* massin, double volout, long tstep,
+                  double* nodemass)
     /*
     **--------------------------------------------------------------
     **   Input:   n = node index
@@ -1441,6 +1843,8 @@ void findnodequal(int n, double volin, double* massin, double volout, long tstep
     **            massin = mass entering node
     **            volout = flow volume leaving node
     **            tstep = length of current time step
+    **            nodemass = array that receives the node's mass
+    **                       balance terms (or NULL)
     **   Output:  returns water quality in a node's outflow
     **   Purpose: computes a node's new quality from its inflow
     **            volume and mass, including any source contribution.
@@ -1483,8 +1887,9 @@ void findnodequal(int n, double volin, double* massin, double volout, long tstep
             for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
             {
                
-                MSX.MassBalance.inflow[m] += MSX.Node[n].c[m] * volout * LperFT3;
-                MSX.MassBalance.outflow[m] += massin[m];
+                addmassflow(nodemass, RESERVOIR_IN, m,
+                            MSX.Node[n].c[m] * volout * LperFT3);
+                addmassflow(nodemass, NODE_OUT, m, massin[m]);
             }
         }
 
@@ -1521,12 +1926,13 @@ void findnodequal(int n, double volin, double* massin, double volout, long tstep
     }
 
     // Find quality contribued by any external chemical source
-    sourceInput(n, volout, tstep);
+    sourceInput(n, volout, tstep, nodemass);
     if (MSX.Node[n].tank == 0)
     {
         for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
             if(MSX.Species[m].type == BULK)
-                MSX.MassBalance.outflow[m] += MAX(0.0, MSX.D[n]) * tstep * MSX.Node[n].c[m]*LperFT3;
+                addmassflow(nodemass, NODE_OUT, m,
+                            MAX(0.0, MSX.D[n]) * tstep * MSX.Node[n].c[m]*LperFT3);
     }
 }
 
@@ -1544,153 +1950,554 @@ int sortNodes()
 {
 
     int i, j, k, n;
-    int* indegree = NULL;
-    int* stack = NULL;
+    int* indegree = MSX.SortWork;
+    int* stack = MSX.SortWork + MSX.Nobjects[NODE] + 1;
     int stacksize = 0;
     int numsorted = 0;
     int errcode = 0;
     FlowDirection dir;
     Padjlist  alink;
 
-    // Allocate an array to count # links with inflow to each node
-    // and for a stack to hold nodes waiting to be processed
-    indegree = (int*)calloc(MSX.Nobjects[NODE] + 1, sizeof(int));
-    stack = (int*)calloc(MSX.Nobjects[NODE] + 1, sizeof(int));
-    if (indegree && stack)
+    // Use the project's scratch space to count # links with inflow
+    // to each node and for a stack to hold nodes waiting to be processed
+    memset(indegree, 0, (MSX.Nobjects[NODE] + 1) * sizeof(int));
+    MSX.SortAcyclic = TRUE;
+
+    // Count links with "non-negligible" inflow to each node
+    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
     {
-        // Count links with "non-negligible" inflow to each node
-        for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+        dir = MSX.FlowDir[k];
+        if (dir == POSITIVE) n = MSX.Link[k].n2;
+        else if (dir == NEGATIVE) n = MSX.Link[k].n1;
+        else continue;
+        indegree[n]++;
+    }
+
+    // Place nodes with no inflow onto a stack
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+    {
+        if (indegree[i] == 0)
         {
-            dir = MSX.FlowDir[k];
-            if (dir == POSITIVE) n = MSX.Link[k].n2;
-            else if (dir == NEGATIVE) n = MSX.Link[k].n1;
-            else continue;
-            indegree[n]++;
+            stacksize++;
+            stack[stacksize] = i;
         }
+    }
 
-        // Place nodes with no inflow onto a stack
-        for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+    // Examine each node on the stack until none are left
+    while (numsorted < MSX.Nobjects[NODE])
+    {
+        // ... if stack is empty then a cycle exists
+        if (stacksize == 0)
         {
-            if (indegree[i] == 0)
-            {
-                stacksize++;
-                stack[stacksize] = i;
-            }
+            //  ... add a non-sorted node connected to a sorted one to stack
+            j = selectnonstacknode(numsorted, indegree);
+            if (j == 0) break;  // This shouldn't happen.
+            MSX.SortAcyclic = FALSE;
+            indegree[j] = 0;
+            stacksize++;
+            stack[stacksize] = j;
         }
 
-        // Examine each node on the stack until none are left
-        while (numsorted < MSX.Nobjects[NODE])
-        {
-            // ... if stack is empty then a cycle exists
-            if (stacksize == 0)
-            {
-                //  ... add a non-sorted node connected to a sorted one to stack
-                j = selectnonstacknode(numsorted, indegree);
-                if (j == 0) break;  // This shouldn't happen.
-                indegree[j] = 0;
-                stacksize++;
-                stack[stacksize] = j;
-            }
+        // ... make the last node added to the stack the next
+        //     in sorted order & remove it from the stack
+        i = stack[stacksize];
+        stacksize--;
+        numsorted++;
+        MSX.SortedNodes[numsorted] = i;
 
-            // ... make the last node added to the stack the next
-            //     in sorted order & remove it from the stack
-            i = stack[stacksize];
-            stacksize--;
-            numsorted++;
-            MSX.SortedNodes[numsorted] = i;
+        // ... for each outflow link from this node reduce the in-degree
+        //     of its downstream node
+        for (alink = MSX.Adjlist[i]; alink != NULL; alink = alink->next)
+        {
+            // ... k is the index of the next link incident on node i
+            k = alink->link;
 
-            // ... for each outflow link from this node reduce the in-degree
-            //     of its downstream node
-            for (alink = MSX.Adjlist[i]; alink != NULL; alink = alink->next)
-            {
-                // ... k is the index of the next link incident on node i
-                k = alink->link;
+            // ... skip link if flow is negligible
+            if (MSX.FlowDir[k] == 0) continue;
 
-                // ... skip link if flow is negligible
-                if (MSX.FlowDir[k] == 0) continue;
+            // ... link has flow out of node (downstream node n not equal to i)
+            n = MSX.Link[k].n2;
+            if (MSX.FlowDir[k] < 0) n = MSX.Link[k].n1;
 
-                // ... link has flow out of node (downstream node n not equal to i)
-                n = MSX.Link[k].n2;
-                if (MSX.FlowDir[k] < 0) n = MSX.Link[k].n1;
+            // ... reduce degree of node n
+            if (n != i && indegree[n] > 0)
+            {
+                indegree[n]--;
 
-                // ... reduce degree of node n
-                if (n != i && indegree[n] > 0)
+                // ... no more degree left so add node n to stack
+                if (indegree[n] == 0)
                 {
-                    indegree[n]--;
-
-                    // ... no more degree left so add node n to stack
-                    if (indegree[n] == 0)
-                    {
-                        stacksize++;
-                        stack[stacksize] = n;
-                    }
+                    stacksize++;
+                    stack[stacksize] = n;
                 }
             }
         }
     }
-    else errcode = 101;
     if (numsorted < MSX.Nobjects[NODE]) errcode = 120;
-    FREE(indegree);
-    FREE(stack);
+
+    // Note each node's position and group the sorted nodes into
+    // levels that can be mixed in parallel
+    if (!errcode)
+    {
+        for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+        {
+            MSX.SortPos[MSX.SortedNodes[i]] = i;
+        }
+        levelNodes();
+    }
     return errcode;
 }
 
-int selectnonstacknode(int numsorted, int* indegree)
+void levelNodes()
 /*
 **--------------------------------------------------------------
-**   Input:   numsorted = number of nodes that have been sorted
-**            indegree = number of inflow links to each node
-**   Output:  returns a node index
-**   Purpose: selects a next node for sorting when a cycle exists.
+**   Input:   none
+**   Output:  none
+**   Purpose: groups the topologically sorted nodes into levels,
+**            placing each node one level past every node it
+**            shares a link with that comes before it in sorted
+**            order.
+**   Note:    the nodes of a level share no links, so mixing the
+**            levels in turn gives the same results as mixing the
+**            nodes in sorted order. A node's links are all
+**            considered, even those with negligible flow that
+**            the sort ignores.
 **--------------------------------------------------------------
 */
 {
-
-    int i, m, n;
+    int i, j, n, lev;
+    int* level = MSX.SortWork;
     Padjlist  alink;
 
-    // Examine each sorted node in last in - first out order
-    for (i = numsorted; i > 0; i--)
+    // Find the level of each node (0 if not yet reached)
+    memset(level, 0, (MSX.Nobjects[NODE] + 1) * sizeof(int));
+    MSX.Nlevels = 0;
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
     {
-        // For each link connected to the sorted node
-        m = MSX.SortedNodes[i];
-        for (alink = MSX.Adjlist[m]; alink != NULL; alink = alink->next)
+        n = MSX.SortedNodes[i];
+        lev = 1;
+        for (alink = MSX.Adjlist[n]; alink != NULL; alink = alink->next)
         {
-            // ... n is the node of link k opposite to node m
-            n = alink->node;
-
-            // ... select node n if it still has inflow links
-            if (indegree[n] > 0) return n;
+            lev = MAX(lev, level[alink->node] + 1);
         }
+        level[n] = lev;
+        MSX.Nlevels = MAX(MSX.Nlevels, lev);
     }
 
-    // If no node was selected by the above process then return the
-    // first node that still has inflow links remaining
+    // Count the nodes in each level and find where each level
+    // begins, keeping sorted order within a level
+    for (j = 1; j <= MSX.Nlevels + 1; j++) MSX.LevelStart[j] = 0;
     for (i = 1; i <= MSX.Nobjects[NODE]; i++)
     {
-        if (indegree[i] > 0) return i;
+        MSX.LevelStart[level[MSX.SortedNodes[i]] + 1]++;
     }
-
-    // If all else fails return 0 indicating that no node was selected
-    return 0;
+    MSX.LevelStart[1] = 1;
+    for (j = 2; j <= MSX.Nlevels + 1; j++)
+    {
+        MSX.LevelStart[j] += MSX.LevelStart[j - 1];
+    }
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+    {
+        n = MSX.SortedNodes[i];
+        MSX.LevelNodes[MSX.LevelStart[level[n]]++] = n;
+    }
+    for (j = MSX.Nlevels + 1; j > 1; j--)
+    {
+        MSX.LevelStart[j] = MSX.LevelStart[j - 1];
+    }
+    MSX.LevelStart[1] = 1;
 }
 
-void  noflowqual(int n)
+int orderNodes(int reset)
 /*
 **--------------------------------------------------------------
-**   Input:   n = node index
-**   Output:  quality for node n
-**   Purpose: sets the quality for a junction node that has no
-**            inflow to the average of the quality in its
-**            adjoining link segments.
-**   Note:    this function is only used for reactive substances.
+**   Input:   reset = TRUE if flow directions were just initialized
+**   Output:  returns an error code
+**   Purpose: orders nodes from upstream to downstream after flow
+**            directions change, reusing the ordering saved for
+**            the same flow directions or else repairing the
+**            current ordering when only a few links reversed.
 **--------------------------------------------------------------
 */
 {
+    int errcode = 0;
+    unsigned int hash = flowdirhash();
 
-    int k, m, inflow, kount = 0;
-    double c = 0.0;
-    FlowDirection dir;
+    if (findOrder(hash))
+    {
+        MSX.Profile.reorders++;
+        return 0;
+    }
+    if (!reset && repairOrder())
+    {
+        levelNodes();
+        MSX.Profile.repairs++;
+    }
+    else
+    {
+        errcode = sortNodes();
+        MSX.Profile.sorts++;
+    }
+    if (!errcode) saveOrder(hash);
+    return errcode;
+}
+
+unsigned int flowdirhash()
+/*
+**--------------------------------------------------------------
+**   Input:   none
+**   Output:  returns a hash value
+**   Purpose: hashes the flow directions of all links (FNV-1a).
+**--------------------------------------------------------------
+*/
+{
+    int k;
+    unsigned int hash = 2166136261u;
+
+    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+    {
+        hash ^= (unsigned int)(MSX.FlowDir[k] + 1);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int findOrder(unsigned int hash)
+/*
+**--------------------------------------------------------------
+**   Input:   hash = hash of the current flow directions
+**   Output:  returns TRUE if a saved ordering was used
+**   Purpose: restores the node ordering saved for the current
+**            flow directions, if there is one.
+**--------------------------------------------------------------
+*/
+{
+    int i, k;
+    SnodeOrder* order;
+
+    for (i = 0; i < ORDERCACHESIZE; i++)
+    {
+        order = &MSX.OrderCache[i];
+        if (order->dir == NULL || order->hash != hash) continue;
+        for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+        {
+            if (order->dir[k] != (char)MSX.FlowDir[k]) break;
+        }
+        if (k <= MSX.Nobjects[LINK]) continue;
+
+        k = MSX.Nobjects[NODE] + 1;
+        memcpy(MSX.SortedNodes, order->sortedNodes, k * sizeof(int));
+        memcpy(MSX.LevelNodes, order->levelNodes, k * sizeof(int));
+        memcpy(MSX.LevelStart, order->levelStart,
+               (order->nlevels + 2) * sizeof(int));
+        MSX.Nlevels = order->nlevels;
+        MSX.SortAcyclic = order->acyclic;
+        for (k = 1; k <= MSX.Nobjects[NODE]; k++)
+        {
+            MSX.SortPos[MSX.SortedNodes[k]] = k;
+        }
+        order->lastUsed = ++MSX.OrderClock;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void saveOrder(unsigned int hash)
+/*
+**--------------------------------------------------------------
+**   Input:   hash = hash of the current flow directions
+**   Output:  none
+**   Purpose: saves the current node ordering in place of the
+**            least recently used one.
+**   Note:    the ordering is simply not saved if memory runs out.
+**--------------------------------------------------------------
+*/
+{
+    int i, n = MSX.Nobjects[NODE] + 1;
+    SnodeOrder* order = &MSX.OrderCache[0];
+
+    for (i = 1; i < ORDERCACHESIZE; i++)
+    {
+        if (MSX.OrderCache[i].lastUsed < order->lastUsed)
+        {
+            order = &MSX.OrderCache[i];
+        }
+    }
+    if (!MSXqual_newOrder(order)) return;
+    order->hash = hash;
+    for (i = 1; i <= MSX.Nobjects[LINK]; i++)
+    {
+        order->dir[i] = (char)MSX.FlowDir[i];
+    }
+    memcpy(order->sortedNodes, MSX.SortedNodes, n * sizeof(int));
+    memcpy(order->levelNodes, MSX.LevelNodes, n * sizeof(int));
+    memcpy(order->levelStart, MSX.LevelStart, (MSX.Nlevels + 2) * sizeof(int));
+    order->nlevels = MSX.Nlevels;
+    order->acyclic = MSX.SortAcyclic;
+    order->lastUsed = ++MSX.OrderClock;
+}
+
+int MSXqual_newOrder(SnodeOrder* order)
+/*
+**--------------------------------------------------------------
+**   Input:   order = a saved node ordering
+**   Output:  returns TRUE if the ordering has room for its data
+**   Purpose: allocates the memory used by a saved node ordering
+**            if it has none yet.
+**--------------------------------------------------------------
+*/
+{
+    int n = MSX.Nobjects[NODE] + 1;
+
+    if (order->dir != NULL) return TRUE;
+    order->dir = (char*)calloc(MSX.Nobjects[LINK] + 1, sizeof(char));
+    order->sortedNodes = (int*)calloc(n, sizeof(int));
+    order->levelNodes = (int*)calloc(n, sizeof(int));
+    order->levelStart = (int*)calloc(n + 1, sizeof(int));
+    if (!order->dir || !order->sortedNodes || !order->levelNodes ||
+        !order->levelStart)
+    {
+        freeOrder(order);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void freeOrder(SnodeOrder* order)
+/*
+**--------------------------------------------------------------
+**   Input:   order = a saved node ordering
+**   Output:  none
+**   Purpose: frees the memory used by a saved node ordering.
+**--------------------------------------------------------------
+*/
+{
+    FREE(order->dir);
+    FREE(order->sortedNodes);
+    FREE(order->levelNodes);
+    FREE(order->levelStart);
+    order->lastUsed = 0;
+}
+
+int repairOrder()
+/*
+**--------------------------------------------------------------
+**   Input:   none
+**   Output:  returns TRUE if the sorted nodes were repaired
+**   Purpose: restores the topological order of the sorted nodes
+**            after the links in ChangedLinks change direction,
+**            moving only nodes placed between the ends of a link
+**            now flowing against the order.
+**   Note:    FALSE is returned, leaving a full sort to be made,
+**            if the order has or would have cycles or if the
+**            repair visits too many nodes.
+**--------------------------------------------------------------
+*/
+{
+    int i, k, u, v;
+    int ok = TRUE;
+    int budget = MSX.Nobjects[NODE] / MAXREPAIRFRACTION;
+
+    if (!MSX.SortAcyclic) return FALSE;
+
+    // Hide each changed link until it is added back in turn, so
+    // that every visible link agrees with the order
+    for (i = 0; i < MSX.Nchanged; i++) MSX.LinkMark[MSX.ChangedLinks[i]] = 1;
+    for (i = 0; i < MSX.Nchanged; i++)
+    {
+        k = MSX.ChangedLinks[i];
+        MSX.LinkMark[k] = 0;
+        if (!ok || MSX.FlowDir[k] == ZERO_FLOW) continue;
+        u = UP_NODE(k);
+        v = DOWN_NODE(k);
+        if (u == v || MSX.SortPos[u] < MSX.SortPos[v]) continue;
+        ok = promoteNodes(u, v, &budget);
+    }
+    return ok;
+}
+
+int promoteNodes(int u, int v, int* budget)
+/*
+**--------------------------------------------------------------
+**   Input:   u = upstream node of a link that now flows against
+**                the sorted order
+**            v = downstream node of the link
+**            budget = number of nodes the repair may still visit
+**   Output:  returns FALSE if a cycle was found or the budget
+**            ran out
+**   Purpose: places u and the nodes upstream of it ahead of v and
+**            the nodes downstream of it, reusing the positions of
+**            just those nodes (Pearce & Kelly, 2006).
+**--------------------------------------------------------------
+*/
+{
+    int n = MSX.Nobjects[NODE] + 1;
+    int* fwd = MSX.SortWork;           // nodes downstream of v
+    int* bwd = MSX.SortWork + n;       // nodes upstream of u
+    int* pos = MSX.SortWork + 2 * n;   // positions the nodes occupy
+    int lower = MSX.SortPos[v];
+    int upper = MSX.SortPos[u];
+    int nf = 0, nb = 0;
+    int i, j, k, w, x;
+    int ok = TRUE;
+    Padjlist alink;
+
+    // Find the nodes downstream of v placed no later than u
+    fwd[nf++] = v;
+    MSX.SortMark[v] = 1;
+    for (i = 0; i < nf && ok; i++)
+    {
+        w = fwd[i];
+        for (alink = MSX.Adjlist[w]; alink != NULL; alink = alink->next)
+        {
+            k = alink->link;
+            x = alink->node;
+            if (MSX.FlowDir[k] == ZERO_FLOW || MSX.LinkMark[k]) continue;
+            if (x == w || UP_NODE(k) != w) continue;
+
+            // ... reaching u means the new link closes a cycle
+            if (x == u)
+            {
+                ok = FALSE;
+                break;
+            }
+            if (MSX.SortMark[x] || MSX.SortPos[x] > upper) continue;
+            if (nf >= *budget)
+            {
+                ok = FALSE;
+                break;
+            }
+            MSX.SortMark[x] = 1;
+            fwd[nf++] = x;
+        }
+    }
+
+    // Find the nodes upstream of u placed no earlier than v
+    if (ok)
+    {
+        bwd[nb++] = u;
+        MSX.SortMark[u] = 1;
+    }
+    for (i = 0; i < nb && ok; i++)
+    {
+        w = bwd[i];
+        for (alink = MSX.Adjlist[w]; alink != NULL; alink = alink->next)
+        {
+            k = alink->link;
+            x = alink->node;
+            if (MSX.FlowDir[k] == ZERO_FLOW || MSX.LinkMark[k]) continue;
+            if (x == w || DOWN_NODE(k) != w) continue;
+            if (MSX.SortMark[x] || MSX.SortPos[x] < lower) continue;
+            if (nf + nb >= *budget)
+            {
+                ok = FALSE;
+                break;
+            }
+            MSX.SortMark[x] = 1;
+            bwd[nb++] = x;
+        }
+    }
+    for (i = 0; i < nf; i++) MSX.SortMark[fwd[i]] = 0;
+    for (i = 0; i < nb; i++) MSX.SortMark[bwd[i]] = 0;
+    *budget -= nf + nb;
+    if (!ok) return FALSE;
+
+    // Merge the positions held by both sets of nodes
+    qsort(fwd, nf, sizeof(int), comparePos);
+    qsort(bwd, nb, sizeof(int), comparePos);
+    i = 0;
+    j = 0;
+    for (k = 0; k < nf + nb; k++)
+    {
+        if (j >= nf || (i < nb && MSX.SortPos[bwd[i]] < MSX.SortPos[fwd[j]]))
+            pos[k] = MSX.SortPos[bwd[i++]];
+        else
+            pos[k] = MSX.SortPos[fwd[j++]];
+    }
+
+    // Fill them with the upstream nodes followed by the downstream ones,
+    // each set keeping its existing order
+    for (k = 0; k < nb; k++)
+    {
+        MSX.SortedNodes[pos[k]] = bwd[k];
+        MSX.SortPos[bwd[k]] = pos[k];
+    }
+    for (k = 0; k < nf; k++)
+    {
+        MSX.SortedNodes[pos[nb + k]] = fwd[k];
+        MSX.SortPos[fwd[k]] = pos[nb + k];
+    }
+    return TRUE;
+}
+
+int comparePos(const void* a, const void* b)
+/*
+**--------------------------------------------------------------
+**   Input:   a, b = pointers to node indexes
+**   Output:  returns the difference in the nodes' sorted positions
+**   Purpose: comparison function used to sort nodes by position.
+**--------------------------------------------------------------
+*/
+{
+    return MSX.SortPos[*(const int*)a] - MSX.SortPos[*(const int*)b];
+}
+
+int selectnonstacknode(int numsorted, int* indegree)
+/*
+**--------------------------------------------------------------
+**   Input:   numsorted = number of nodes that have been sorted
+**            indegree = number of inflow links to each node
+**   Output:  returns a node index
+**   Purpose: selects a next node for sorting when a cycle exists.
+**--------------------------------------------------------------
+*/
+{
+
+    int i, m, n;
+    Padjlist  alink;
+
+    // Examine each sorted node in last in - first out order
+    for (i = numsorted; i > 0; i--)
+    {
+        // For each link connected to the sorted node
+        m = MSX.SortedNodes[i];
+        for (alink = MSX.Adjlist[m]; alink != NULL; alink = alink->next)
+        {
+            // ... n is the node of link k opposite to node m
+            n = alink->node;
+
+            // ... select node n if it still has inflow links
+            if (indegree[n] > 0) return n;
+        }
+    }
+
+    // If no node was selected by the above process then return the
+    // first node that still has inflow links remaining
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+    {
+        if (indegree[i] > 0) return i;
+    }
+
+    // If all else fails return 0 indicating that no node was selected
+    return 0;
+}
+
+void  noflowqual(int n)
+/*
+**--------------------------------------------------------------
+**   Input:   n = node index
+**   Output:  quality for node n
+**   Purpose: sets the quality for a junction node that has no
+**            inflow to the average of the quality in its
+**            adjoining link segments.
+**   Note:    this function is only used for reactive substances.
+**--------------------------------------------------------------
+*/
+{
+
+    int k, m, inflow, kount = 0;
+    double c = 0.0;
+    FlowDirection dir;
     Padjlist  alink;
 
     for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
@@ -1789,6 +2596,104 @@ void findstoredmass(double * mass)
     }
 }
 
+double findreactedmass(int m)
+/*
+**--------------------------------------------------------------
+**   Input:   m = species index
+**   Output:  returns mass of species m reacted so far
+**   Purpose: adds up the mass of a species that has reacted in
+**            all pipes and tanks.
+**--------------------------------------------------------------
+*/
+{
+    int    k;
+    double sreacted = 0.0;
+
+    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+        sreacted += MSX.Link[k].reacted[m];
+    for (k = 1; k <= MSX.Nobjects[TANK]; k++)
+        sreacted += MSX.Tank[k].reacted[m];
+    return sreacted;
+}
+
+void MSXqual_updateMassBalance()
+/*
+**--------------------------------------------------------------
+**   Input:   none
+**   Output:  none
+**   Purpose: finds the mass stored and reacted in the network
+**            and the ratio of mass lost to mass added.
+**
+**   Note:    the inflow and outflow terms are accumulated as
+**            they occur, so only the stored and reacted mass
+**            need a pass through the network. This is done on
+**            each whole hour, at the end of the run and when
+**            MSXgetstats is asked for the balance, rather than
+**            after every time step. The stored mass is found
+**            by this sweep, not kept up to date as segments
+**            change, since otherwise it would just be derived
+**            from the other terms and the balance could no
+**            longer show errors in the transport.
+**--------------------------------------------------------------
+*/
+{
+    int    m;
+    double smassin, smassout, sreacted;
+
+    findstoredmass(MSX.MassBalance.final);
+    for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+    {
+        sreacted = findreactedmass(m);
+        MSX.MassBalance.reacted[m] = sreacted;
+        smassin = MSX.MassBalance.initial[m] + MSX.MassBalance.inflow[m];
+        smassout = MSX.MassBalance.outflow[m] + MSX.MassBalance.final[m];
+        if (sreacted < 0)  //loss
+            smassout -= sreacted;
+        else
+            smassin += sreacted;
+        if (smassin == 0)
+            MSX.MassBalance.ratio[m] = 1.0;
+        else
+            MSX.MassBalance.ratio[m] = smassout / smassin;
+    }
+}
+
+void checkMassBalance()
+/*
+**--------------------------------------------------------------
+**   Input:   none
+**   Output:  none
+**   Purpose: compares the mass stored in the network with the
+**            mass the balance's terms say should be there and
+**            keeps the largest difference, relative to the mass
+**            added, that any time step has had.
+**
+**   Note:    used for the MASSCHECK debugging option, since it
+**            takes a full pass through the network each step.
+**--------------------------------------------------------------
+*/
+{
+    int    m;
+    double smassin, sreacted, expected, err;
+
+    findstoredmass(MSX.MassBalance.final);
+    for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+    {
+        sreacted = findreactedmass(m);
+        smassin = MSX.MassBalance.initial[m] + MSX.MassBalance.inflow[m];
+        if (sreacted > 0) smassin += sreacted;
+        expected = MSX.MassBalance.initial[m] + MSX.MassBalance.inflow[m]
+                 - MSX.MassBalance.outflow[m] + sreacted;
+        err = fabs(MSX.MassBalance.final[m] - expected);
+        if (smassin != 0) err /= fabs(smassin);
+        if (err > MSX.MassBalance.imbalance[m])
+        {
+            MSX.MassBalance.imbalance[m] = err;
+            MSX.MassBalance.imbalanceTime[m] = MSX.Qtime;
+        }
+    }
+}
+
 void MSXqual_reversesegs(int k)
 /*
 **--------------------------------------------------------------
@@ -1816,21 +2721,150 @@ void MSXqual_reversesegs(int k)
 
 
 
+//=============================================================================
+
+void coarsenSegs()
+/*
+**   Purpose:
+**     merges adjacent segments in each pipe that holds more than
+**     MSX.MaxSegs of them until the limit is met.
+**
+**   Input:
+**     none.
+*/
+{
+    int  k, count;
+    Pseg seg;
+
+    for (k = 1; k <= MSX.Nobjects[LINK]; k++)
+    {
+        count = 0;
+        for (seg = MSX.FirstSeg[k]; seg != NULL; seg = seg->prev) count++;
+        for (; count > MSX.MaxSegs; count--) mergeSegs(k);
+    }
+}
+
+//=============================================================================
+
+void wakeSegs(long t)
+/*
+**   Purpose:
+**     decides if pipe segments whose reactions were deferred must be
+**     brought up to date in a quality step.
+**
+**   Input:
+**     t = time at the end of the step (sec).
+**
+**   Note: this is done in the last step before hydraulics change (which
+**         changes reaction rates), results are reported, or the
+**         simulation ends. In between, a dormant segment's concentrations
+**         lag behind by less than DORMANT_TOL times their tolerance.
+*/
+{
+    MSX.WakeSegs = FALSE;
+    if (!MSX.LazyReact) return;
+    if (t >= MSX.Htime || t >= MSX.Dur) MSX.WakeSegs = TRUE;
+    if (MSX.Saveflag && t >= MSX.Rtime) MSX.WakeSegs = TRUE;
+}
+
+//=============================================================================
+
+void mergeSegs(int k)
+/*
+**   Purpose:
+**     merges the two adjacent segments of a pipe whose concentrations
+**     differ the least.
+**
+**   Input:
+**     k = link index.
+**
+**   Note: concentrations are volume-weighted so that the mass of every
+**         species, bulk or wall, held in the pipe is unchanged.
+*/
+{
+    int    m;
+    double d, dmin = -1.0, v;
+    Pseg   seg, pseg, best = NULL;
+
+// --- find the segment that differs least from its upstream neighbor
+
+    for (seg = MSX.FirstSeg[k]; seg != NULL && seg->prev != NULL; seg = seg->prev)
+    {
+        d = segDifference(seg, seg->prev);
+        if (best == NULL || d < dmin)
+        {
+            best = seg;
+            dmin = d;
+        }
+    }
+    if (best == NULL) return;
+
+// --- fold the upstream segment into it
+
+    seg = best;
+    pseg = best->prev;
+    v = seg->v + pseg->v;
+    if (v > 0.0) for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+    {
+        seg->c[m] = (seg->c[m]*seg->v + pseg->c[m]*pseg->v) / v;
+        seg->lastc[m] = (seg->lastc[m]*seg->v + pseg->lastc[m]*pseg->v) / v;
+    }
+    if (pseg->v > seg->v) seg->hstep = pseg->hstep;
+    if (v > 0.0) seg->idle = (seg->idle*seg->v + pseg->idle*pseg->v) / v;
+    if (pseg->drift < 0.0 || seg->drift < 0.0) seg->drift = -1.0;
+    else seg->drift = MAX(seg->drift, pseg->drift);
+    seg->v = v;
+
+// --- unlink and recycle the upstream segment
+
+    seg->prev = pseg->prev;
+    if (pseg->prev) pseg->prev->next = seg;
+    else MSX.LastSeg[k] = seg;
+    MSXqual_removeSeg(pseg);
+}
+
+//=============================================================================
+
+double segDifference(Pseg seg1, Pseg seg2)
+/*
+**   Purpose:
+**     measures how much the concentrations of two segments differ.
+**
+**   Input:
+**     seg1, seg2 = pointers to two WQ segments.
+**
+**   Returns:
+**     the largest difference in any species' concentration relative to
+**     that species' absolute tolerance.
+*/
+{
+    int    m;
+    double d, dmax = 0.0;
+
+    for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+    {
+        d = fabs(seg1->c[m] - seg2->c[m]);
+        if (MSX.Species[m].aTol > 0.0) d /= MSX.Species[m].aTol;
+        dmax = MAX(dmax, d);
+    }
+    return dmax;
+}
+
 //=============================================================================
 
 void MSXqual_removeSeg(Pseg seg)
 /*
 **   Purpose:
-**     places a WQ segment back into the memory pool of segments.
+**     places a WQ segment back into the memory arena of segments.
 **
 **   Input:
 **     seg = pointer to a WQ segment.
+**
+**   Note: the segment joins the free list of the calling thread, so
+**         this can be called while nodes are mixed in parallel.
 */
 {
-    if ( seg == NULL ) return;
-    seg->prev = MSX.FreeSeg;
-    seg->next = NULL;
-    MSX.FreeSeg = seg;
+    MSXarena_free(MSX.SegArena, MSX.SegClass, seg);
 }
 
 //=============================================================================
@@ -1838,7 +2872,7 @@ void MSXqual_removeSeg(Pseg seg)
 Pseg MSXqual_getFreeSeg(double v, double c[])
 /*
 **   Purpose:
-**     retrieves an unused water quality volume segment from the memory pool.
+**     retrieves an unused water quality volume segment from the memory arena.
 **
 **   Input:
 **     v = segment volume (ft3)
@@ -1851,39 +2885,123 @@ Pseg MSXqual_getFreeSeg(double v, double c[])
     Pseg seg;
     int  m;
 
-// --- try using the last discarded segment if one is available
+// --- take a discarded segment, or a new one, from the memory arena
 
-    if (MSX.FreeSeg != NULL)
+    seg = newSeg(MSX.SegArena);
+    if (seg == NULL)
     {
-        seg = MSX.FreeSeg;
-        MSX.FreeSeg = seg->prev;
+        MSX.OutOfMemory = TRUE;
+        return NULL;
     }
 
-// --- otherwise create a new segment from the memory pool
+// --- assign volume, WQ, & integration time step to the new segment
 
-    else
+    seg->v = v;
+    for (m=1; m<=MSX.Nobjects[SPECIES]; m++) seg->c[m] = c[m];
+    seg->hstep = 0.0;
+    seg->idle = 0.0;
+    seg->drift = -1.0;
+    return seg;
+}
+
+//=============================================================================
+
+Pseg newSeg(Sarena *arena)
+/*
+**   Purpose:
+**     allocates a water quality segment from a memory arena.
+**
+**   Input:
+**     arena = pointer to the memory arena.
+**
+**   Returns:
+**     a pointer to the segment (or NULL if out of memory).
+**
+**   Note: the segment's concentration arrays are placed directly after
+**         it in the same object. The size of each part is a multiple
+**         of 8 bytes so the arrays stay aligned.
+*/
+{
+    Pseg seg;
+    int  n = MSX.Nobjects[SPECIES] + 1;
+
+    seg = (struct Sseg *) MSXarena_alloc(arena, MSX.SegClass);
+    if (seg == NULL) return NULL;
+    seg->c = (SEGREAL *) (seg + 1);
+    seg->lastc = seg->c + n;
+    return seg;
+}
+
+//=============================================================================
+
+int packSegs()
+/*
+**   Purpose:
+**     copies the WQ segments of every pipe and tank into a fresh memory
+**     arena so that each one's segments lie next to each other in the
+**     order they are visited.
+**
+**   Input:
+**     none.
+**
+**   Returns:
+**     an error code (0 if no error).
+**
+**   Note: segments recycled through the arena's free lists and added to
+**         many pipes in turn become scattered throughout the arena as a
+**         run proceeds.
+**         This undoes that scatter at the start of each hydraulic period,
+**         when no segment is held outside of the pipe and tank lists.
+*/
+{
+    int   k, m, n;
+    Pseg  seg, newseg, pseg;
+    Sarena *arena;
+
+// --- empty the spare memory arena
+
+    MSXarena_reset(MSX.SpareArena);
+    n = MSX.Nobjects[LINK] + MSX.Nobjects[TANK];
+    for (k = 1; k <= n; k++)
     {
-        seg = (struct Sseg *) Alloc(sizeof(struct Sseg));
-        if (seg == NULL)
-        {
-            MSX.OutOfMemory = TRUE;
-            return NULL;
-        }
-        seg->c = (double *) Alloc((MSX.Nobjects[SPECIES]+1)*sizeof(double));
-        seg->lastc = (double *)Alloc((MSX.Nobjects[SPECIES] + 1) * sizeof(double));
-        if ( seg->c == NULL||seg->lastc == NULL)
+    // --- copy the segments from the downstream end to the upstream end
+
+        pseg = NULL;
+        for (seg = MSX.FirstSeg[k]; seg != NULL; seg = seg->prev)
         {
-            MSX.OutOfMemory = TRUE;
-            return NULL;
+            newseg = newSeg(MSX.SpareArena);
+            if (newseg == NULL)
+            {
+                MSX.OutOfMemory = TRUE;
+                return ERR_MEMORY;
+            }
+            newseg->hstep = seg->hstep;
+            newseg->v = seg->v;
+            newseg->idle = seg->idle;
+            newseg->drift = seg->drift;
+            for (m = 1; m <= MSX.Nobjects[SPECIES]; m++)
+            {
+                newseg->c[m] = seg->c[m];
+                newseg->lastc[m] = seg->lastc[m];
+            }
+            MSX.Profile.segPacked += 1.0;
+            newseg->prev = NULL;
+            newseg->next = pseg;
+            if (pseg) pseg->prev = newseg;
+            else MSX.FirstSeg[k] = newseg;
+            pseg = newseg;
         }
+        MSX.LastSeg[k] = pseg;
     }
 
-// --- assign volume, WQ, & integration time step to the new segment
+// --- the old arena becomes the spare arena, which keeps only as many
+//     blocks of memory as the packed segments use
 
-    seg->v = v;
-    for (m=1; m<=MSX.Nobjects[SPECIES]; m++) seg->c[m] = c[m];
-    seg->hstep = 0.0;
-    return seg;
+    arena = MSX.SegArena;
+    MSX.SegArena = MSX.SpareArena;
+    MSX.SpareArena = arena;
+    MSXarena_trim(MSX.SegArena);
+    return 0;
 }
 
 //=============================================================================
@@ -1909,3 +3027,151 @@ void  MSXqual_addSeg(int k, Pseg seg)
     }
     MSX.LastSeg[k] = seg;
 }
+
+//=============================================================================
+
+void MSXqual_addThreadTime(double *times, double t)
+/*
+**   Purpose:
+**     adds to the time the calling thread has spent on part of a run.
+**
+**   Input:
+**     times = array of the times spent by each thread
+**     t = time to add (sec).
+*/
+{
+    int i = 0;
+
+#ifdef _OPENMP
+    i = omp_get_thread_num();
+#endif
+    if ( times && i < MSX.Profile.nthreads ) times[i] += t;
+}
+
+//=============================================================================
+
+void MSXqual_updateProfile()
+/*
+**   Purpose:
+**     brings the counts of segments in a run's profile up to date.
+**
+**   Input:
+**     none.
+**
+**   Note: the segments created are those handed out by both memory
+**         arenas since the run began, less the copies made when the
+**         segments were packed.
+*/
+{
+    SarenaStats s1, s2;
+
+    samplePeakSegs();
+    MSXarena_getStats(MSX.SegArena, &s1);
+    MSXarena_getStats(MSX.SpareArena, &s2);
+    MSX.Profile.segments = s1.allocs + s2.allocs - MSX.Profile.segBase -
+                           MSX.Profile.segPacked;
+}
+
+//=============================================================================
+
+void resetProfile()
+/*
+**   Purpose:
+**     clears the times and counts of the work done by a run.
+**
+**   Input:
+**     none.
+*/
+{
+    int i;
+    SarenaStats s1, s2;
+
+// --- first add in any work still held by the solvers of each thread
+
+    MSXchem_collectStats();
+    memset(&MSX.SolverStats, 0, sizeof(SsolverStats));
+    for (i = 0; i < MAX_PHASES; i++)
+    {
+        MSX.Profile.wall[i] = 0.0;
+        MSX.Profile.cpu[i] = 0.0;
+    }
+    for (i = 0; i < MSX.Profile.nthreads; i++)
+    {
+        MSX.Profile.threadReact[i] = 0.0;
+        MSX.Profile.threadMix[i] = 0.0;
+    }
+    MSXarena_getStats(MSX.SegArena, &s1);
+    MSXarena_getStats(MSX.SpareArena, &s2);
+    MSX.Profile.segBase = s1.allocs + s2.allocs;
+    MSX.Profile.segPacked = 0.0;
+    MSX.Profile.segments = 0.0;
+    MSX.Profile.peakSegments = 0.0;
+    MSX.Profile.segSteps = 0.0;
+    MSX.Profile.qualSteps = 0;
+    MSX.Profile.reversals = 0;
+    MSX.Profile.sorts = 0;
+    MSX.Profile.repairs = 0;
+    MSX.Profile.reorders = 0;
+}
+
+//=============================================================================
+
+void startPhase(double t[2])
+/*
+**   Purpose:
+**     reads the clocks at the start of a profiled part of a run.
+**
+**   Input:
+**     none.
+**
+**   Output:
+**     t[0] = wall clock time (sec)
+**     t[1] = CPU time (sec), or both 0 when not profiling.
+*/
+{
+    t[0] = 0.0;
+    t[1] = 0.0;
+    if ( !MSX.Profiling ) return;
+    t[0] = MSXutils_wallClock();
+    t[1] = MSXutils_cpuClock();
+}
+
+//=============================================================================
+
+void stopPhase(int phase, double t[2])
+/*
+**   Purpose:
+**     adds the time taken by a profiled part of a run to its totals.
+**
+**   Input:
+**     phase = part of the run (see ProfilePhase in msxtypes.h)
+**     t[] = clock times read by startPhase.
+*/
+{
+    if ( !MSX.Profiling ) return;
+    MSX.Profile.wall[phase] += MSXutils_wallClock() - t[0];
+    MSX.Profile.cpu[phase] += MSXutils_cpuClock() - t[1];
+}
+
+//=============================================================================
+
+double samplePeakSegs()
+/*
+**   Purpose:
+**     updates the largest number of segments in use at one time.
+**
+**   Input:
+**     none.
+**
+**   Returns:
+**     the number of segments now in use.
+*/
+{
+    SarenaStats stats;
+    double n = sizeof(struct Sseg) + 2*(MSX.Nobjects[SPECIES]+1)*sizeof(SEGREAL);
+
+    MSXarena_getStats(MSX.SegArena, &stats);
+    n = stats.inUse / n;
+    if ( n > MSX.Profile.peakSegments ) MSX.Profile.peakSegments = n;
+    return n;
+}
@@ -15,6 +15,7 @@
 #define _CRT_SECURE_NO_DEPRECATE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
@@ -27,10 +28,6 @@
 #define SERIES_TABLE  0
 #define STATS_TABLE   1
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Local variables
 //-----------------
 static char *Logo[] =
@@ -58,12 +55,20 @@ static struct TableHdrStruct
     char Line5[MAXLINE+1];
 } TableHdr;
 static char IDname[MAXLINE+1];
+static REAL4 *Series;                  // Results of all periods by species
+
+#ifdef _OPENMP
+#pragma omp threadprivate(Line, LineNum, PageNum, RptdSpecies, TableHdr, IDname, \
+                          Series)
+#endif
 
 //  Imported functions
 //--------------------
 void  MSXinp_getSpeciesUnits(int m, char *units);
-float MSXout_getNodeQual(int k, int j, int m);
-float MSXout_getLinkQual(int k, int j, int m);
+int   MSXout_checkFile(void);
+int   MSXout_getSeries(int objType, int j, int m, REAL4 *x);
+void  MSXchem_collectStats(void);
+void  MSXqual_updateProfile(void);
 
 //  Exported functions
 //--------------------
@@ -83,22 +88,27 @@ static void  newPage(void);
 static void  writeLine(char *line);
 
 static void writemassbalance();
+static void writesolverstats();
+static void writeprofile();
+static double percent(long part, long whole);
 
 //=============================================================================
 
 int  MSXrpt_write()
 {
-    INT4  magic = 0;
-    int  j;
-    int recordsize = sizeof(INT4);
+    int  j, err;
 
 // --- check that results are available
 
     if ( MSX.Nperiods < 1 )    return 0;
-    if ( MSX.OutFile.file == NULL ) return ERR_OPEN_OUT_FILE;
-    fseek(MSX.OutFile.file, -recordsize, SEEK_END);
-    fread(&magic, sizeof(INT4), 1, MSX.OutFile.file);
-    if ( magic != MAGICNUMBER ) return ERR_IO_OUT_FILE;
+    err = MSXout_checkFile();
+    if ( err ) return err;
+
+// --- allocate room for the results of an object
+
+    Series = (REAL4 *) calloc(MSX.Nobjects[SPECIES]*MSX.Nperiods,
+                              sizeof(REAL4));
+    if ( Series == NULL ) return ERR_MEMORY;
 
 // --- write program logo & project title
 
@@ -115,8 +125,11 @@ int  MSXrpt_write()
     else createStatsTables();
 
     writemassbalance();
+    if ( MSX.ReuseJac > 0 ) writesolverstats();
+    if ( MSX.Profiling ) writeprofile();
 
     writeLine("");
+    FREE(Series);
     return 0;
 }
 
@@ -256,6 +269,12 @@ void  writeNodeTable(int j, int tableType)
     char  s[MAXLINE+1];
     float c;
 
+    for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
+    {
+        if ( !MSX.Species[m].rpt ) continue;
+        if ( MSX.Species[m].type == WALL ) continue;
+        MSXout_getSeries(NODE, j, m, &Series[(m-1)*MSX.Nperiods]);
+    }
     for (k=0; k<MSX.Nperiods; k++)
     {
         if ( tableType == SERIES_TABLE )
@@ -272,7 +291,7 @@ void  writeNodeTable(int j, int tableType)
         {
             if ( !MSX.Species[m].rpt ) continue;
             if ( MSX.Species[m].type == WALL ) continue;
-            c = MSXout_getNodeQual(k, j, m);
+            c = Series[(m-1)*MSX.Nperiods + k];
             sprintf(s, "  %10.*f", MSX.Species[m].precision, c);
             strcat(Line, s);
         }
@@ -288,6 +307,11 @@ void  writeLinkTable(int j, int tableType)
     char  s[MAXLINE+1];
     float c;
 
+    for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
+    {
+        if ( !MSX.Species[m].rpt ) continue;
+        MSXout_getSeries(LINK, j, m, &Series[(m-1)*MSX.Nperiods]);
+    }
     for (k=0; k<MSX.Nperiods; k++)
     {
         if ( tableType == SERIES_TABLE )
@@ -303,7 +327,7 @@ void  writeLinkTable(int j, int tableType)
         for (m=1; m<=MSX.Nobjects[SPECIES]; m++)
         {
             if ( !MSX.Species[m].rpt ) continue;
-            c = MSXout_getLinkQual(k, j, m);
+            c = Series[(m-1)*MSX.Nperiods + k];
             sprintf(s, "  %10.*f", MSX.Species[m].precision, c);
             strcat(Line, s);
         }
@@ -317,7 +341,7 @@ void getHrsMins(int k, int *hrs, int *mins)
 {
     long m, h;
 
-    m = (MSX.Rstart + k*MSX.Rstep) / 60;
+    m = (MSX.Rfirst + k*MSX.Rstep) / 60;
     h = m / 60;
     m = m - 60*h;
     *hrs = h;
@@ -365,6 +389,7 @@ void writemassbalance()
 
     char s1[MAXMSG + 1];
     int  kunits = 0;
+    long t;
 
     for (int m = 1; m <= MSX.Nobjects[SPECIES]; m++)
     {
@@ -389,15 +414,147 @@ void writemassbalance()
         writeLine(s1);
         snprintf(s1, MAXMSG, "Mass Ratio:         %-.5f", MSX.MassBalance.ratio[m]);
         writeLine(s1);
+        if (MSX.MassCheck)
+        {
+            t = MSX.MassBalance.imbalanceTime[m] / 60;
+            snprintf(s1, MAXMSG, "Max. Imbalance:    %12.5e at %ld:%02ld",
+                     MSX.MassBalance.imbalance[m], t / 60, t % 60);
+            writeLine(s1);
+        }
         snprintf(s1, MAXMSG, "================================\n");
         writeLine(s1);
     }
 }
 
+//=============================================================================
 
+void writesolverstats()
+/*
+**-------------------------------------------------------------
+**   Input:   none
+**   Output:  none
+**   Purpose: writes how often the chemistry solvers reused
+**            Jacobians, factorizations and previous solutions
+**            to report file.
+**-------------------------------------------------------------
+*/
+{
+    char s1[MAXMSG + 1];
+    SsolverStats *s = &MSX.SolverStats;
+    long rosTotal, newtonTotal;
 
+    MSXchem_collectStats();
+    rosTotal = s->rosJacobians + s->rosReused;
+    newtonTotal = s->newtonJacobians + s->newtonReused;
+    writeLine("");
+    writeLine("Chemistry Solver Reuse Statistics");
+    writeLine("================================");
+    snprintf(s1, MAXMSG, "ROS2 Jacobians Evaluated:      %12ld", s->rosJacobians);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "ROS2 Jacobians Reused:         %12ld  (%.1f%%)",
+             s->rosReused, percent(s->rosReused, rosTotal));
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "ROS2 Factorizations Made:      %12ld", s->rosFactors);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "ROS2 Factorizations Reused:    %12ld  (%.1f%%)",
+             s->rosFactorsReused, percent(s->rosFactorsReused,
+             s->rosFactors + s->rosFactorsReused));
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Equilibrium Solves:            %12ld", s->newtonSolves);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Newton Jacobians Evaluated:    %12ld", s->newtonJacobians);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Newton Jacobians Reused:       %12ld  (%.1f%%)",
+             s->newtonReused, percent(s->newtonReused, newtonTotal));
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Warm Starts:                   %12ld  (%.1f%%)",
+             s->warmStarts, percent(s->warmStarts, s->newtonSolves));
+    writeLine(s1);
+    writeLine("================================");
+}
 
+//=============================================================================
 
+void writeprofile()
+/*
+**-------------------------------------------------------------
+**   Input:   none
+**   Output:  none
+**   Purpose: writes the time spent in each part of the run,
+**            by each thread, and counts of the work done to
+**            report file.
+**-------------------------------------------------------------
+*/
+{
+    static char *phaseNames[] = {"Hydraulics", "Node Sorting", "Reactions",
+                                 "Advection", "Node Mixing", "Output",
+                                 "Total"};
+    char s1[MAXMSG + 1];
+    Sprofile *p = &MSX.Profile;
+    SsolverStats *s = &MSX.SolverStats;
+    int i;
 
+    MSXchem_collectStats();
+    MSXqual_updateProfile();
+    writeLine("");
+    writeLine("Run Profile");
+    writeLine("================================");
+    writeLine("Phase                Wall (s)     CPU (s)");
+    writeLine("--------------------------------------------");
+    for (i = 0; i < MAX_PHASES; i++)
+    {
+        snprintf(s1, MAXMSG, "%-16s %12.3f %12.3f", phaseNames[i],
+                 p->wall[i], p->cpu[i]);
+        writeLine(s1);
+    }
+    writeLine("");
+    writeLine("Thread           Reacting (s)   Mixing (s)");
+    writeLine("--------------------------------------------");
+    for (i = 0; i < p->nthreads; i++)
+    {
+        snprintf(s1, MAXMSG, "%-16d %12.3f %12.3f", i, p->threadReact[i],
+                 p->threadMix[i]);
+        writeLine(s1);
+    }
+    writeLine("");
+    snprintf(s1, MAXMSG, "Segments Created:              %12.0f", p->segments);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Peak Segments:                 %12.0f", p->peakSegments);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Segment Steps:                 %12.0f", p->segSteps);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Quality Time Steps:            %12ld", p->qualSteps);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Integrator Steps:              %12ld", s->steps);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Integrator Steps Rejected:     %12ld  (%.1f%%)",
+             s->rejects, percent(s->rejects, s->steps + s->rejects));
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Newton Iterations:             %12ld", s->newtonIters);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Flow Reversals:                %12ld", p->reversals);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Full Node Sorts:               %12ld", p->sorts);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Node Orders Repaired:          %12ld", p->repairs);
+    writeLine(s1);
+    snprintf(s1, MAXMSG, "Node Orders Reused:            %12ld", p->reorders);
+    writeLine(s1);
+    writeLine("================================");
+}
+
+//=============================================================================
 
+double percent(long part, long whole)
+/*
+**-------------------------------------------------------------
+**   Input:   part = a count
+**            whole = the count it is part of
+**   Output:  returns part as a percentage of whole
+**-------------------------------------------------------------
+*/
+{
+    if ( whole <= 0 ) return 0.0;
+    return 100.0 * (double)part / (double)whole;
+}
 
@@ -0,0 +1,1214 @@
+/******************************************************************************
+**  MODULE:        MSXSNAP.C
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Saves an opened project's input data to a binary snapshot
+**                 file and opens a project from such a file, and saves
+**                 and restores checkpoints of its water quality state.
+**  COPYRIGHT:     Copyright (C) 2007 Feng Shang, Lewis Rossman, and James Uber.
+**                 All Rights Reserved. See license information in LICENSE.TXT.
+**  AUTHORS:       L. Rossman, US EPA - NRMRL
+**                 F. Shang, University of Cincinnati
+**                 J. Uber, University of Cincinnati
+**  VERSION:       1.1.00
+**  LAST UPDATE:   10/14/26
+**
+**  A snapshot holds everything that MSXproj_open reads from the EPANET
+**  network and the MSX input file, already parsed and converted to
+**  internal units: the options, the network data used by MSX, the species,
+**  coefficients, terms and their tokenized expressions, time patterns,
+**  sources, initial qualities, reporting flags and the nodal adjacency
+**  lists. Opening a snapshot takes a single read of the file followed by
+**  block copies of its arrays, with no text to scan and no expressions to
+**  parse.
+**
+**  The file begins with a header of four 4-byte integers - a magic number,
+**  the snapshot format version, the number of bytes that follow and a
+**  checksum of those bytes - and all values are written in the byte order
+**  of the machine that saved them. A snapshot is only accepted if its
+**  version and checksum are right and the EPANET network that is open has
+**  the same numbers of nodes, tanks and links as the one it was saved with.
+**
+**  A checkpoint, framed by the same kind of header, holds the state of a
+**  water quality simulation at the end of a time step: the quality of
+**  every node and tank, the volume, quality and integration step of every
+**  pipe and tank segment, each link's flow direction, the order the nodes
+**  are mixed in and the orderings kept for reuse, the reacted mass and
+**  mass balance totals, the quality, hydraulic and reporting times, and
+**  how far the simulation is through the current reaction step. It
+**  can only be restored into the project it was saved from, by a build
+**  that stores segment concentrations in the same precision.
+******************************************************************************/
+
+#define _CRT_SECURE_NO_DEPRECATE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msxtypes.h"
+#include "epanet2.h"
+
+//  Constants
+//-----------
+#define SNAP_MAGIC    516114522        // identifies a snapshot file
+#define SNAP_VERSION  4                // version of the snapshot format
+#define STATE_MAGIC   516114523        // identifies a checkpoint file
+#define STATE_VERSION 4                // version of the checkpoint format
+#define HEADER_SIZE   4                // integers in a file header
+
+//  Data structures
+//-----------------
+typedef struct                         // SNAPSHOT BEING WRITTEN
+{
+    FILE         *f;                   // file being written
+    unsigned int sum;                  // checksum of the bytes written
+    long         size;                 // number of bytes written
+    int          err;                  // TRUE if a write failed
+}   Swriter;
+
+typedef struct                         // SNAPSHOT BEING READ
+{
+    char  *buf;                        // file's contents after its header
+    char  *p;                          // next byte to read
+    char  *end;                        // end of the snapshot's data
+    int   err;                         // TRUE if data ran out
+}   Sreader;
+
+//  Imported functions
+//--------------------
+int    MSXproj_addObject(int type, char *id, int n);
+char * MSXproj_findID(int type, char *id);
+Pseg   MSXqual_getFreeSeg(double v, double c[]);
+void   MSXqual_addSeg(int k, Pseg seg);
+int    MSXqual_newOrder(SnodeOrder *order);
+
+//  Exported functions
+//--------------------
+int    MSXsnap_isSnapshot(char *fname);
+int    MSXsnap_save(char *fname);
+int    MSXsnap_read(char *fname, int (*createObjects)(void));
+int    MSXsnap_saveState(char *fname);
+int    MSXsnap_readState(char *fname, long *htime);
+
+//  Local functions
+//-----------------
+static int    openWriter(Swriter *w, char *fname);
+static int    closeWriter(Swriter *w, int magic, int version);
+static int    openReader(Sreader *r, char *fname, int magic, int version,
+                         int errcode);
+static unsigned int checksum(unsigned int sum, char *p, long n);
+static void   putBytes(Swriter *w, void *x, long n);
+static void   putInt(Swriter *w, int x);
+static void   putDouble(Swriter *w, double x);
+static void   putString(Swriter *w, char *s);
+static void   putExpr(Swriter *w, MathExpr *expr);
+static void   getBytes(Sreader *r, void *x, long n);
+static int    getInt(Sreader *r);
+static double getDouble(Sreader *r);
+static void   getString(Sreader *r, char *s, int maxlen);
+static int    getExpr(Sreader *r, MathExpr **expr);
+static int    getID(Sreader *r, int type, int n, char **id);
+static void   saveOptions(Swriter *w);
+static void   saveChemistry(Swriter *w);
+static void   saveNetwork(Swriter *w);
+static void   saveOrder(Swriter *w, SnodeOrder *order);
+static int    readOptions(Sreader *r);
+static int    readChemistry(Sreader *r);
+static int    readNetwork(Sreader *r);
+static void   readOrder(Sreader *r, SnodeOrder *order);
+
+//=============================================================================
+
+int MSXsnap_isSnapshot(char *fname)
+/*
+**  Purpose:
+**    checks if a file is a binary project snapshot.
+**
+**  Input:
+**    fname = name of the file.
+**
+**  Returns:
+**    TRUE if the file begins with a snapshot's magic number.
+*/
+{
+    INT4 magic = 0;
+    FILE *f = fopen(fname, "rb");
+
+    if ( f == NULL ) return FALSE;
+    if ( fread(&magic, sizeof(INT4), 1, f) != 1 ) magic = 0;
+    fclose(f);
+    return magic == SNAP_MAGIC;
+}
+
+//=============================================================================
+
+int MSXsnap_save(char *fname)
+/*
+**  Purpose:
+**    saves the input data of the current project to a snapshot file.
+**
+**  Input:
+**    fname = name of the snapshot file.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    Swriter w;
+
+    if ( !openWriter(&w, fname) ) return ERR_OPEN_OUT_FILE;
+    saveOptions(&w);
+    saveChemistry(&w);
+    saveNetwork(&w);
+    return closeWriter(&w, SNAP_MAGIC, SNAP_VERSION);
+}
+
+//=============================================================================
+
+int MSXsnap_read(char *fname, int (*createObjects)(void))
+/*
+**  Purpose:
+**    reads the input data of the current project from a snapshot file.
+**
+**  Input:
+**    fname = name of the snapshot file
+**    createObjects = function that allocates the project's objects once
+**                    their numbers are known.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int     errcode = 0;
+    Sreader r;
+
+    strcpy(MSX.Msg, "Processing MSX snapshot file ");
+    strncat(MSX.Msg, fname, MAXMSG - strlen(MSX.Msg));
+    ENwriteline(MSX.Msg);
+    ENwriteline("");
+    errcode = openReader(&r, fname, SNAP_MAGIC, SNAP_VERSION, ERR_SNAPSHOT);
+    if ( errcode ) return errcode;
+
+// --- copy its contents into the project
+
+    CALL(errcode, readOptions(&r));
+    CALL(errcode, createObjects());
+    CALL(errcode, readChemistry(&r));
+    CALL(errcode, readNetwork(&r));
+    if ( !errcode && (r.err || r.p != r.end) ) errcode = ERR_SNAPSHOT;
+    free(r.buf);
+    return errcode;
+}
+
+//=============================================================================
+
+int MSXsnap_saveState(char *fname)
+/*
+**  Purpose:
+**    saves the current water quality state of the project to a
+**    checkpoint file.
+**
+**  Input:
+**    fname = name of the checkpoint file.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int      i, k, n;
+    int      nl = MSX.Nobjects[LINK];
+    int      ns = MSX.Nobjects[SPECIES];
+    long     bytes = (ns + 1) * sizeof(double);
+    long     segBytes = (ns + 1) * sizeof(SEGREAL);
+    Pseg     seg;
+    Swriter  w;
+    SnodeOrder   current;
+    SnodeOrder   *order;
+    SmassBalance *mb = &MSX.MassBalance;
+
+    if ( !openWriter(&w, fname) ) return ERR_OPEN_OUT_FILE;
+
+// --- sizes of the project and the simulation times
+
+    putInt(&w, MSX.Nobjects[NODE]);
+    putInt(&w, nl);
+    putInt(&w, MSX.Nobjects[TANK]);
+    putInt(&w, ns);
+    putInt(&w, sizeof(SEGREAL));
+    putInt(&w, MSX.Qtime);
+    putInt(&w, MSX.Htime);
+    putInt(&w, MSX.Rtime);
+    putInt(&w, MSX.ReactBlock);
+    putInt(&w, MSX.ReactLeft);
+
+// --- node, link and tank quality
+
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+        putBytes(&w, MSX.Node[i].c, bytes);
+    for (i = 1; i <= nl; i++)
+    {
+        putInt(&w, MSX.FlowDir[i]);
+        putBytes(&w, MSX.Link[i].reacted, bytes);
+    }
+    for (i = 1; i <= MSX.Nobjects[TANK]; i++)
+    {
+        putDouble(&w, MSX.Tank[i].v);
+        putDouble(&w, MSX.Tank[i].hstep);
+        putBytes(&w, MSX.Tank[i].c, bytes);
+        putBytes(&w, MSX.Tank[i].reacted, bytes);
+    }
+
+// --- the segments of each link and tank, from downstream to upstream
+
+    for (k = 1; k <= nl + MSX.Nobjects[TANK]; k++)
+    {
+        n = 0;
+        for (seg = MSX.FirstSeg[k]; seg; seg = seg->prev) n++;
+        putInt(&w, n);
+        for (seg = MSX.FirstSeg[k]; seg; seg = seg->prev)
+        {
+            putDouble(&w, seg->v);
+            putDouble(&w, seg->hstep);
+            putDouble(&w, seg->idle);
+            putDouble(&w, seg->drift);
+            putBytes(&w, seg->c, segBytes);
+            putBytes(&w, seg->lastc, segBytes);
+        }
+    }
+
+// --- the order the nodes are mixed in and the orderings kept for
+//     recurring flow directions
+
+    current.sortedNodes = MSX.SortedNodes;
+    current.levelNodes = MSX.LevelNodes;
+    current.levelStart = MSX.LevelStart;
+    current.nlevels = MSX.Nlevels;
+    current.acyclic = MSX.SortAcyclic;
+    saveOrder(&w, &current);
+    putInt(&w, MSX.OrderClock);
+    for (i = 0; i < ORDERCACHESIZE; i++)
+    {
+        order = &MSX.OrderCache[i];
+        putInt(&w, order->dir != NULL);
+        if ( order->dir == NULL ) continue;
+        putInt(&w, order->hash);
+        putInt(&w, order->lastUsed);
+        putBytes(&w, order->dir, nl + 1);
+        saveOrder(&w, order);
+    }
+
+// --- mass balance totals
+
+    putBytes(&w, mb->initial, bytes);
+    putBytes(&w, mb->inflow, bytes);
+    putBytes(&w, mb->outflow, bytes);
+    putBytes(&w, mb->reacted, bytes);
+    putBytes(&w, mb->final, bytes);
+    putBytes(&w, mb->ratio, bytes);
+    putBytes(&w, mb->imbalance, bytes);
+    for (i = 1; i <= ns; i++) putInt(&w, mb->imbalanceTime[i]);
+    return closeWriter(&w, STATE_MAGIC, STATE_VERSION);
+}
+
+//=============================================================================
+
+int MSXsnap_readState(char *fname, long *htime)
+/*
+**  Purpose:
+**    replaces the current water quality state of the project with
+**    one read from a checkpoint file.
+**
+**  Input:
+**    fname = name of the checkpoint file.
+**
+**  Output:
+**    htime = time of the next hydraulic event when the checkpoint
+**            was saved (sec).
+**
+**  Returns:
+**    an error code (0 if no error).
+**
+**  Note: all existing segments and saved node orderings must have
+**        been freed beforehand.
+*/
+{
+    int      i, k, n, errcode;
+    int      nl = MSX.Nobjects[LINK];
+    int      ns = MSX.Nobjects[SPECIES];
+    long     bytes = (ns + 1) * sizeof(double);
+    long     segBytes = (ns + 1) * sizeof(SEGREAL);
+    Pseg     seg;
+    Sreader  r;
+    SnodeOrder   current;
+    SnodeOrder   *order;
+    SmassBalance *mb = &MSX.MassBalance;
+
+    errcode = openReader(&r, fname, STATE_MAGIC, STATE_VERSION, ERR_CHECKPOINT);
+    if ( errcode ) return errcode;
+
+// --- check that the checkpoint is of this project
+
+    if ( getInt(&r) != MSX.Nobjects[NODE] || getInt(&r) != nl ||
+         getInt(&r) != MSX.Nobjects[TANK] || getInt(&r) != ns ||
+         getInt(&r) != (int)sizeof(SEGREAL) ) r.err = TRUE;
+    MSX.Qtime = getInt(&r);
+    *htime = getInt(&r);
+    MSX.Rtime = getInt(&r);
+    MSX.ReactBlock = getInt(&r);
+    MSX.ReactLeft = getInt(&r);
+    if ( MSX.Qtime < 0 || *htime < MSX.Qtime ) r.err = TRUE;
+
+// --- node, link and tank quality
+
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+        getBytes(&r, MSX.Node[i].c, bytes);
+    for (i = 1; i <= nl; i++)
+    {
+        MSX.FlowDir[i] = (FlowDirection)getInt(&r);
+        getBytes(&r, MSX.Link[i].reacted, bytes);
+    }
+    for (i = 1; i <= MSX.Nobjects[TANK]; i++)
+    {
+        MSX.Tank[i].v = getDouble(&r);
+        MSX.Tank[i].hstep = getDouble(&r);
+        getBytes(&r, MSX.Tank[i].c, bytes);
+        getBytes(&r, MSX.Tank[i].reacted, bytes);
+    }
+
+// --- rebuild the segments of each link and tank
+
+    for (k = 1; k <= nl + MSX.Nobjects[TANK] && !r.err; k++)
+    {
+        MSX.FirstSeg[k] = NULL;
+        MSX.LastSeg[k] = NULL;
+        n = getInt(&r);
+        if ( n < 0 || (long)n * (4 * (long)sizeof(double) + 2 * segBytes) >
+                      r.end - r.p ) r.err = TRUE;
+        for (i = 0; i < n && !r.err; i++)
+        {
+            seg = MSXqual_getFreeSeg(0.0, MSX.C1);
+            if ( seg == NULL )
+            {
+                errcode = ERR_MEMORY;
+                break;
+            }
+            seg->v = getDouble(&r);
+            seg->hstep = getDouble(&r);
+            seg->idle = getDouble(&r);
+            seg->drift = getDouble(&r);
+            getBytes(&r, seg->c, segBytes);
+            getBytes(&r, seg->lastc, segBytes);
+            MSXqual_addSeg(k, seg);
+        }
+    }
+
+// --- the order the nodes are mixed in and the orderings kept for
+//     recurring flow directions
+
+    current.sortedNodes = MSX.SortedNodes;
+    current.levelNodes = MSX.LevelNodes;
+    current.levelStart = MSX.LevelStart;
+    readOrder(&r, &current);
+    MSX.Nlevels = current.nlevels;
+    MSX.SortAcyclic = current.acyclic;
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+        MSX.SortPos[MSX.SortedNodes[i]] = i;
+    MSX.OrderClock = getInt(&r);
+    for (i = 0; i < ORDERCACHESIZE && !r.err && !errcode; i++)
+    {
+        if ( !getInt(&r) ) continue;
+        order = &MSX.OrderCache[i];
+        if ( !MSXqual_newOrder(order) )
+        {
+            errcode = ERR_MEMORY;
+            break;
+        }
+        order->hash = getInt(&r);
+        order->lastUsed = getInt(&r);
+        getBytes(&r, order->dir, nl + 1);
+        readOrder(&r, order);
+    }
+
+// --- mass balance totals
+
+    getBytes(&r, mb->initial, bytes);
+    getBytes(&r, mb->inflow, bytes);
+    getBytes(&r, mb->outflow, bytes);
+    getBytes(&r, mb->reacted, bytes);
+    getBytes(&r, mb->final, bytes);
+    getBytes(&r, mb->ratio, bytes);
+    getBytes(&r, mb->imbalance, bytes);
+    for (i = 1; i <= ns; i++) mb->imbalanceTime[i] = getInt(&r);
+    if ( !errcode && (r.err || r.p != r.end) ) errcode = ERR_CHECKPOINT;
+    free(r.buf);
+    return errcode;
+}
+
+//=============================================================================
+
+int openWriter(Swriter *w, char *fname)
+/*
+**  Purpose:
+**    opens a file for writing and leaves room for its header.
+**
+**  Input:
+**    fname = name of the file.
+**
+**  Output:
+**    w = the file's writer.
+**
+**  Returns:
+**    TRUE if the file was opened.
+*/
+{
+    INT4 header[HEADER_SIZE] = {0, 0, 0, 0};
+
+    w->f = fopen(fname, "wb");
+    if ( w->f == NULL ) return FALSE;
+    w->sum = checksum(0, NULL, 0);
+    w->size = 0;
+    w->err = FALSE;
+    if ( fwrite(header, sizeof(INT4), HEADER_SIZE, w->f) != HEADER_SIZE )
+        w->err = TRUE;
+    return TRUE;
+}
+
+//=============================================================================
+
+int closeWriter(Swriter *w, int magic, int version)
+/*
+**  Purpose:
+**    writes a file's header once its data have been written and
+**    closes the file.
+**
+**  Input:
+**    w = the file's writer
+**    magic = magic number of the type of file
+**    version = version of the file's format.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    INT4 header[HEADER_SIZE];
+
+    header[0] = magic;
+    header[1] = version;
+    header[2] = (INT4)w->size;
+    header[3] = (INT4)w->sum;
+    if ( fseek(w->f, 0, SEEK_SET) != 0 ||
+         fwrite(header, sizeof(INT4), HEADER_SIZE, w->f) != HEADER_SIZE )
+        w->err = TRUE;
+    if ( fclose(w->f) != 0 ) w->err = TRUE;
+    if ( w->err ) return ERR_IO_OUT_FILE;
+    return 0;
+}
+
+//=============================================================================
+
+int openReader(Sreader *r, char *fname, int magic, int version, int errcode)
+/*
+**  Purpose:
+**    reads the whole of a file into memory and validates its header.
+**
+**  Input:
+**    fname = name of the file
+**    magic = magic number of the expected type of file
+**    version = version of the expected file format
+**    errcode = error code returned if the file is not valid.
+**
+**  Output:
+**    r = the file's reader, whose buffer the caller must free.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    INT4    header[HEADER_SIZE];
+    long    size;
+    FILE    *f;
+
+    r->buf = NULL;
+    f = fopen(fname, "rb");
+    if ( f == NULL ) return ERR_OPEN_MSX_FILE;
+    if ( fread(header, sizeof(INT4), HEADER_SIZE, f) != HEADER_SIZE ||
+         header[0] != magic || header[1] != version || header[2] < 0 )
+    {
+        fclose(f);
+        return errcode;
+    }
+    size = header[2];
+    r->buf = (char *) malloc(size + 1);
+    if ( r->buf == NULL )
+    {
+        fclose(f);
+        return ERR_MEMORY;
+    }
+    if ( (long)fread(r->buf, 1, size, f) != size ||
+         checksum(checksum(0, NULL, 0), r->buf, size) != (unsigned int)header[3] )
+    {
+        fclose(f);
+        free(r->buf);
+        r->buf = NULL;
+        return errcode;
+    }
+    fclose(f);
+    r->p = r->buf;
+    r->end = r->buf + size;
+    r->err = FALSE;
+    return 0;
+}
+
+//=============================================================================
+
+unsigned int checksum(unsigned int sum, char *p, long n)
+/*
+**  Purpose:
+**    extends an FNV-1a checksum over a number of bytes.
+**
+**  Input:
+**    sum = checksum of the bytes that came before
+**    p = start of the bytes
+**    n = number of bytes.
+**
+**  Returns:
+**    the updated checksum (the starting value if p is NULL).
+*/
+{
+    long i;
+
+    if ( p == NULL ) return 2166136261u;
+    for (i = 0; i < n; i++)
+    {
+        sum ^= (unsigned char)p[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+//=============================================================================
+
+void putBytes(Swriter *w, void *x, long n)
+{
+    if ( n <= 0 ) return;
+    if ( fwrite(x, 1, n, w->f) != (size_t)n ) w->err = TRUE;
+    w->sum = checksum(w->sum, (char *)x, n);
+    w->size += n;
+}
+
+void putInt(Swriter *w, int x)
+{
+    INT4 y = x;
+    putBytes(w, &y, sizeof(INT4));
+}
+
+void putDouble(Swriter *w, double x)
+{
+    putBytes(w, &x, sizeof(double));
+}
+
+void putString(Swriter *w, char *s)
+/*
+**  Purpose:
+**    writes the length of a string (-1 if NULL) followed by its characters.
+*/
+{
+    int n = -1;
+
+    if ( s ) n = (int)strlen(s);
+    putInt(w, n);
+    putBytes(w, s, n);
+}
+
+void putExpr(Swriter *w, MathExpr *expr)
+/*
+**  Purpose:
+**    writes the number of tokens in a tokenized math expression
+**    followed by each token in order.
+*/
+{
+    int n = 0;
+    MathExpr *node;
+
+    for (node = expr; node; node = node->next) n++;
+    putInt(w, n);
+    for (node = expr; node; node = node->next)
+    {
+        putInt(w, node->opcode);
+        putInt(w, node->ivar);
+        putDouble(w, node->fvalue);
+    }
+}
+
+//=============================================================================
+
+void getBytes(Sreader *r, void *x, long n)
+{
+    if ( n <= 0 ) return;
+    if ( r->err || r->end - r->p < n )
+    {
+        r->err = TRUE;
+        memset(x, 0, n);
+        return;
+    }
+    memcpy(x, r->p, n);
+    r->p += n;
+}
+
+int getInt(Sreader *r)
+{
+    INT4 y;
+    getBytes(r, &y, sizeof(INT4));
+    return y;
+}
+
+double getDouble(Sreader *r)
+{
+    double x;
+    getBytes(r, &x, sizeof(double));
+    return x;
+}
+
+void getString(Sreader *r, char *s, int maxlen)
+/*
+**  Purpose:
+**    reads a string written by putString into an array that holds
+**    at most maxlen characters (a NULL string reads as empty).
+*/
+{
+    int n = getInt(r);
+
+    if ( n < 0 ) n = 0;
+    if ( n > maxlen ) r->err = TRUE;
+    if ( r->err ) n = 0;
+    getBytes(r, s, n);
+    s[n] = '\0';
+}
+
+int getExpr(Sreader *r, MathExpr **expr)
+/*
+**  Purpose:
+**    rebuilds a tokenized math expression written by putExpr.
+**
+**  Output:
+**    expr = the expression (NULL if it has no tokens).
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int i, n = getInt(r);
+    MathExpr *node, *last = NULL;
+
+    *expr = NULL;
+    if ( n < 0 || (long)n * (long)(2 * sizeof(INT4) + sizeof(double)) >
+                  r->end - r->p ) r->err = TRUE;
+    if ( r->err ) return ERR_SNAPSHOT;
+    for (i = 0; i < n; i++)
+    {
+        node = (MathExpr *) malloc(sizeof(MathExpr));
+        if ( node == NULL ) return ERR_MEMORY;
+        node->opcode = getInt(r);
+        node->ivar = getInt(r);
+        node->fvalue = getDouble(r);
+        node->prev = last;
+        node->next = NULL;
+        if ( last ) last->next = node;
+        else *expr = node;
+        last = node;
+    }
+    return 0;
+}
+
+int getID(Sreader *r, int type, int n, char **id)
+/*
+**  Purpose:
+**    reads the ID name of an object and adds it to the project's
+**    hash tables.
+**
+**  Input:
+**    type = type of object
+**    n = object index.
+**
+**  Output:
+**    id = the ID name stored with the hash tables (NULL if none).
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    char s[MAXLINE+1];
+
+    *id = NULL;
+    getString(r, s, MAXLINE);
+    if ( r->err ) return ERR_SNAPSHOT;
+    if ( *s == '\0' ) return 0;
+    if ( MSXproj_addObject(type, s, n) < 0 ) return ERR_MEMORY;
+    *id = MSXproj_findID(type, s);
+    return 0;
+}
+
+//=============================================================================
+
+void saveOptions(Swriter *w)
+/*
+**  Purpose:
+**    writes the numbers of objects, the file names and the options.
+*/
+{
+    int i;
+
+    for (i = 0; i < MAX_OBJECTS; i++) putInt(w, MSX.Nobjects[i]);
+    putString(w, MSX.MsxFile.name);
+    putString(w, MSX.Title);
+    putString(w, MSX.RptFile.name);
+    putString(w, MSX.CacheDir);
+
+    putInt(w, MSX.Unitsflag);
+    putInt(w, MSX.Flowflag);
+    putInt(w, MSX.Coupling);
+    putInt(w, MSX.Compiler);
+    putInt(w, MSX.OutFormat);
+    putInt(w, MSX.MaxSegs);
+    putInt(w, MSX.LazyReact);
+    putInt(w, MSX.Jacobian);
+    putInt(w, MSX.ReuseJac);
+    putInt(w, MSX.Profiling);
+    putInt(w, MSX.MassCheck);
+    putInt(w, MSX.AreaUnits);
+    putInt(w, MSX.RateUnits);
+    putInt(w, MSX.Solver);
+    putInt(w, MSX.PageSize);
+    putInt(w, MSX.OutSubset);
+
+    putInt(w, MSX.Qstep);
+    putInt(w, MSX.ReactStep);
+    putInt(w, MSX.Pstep);
+    putInt(w, MSX.Pstart);
+    putInt(w, MSX.Rstep);
+    putInt(w, MSX.Rstart);
+    putInt(w, MSX.Statflag);
+
+    for (i = 0; i < MAX_UNIT_TYPES; i++) putDouble(w, MSX.Ucf[i]);
+    putDouble(w, MSX.DefRtol);
+    putDouble(w, MSX.DefAtol);
+}
+
+//=============================================================================
+
+void saveChemistry(Swriter *w)
+/*
+**  Purpose:
+**    writes the species, coefficients, terms and time patterns.
+**
+**  Note: a tank expression that is only a copy of the pipe expression
+**        (see setTankChemistry in msxchem.c) is saved as missing so
+**        that it is copied again when the snapshot is opened.
+*/
+{
+    int i, ns = MSX.Nobjects[SPECIES];
+    Sspecies *s;
+    SnumList *item;
+
+    putBytes(w, MSX.C0, (ns + 1) * sizeof(double));
+    for (i = 1; i <= ns; i++)
+    {
+        s = &MSX.Species[i];
+        putString(w, s->id);
+        putString(w, s->units);
+        putDouble(w, s->aTol);
+        putDouble(w, s->rTol);
+        putInt(w, s->type);
+        putInt(w, s->precision);
+        putInt(w, s->rpt);
+        putInt(w, s->pipeExprType);
+        putExpr(w, s->pipeExpr);
+        if ( s->tankExpr == s->pipeExpr )
+        {
+            putInt(w, NO_EXPR);
+            putExpr(w, NULL);
+        }
+        else
+        {
+            putInt(w, s->tankExprType);
+            putExpr(w, s->tankExpr);
+        }
+    }
+    for (i = 1; i <= MSX.Nobjects[PARAMETER]; i++)
+    {
+        putString(w, MSX.Param[i].id);
+        putDouble(w, MSX.Param[i].value);
+    }
+    for (i = 1; i <= MSX.Nobjects[CONSTANT]; i++)
+    {
+        putString(w, MSX.Const[i].id);
+        putDouble(w, MSX.Const[i].value);
+    }
+    for (i = 1; i <= MSX.Nobjects[TERM]; i++)
+    {
+        putString(w, MSX.Term[i].id);
+        putExpr(w, MSX.Term[i].expr);
+    }
+    for (i = 1; i <= MSX.Nobjects[PATTERN]; i++)
+    {
+        putString(w, MSX.Pattern[i].id);
+        putInt(w, MSX.Pattern[i].length);
+        for (item = MSX.Pattern[i].first; item; item = item->next)
+            putDouble(w, item->value);
+    }
+}
+
+//=============================================================================
+
+void saveNetwork(Swriter *w)
+/*
+**  Purpose:
+**    writes the data of each node, link and tank and the nodal
+**    adjacency lists.
+*/
+{
+    int i, n;
+    int ns = MSX.Nobjects[SPECIES];
+    int np = MSX.Nobjects[PARAMETER];
+    Psource  source;
+    Padjlist alink;
+
+    for (i = 1; i <= MSX.Nobjects[NODE]; i++)
+    {
+        putInt(w, MSX.Node[i].tank);
+        putInt(w, MSX.Node[i].rpt);
+        putBytes(w, MSX.Node[i].c0, (ns + 1) * sizeof(double));
+        n = 0;
+        for (source = MSX.Node[i].sources; source; source = source->next) n++;
+        putInt(w, n);
+        for (source = MSX.Node[i].sources; source; source = source->next)
+        {
+            putInt(w, source->type);
+            putInt(w, source->species);
+            putDouble(w, source->c0);
+            putInt(w, source->pat);
+        }
+    }
+    for (i = 1; i <= MSX.Nobjects[LINK]; i++)
+    {
+        putInt(w, MSX.Link[i].n1);
+        putInt(w, MSX.Link[i].n2);
+        putInt(w, MSX.Link[i].rpt);
+        putDouble(w, MSX.Link[i].diam);
+        putDouble(w, MSX.Link[i].len);
+        putDouble(w, MSX.Link[i].roughness);
+        putBytes(w, MSX.Link[i].c0, (ns + 1) * sizeof(double));
+        putBytes(w, MSX.Link[i].param, (np + 1) * sizeof(double));
+    }
+    for (i = 1; i <= MSX.Nobjects[TANK]; i++)
+    {
+        putInt(w, MSX.Tank[i].node);
+        putInt(w, MSX.Tank[i].mixModel);
+        putDouble(w, MSX.Tank[i].a);
+        putDouble(w, MSX.Tank[i].v0);
+        putDouble(w, MSX.Tank[i].vMix);
+        putBytes(w, MSX.Tank[i].param, (np + 1) * sizeof(double));
+    }
+    for (i = 0; i <= MSX.Nobjects[NODE]; i++)
+    {
+        n = 0;
+        if ( MSX.Adjlist )
+            for (alink = MSX.Adjlist[i]; alink; alink = alink->next) n++;
+        putInt(w, n);
+        if ( MSX.Adjlist )
+            for (alink = MSX.Adjlist[i]; alink; alink = alink->next)
+            {
+                putInt(w, alink->node);
+                putInt(w, alink->link);
+            }
+    }
+}
+
+//=============================================================================
+
+int readOptions(Sreader *r)
+/*
+**  Purpose:
+**    reads the numbers of objects, the file names and the options,
+**    checking the numbers of network objects against those of the
+**    EPANET project.
+*/
+{
+    int i, errcode = 0;
+    int nnodes = 0, ntanks = 0, nlinks = 0;
+
+    for (i = 0; i < MAX_OBJECTS; i++)
+    {
+        MSX.Nobjects[i] = getInt(r);
+        if ( MSX.Nobjects[i] < 0 ) r->err = TRUE;
+    }
+    CALL(errcode, ENgetcount(EN_NODECOUNT, &nnodes));
+    CALL(errcode, ENgetcount(EN_TANKCOUNT, &ntanks));
+    CALL(errcode, ENgetcount(EN_LINKCOUNT, &nlinks));
+    if ( errcode ) return errcode;
+    if ( r->err || nnodes != MSX.Nobjects[NODE] ||
+         ntanks != MSX.Nobjects[TANK] || nlinks != MSX.Nobjects[LINK] )
+        return ERR_SNAPSHOT;
+
+// --- the source MSX file name is kept so that MSXsavemsxfile can
+//     still copy its sections
+
+    getString(r, MSX.MsxFile.name, MAXFNAME - 1);
+    getString(r, MSX.Title, MAXLINE);
+    getString(r, MSX.RptFile.name, MAXFNAME - 1);
+    getString(r, MSX.CacheDir, MAXFNAME);
+
+    MSX.Unitsflag = getInt(r);
+    MSX.Flowflag = getInt(r);
+    MSX.Coupling = getInt(r);
+    MSX.Compiler = getInt(r);
+    MSX.OutFormat = getInt(r);
+    MSX.MaxSegs = getInt(r);
+    MSX.LazyReact = getInt(r);
+    MSX.Jacobian = getInt(r);
+    MSX.ReuseJac = getInt(r);
+    MSX.Profiling = getInt(r);
+    MSX.MassCheck = getInt(r);
+    MSX.AreaUnits = getInt(r);
+    MSX.RateUnits = getInt(r);
+    MSX.Solver = getInt(r);
+    MSX.PageSize = getInt(r);
+    MSX.OutSubset = getInt(r);
+
+    MSX.Qstep = getInt(r);
+    MSX.ReactStep = getInt(r);
+    MSX.Pstep = getInt(r);
+    MSX.Pstart = getInt(r);
+    MSX.Rstep = getInt(r);
+    MSX.Rstart = getInt(r);
+    MSX.Statflag = getInt(r);
+
+    for (i = 0; i < MAX_UNIT_TYPES; i++) MSX.Ucf[i] = getDouble(r);
+    MSX.DefRtol = getDouble(r);
+    MSX.DefAtol = getDouble(r);
+    if ( r->err ) return ERR_SNAPSHOT;
+    return 0;
+}
+
+//=============================================================================
+
+int readChemistry(Sreader *r)
+/*
+**  Purpose:
+**    reads the species, coefficients, terms and time patterns.
+*/
+{
+    int i, k, n, errcode = 0;
+    int ns = MSX.Nobjects[SPECIES];
+    Sspecies *s;
+    SnumList *item;
+
+    getBytes(r, MSX.C0, (ns + 1) * sizeof(double));
+    for (i = 1; i <= ns; i++)
+    {
+        s = &MSX.Species[i];
+        CALL(errcode, getID(r, SPECIES, i, &s->id));
+        getString(r, s->units, MAXUNITS - 1);
+        s->aTol = getDouble(r);
+        s->rTol = getDouble(r);
+        s->type = getInt(r);
+        s->precision = getInt(r);
+        s->rpt = (char)getInt(r);
+        s->pipeExprType = getInt(r);
+        CALL(errcode, getExpr(r, &s->pipeExpr));
+        s->tankExprType = getInt(r);
+        CALL(errcode, getExpr(r, &s->tankExpr));
+    }
+    for (i = 1; i <= MSX.Nobjects[PARAMETER]; i++)
+    {
+        CALL(errcode, getID(r, PARAMETER, i, &MSX.Param[i].id));
+        MSX.Param[i].value = getDouble(r);
+    }
+    for (i = 1; i <= MSX.Nobjects[CONSTANT]; i++)
+    {
+        CALL(errcode, getID(r, CONSTANT, i, &MSX.Const[i].id));
+        MSX.Const[i].value = getDouble(r);
+    }
+    for (i = 1; i <= MSX.Nobjects[TERM]; i++)
+    {
+        CALL(errcode, getID(r, TERM, i, &MSX.Term[i].id));
+        CALL(errcode, getExpr(r, &MSX.Term[i].expr));
+    }
+    for (i = 1; i <= MSX.Nobjects[PATTERN] && !errcode; i++)
+    {
+        CALL(errcode, getID(r, PATTERN, i, &MSX.Pattern[i].id));
+        n = getInt(r);
+        if ( n < 0 || (long)n * (long)sizeof(double) > r->end - r->p ) r->err = TRUE;
+        if ( r->err ) return ERR_SNAPSHOT;
+        for (k = 0; k < n; k++)
+        {
+            item = (SnumList *) malloc(sizeof(SnumList));
+            if ( item == NULL ) return ERR_MEMORY;
+            item->value = getDouble(r);
+            item->next = NULL;
+            if ( MSX.Pattern[i].first == NULL ) MSX.Pattern[i].first = item;
+            else MSX.Pattern[i].current->next = item;
+            MSX.Pattern[i].current = item;
+        }
+        MSX.Pattern[i].length = n;
+    }
+    if ( !errcode && r->err ) errcode = ERR_SNAPSHOT;
+    return errcode;
+}
+
+//=============================================================================
+
+int readNetwork(Sreader *r)
+/*
+**  Purpose:
+**    reads the data of each node, link and tank and rebuilds the
+**    nodal adjacency lists (unless the project already has them).
+*/
+{
+    int i, k, n;
+    int nn = MSX.Nobjects[NODE];
+    int nl = MSX.Nobjects[LINK];
+    int ns = MSX.Nobjects[SPECIES];
+    int np = MSX.Nobjects[PARAMETER];
+    Psource  source, last;
+    Padjlist alink, tail;
+    Padjlist *adjlist = NULL;
+
+    for (i = 1; i <= nn && !r->err; i++)
+    {
+        MSX.Node[i].tank = getInt(r);
+        MSX.Node[i].rpt = (char)getInt(r);
+        getBytes(r, MSX.Node[i].c0, (ns + 1) * sizeof(double));
+        n = getInt(r);
+        if ( n < 0 || n > ns ) r->err = TRUE;
+        last = NULL;
+        for (k = 0; k < n && !r->err; k++)
+        {
+            source = (struct Ssource *) malloc(sizeof(struct Ssource));
+            if ( source == NULL ) return ERR_MEMORY;
+            source->type = (char)getInt(r);
+            source->species = getInt(r);
+            source->c0 = getDouble(r);
+            source->pat = getInt(r);
+            source->massRate = 0.0;
+            source->next = NULL;
+            if ( last ) last->next = source;
+            else MSX.Node[i].sources = source;
+            last = source;
+            if ( source->species < 1 || source->species > ns ||
+                 source->pat < 0 || source->pat > MSX.Nobjects[PATTERN] )
+                r->err = TRUE;
+        }
+    }
+    for (i = 1; i <= nl && !r->err; i++)
+    {
+        MSX.Link[i].n1 = getInt(r);
+        MSX.Link[i].n2 = getInt(r);
+        MSX.Link[i].rpt = (char)getInt(r);
+        MSX.Link[i].diam = getDouble(r);
+        MSX.Link[i].len = getDouble(r);
+        MSX.Link[i].roughness = getDouble(r);
+        getBytes(r, MSX.Link[i].c0, (ns + 1) * sizeof(double));
+        getBytes(r, MSX.Link[i].param, (np + 1) * sizeof(double));
+        if ( MSX.Link[i].n1 < 1 || MSX.Link[i].n1 > nn ||
+             MSX.Link[i].n2 < 1 || MSX.Link[i].n2 > nn ) r->err = TRUE;
+    }
+    for (i = 1; i <= MSX.Nobjects[TANK] && !r->err; i++)
+    {
+        MSX.Tank[i].node = getInt(r);
+        MSX.Tank[i].mixModel = getInt(r);
+        MSX.Tank[i].a = getDouble(r);
+        MSX.Tank[i].v0 = getDouble(r);
+        MSX.Tank[i].vMix = getDouble(r);
+        getBytes(r, MSX.Tank[i].param, (np + 1) * sizeof(double));
+        if ( MSX.Tank[i].node < 1 || MSX.Tank[i].node > nn ) r->err = TRUE;
+    }
+    if ( r->err ) return ERR_SNAPSHOT;
+
+// --- rebuild each node's adjacency list in its saved order
+
+    if ( MSX.Adjlist == NULL )
+    {
+        adjlist = (Padjlist *) calloc(nn + 1, sizeof(Padjlist));
+        if ( adjlist == NULL ) return ERR_MEMORY;
+        MSX.Adjlist = adjlist;
+    }
+    for (i = 0; i <= nn && !r->err; i++)
+    {
+        n = getInt(r);
+        if ( n < 0 || n > 2 * nl ) r->err = TRUE;
+        tail = NULL;
+        for (k = 0; k < n && !r->err; k++)
+        {
+            if ( adjlist == NULL )
+            {
+                getInt(r);
+                getInt(r);
+                continue;
+            }
+            alink = (struct Sadjlist *) malloc(sizeof(struct Sadjlist));
+            if ( alink == NULL ) return ERR_MEMORY;
+            alink->node = getInt(r);
+            alink->link = getInt(r);
+            alink->next = NULL;
+            if ( tail ) tail->next = alink;
+            else adjlist[i] = alink;
+            tail = alink;
+            if ( alink->node < 1 || alink->node > nn ||
+                 alink->link < 1 || alink->link > nl ) r->err = TRUE;
+        }
+    }
+    if ( r->err ) return ERR_SNAPSHOT;
+    return 0;
+}
+
+//=============================================================================
+
+void saveOrder(Swriter *w, SnodeOrder *order)
+/*
+**  Purpose:
+**    writes an ordering of the nodes: the sorted nodes, their levels
+**    and whether the sort found any cycles.
+*/
+{
+    long nodeBytes = (MSX.Nobjects[NODE] + 1) * sizeof(int);
+
+    putInt(w, order->acyclic);
+    putInt(w, order->nlevels);
+    putBytes(w, order->sortedNodes, nodeBytes);
+    putBytes(w, order->levelNodes, nodeBytes);
+    putBytes(w, order->levelStart, (order->nlevels + 2) * sizeof(int));
+}
+
+//=============================================================================
+
+void readOrder(Sreader *r, SnodeOrder *order)
+/*
+**  Purpose:
+**    reads an ordering of the nodes into arrays that can hold one.
+*/
+{
+    int  i;
+    int  nn = MSX.Nobjects[NODE];
+    long nodeBytes = (nn + 1) * sizeof(int);
+
+    order->acyclic = getInt(r);
+    order->nlevels = getInt(r);
+    if ( order->nlevels < 0 || order->nlevels > nn ) r->err = TRUE;
+    if ( r->err ) order->nlevels = 0;
+    getBytes(r, order->sortedNodes, nodeBytes);
+    getBytes(r, order->levelNodes, nodeBytes);
+    getBytes(r, order->levelStart, (order->nlevels + 2) * sizeof(int));
+    for (i = 1; i <= nn; i++)
+    {
+        if ( order->sortedNodes[i] < 0 || order->sortedNodes[i] > nn ||
+             order->levelNodes[i] < 0 || order->levelNodes[i] > nn )
+            r->err = TRUE;
+    }
+    for (i = 1; order->nlevels > 0 && i <= order->nlevels + 1; i++)
+    {
+        if ( order->levelStart[i] < 1 || order->levelStart[i] > nn + 1 )
+            r->err = TRUE;
+    }
+    if ( r->err ) memset(order->sortedNodes, 0, nodeBytes);
+}
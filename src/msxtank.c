@@ -17,17 +17,14 @@
 
 #include "msxtypes.h"
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Imported functions
 //--------------------
 extern void  MSXqual_removeSeg(Pseg seg);
 extern Pseg  MSXqual_getFreeSeg(double v, double c[]);
 extern void  MSXqual_addSeg(int k, Pseg seg);
-extern int   MSXqual_isSame(double c1[], double c2[]);
+extern int   MSXqual_isSame(SEGREAL c1[], double c2[]);
 extern int   MSXchem_equil(int zone, double *c);
+extern int   MSXchem_equilSeg(int zone, Pseg seg);
 extern void  MSXqual_reversesegs(int k);
 
 //  Exported functions
@@ -185,8 +182,8 @@ void  MSXtank_mix2(int i, double vin, double *massin, double vnet)
         stagzone->v = 0.0;
     }
 
-    if (mixzone->v > 0.0) MSXchem_equil(NODE, mixzone->c);
-    if (stagzone->v > 0.0) MSXchem_equil(NODE, stagzone->c);
+    if (mixzone->v > 0.0) MSXchem_equilSeg(NODE, mixzone);
+    if (stagzone->v > 0.0) MSXchem_equilSeg(NODE, stagzone);
 
 // --- use quality of mixed compartment (mixzone) to represent quality
 //     of tank since this is where outflow begins to flow from
@@ -275,9 +272,7 @@ void  MSXtank_mix3(int i, double vin, double *massin, double vnet)
             if (seg->prev)
             {
                 MSX.FirstSeg[k] = seg->prev;
-             //   MSXqual_removeSeg(seg);
-                seg->prev = MSX.FreeSeg;
-                MSX.FreeSeg = seg;
+                MSXqual_removeSeg(seg);
 
             }
         }
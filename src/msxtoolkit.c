@@ -60,26 +60,40 @@
 #include "epanet2.h"
 #include "epanetmsx.h"
 
-//  External variables
-//--------------------
-extern MSXproject  MSX;                // MSX project data
-
 //  Imported functions
 //--------------------
 int    MSXproj_open(char *fname);
 int    MSXproj_close(void);
+int    MSXhyd_open(char *fname);
+void   MSXhyd_close(void);
+int    MSXhyd_load(ShydTimeline **timeline);
+int    MSXhyd_attach(ShydTimeline *timeline);
+void   MSXhyd_free(ShydTimeline *timeline);
+int    MSXout_flush(void);
+int    MSXout_checkFile(void);
+int    MSXout_getSeries(int objType, int j, int m, REAL4 *x);
 int    MSXproj_addObject(int type, char *id, int n);
 int    MSXproj_findObject(int type, char *id);
 char * MSXproj_findID(int type, char *id);
 char * MSXproj_getErrmsg(int errcode);
+int    MSXproj_saveBaseline(void);
+void   MSXproj_restoreBaseline(void);
 int    MSXqual_open(void);
 int    MSXqual_init(void);
+int    MSXqual_restore(char *fname);
 int    MSXqual_step(long *t, long *tleft);
 int    MSXqual_close(void);
 double MSXqual_getNodeQual(int j, int m);
 double MSXqual_getLinkQual(int k, int m);
+void   MSXqual_getLinkQuals(int k, int m1, int m2, double x[], int stride);
+void   MSXqual_updateProfile(void);
+void   MSXqual_updateMassBalance(void);
+void   MSXchem_collectStats(void);
 int    MSXrpt_write(void);
 int    MSXfile_save(FILE *f);
+int    MSXsnap_save(char *fname);
+int    MSXsnap_saveState(char *fname);
+MSXproject * MSXproj_setCurrent(MSXproject *project);
 
 //=============================================================================
 
@@ -99,6 +113,7 @@ int  DLLEXPORT  MSXopen(char *fname)
     if (MSX.ProjectOpened) return(ERR_MSX_OPENED);
     CALL(err, MSXproj_open(fname));
     CALL(err, MSXqual_open());
+    CALL(err, MSXproj_saveBaseline());
 
     if ( err )
     {
@@ -131,11 +146,7 @@ int   DLLEXPORT  MSXsolveH()
 
 // --- close & remove any existing hydraulics file
 
-    if ( MSX.HydFile.file )
-    {
-        fclose(MSX.HydFile.file);
-        MSX.HydFile.file = NULL;
-    }
+    MSXhyd_close();
     if ( MSX.HydFile.mode == SCRATCH_FILE ) remove(MSX.HydFile.name);
 
 // --- create a temporary hydraulics file
@@ -165,10 +176,6 @@ int   DLLEXPORT  MSXusehydfile(char *fname)
 **    an error code (or 0 for no error).
 */
 {
-    INT4 magic;
-    INT4 version;
-    INT4 n;
-
 // --- check that an MSX project was opened
 
     if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
@@ -177,32 +184,99 @@ int   DLLEXPORT  MSXusehydfile(char *fname)
 
     if ( MSX.HydFile.file )
     {
-        fclose(MSX.HydFile.file);
+        MSXhyd_close();
         if ( MSX.HydFile.mode == SCRATCH_FILE ) remove(MSX.HydFile.name);      //(LR-10/05/08)   
     } 
 	
 
-// --- open hydraulics file
+// --- open and index the hydraulics file
 
     //MSX.HydFile.mode = USED_FILE;                                            //(LR-10/05/08)
-    MSX.HydFile.file = fopen(fname, "rb");
-    if (!MSX.HydFile.file) return ERR_OPEN_HYD_FILE;
+    return MSXhyd_open(fname);
+}
+
+//=============================================================================
+
+int   DLLEXPORT  MSXloadhydraulics(MSX_Hydraulics *hh)
+/*
+**  Purpose:
+**    loads the project's hydraulics file into memory so that its
+**    solution can be shared by many projects.
+**
+**  Input:
+**    hh = pointer to a shared hydraulics handle.
+**
+**  Output:
+**    *hh = handle of the loaded hydraulics (or NULL on error).
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: MSXsolveH or MSXusehydfile must have been called first.
+*/
+{
+    if ( hh == NULL ) return ERR_MEMORY;
+    *hh = NULL;
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    return MSXhyd_load(hh);
+}
+
+//=============================================================================
+
+int   DLLEXPORT  MSXusehydraulics(MSX_Hydraulics hh)
+/*
+**  Purpose:
+**    has the project use a loaded hydraulic solution in place of a
+**    hydraulics file.
+**
+**  Input:
+**    hh = handle of hydraulics loaded by MSXloadhydraulics.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: the hydraulics must be loaded from the same EPANET network.
+**        They are only read, so many projects (including ones being
+**        run concurrently) can use the same hydraulics.
+*/
+{
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
 
-// --- check that file is really a hydraulics file for current project
+// --- close any existing hydraulics file
 
-    fread(&magic, sizeof(INT4), 1, MSX.HydFile.file);
-    if ( magic != MAGICNUMBER ) return ERR_READ_HYD_FILE;
-    fread(&version, sizeof(INT4), 1, MSX.HydFile.file);
-    fread(&n, sizeof(INT4), 1, MSX.HydFile.file);
-    if ( n != MSX.Nobjects[NODE] ) return ERR_READ_HYD_FILE;
-    fread(&n, sizeof(INT4), 1, MSX.HydFile.file);
-    if ( n != MSX.Nobjects[LINK] ) return ERR_READ_HYD_FILE;
-    fseek(MSX.HydFile.file, 3*sizeof(INT4), SEEK_CUR);
+    if ( MSX.HydFile.file )
+    {
+        MSXhyd_close();
+        if ( MSX.HydFile.mode == SCRATCH_FILE ) remove(MSX.HydFile.name);
+    }
+    return MSXhyd_attach(hh);
+}
 
-// --- read length of simulation period covered by file
+//=============================================================================
 
-    fread(&MSX.Dur, sizeof(INT4), 1, MSX.HydFile.file);
-    MSX.HydOffset = ftell(MSX.HydFile.file);
+int   DLLEXPORT  MSXfreehydraulics(MSX_Hydraulics *hh)
+/*
+**  Purpose:
+**    releases hydraulics loaded by MSXloadhydraulics.
+**
+**  Input:
+**    hh = pointer to a shared hydraulics handle.
+**
+**  Output:
+**    *hh = NULL.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: the hydraulics are freed once every project using them has
+**        been closed or given another hydraulic solution, so projects
+**        still using them can go on running. The handle itself can no
+**        longer be passed to MSXusehydraulics.
+*/
+{
+    if ( hh == NULL ) return 0;
+    MSXhyd_free(*hh);
+    *hh = NULL;
     return 0;
 }
 
@@ -252,6 +326,34 @@ int  DLLEXPORT  MSXinit(int saveFlag)
 
 //=============================================================================
 
+int  DLLEXPORT  MSXreset()
+/*
+**  Purpose:
+**    restores the initial concentrations, water quality sources, reaction
+**    parameters and constants of the project to those read from its
+**    input file.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: this undoes changes made with MSXsetinitqual, MSXsetsource,
+**        MSXsetparameter and MSXsetconstant, so that many scenarios can
+**        be run one after another from the same opened project: each
+**        calls MSXreset, makes its own changes and then calls MSXinit.
+**        The project's memory, compiled chemistry and hydraulics are
+**        all kept, and its pipe segments are recycled by MSXinit.
+*/
+{
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    MSXproj_restoreBaseline();
+    return 0;
+}
+
+//=============================================================================
+
 int  DLLEXPORT  MSXstep(long *t, long *tleft)
 /*
 **  Purpose:
@@ -291,6 +393,7 @@ int  DLLEXPORT  MSXsaveoutfile(char *fname)
 
     if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
     if ( !MSX.OutFile.file ) return ERR_OPEN_OUT_FILE;
+    if ( MSXout_flush() ) return ERR_IO_OUT_FILE;
     if ( (f = fopen(fname,"w+b") ) == NULL) return ERR_OPEN_OUT_FILE;
     fseek(MSX.OutFile.file, 0, SEEK_SET);
     while ( (c = fgetc(MSX.OutFile.file)) != EOF) fputc(c, f);
@@ -350,7 +453,7 @@ int  DLLEXPORT  MSXgetindex(int type, char *id, int *index)
 **
 **  Input:
 **    type = object type code
-**    id = name of water quality species.
+**    id = name of the object.
 **
 **  Output:
 **    index = index (base 1) in the list of all objects of the given type.
@@ -359,20 +462,49 @@ int  DLLEXPORT  MSXgetindex(int type, char *id, int *index)
 **    an error code (or 0 for no error).
 */
 {
-    int i;
-    *index = 0;
+    return MSXgetindices(type, 1, &id, index);
+}
+
+//=============================================================================
+
+int  DLLEXPORT  MSXgetindices(int type, int n, char *ids[], int *indices)
+/*
+**  Purpose:
+**    retrieves the indices of a number of named objects of the same type.
+**
+**  Input:
+**    type = object type code (including MSX_NODE and MSX_LINK)
+**    n = number of names
+**    ids = array of n object names.
+**
+**  Output:
+**    indices = array of n indices (base 1), with 0 for each name that
+**              was not found.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    int i, j, k, err = 0;
+    for (i = 0; i < n; i++) indices[i] = 0;
     if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
     switch(type)
     {
-        case MSX_SPECIES:   i = MSXproj_findObject(SPECIES, id);   break;
-        case MSX_CONSTANT:  i = MSXproj_findObject(CONSTANT, id);  break;
-        case MSX_PARAMETER: i = MSXproj_findObject(PARAMETER, id); break;
-        case MSX_PATTERN:   i = MSXproj_findObject(PATTERN, id);   break;
+        case MSX_NODE:      k = NODE;      break;
+        case MSX_LINK:      k = LINK;      break;
+        case MSX_SPECIES:   k = SPECIES;   break;
+        case MSX_CONSTANT:  k = CONSTANT;  break;
+        case MSX_PARAMETER: k = PARAMETER; break;
+        case MSX_PATTERN:   k = PATTERN;   break;
         default:            return ERR_INVALID_OBJECT_TYPE;
     }
-    if ( i < 1 ) return ERR_UNDEFINED_OBJECT_ID;
-    *index = i;
-    return 0;
+    for (i = 0; i < n; i++)
+    {
+        j = MSXproj_findObject(k, ids[i]);
+        if ( j < 1 ) err = ERR_UNDEFINED_OBJECT_ID;
+        else indices[i] = j;
+    }
+    return err;
 }
 //=============================================================================
 
@@ -779,6 +911,238 @@ int  DLLEXPORT  MSXgetqual(int type, int index, int species, double *value)
 
 //=============================================================================
 
+int  DLLEXPORT  MSXgetquals(int type, int species, double *values)
+/*
+**  Purpose:
+**    retrieves the current concentration of one or all species at every
+**    node or link of the pipe network in a single call.
+**
+**  Input:
+**    type = MSX_NODE (0) for nodes or MSX_LINK (1) for links;
+**    species = index (base 1) of the species of interest or 0 for all
+**              species.
+**
+**  Output:
+**    values = concentration of species m at node or link j placed at
+**             values[(m-1)*n + j-1] where n is the number of nodes or
+**             links (or at values[j-1] for a single species).
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: values must hold n entries for a single species and n times
+**        the number of species entries for all species.
+*/
+{
+    int j, m, n, m1, m2;
+
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    if ( species < 0 || species > MSX.Nobjects[SPECIES] )
+        return ERR_INVALID_OBJECT_INDEX;
+    if ( species == 0 )
+    {
+        m1 = 1;
+        m2 = MSX.Nobjects[SPECIES];
+    }
+    else m1 = m2 = species;
+
+    if ( type == MSX_NODE )
+    {
+        n = MSX.Nobjects[NODE];
+#ifdef _OPENMP
+#pragma omp parallel for private(j, m) schedule(static) copyin(MSXcurrent)
+#endif
+        for (j = 1; j <= n; j++)
+        {
+            for (m = m1; m <= m2; m++)
+                values[(m-m1)*n + j-1] = MSXqual_getNodeQual(j, m);
+        }
+    }
+    else if ( type == MSX_LINK )
+    {
+        n = MSX.Nobjects[LINK];
+#ifdef _OPENMP
+#pragma omp parallel for private(j) schedule(static) copyin(MSXcurrent)
+#endif
+        for (j = 1; j <= n; j++)
+        {
+            MSXqual_getLinkQuals(j, m1, m2, &values[j-1], n);
+        }
+    }
+    else return ERR_INVALID_OBJECT_TYPE;
+    return 0;
+}
+
+//=============================================================================
+
+int  DLLEXPORT  MSXgetperiods(int *count)
+/*
+**  Purpose:
+**    retrieves the number of time periods saved to the binary output file.
+**
+**  Input:
+**    none.
+**
+**  Output:
+**    count = number of reporting periods (1 if a time statistic was
+**            reported).
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: the results of a complete run must have been saved with
+**        MSXsolveQ or with MSXinit(1) followed by MSXstep.
+*/
+{
+    int errcode;
+
+    *count = 0;
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    if ( MSX.Nperiods < 1 ) return 0;
+    errcode = MSXout_checkFile();
+    if ( !errcode ) *count = MSX.Nperiods;
+    return errcode;
+}
+
+//=============================================================================
+
+int  DLLEXPORT  MSXgetseries(int type, int index, int species, double *values)
+/*
+**  Purpose:
+**    retrieves the concentration of a species at a particular node or
+**    link in every time period saved to the binary output file.
+**
+**  Input:
+**    type = MSX_NODE (0) for a node or MSX_LINK (1) for a link;
+**    index = index (base 1) of the node or link of interest;
+**    species = index (base 1) of the species of interest.
+**
+**  Output:
+**    values = species concentration in each period (which must be sized
+**             to hold the number of periods given by MSXgetperiods).
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: reading a series from a file saved with OUTPUT COLUMNAR takes
+**        one read per chunk of periods instead of one per period. An
+**        object or species left out of a subset of results saved with
+**        SUBSET YES (or MSXsetoutput) has a series of zeros and returns
+**        error 516.
+*/
+{
+    int    errcode, objType, k;
+    REAL4* x;
+
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    if ( species < 1 || species > MSX.Nobjects[SPECIES] ) return ERR_INVALID_OBJECT_INDEX;
+    if ( type == MSX_NODE ) objType = NODE;
+    else if ( type == MSX_LINK ) objType = LINK;
+    else return ERR_INVALID_OBJECT_TYPE;
+    if ( index < 1 || index > MSX.Nobjects[objType] ) return ERR_INVALID_OBJECT_INDEX;
+    if ( MSX.Nperiods < 1 ) return 0;
+    errcode = MSXout_checkFile();
+    if ( errcode ) return errcode;
+
+    x = (REAL4 *) calloc(MSX.Nperiods, sizeof(REAL4));
+    if ( x == NULL ) return ERR_MEMORY;
+    errcode = MSXout_getSeries(objType, index, species, x);
+    for (k = 0; k < MSX.Nperiods; k++) values[k] = x[k];
+    free(x);
+    return errcode;
+}
+
+//=============================================================================
+
+int  DLLEXPORT  MSXgetstats(int stat, int index, double *value)
+/*
+**  Purpose:
+**    retrieves a time or a count of the work done by the run so far.
+**
+**  Input:
+**    stat = MSX_WALLTIME (0) or MSX_CPUTIME (1) for the seconds spent in
+**           a phase, MSX_THREADREACT (2) or MSX_THREADMIX (3) for the
+**           seconds a thread spent reacting or mixing, or one of the
+**           counts MSX_SEGMENTS (4) through MSX_QUALSTEPS (15), or
+**           MSX_IMBALANCE (16) for the largest mass imbalance found
+**           by the MASSCHECK option, MSX_MASSRATIO (17) for the ratio
+**           of mass lost to mass added or MSX_STOREDMASS (18) for the
+**           mass held in the network;
+**    index = the phase (MSX_HYDPHASE (0) to MSX_TOTALPHASE (6)) for a
+**            time, the thread (base 0) for a thread's time, the
+**            species for an imbalance, ratio or stored mass, and
+**            ignored for a count.
+**
+**  Output:
+**    value = the time (in seconds) or count.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: times are only kept when PROFILE YES is set in the OPTIONS
+**        section; the counts are always kept. The mass ratio and
+**        stored mass are brought up to the current time when asked
+**        for, which takes a pass through every pipe and tank segment.
+*/
+{
+    Sprofile *p = &MSX.Profile;
+    SsolverStats *s = &MSX.SolverStats;
+
+    *value = 0.0;
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    MSXchem_collectStats();
+    if ( MSX.QualityOpened ) MSXqual_updateProfile();
+    switch (stat)
+    {
+    case MSX_WALLTIME:
+    case MSX_CPUTIME:
+        if ( index < 0 || index >= MAX_PHASES ) return ERR_INVALID_OBJECT_INDEX;
+        if ( stat == MSX_WALLTIME ) *value = p->wall[index];
+        else *value = p->cpu[index];
+        break;
+
+    case MSX_THREADREACT:
+    case MSX_THREADMIX:
+        if ( index < 0 || index >= p->nthreads ) return ERR_INVALID_OBJECT_INDEX;
+        if ( stat == MSX_THREADREACT ) *value = p->threadReact[index];
+        else *value = p->threadMix[index];
+        break;
+
+    case MSX_SEGMENTS:     *value = p->segments;      break;
+    case MSX_PEAKSEGMENTS: *value = p->peakSegments;  break;
+    case MSX_STEPS:        *value = s->steps;         break;
+    case MSX_REJECTS:      *value = s->rejects;       break;
+    case MSX_NEWTONITERS:  *value = s->newtonIters;   break;
+    case MSX_REVERSALS:    *value = p->reversals;     break;
+    case MSX_SORTS:        *value = p->sorts;         break;
+    case MSX_REPAIRS:      *value = p->repairs;       break;
+    case MSX_REORDERS:     *value = p->reorders;      break;
+    case MSX_THREADS:      *value = p->nthreads;      break;
+    case MSX_SEGSTEPS:     *value = p->segSteps;      break;
+    case MSX_QUALSTEPS:    *value = p->qualSteps;     break;
+
+    case MSX_IMBALANCE:
+        if ( index < 1 || index > MSX.Nobjects[SPECIES] )
+            return ERR_INVALID_OBJECT_INDEX;
+        if ( MSX.QualityOpened ) *value = MSX.MassBalance.imbalance[index];
+        break;
+
+    case MSX_MASSRATIO:
+    case MSX_STOREDMASS:
+        if ( index < 1 || index > MSX.Nobjects[SPECIES] )
+            return ERR_INVALID_OBJECT_INDEX;
+        if ( !MSX.QualityOpened ) break;
+        MSXqual_updateMassBalance();
+        if ( stat == MSX_MASSRATIO ) *value = MSX.MassBalance.ratio[index];
+        else *value = MSX.MassBalance.final[index];
+        break;
+    default: return ERR_INVALID_OBJECT_PARAMS;
+    }
+    return 0;
+}
+
+//=============================================================================
+
 int  DLLEXPORT  MSXgeterror(int code, char *msg, int len)
 /*
 **  Purpose:
@@ -1150,6 +1514,55 @@ int  DLLEXPORT  MSXsetpattern(int pat, double mult[], int len)
 
 //=============================================================================
 
+int  DLLEXPORT  MSXsetoutput(int type, int index, int flag)
+/*
+**  Purpose:
+**    chooses whether the results of a node, link or species are saved to
+**    the binary output file, so that only a subset of all results is
+**    saved.
+**
+**  Input:
+**    type = MSX_NODE (0) for a node, MSX_LINK (1) for a link or
+**           MSX_SPECIES (3) for a species;
+**    index = index (base 1) of the object (or 0 for all objects of the
+**            given type);
+**    flag = 1 if the object's results are saved or 0 if not.
+**
+**  Output:
+**    none.
+**
+**  Returns:
+**    an error code or 0 for no error.
+**
+**  Note: this sets the object's reporting flag, as the [REPORT] section
+**        of the MSX input file does, and turns on the SUBSET option. The
+**        choice applies to the results saved after the next call to
+**        MSXinit.
+*/
+{
+    int j, objType, first, last;
+
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    if ( type == MSX_NODE ) objType = NODE;
+    else if ( type == MSX_LINK ) objType = LINK;
+    else if ( type == MSX_SPECIES ) objType = SPECIES;
+    else return ERR_INVALID_OBJECT_TYPE;
+    if ( index < 0 || index > MSX.Nobjects[objType] ) return ERR_INVALID_OBJECT_INDEX;
+    if ( flag != 0 && flag != 1 ) return ERR_INVALID_OBJECT_PARAMS;
+    first = index ? index : 1;
+    last = index ? index : MSX.Nobjects[objType];
+    for (j = first; j <= last; j++)
+    {
+        if ( objType == NODE ) MSX.Node[j].rpt = (char)flag;
+        else if ( objType == LINK ) MSX.Link[j].rpt = (char)flag;
+        else MSX.Species[j].rpt = (char)flag;
+    }
+    MSX.OutSubset = TRUE;
+    return 0;
+}
+
+//=============================================================================
+
 int  DLLEXPORT MSXsavemsxfile(char *fname)
 {
     int errcode;
@@ -1160,3 +1573,241 @@ int  DLLEXPORT MSXsavemsxfile(char *fname)
     fclose(f);
     return errcode;
 }
+
+//=============================================================================
+
+int  DLLEXPORT MSXsavesnapshot(char *fname)
+/*
+**  Purpose:
+**    saves the current project's input data as a binary snapshot
+**    that MSXopen can read in place of the MSX input file.
+**
+**  Input:
+**    fname = name of the snapshot file.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: the snapshot is only valid for the EPANET network that was
+**        open when it was saved.
+*/
+{
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    return MSXsnap_save(fname);
+}
+
+//=============================================================================
+
+int  DLLEXPORT MSXsavestate(char *fname)
+/*
+**  Purpose:
+**    saves the current water quality state of a simulation to a
+**    binary checkpoint file.
+**
+**  Input:
+**    fname = name of the checkpoint file.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: call between calls to MSXstep once MSXinit has been called.
+*/
+{
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    return MSXsnap_saveState(fname);
+}
+
+//=============================================================================
+
+int  DLLEXPORT MSXrestorestate(char *fname)
+/*
+**  Purpose:
+**    resumes a simulation from the water quality state saved to a
+**    checkpoint file.
+**
+**  Input:
+**    fname = name of the checkpoint file.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+**
+**  Note: call right after MSXinit, using the same hydraulics as the run
+**        that saved the checkpoint. MSXstep then continues from the
+**        checkpoint's time, and the results it saves begin at the next
+**        reporting time after it.
+*/
+{
+    if ( !MSX.ProjectOpened ) return ERR_MSX_NOT_OPENED;
+    return MSXqual_restore(fname);
+}
+
+//=============================================================================
+//  Project handle versions of the toolkit functions.
+//
+//  Each handle owns a complete MSX project. A call binds the handle's
+//  project to the calling thread for the duration of the call, so that
+//  different threads may work on different handles at the same time.
+//  The EPANET network is shared read-only; MSXsolveH calls back into
+//  EPANET and so must not be run on two handles at once.
+//=============================================================================
+
+#define PROJCALL(ph, f) \
+{ \
+    int err; \
+    MSXproject *previous; \
+    if ( ph == NULL ) return ERR_MSX_NOT_OPENED; \
+    previous = MSXproj_setCurrent(ph); \
+    err = f; \
+    MSXproj_setCurrent(previous); \
+    return err; \
+}
+
+int  DLLEXPORT  MSX_createproject(MSX_Project *ph)
+/*
+**  Purpose:
+**    creates a new, empty EPANET-MSX project.
+**
+**  Input:
+**    ph = pointer to a project handle.
+**
+**  Output:
+**    *ph = handle of the new project (or NULL if no memory).
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    if ( ph == NULL ) return ERR_MEMORY;
+    *ph = (MSX_Project)calloc(1, sizeof(MSXproject));
+    if ( *ph == NULL ) return ERR_MEMORY;
+    return 0;
+}
+
+//=============================================================================
+
+int  DLLEXPORT  MSX_deleteproject(MSX_Project *ph)
+/*
+**  Purpose:
+**    closes a project (if still open) and frees its handle.
+**
+**  Input:
+**    ph = pointer to a project handle.
+**
+**  Output:
+**    *ph = NULL.
+**
+**  Returns:
+**    an error code (or 0 for no error).
+*/
+{
+    MSXproject *previous;
+    if ( ph == NULL || *ph == NULL ) return 0;
+    previous = MSXproj_setCurrent(*ph);
+    if ( MSX.ProjectOpened ) MSXclose();
+    MSXproj_setCurrent(previous);
+    free(*ph);
+    *ph = NULL;
+    return 0;
+}
+
+//=============================================================================
+
+int DLLEXPORT MSX_open(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXopen(fname))
+int DLLEXPORT MSX_solveH(MSX_Project ph)
+    PROJCALL(ph, MSXsolveH())
+int DLLEXPORT MSX_usehydfile(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXusehydfile(fname))
+int DLLEXPORT MSX_loadhydraulics(MSX_Project ph, MSX_Hydraulics *hh)
+    PROJCALL(ph, MSXloadhydraulics(hh))
+int DLLEXPORT MSX_usehydraulics(MSX_Project ph, MSX_Hydraulics hh)
+    PROJCALL(ph, MSXusehydraulics(hh))
+int DLLEXPORT MSX_solveQ(MSX_Project ph)
+    PROJCALL(ph, MSXsolveQ())
+int DLLEXPORT MSX_init(MSX_Project ph, int saveFlag)
+    PROJCALL(ph, MSXinit(saveFlag))
+int DLLEXPORT MSX_reset(MSX_Project ph)
+    PROJCALL(ph, MSXreset())
+int DLLEXPORT MSX_step(MSX_Project ph, long *t, long *tleft)
+    PROJCALL(ph, MSXstep(t, tleft))
+int DLLEXPORT MSX_saveoutfile(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXsaveoutfile(fname))
+int DLLEXPORT MSX_savemsxfile(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXsavemsxfile(fname))
+
+int DLLEXPORT MSX_savesnapshot(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXsavesnapshot(fname))
+int DLLEXPORT MSX_savestate(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXsavestate(fname))
+int DLLEXPORT MSX_restorestate(MSX_Project ph, char *fname)
+    PROJCALL(ph, MSXrestorestate(fname))
+int DLLEXPORT MSX_report(MSX_Project ph)
+    PROJCALL(ph, MSXreport())
+int DLLEXPORT MSX_close(MSX_Project ph)
+    PROJCALL(ph, MSXclose())
+
+int DLLEXPORT MSX_getindex(MSX_Project ph, int type, char *id, int *index)
+    PROJCALL(ph, MSXgetindex(type, id, index))
+int DLLEXPORT MSX_getindices(MSX_Project ph, int type, int n, char *ids[],
+                             int *indices)
+    PROJCALL(ph, MSXgetindices(type, n, ids, indices))
+int DLLEXPORT MSX_getIDlen(MSX_Project ph, int type, int index, int *len)
+    PROJCALL(ph, MSXgetIDlen(type, index, len))
+int DLLEXPORT MSX_getID(MSX_Project ph, int type, int index, char *id, int len)
+    PROJCALL(ph, MSXgetID(type, index, id, len))
+int DLLEXPORT MSX_getcount(MSX_Project ph, int type, int *count)
+    PROJCALL(ph, MSXgetcount(type, count))
+int DLLEXPORT MSX_getspecies(MSX_Project ph, int index, int *type,
+              char *units, double *aTol, double *rTol)
+    PROJCALL(ph, MSXgetspecies(index, type, units, aTol, rTol))
+int DLLEXPORT MSX_getconstant(MSX_Project ph, int index, double *value)
+    PROJCALL(ph, MSXgetconstant(index, value))
+int DLLEXPORT MSX_getparameter(MSX_Project ph, int type, int index, int param,
+              double *value)
+    PROJCALL(ph, MSXgetparameter(type, index, param, value))
+int DLLEXPORT MSX_getsource(MSX_Project ph, int node, int species, int *type,
+              double *level, int *pat)
+    PROJCALL(ph, MSXgetsource(node, species, type, level, pat))
+int DLLEXPORT MSX_getpatternlen(MSX_Project ph, int pat, int *len)
+    PROJCALL(ph, MSXgetpatternlen(pat, len))
+int DLLEXPORT MSX_getpatternvalue(MSX_Project ph, int pat, int period,
+              double *value)
+    PROJCALL(ph, MSXgetpatternvalue(pat, period, value))
+int DLLEXPORT MSX_getinitqual(MSX_Project ph, int type, int index, int species,
+              double *value)
+    PROJCALL(ph, MSXgetinitqual(type, index, species, value))
+int DLLEXPORT MSX_getqual(MSX_Project ph, int type, int index, int species,
+              double *value)
+    PROJCALL(ph, MSXgetqual(type, index, species, value))
+int DLLEXPORT MSX_getquals(MSX_Project ph, int type, int species,
+              double *values)
+    PROJCALL(ph, MSXgetquals(type, species, values))
+int DLLEXPORT MSX_getperiods(MSX_Project ph, int *count)
+    PROJCALL(ph, MSXgetperiods(count))
+int DLLEXPORT MSX_getseries(MSX_Project ph, int type, int index, int species,
+              double *values)
+    PROJCALL(ph, MSXgetseries(type, index, species, values))
+
+int DLLEXPORT MSX_getstats(MSX_Project ph, int stat, int index, double *value)
+    PROJCALL(ph, MSXgetstats(stat, index, value))
+
+int DLLEXPORT MSX_setconstant(MSX_Project ph, int index, double value)
+    PROJCALL(ph, MSXsetconstant(index, value))
+int DLLEXPORT MSX_setparameter(MSX_Project ph, int type, int index, int param,
+              double value)
+    PROJCALL(ph, MSXsetparameter(type, index, param, value))
+int DLLEXPORT MSX_setinitqual(MSX_Project ph, int type, int index, int species,
+              double value)
+    PROJCALL(ph, MSXsetinitqual(type, index, species, value))
+int DLLEXPORT MSX_setsource(MSX_Project ph, int node, int species, int type,
+              double level, int pat)
+    PROJCALL(ph, MSXsetsource(node, species, type, level, pat))
+int DLLEXPORT MSX_setpatternvalue(MSX_Project ph, int pat, int period,
+              double value)
+    PROJCALL(ph, MSXsetpatternvalue(pat, period, value))
+int DLLEXPORT MSX_setpattern(MSX_Project ph, int pat, double mult[], int len)
+    PROJCALL(ph, MSXsetpattern(pat, mult, len))
+int DLLEXPORT MSX_setoutput(MSX_Project ph, int type, int index, int flag)
+    PROJCALL(ph, MSXsetoutput(type, index, flag))
+int DLLEXPORT MSX_addpattern(MSX_Project ph, char *id)
+    PROJCALL(ph, MSXaddpattern(id))
@@ -15,7 +15,9 @@
 ***********************************************************************/
 
 #include "mathexpr.h"
-#include "mempool.h"
+#include "msxarena.h"
+#include "hash.h"
+#include "msxfuncs.h"
 
 //-----------------------------------------------------------------------------
 //  Definition of 4-byte integers & reals
@@ -23,6 +25,15 @@
 typedef  int   INT4;
 typedef  float REAL4;
 
+// Type of the species concentrations held by each pipe and tank segment
+// (building with MSX_FLOAT_SEGS defined stores them in single precision,
+// halving the memory they take at the cost of some accuracy)
+#ifdef MSX_FLOAT_SEGS
+typedef  float  SEGREAL;
+#else
+typedef  double SEGREAL;
+#endif
+
 //-----------------------------------------------------------------------------
 //  Macros for memory allocation
 //-----------------------------------------------------------------------------
@@ -56,8 +67,14 @@ typedef  float REAL4;
 //-----------------------------------------------------------------------------
 #define   MAGICNUMBER  516114521
 #define   VERSION      100000
+#define   VERSION_COLUMNAR 100100      // Version written to columnar files
+#define   VERSION_SUBSET   100200      // Version written to files of a subset
+#define   VERSION_COLUMNAR_SUBSET 100300  // ... and to columnar files of one
 #define   MAXMSG       1024            // Max. # characters in message text
 #define   MAXLINE      1024            // Max. # characters in input line
+#define   MAXID        31              // Max. # characters in an EPANET ID
+#define   MAXBATCH     32              // Max. # pipe segments reacted at once
+#define   ORDERCACHESIZE 8             // Max. # node orderings kept for reuse
 #define   TRUE         1
 #define   FALSE        0
 #define   BIG          1.E10
@@ -207,13 +224,41 @@ typedef  float REAL4;
                   TIMESTEP_OPTION,
                   RTOL_OPTION,
                   ATOL_OPTION,
-                  COMPILER_OPTION};                                            //1.1.00
+                  COMPILER_OPTION,                                             //1.1.00
+                  CACHE_OPTION,
+                  OUTPUT_OPTION,
+                  MAXSEGS_OPTION,
+                  LAZY_OPTION,
+                  JACOBIAN_OPTION,
+                  REUSE_OPTION,
+                  PROFILE_OPTION,
+                  MASSCHECK_OPTION,
+                  REACTSTEP_OPTION};
 
  enum CompilerType                     // C compiler type                      //1.1.00
                  {NO_COMPILER,
                   VC,                  // MS Visual C compiler
                   GC};                 // Gnu C compiler
 
+ enum JacobianType                     // How solvers find Jacobian matrices
+                 {NUMERICAL_JACOBIAN,  //   by finite differences
+                  ANALYTIC_JACOBIAN};  //   from derivatives of the expressions
+
+ enum OutFormatType                   // Binary output file layouts
+                 {STANDARD_FORMAT,     //   all results of each period together
+                  COLUMNAR_FORMAT};    //   each result's values for a chunk
+                                       //   of periods together
+
+ enum ProfilePhase                     // Parts of a WQ step that are timed
+                 {HYDRAULICS_PHASE,    //   reading hydraulics (getHydVars)
+                  SORT_PHASE,          //   ordering nodes (orderNodes)
+                  REACT_PHASE,         //   reactions (MSXchem_react)
+                  ADVECT_PHASE,        //   advecting segments (advectSegs)
+                  TRANSPORT_PHASE,     //   mixing at nodes (topological_transport)
+                  OUTPUT_PHASE,        //   saving results (MSXout_saveResults)
+                  TOTAL_PHASE,         //   all of MSXqual_step
+                  MAX_PHASES};
+
  enum FileModeType                     // File modes
                  {SCRATCH_FILE,
                   SAVED_FILE,
@@ -259,6 +304,8 @@ typedef  float REAL4;
            ERR_COMPILE_FAILED,         // 522                                  //1.1.00
            ERR_COMPILED_LOAD,          // 523                                  //1.1.00
 		   ERR_ILLEGAL_MATH,           // 524                                  //1.1.00
+           ERR_SNAPSHOT,               // 525
+           ERR_CHECKPOINT,             // 526
            ERR_MAX};
 
 
@@ -316,6 +363,7 @@ typedef struct                         // LINK OBJECT
    double *reacted;
    double *param;                      // kinetic parameter values
    double roughness;		       // roughness  /*Feng Shang, Bug ID 8,  01/29/2008*/
+   double cost;                        // work done in last reaction step
 }  Slink;
 
 
@@ -338,8 +386,11 @@ struct Sseg                            // PIPE SEGMENT OBJECT
 {
     double    hstep;                   // integration time step
     double    v;                       // segment volume
-    double    *c;                      // species concentrations
-    double    * lastc;                 // species concentrations of previous step 
+    SEGREAL   *c;                      // species concentrations
+    SEGREAL   *lastc;                  // species concentrations of previous step
+    double    idle;                    // time its reactions were deferred
+    double    drift;                   // rate of change relative to aTol
+                                       //   (< 0 if not yet known)
     struct    Sseg *prev;              // ptr. to previous segment
     struct    Sseg *next;              // ptr. to next segment
 };
@@ -360,6 +411,8 @@ typedef struct                         // CHEMICAL SPECIES OBJECT
     char      rpt;                     // reporting flag
     MathExpr  *pipeExpr;               // pipe chemistry expression
     MathExpr  *tankExpr;               // tank chemistry expression
+    MathCode  *pipeCode;               // compiled pipe chemistry expression
+    MathCode  *tankCode;               // compiled tank chemistry expression
 }   Sspecies;
 
 
@@ -367,9 +420,31 @@ typedef struct                         // INTERMEDIATE TERM OBJECT
 {
     char      *id;                     // name
     MathExpr  *expr;                   // math expression for term
+    MathCode  *code;                   // compiled math expression for term
 }   Sterm;
 
 
+typedef struct                         // NONZERO PARTIAL DERIVATIVE
+{
+    int       row;                     // expression differentiated: a system
+                                       //   function (> 0) or -(intermediate)
+    int       col;                     // variable differentiated by: an
+                                       //   unknown (> 0) or -(intermediate)
+    MathExpr  *expr;                   // math expression of the derivative
+    MathCode  *code;                   // compiled math expression
+}   Spartial;
+
+
+typedef struct                         // JACOBIAN OF A CHEMISTRY SYSTEM
+{
+    int       n;                       // number of unknowns
+    int       nint;                    // number of intermediates that
+                                       //   depend on the unknowns
+    int       npartials;               // number of nonzero partials
+    Spartial  *partial;                // partials in order of evaluation
+}   Sjacobian;
+
+
 typedef struct                         // REACTION RATE PARAMETER OBJECT
 {
     char       *id;                    // name
@@ -409,6 +484,26 @@ typedef enum {
     POSITIVE = 1    // flow in pre-assigned direction
 } FlowDirection;
 
+typedef struct                 // Cached ordering of nodes
+{
+    unsigned int hash;         // hash of the link flow directions
+    char     * dir;            // flow direction of each link
+    int      * sortedNodes;    // topologically sorted nodes
+    int      * levelNodes;     // sorted nodes grouped by level
+    int      * levelStart;     // position where each level begins
+    int        nlevels;        // number of levels
+    int        acyclic;        // TRUE if the sort found no cycles
+    long       lastUsed;       // when the ordering was last used
+} SnodeOrder;
+
+typedef struct                 // Objects saved to the output file
+{
+    int        n;              // number of objects saved
+    int      * index;          // index of each object saved
+    int      * pos;            // position (base 1) of each object among
+                               //   those saved (0 if not saved)
+} SoutSet;
+
 typedef struct                 // Mass Balance Components
 {
     double   * initial;         // initial mass in system
@@ -417,9 +512,98 @@ typedef struct                 // Mass Balance Components
     double   * reacted;         // mass reacted in system
     double   * final;           // final mass in system
     double   * ratio;           // ratio of mass added to mass lost
+    double   * imbalance;       // largest imbalance of a step (MASSCHECK)
+    long     * imbalanceTime;   // time when it occurred (sec)
 } SmassBalance;
 
-typedef struct                         // MSX PROJECT VARIABLES
+typedef struct                         // SOLVER WORK COUNTERS
+{
+   long   rosJacobians;                // Jacobians evaluated by ROS2
+   long   rosReused;                   // ROS2 steps reusing a Jacobian
+   long   rosFactors;                  // factorizations made by ROS2
+   long   rosFactorsReused;            // ROS2 steps reusing a factorization
+   long   newtonSolves;                // equilibrium systems solved
+   long   newtonJacobians;             // Jacobians evaluated by Newton
+   long   newtonReused;                // Newton iterations reusing a Jacobian
+   long   warmStarts;                  // solves started from the previous
+                                       //   solution
+   long   steps;                       // steps taken by RK5 or ROS2
+   long   rejects;                     // steps rejected by RK5 or ROS2
+   long   newtonIters;                 // Newton iterations
+}  SsolverStats;
+
+typedef struct                         // RUN PROFILE
+{
+   double  wall[MAX_PHASES];           // wall clock seconds in each phase
+   double  cpu[MAX_PHASES];            // CPU seconds in each phase
+   int     nthreads;                   // number of threads profiled
+   double* threadReact;                // seconds each thread spent reacting
+   double* threadMix;                  // seconds each thread spent mixing nodes
+   double  segBase;                    // segments handed out before the run
+   double  segPacked;                  // segment copies made by packing
+   double  segments;                   // segments created
+   double  peakSegments;               // most segments in use at once
+   double  segSteps;                   // segments in use summed over steps
+   long    qualSteps;                  // water quality time steps taken
+   long    reversals;                  // flow reversals
+   long    sorts;                      // full sorts of the nodes
+   long    repairs;                    // node orders repaired
+   long    reorders;                   // node orders taken from the cache
+}  Sprofile;
+
+typedef struct                         // COMPILED CHEMISTRY FILES
+{
+   char   *Fname;                      // Prefix used for all file names
+   char   TempName[L_tmpnam];          // Name of temporary file
+   char   srcFile[MAXFNAME];           // Name of source code file
+   char   objFile[MAXFNAME];           // Name of object file
+   char   libFile[MAXFNAME];           // Name of library file
+   int    Compiled;                    // Flag for compilation step
+   int    Cached;                      // Flag for library kept in a cache
+   void   *hDLL;                       // Handle to loaded library
+}  ScompiledChem;
+
+typedef struct                         // HYDRAULICS FILE INDEX
+{
+   int    Nperiods;                    // Number of hydraulic periods in file
+   int    Period;                      // Index of next period to be read
+   long   RecordSize;                  // Bytes used by each period's record
+   long   Size;                        // Bytes in the whole file
+   long   *Time;                       // Starting time of each period (sec)
+   char   *Map;                        // File contents mapped into memory
+   char   *Buf;                        // Record buffer if file isn't mapped
+   void   *hMap;                       // Handle to the file mapping
+}  ShydIndex;
+
+typedef struct ShydTimeline            // SHARED HYDRAULIC SOLUTION
+{
+   int    Nnodes,                      // Number of nodes
+          Nlinks,                      // Number of links
+          Nperiods;                    // Number of hydraulic periods
+   long   Dur;                         // Duration of hydraulics (sec)
+   long   *Time;                       // Starting time of each period (sec)
+   long   *Step;                       // Time step to next period (sec)
+   REAL4  *D,                          // Node demands in each period
+          *H,                          // Node heads in each period
+          *Q;                          // Link flows in each period
+   char   *FlowDir;                    // Link flow directions in each period
+   int    Users;                       // Number of projects using it
+   int    Released;                    // TRUE once its handle is freed
+}  ShydTimeline;
+
+typedef struct                         // INPUTS AS READ FROM THE INPUT FILE
+{
+   double *NodeC0,                     // Initial concentrations at nodes
+          *LinkC0,                     // Initial concentrations in links
+          *LinkParam,                  // Reaction parameters of pipes
+          *TankParam,                  // Reaction parameters of tanks
+          *Const;                      // Reaction constants
+   struct Ssource *Sources;            // Water quality sources
+   int    *SourceNode,                 // Node of each source
+          Nsources;                    // Number of sources
+}  Sbaseline;
+
+typedef struct Sproject                // MSX PROJECT VARIABLES
 {
    TFile  HydFile,                     // EPANET hydraulics file
           MsxFile,                     // MSX input file
@@ -428,7 +612,8 @@ typedef struct                         // MSX PROJECT VARIABLES
           RptFile;                     // MSX report file
 
    char   Title[MAXLINE+1],            // Project title
-          Msg[MAXLINE+1];              // Message string
+          Msg[MAXLINE+1],              // Message string
+          CacheDir[MAXFNAME+1];        // Compiled chemistry cache directory
 
    int    Nobjects[MAX_OBJECTS],       // Numbers of each type of object
           Unitsflag,                   // Unit system flag
@@ -437,6 +622,15 @@ typedef struct                         // MSX PROJECT VARIABLES
           Rptflag,                     // Report results flag
           Coupling,                    // Degree of coupling for solving DAE's
           Compiler,                    // chemistry function compiler code     //1.1.00 
+          OutFormat,                   // Binary output file layout
+          MaxSegs,                     // Max. segments per pipe (0 = no limit)
+          LazyReact,                   // TRUE if dormant segments skip reactions
+          Jacobian,                    // Method used to find Jacobians
+          ReuseJac,                    // Max. reuses of a Jacobian (0 = none)
+          Profiling,                   // TRUE if parts of a run are timed
+          MassCheck,                   // TRUE if mass balance checked each step
+          OutSubset,                   // TRUE if only reported results saved
+          WakeSegs,                    // TRUE if dormant segments must catch up
           AreaUnits,                   // Surface area units
           RateUnits,                   // Reaction rate time units
           Solver,                      // Choice of ODE solver
@@ -448,10 +642,14 @@ typedef struct                         // MSX PROJECT VARIABLES
 
    long   HydOffset,                   // Hydraulics file byte offset
           Qstep,                       // Quality time step (sec)
+          ReactStep,                   // Reaction time step (sec, 0 = Qstep)
+          ReactBlock,                  // Length of current reaction step (sec)
+          ReactLeft,                   // Transport left in reaction step (sec)
           Pstep,                       // Time pattern time step (sec)
           Pstart,                      // Starting pattern time (sec)
           Rstep,                       // Reporting time step (sec)
           Rstart,                      // Time when reporting starts
+          Rfirst,                      // Time of first period in output file
           Rtime,                       // Next reporting time (sec)
           Htime,                       // Current hydraulic time (sec)
           Qtime,                       // Current quality time (sec)
@@ -485,13 +683,99 @@ typedef struct                         // MSX PROJECT VARIABLES
    char      OutOfMemory;     // out of memory indicator
    Padjlist* Adjlist;                   // Node adjacency lists
    Pseg* NewSeg;         // new segment added to each pipe
-   Pseg  FreeSeg;        // pointer to unused segment
    FlowDirection *FlowDir;        // flow direction for each pipe
    SmassBalance MassBalance;
-   alloc_handle_t* QualPool;       // memory pool
+   SsolverStats SolverStats;           // Work done by the chemistry solvers
+   Sprofile  Profile;                  // Times and counts of a run's work
+   Sarena* SegArena;      // memory arena for segments
+   Sarena* SpareArena;    // memory arena that segments are packed into
+   int     SegClass;      // size class of a segment in both arenas
 
    double* MassIn;        // mass inflow of each species to each node
    double* SourceIn;      // external mass inflow of each species from WQ source;
    int* SortedNodes;
+   int* LevelNodes;       // sorted nodes grouped by level of dependency
+   int* LevelStart;       // position in LevelNodes where each level begins
+   int  Nlevels;          // number of levels of sorted nodes
+   double* NodeMass;      // mass balance terms of nodes mixed in parallel
+   int* SortPos;          // position of each node in SortedNodes
+   int* SortWork;         // scratch arrays used to sort nodes
+   char* SortMark;        // scratch flags used to sort nodes
+   char* LinkMark;        // scratch flags used to sort nodes
+   int* ChangedLinks;     // links whose flow direction last changed
+   int  Nchanged;         // number of links in ChangedLinks
+   int  SortAcyclic;      // TRUE if SortedNodes has no cycles
+   SnodeOrder* OrderCache;  // recently used node orderings
+   long OrderClock;       // counts uses of node orderings
+
+   Sarena   *HashArena;                // Memory arena for hash table IDs
+   HTtable  *Htable[MAX_OBJECTS];      // Hash tables for object ID names
+
+   int    NumSpecies,                  // Total number of species
+          NumPipeRateSpecies,          // Number of species with pipe rates
+          NumTankRateSpecies,          // Number of species with tank rates
+          NumPipeFormulaSpecies,       // Number of species with pipe formulas
+          NumTankFormulaSpecies,       // Number of species with tank formulas
+          NumPipeEquilSpecies,         // Number of species with pipe equilibria
+          NumTankEquilSpecies,         // Number of species with tank equilibria
+          *PipeRateSpecies,            // Species governed by pipe reactions
+          *TankRateSpecies,            // Species governed by tank reactions
+          *PipeEquilSpecies,           // Species governed by pipe equilibria
+          *TankEquilSpecies,           // Species governed by tank equilibria
+          LastIndex[MAX_OBJECTS],      // Last index of given type of variable
+          *ReactLinks,                 // Pipes to react in order of cost
+          *PipeRateOrder,              // Terms & formulas used by pipe rates
+          *TankRateOrder,              // Terms & formulas used by tank rates
+          *PipeEquilOrder,             // Terms & formulas used by pipe equilibria
+          *TankEquilOrder,             // Terms & formulas used by tank equilibria
+          *PipeFormulaOrder,           // Terms & formulas used by pipe formulas
+          *TankFormulaOrder;           // Terms & formulas used by tank formulas
+   Sjacobian *PipeRateJac,             // Analytic Jacobians of the chemistry
+          *TankRateJac,                //   systems (NULL if found numerically)
+          *PipeEquilJac,
+          *TankEquilJac;
+   double *Atol,                       // Absolute concentration tolerances
+          *Rtol;                       // Relative concentration tolerances
+
+   MSXGETRATES    MSXgetPipeRates;     // Compiled chemistry functions
+   MSXGETRATES    MSXgetTankRates;
+   MSXGETEQUIL    MSXgetPipeEquil;
+   MSXGETEQUIL    MSXgetTankEquil;
+   MSXGETFORMULAS MSXgetPipeFormulas;
+   MSXGETFORMULAS MSXgetTankFormulas;
+   MSXGETBATCHRATES MSXgetPipeRatesBatch;
+   MSXGETJACOBIAN MSXgetPipeRatesJac;  // Compiled Jacobian functions (NULL if
+   MSXGETJACOBIAN MSXgetTankRatesJac;  //   not in the library)
+   MSXGETJACOBIAN MSXgetPipeEquilJac;
+   MSXGETJACOBIAN MSXgetTankEquilJac;
+   ScompiledChem  CompiledChem;        // Files used to compile chemistry
+   ShydIndex      HydIndex;            // Index of hydraulics file periods
+   ShydTimeline   *HydTimeline;        // Shared hydraulics used instead of file
+   Sbaseline      Baseline;            // Inputs restored by MSXreset
+
+   long   ResultsOffset,               // Offset byte where results begin
+          NodeBytesPerPeriod,          // Bytes per time period used by all nodes
+          LinkBytesPerPeriod,          // Bytes per time period used by all links
+          ChunkPeriods;                // Periods per chunk of a columnar file
+
+   SoutSet OutSet[MAX_OBJECTS];        // Nodes, links & species saved to the
+                                       //   output file
+
+   void   *Writer;                     // Writer of results to output file
+
+   int    MathError;                   // Math error flag
+   int    MathErrorElement;            // Rank of the element the math error
+                                       //   occurred in (see MSXchem_element)
+   char   MathErrorMsg[MAXMSG+1];      // Math error message
 
 } MSXproject;
+
+//-----------------------------------------------------------------------------
+//  Project whose data are accessed through MSX by the calling thread
+//  (see MSXproj_setCurrent in msxproj.c)
+//-----------------------------------------------------------------------------
+extern MSXproject *MSXcurrent;
+#ifdef _OPENMP
+#pragma omp threadprivate(MSXcurrent)
+#endif
+#define MSX (*MSXcurrent)
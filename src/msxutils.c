@@ -31,6 +31,13 @@
   #define WINDOWS
 #endif
 
+#ifdef WINDOWS
+  #include <windows.h>
+#else
+  #include <sys/time.h>
+  #include <sys/resource.h>
+#endif
+
 #define UCHAR(x) (((x) >= 'a' && (x) <= 'z') ? ((x)&~32) : (x))
 #define TINY1 1.0e-20
 
@@ -526,3 +533,65 @@ void jacobian(double *x, int n, double *f, double *w, double **a,
 */
 
 }
+
+//=============================================================================
+
+double MSXutils_wallClock()
+/*
+**  Purpose:
+**    reads a wall clock that is used to time parts of a run.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    the time in seconds since some fixed moment.
+*/
+{
+#ifdef WINDOWS
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + 1.0e-6 * (double)tv.tv_usec;
+#endif
+}
+
+//=============================================================================
+
+double MSXutils_cpuClock()
+/*
+**  Purpose:
+**    reads the CPU time used by all threads of the process.
+**
+**  Input:
+**    none.
+**
+**  Returns:
+**    the CPU time in seconds.
+*/
+{
+#ifdef WINDOWS
+    FILETIME created, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    if ( !GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user) )
+        return 0.0;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return 1.0e-7 * (double)(k.QuadPart + u.QuadPart);
+#else
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)ru.ru_utime.tv_sec + 1.0e-6 * (double)ru.ru_utime.tv_usec +
+           (double)ru.ru_stime.tv_sec + 1.0e-6 * (double)ru.ru_stime.tv_usec;
+#endif
+}
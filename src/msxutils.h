@@ -51,3 +51,9 @@ void solve(double **a, int n, int *indx, double b[]);
 // Computes the Jacobian matrix of a set of functions
 void jacobian(double *x, int n, double *f, double *w, double **a,
               void (*func)(double, double*, int, double*));
+
+// Reads a wall clock in seconds
+double MSXutils_wallClock(void);
+
+// Reads the CPU time used by the process in seconds
+double MSXutils_cpuClock(void);
@@ -23,6 +23,10 @@
 //-------------------
 MSXNewton MSXNewtonSolver;
 
+// Largest ratio of successive errors for which an iteration with a reused
+// Jacobian is considered to converge
+#define MAXRATE 0.5
+
 #ifdef _OPENMP
 #pragma omp threadprivate(MSXNewtonSolver)
 #endif
@@ -43,35 +47,22 @@ int newton_open(int n)
 **  Note:
 **    All arrays are 1-based so an extra memory location
 **    must be allocated for the unused 0-th position.
+**    Only the calling thread's copy of the solver is opened and
+**    its arrays are re-used if they already hold n equations.
 */
 {
-    int errorcode = 1;
-#ifdef _OPENMP 
-#pragma omp parallel
-    {
-#endif
-        MSXNewtonSolver.Nmax = 0;
-        MSXNewtonSolver.Indx = NULL;
-        MSXNewtonSolver.F = NULL;
-        MSXNewtonSolver.W = NULL;
-        MSXNewtonSolver.Indx = (int*)calloc(n + 1, sizeof(int));
-        MSXNewtonSolver.F = (double*)calloc(n + 1, sizeof(double));
-        MSXNewtonSolver.W = (double*)calloc(n + 1, sizeof(double));
-        MSXNewtonSolver.J = createMatrix(n + 1, n + 1);
-#ifdef _OPENMP
-#pragma omp critical
-        {
-#endif
-            if (!MSXNewtonSolver.Indx || !MSXNewtonSolver.F || !MSXNewtonSolver.W || !MSXNewtonSolver.J) 
-                errorcode = 0;
-#ifdef _OPENMP 
-        }
-#endif
-        MSXNewtonSolver.Nmax = n;
-#ifdef _OPENMP
-    }
-#endif
-    return errorcode;
+    if ( MSXNewtonSolver.J && MSXNewtonSolver.Nmax >= n ) return 1;
+    newton_close();
+    MSXNewtonSolver.Indx = (int*)calloc(n + 1, sizeof(int));
+    MSXNewtonSolver.F = (double*)calloc(n + 1, sizeof(double));
+    MSXNewtonSolver.W = (double*)calloc(n + 1, sizeof(double));
+    MSXNewtonSolver.X0 = (double*)calloc(n + 1, sizeof(double));
+    MSXNewtonSolver.J = createMatrix(n + 1, n + 1);
+    if (!MSXNewtonSolver.Indx || !MSXNewtonSolver.F || !MSXNewtonSolver.W || !MSXNewtonSolver.J ||
+        !MSXNewtonSolver.X0) 
+        return 0;
+    MSXNewtonSolver.Nmax = n;
+    return 1;
 }
 
 //=============================================================================
@@ -79,30 +70,74 @@ int newton_open(int n)
 void newton_close()
 /*
 **  Purpose:
-**    closes the algebraic solver.
+**    closes the calling thread's copy of the algebraic solver.
 **
 **  Input:
 **    none
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        if (MSXNewtonSolver.Indx) { free(MSXNewtonSolver.Indx); MSXNewtonSolver.Indx = NULL; }
-        if (MSXNewtonSolver.F) { free(MSXNewtonSolver.F); MSXNewtonSolver.F = NULL; }
-        if (MSXNewtonSolver.W) { free(MSXNewtonSolver.W); MSXNewtonSolver.W = NULL; }
-        freeMatrix(MSXNewtonSolver.J);
-        MSXNewtonSolver.J = NULL;
-#ifdef _OPENMP
-    }
-#endif
+    if (MSXNewtonSolver.Indx) { free(MSXNewtonSolver.Indx); MSXNewtonSolver.Indx = NULL; }
+    if (MSXNewtonSolver.F) { free(MSXNewtonSolver.F); MSXNewtonSolver.F = NULL; }
+    if (MSXNewtonSolver.W) { free(MSXNewtonSolver.W); MSXNewtonSolver.W = NULL; }
+    if (MSXNewtonSolver.X0) { free(MSXNewtonSolver.X0); MSXNewtonSolver.X0 = NULL; }
+    freeMatrix(MSXNewtonSolver.J);
+    MSXNewtonSolver.J = NULL;
+    MSXNewtonSolver.Jn = 0;
+    MSXNewtonSolver.Nmax = 0;
+}
+
+//=============================================================================
+
+void newton_setReuse(int maxuses)
+/*
+**  Purpose:
+**    sets how many iterations of the calling thread's solver may use a
+**    Jacobian factorized for an earlier iteration.
+**
+**  Input:
+**    maxuses = max. number of times a Jacobian is reused (0 if never).
+**
+**  Note:
+**    A reused Jacobian (which may come from an earlier call for the same
+**    function) makes these modified Newton iterations. It is replaced
+**    whenever an iteration fails to cut the error by MAXRATE, and a solve
+**    that fails to converge with reused Jacobians is repeated without them.
+**    Any Jacobian saved before this call is discarded.
+*/
+{
+    MSXNewtonSolver.Reuse = maxuses;
+    MSXNewtonSolver.Jn = 0;
+}
+
+//=============================================================================
+
+void newton_getStats(long *nsolve, long *niter, long *njac, long *nreused)
+/*
+**  Purpose:
+**    returns and clears the calling thread's solver work counters.
+**
+**  Output:
+**    nsolve = number of systems solved
+**    niter = number of iterations made
+**    njac = number of Jacobians evaluated
+**    nreused = number of iterations that reused a factorized Jacobian.
+*/
+{
+    *nsolve = MSXNewtonSolver.Nsolve;
+    *niter = MSXNewtonSolver.Niter;
+    *njac = MSXNewtonSolver.Njac;
+    *nreused = MSXNewtonSolver.Nreused;
+    MSXNewtonSolver.Nsolve = 0;
+    MSXNewtonSolver.Niter = 0;
+    MSXNewtonSolver.Njac = 0;
+    MSXNewtonSolver.Nreused = 0;
 }
 
 //=============================================================================
 
 int newton_solve(double x[], int n, int maxit, int numsig, 
-                 void (*func)(double, double*, int, double*))
+                 void (*func)(double, double*, int, double*),
+                 void (*jac)(double, double*, int, double**))
 /*
 **  Purpose:
 **    uses newton-raphson iterations to solve n nonlinear eqns.
@@ -112,7 +147,9 @@ int newton_solve(double x[], int n, int maxit, int numsig,
 **    n = number of equations
 **    maxit = max. number of iterations allowed
 **    numsig = number of significant digits in error
-**    func = pointer to the function that returns the function values at x.
+**    func = pointer to the function that returns the function values at x
+**    jac = pointer to the function that returns the Jacobian of func at x
+**          (or NULL if it is found by finite differences).
 **
 **  Returns:
 **    number of iterations if successful, -1 if Jacobian is singular,
@@ -124,26 +161,61 @@ int newton_solve(double x[], int n, int maxit, int numsig,
 **      x = vector of unknowns being solved for
 **      n = number of unknowns
 **      f = vector of function values evaluated at x.
+**    and those of jac are the same except for the last one, a matrix
+**    that receives the Jacobian at x.
 */
 {
-    int i, k;
-	double errx, errmax, cscal, relconvg = pow(10.0, -numsig);
+    int i, k, fresh, saved;
+	double errx, errmax, errlast = 0.0, cscal, relconvg = pow(10.0, -numsig);
+    int reuse = MSXNewtonSolver.Reuse > 0;
 
     // --- check that system was sized adequetely
 
     if ( n > MSXNewtonSolver.Nmax ) return -3;
+    MSXNewtonSolver.Nsolve++;
+
+    // --- see if a Jacobian factorized by an earlier call can be used
+
+    fresh = 1;
+    if ( reuse )
+    {
+        for (i=1; i<=n; i++) MSXNewtonSolver.X0[i] = x[i];
+        fresh = MSXNewtonSolver.Jn != n || MSXNewtonSolver.Jfunc != func ||
+                MSXNewtonSolver.Jage >= MSXNewtonSolver.Reuse;
+    }
 
     // --- use up to maxit iterations to find a solution
 
 	for (k=1; k<=maxit; k++) 
 	{
-        // --- evaluate the Jacobian matrix
+        MSXNewtonSolver.Niter++;
+        // --- evaluate the Jacobian matrix (or only the functions if the
+        //     factorized Jacobian is reused)
 
-        jacobian(x, n, MSXNewtonSolver.F, MSXNewtonSolver.W, MSXNewtonSolver.J, func);
+        if ( !fresh )
+        {
+            func(0.0, x, n, MSXNewtonSolver.F);
+            MSXNewtonSolver.Jage++;
+            MSXNewtonSolver.Nreused++;
+        }
+        else if ( jac )
+        {
+            func(0.0, x, n, MSXNewtonSolver.F);
+            jac(0.0, x, n, MSXNewtonSolver.J);
+        }
+        else jacobian(x, n, MSXNewtonSolver.F, MSXNewtonSolver.W, MSXNewtonSolver.J, func);
 
         // --- factorize the Jacobian
 
-        if ( !factorize(MSXNewtonSolver.J, n, MSXNewtonSolver.W, MSXNewtonSolver.Indx) ) return -1;
+        if ( fresh )
+        {
+            MSXNewtonSolver.Njac++;
+            MSXNewtonSolver.Jn = 0;
+            if ( !factorize(MSXNewtonSolver.J, n, MSXNewtonSolver.W, MSXNewtonSolver.Indx) ) return -1;
+            MSXNewtonSolver.Jfunc = func;
+            MSXNewtonSolver.Jn = n;
+            MSXNewtonSolver.Jage = 0;
+        }
 
         // --- solve for the updates to x (returned in F)
 
@@ -162,8 +234,30 @@ int newton_solve(double x[], int n, int maxit, int numsig,
             if (errx > errmax) errmax = errx;
         }
 		if (errmax <= relconvg) return k;
+
+        // --- decide if the next iteration needs a new Jacobian
+
+        if ( reuse )
+        {
+            fresh = MSXNewtonSolver.Jage >= MSXNewtonSolver.Reuse ||
+                    (!fresh && k > 1 && !(errmax <= MAXRATE*errlast));
+        }
+        errlast = errmax;
 	}
 
+    // --- try again without reused Jacobians if they may be at fault
+
+    if ( reuse )
+    {
+        for (i=1; i<=n; i++) x[i] = MSXNewtonSolver.X0[i];
+        saved = MSXNewtonSolver.Reuse;
+        MSXNewtonSolver.Reuse = 0;
+        MSXNewtonSolver.Nsolve--;
+        k = newton_solve(x, n, maxit, numsig, func, jac);
+        MSXNewtonSolver.Reuse = saved;
+        return k;
+    }
+
     // --- return error code if no convergence
 
 	return -2;
@@ -18,6 +18,15 @@ typedef struct
     double* F;            // function & adjustment vector
     double* W;            // work vector
     double** J;           // Jacobian matrix
+    double* X0;           // starting solution vector
+    void     (*Jfunc)(double, double*, int, double*); // function J belongs to
+    int      Jn;          // number of equations of J (0 if none)
+    int      Jage;        // times J has been reused
+    int      Reuse;       // max. times J may be reused
+    long     Nsolve;      // systems solved
+    long     Njac;        // Jacobians evaluated
+    long     Nreused;     // iterations that reused a factorized Jacobian
+    long     Niter;       // iterations made
 }MSXNewton;
 
 // Opens the equation solver system
@@ -26,6 +35,14 @@ int  newton_open(int n);
 // Closes the equation solver system
 void newton_close(void);
 
+// Sets the number of iterations that may reuse a factorized Jacobian
+void newton_setReuse(int maxuses);
+
+// Returns (and clears) the counts of systems solved, of iterations made
+// and of Jacobians evaluated and reused
+void newton_getStats(long *nsolve, long *niter, long *njac, long *nreused);
+
 // Applies the solver to a specific system of equations
 int  newton_solve(double x[], int n, int maxit, int numsig,  
-                  void (*func)(double, double*, int, double*));
+                  void (*func)(double, double*, int, double*),
+                  void (*jac)(double, double*, int, double**));
@@ -45,39 +45,29 @@ int rk5_open(int n, int itmax, int adjust)
 **
 **  Returns:
 **    1 if successful and 0 if not.
+**
+**  Note:
+**    Only the calling thread's copy of the solver is opened. Its
+**    arrays are re-used if they already hold n equations.
 */
 {
     int n1 = n+1;
-    int errorcode = 1;
     MSXRungeKuttaSolver.Report = NULL;
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        MSXRungeKuttaSolver.Nmax = 0;
-        MSXRungeKuttaSolver.Itmax = itmax;
-        MSXRungeKuttaSolver.Adjust = adjust;
-        MSXRungeKuttaSolver.Ynew = (double*)calloc(n1, sizeof(double));
-        MSXRungeKuttaSolver.Ak = (double*)calloc(6 * n1, sizeof(double));
-#ifdef _OPENMP
-#pragma omp critical
-        {
-#endif
-         if (!MSXRungeKuttaSolver.Ynew || !MSXRungeKuttaSolver.Ak) errorcode = 0;
-#ifdef _OPENMP 
-        }
-#endif
-        MSXRungeKuttaSolver.Nmax = n;
-        MSXRungeKuttaSolver.K1 = (MSXRungeKuttaSolver.Ak);
-        MSXRungeKuttaSolver.K2 = ((MSXRungeKuttaSolver.Ak)+(n1));
-        MSXRungeKuttaSolver.K3 = ((MSXRungeKuttaSolver.Ak)+(2 * n1));
-        MSXRungeKuttaSolver.K4 = ((MSXRungeKuttaSolver.Ak)+(3 * n1));
-        MSXRungeKuttaSolver.K5 = ((MSXRungeKuttaSolver.Ak)+(4 * n1));
-        MSXRungeKuttaSolver.K6 = ((MSXRungeKuttaSolver.Ak)+(5 * n1));
-#ifdef _OPENMP
-    }
-#endif
-    return errorcode;
+    MSXRungeKuttaSolver.Itmax = itmax;
+    MSXRungeKuttaSolver.Adjust = adjust;
+    if ( MSXRungeKuttaSolver.Ynew && MSXRungeKuttaSolver.Nmax >= n ) return 1;
+    rk5_close();
+    MSXRungeKuttaSolver.Ynew = (double*)calloc(n1, sizeof(double));
+    MSXRungeKuttaSolver.Ak = (double*)calloc(6 * n1, sizeof(double));
+    if (!MSXRungeKuttaSolver.Ynew || !MSXRungeKuttaSolver.Ak) return 0;
+    MSXRungeKuttaSolver.Nmax = n;
+    MSXRungeKuttaSolver.K1 = (MSXRungeKuttaSolver.Ak);
+    MSXRungeKuttaSolver.K2 = ((MSXRungeKuttaSolver.Ak)+(n1));
+    MSXRungeKuttaSolver.K3 = ((MSXRungeKuttaSolver.Ak)+(2 * n1));
+    MSXRungeKuttaSolver.K4 = ((MSXRungeKuttaSolver.Ak)+(3 * n1));
+    MSXRungeKuttaSolver.K5 = ((MSXRungeKuttaSolver.Ak)+(4 * n1));
+    MSXRungeKuttaSolver.K6 = ((MSXRungeKuttaSolver.Ak)+(5 * n1));
+    return 1;
 }
 
 //=============================================================================
@@ -85,22 +75,33 @@ int rk5_open(int n, int itmax, int adjust)
 void rk5_close()
 /*
 **  Purpose:
-**    Closes the RK5 solver.
+**    Closes the calling thread's copy of the RK5 solver.
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        if (MSXRungeKuttaSolver.Ynew) free(MSXRungeKuttaSolver.Ynew);
-        MSXRungeKuttaSolver.Ynew = NULL;
-        if (MSXRungeKuttaSolver.Ak) free(MSXRungeKuttaSolver.Ak);
-        MSXRungeKuttaSolver.Ak = NULL;
-        MSXRungeKuttaSolver.Nmax = 0;
-        MSXRungeKuttaSolver.Report = NULL;
-#ifdef _OPENMP
-    }
-#endif
+    if (MSXRungeKuttaSolver.Ynew) free(MSXRungeKuttaSolver.Ynew);
+    MSXRungeKuttaSolver.Ynew = NULL;
+    if (MSXRungeKuttaSolver.Ak) free(MSXRungeKuttaSolver.Ak);
+    MSXRungeKuttaSolver.Ak = NULL;
+    MSXRungeKuttaSolver.Nmax = 0;
+    MSXRungeKuttaSolver.Report = NULL;
+}
+
+//=============================================================================
+
+void rk5_getSteps(long *nsteps, long *nrejects)
+/*
+**  Purpose:
+**    returns and clears the calling thread's counts of integration steps.
+**
+**  Output:
+**    nsteps = number of steps accepted
+**    nrejects = number of steps rejected.
+*/
+{
+    *nsteps = MSXRungeKuttaSolver.Nsteps;
+    *nrejects = MSXRungeKuttaSolver.Nrejects;
+    MSXRungeKuttaSolver.Nsteps = 0;
+    MSXRungeKuttaSolver.Nrejects = 0;
 }
 
 //=============================================================================
@@ -263,6 +264,7 @@ int rk5_integrate(double y[], int n, double t, double tnext,
         {
            facold = fmax(err, 1.0e-4);
             naccpt++;
+            MSXRungeKuttaSolver.Nsteps++;
             for (i=1; i<=n; i++)
             {
                 MSXRungeKuttaSolver.K1[i] = MSXRungeKuttaSolver.K2[i];
@@ -283,6 +285,7 @@ int rk5_integrate(double y[], int n, double t, double tnext,
             if ( adjust ) hnew = h/fmin(facc1, (fac11/SAFE));
             reject = 1; 
             if (naccpt >= 1) nrejct++;   
+            MSXRungeKuttaSolver.Nrejects++;
         }
 
     // --- take another step
@@ -21,6 +21,8 @@ typedef struct
     double* K6;
     double* Ynew;         // updated solution
     void     (*Report) (double, double*, int);
+    long     Nsteps;        // steps accepted
+    long     Nrejects;      // steps rejected
 }MSXRungeKutta;
 // Opens the ODE solver system
 int  rk5_open(int n, int itmax, int adjust);
@@ -28,6 +30,9 @@ int  rk5_open(int n, int itmax, int adjust);
 // Closes the ODE solver system
 void rk5_close(void);
 
+// Returns (and clears) the counts of steps accepted and rejected
+void rk5_getSteps(long *nsteps, long *nrejects);
+
 // Applies the solver to integrate a specific system of ODEs
 int  rk5_integrate(double y[], int n, double t, double tnext,
                    double* htry, double atol[], double rtol[],
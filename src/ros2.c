@@ -42,39 +42,26 @@ int ros2_open(int n, int adjust)
 **
 **  Returns:
 **    1 if successful, 0 if not.
+**
+**  Note:
+**    Only the calling thread's copy of the integrator is opened. Its
+**    arrays are re-used if they already hold n equations.
 */
 {
-    int errorcode = 1;
     int n1 = n + 1;
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
-        MSXRosenbrockSolver.Nmax = n;
-        MSXRosenbrockSolver.Adjust = adjust;
-        MSXRosenbrockSolver.K1 = NULL;
-        MSXRosenbrockSolver.K2 = NULL;
-        MSXRosenbrockSolver.Jindx = NULL;
-        MSXRosenbrockSolver.Ynew = NULL;
-        MSXRosenbrockSolver.A = NULL;
-        MSXRosenbrockSolver.K1 = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.K2 = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.Jindx = (int*)calloc(n1, sizeof(int));
-        MSXRosenbrockSolver.Ynew = (double*)calloc(n1, sizeof(double));
-        MSXRosenbrockSolver.A = createMatrix(n1, n1);
-#ifdef _OPENMP
-#pragma omp critical
-    {
-#endif
-     if (!MSXRosenbrockSolver.Jindx || !MSXRosenbrockSolver.Ynew || !MSXRosenbrockSolver.K1 || !MSXRosenbrockSolver.K2) errorcode = 0;
-     if (!MSXRosenbrockSolver.A) errorcode = 0;
-#ifdef _OPENMP
-    }
-#endif
-#ifdef _OPENMP
-    }
-#endif
-    return errorcode;
+    MSXRosenbrockSolver.Adjust = adjust;
+    if ( MSXRosenbrockSolver.A && MSXRosenbrockSolver.Nmax >= n ) return 1;
+    ros2_close();
+    MSXRosenbrockSolver.K1 = (double*)calloc(n1, sizeof(double));
+    MSXRosenbrockSolver.K2 = (double*)calloc(n1, sizeof(double));
+    MSXRosenbrockSolver.Jindx = (int*)calloc(n1, sizeof(int));
+    MSXRosenbrockSolver.Ynew = (double*)calloc(n1, sizeof(double));
+    MSXRosenbrockSolver.A = createMatrix(n1, n1);
+    MSXRosenbrockSolver.J = createMatrix(n1, n1);
+    if (!MSXRosenbrockSolver.Jindx || !MSXRosenbrockSolver.Ynew || !MSXRosenbrockSolver.K1 || !MSXRosenbrockSolver.K2) return 0;
+    if (!MSXRosenbrockSolver.A || !MSXRosenbrockSolver.J) return 0;
+    MSXRosenbrockSolver.Nmax = n;
+    return 1;
 }
 
 //=============================================================================
@@ -82,32 +69,96 @@ int ros2_open(int n, int adjust)
 void ros2_close()
 /*
 **  Purpose:
-**    closes the ROS2 integrator.
+**    closes the calling thread's copy of the ROS2 integrator.
 **
 **  Input:
 **    none.
 */
 {
-#ifdef _OPENMP
-#pragma omp parallel
-    {
-#endif
     if (MSXRosenbrockSolver.Jindx) { free(MSXRosenbrockSolver.Jindx); MSXRosenbrockSolver.Jindx = NULL; }
     if (MSXRosenbrockSolver.Ynew) { free(MSXRosenbrockSolver.Ynew); MSXRosenbrockSolver.Ynew = NULL; }
     if (MSXRosenbrockSolver.K1) { free(MSXRosenbrockSolver.K1); MSXRosenbrockSolver.K1 = NULL; }
     if (MSXRosenbrockSolver.K2) { free(MSXRosenbrockSolver.K2); MSXRosenbrockSolver.K2 = NULL; }
     freeMatrix(MSXRosenbrockSolver.A);
     MSXRosenbrockSolver.A = NULL;
-#ifdef _OPENMP
-    }
-#endif
+    freeMatrix(MSXRosenbrockSolver.J);
+    MSXRosenbrockSolver.J = NULL;
+    MSXRosenbrockSolver.Jn = 0;
+    MSXRosenbrockSolver.LUghinv = 0.0;
+    MSXRosenbrockSolver.Nmax = 0;
+}
+
+//=============================================================================
+
+void ros2_setReuse(int maxuses)
+/*
+**  Purpose:
+**    sets how many steps the calling thread's integrator may take with
+**    a Jacobian evaluated for an earlier step.
+**
+**  Input:
+**    maxuses = max. number of times a Jacobian is reused (0 if never).
+**
+**  Note:
+**    ROS2 keeps its order of accuracy with an approximate Jacobian
+**    (it is a W-method), so a Jacobian saved from an earlier step,
+**    segment or call of the same function can be reused. A step that
+**    is rejected while using a reused Jacobian has it re-evaluated.
+**    Any Jacobian saved before this call is discarded.
+*/
+{
+    MSXRosenbrockSolver.Reuse = maxuses;
+    MSXRosenbrockSolver.Jn = 0;
+}
+
+//=============================================================================
+
+void ros2_getStats(long *njac, long *nreused, long *nfactor, long *nfactorReused)
+/*
+**  Purpose:
+**    returns and clears the calling thread's integrator work counters.
+**
+**  Output:
+**    njac = number of Jacobians evaluated
+**    nreused = number of steps that reused a saved Jacobian
+**    nfactor = number of factorizations made
+**    nfactorReused = number of steps that reused a factorization.
+*/
+{
+    *njac = MSXRosenbrockSolver.Njac;
+    *nreused = MSXRosenbrockSolver.Nreused;
+    *nfactor = MSXRosenbrockSolver.Nfactor;
+    *nfactorReused = MSXRosenbrockSolver.NfactorReused;
+    MSXRosenbrockSolver.Njac = 0;
+    MSXRosenbrockSolver.Nreused = 0;
+    MSXRosenbrockSolver.Nfactor = 0;
+    MSXRosenbrockSolver.NfactorReused = 0;
+}
+
+//=============================================================================
+
+void ros2_getSteps(long *nsteps, long *nrejects)
+/*
+**  Purpose:
+**    returns and clears the calling thread's counts of integration steps.
+**
+**  Output:
+**    nsteps = number of steps accepted
+**    nrejects = number of steps rejected.
+*/
+{
+    *nsteps = MSXRosenbrockSolver.Nsteps;
+    *nrejects = MSXRosenbrockSolver.Nrejects;
+    MSXRosenbrockSolver.Nsteps = 0;
+    MSXRosenbrockSolver.Nrejects = 0;
 }
 
 //=============================================================================
       
 int ros2_integrate(double y[], int n, double t, double tnext,
                    double* htry, double atol[], double rtol[],
-                   void (*func)(double, double*, int, double*))
+                   void (*func)(double, double*, int, double*),
+                   void (*jac)(double, double*, int, double**))
 /*
 **  Purpose:
 **    integrates a system of ODEs over a specified time interval.
@@ -122,6 +173,8 @@ int ros2_integrate(double y[], int n, double t, double tnext,
 **    atol[1..n] = vector of absolute tolerances on the variables y
 **    rtol[1..n] = vector of relative tolerances on the variables y
 **    func = name of the function that computes dy/dt for each y
+**    jac = name of the function that computes the Jacobian of func
+**          (or NULL if it is found by finite differences)
 **
 **  Output:
 **    htry = size of the last full time step taken.
@@ -137,6 +190,8 @@ int ros2_integrate(double y[], int n, double t, double tnext,
 **      y[1..n] = vector of dependent variable values
 **      n = number of dependent variables
 **      dfdy[1..n] = vector of derivative values computed.
+**     The arguments to jac() are the same except for the last one,
+**     a[1..n][1..n], which receives the Jacobian.
 **
 **  2. The arrays used in this function are 1-based, so
 **     they must have been sized to n+1 when first created.
@@ -146,9 +201,11 @@ int ros2_integrate(double y[], int n, double t, double tnext,
     double g, ghinv, ghinv1, dghinv, ytol;
     double h, hold, hmin, hmax, tplus;
     double ej, err, factor, facmax;
-    int    nfcn, njac, naccept, nreject, j;
+    int    nfcn, njac, naccept, nreject, i, j;
     int    isReject;
 	int    adjust = MSXRosenbrockSolver.Adjust;
+    int    reuse = MSXRosenbrockSolver.Reuse > 0;
+    double **a;
 
 // --- Initialize counters, etc.
 
@@ -198,26 +255,71 @@ int ros2_integrate(double y[], int n, double t, double tnext,
             tplus = tnext;
         }
 
-    // --- Re-compute the Jacobian if step size accepted
+    // --- Re-compute the Jacobian if step size accepted (when reusing
+    //     Jacobians, a saved one is taken instead if it is still young
+    //     enough, and one that led to a rejected step is re-computed)
 
-        if ( isReject == 0 )
+        if ( reuse && isReject == 0 && MSXRosenbrockSolver.Jn == n &&
+             MSXRosenbrockSolver.Jfunc == func &&
+             MSXRosenbrockSolver.Jage < MSXRosenbrockSolver.Reuse )
+        {
+            MSXRosenbrockSolver.Jage++;
+            MSXRosenbrockSolver.Nreused++;
+        }
+        else if ( isReject == 0 || (reuse && MSXRosenbrockSolver.Jn != n) )
         {
-            jacobian(y, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.K2, MSXRosenbrockSolver.A, func);
+            a = reuse ? MSXRosenbrockSolver.J : MSXRosenbrockSolver.A;
+            if ( jac ) jac(t, y, n, a);
+            else
+            {
+                jacobian(y, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.K2, a, func);
+                nfcn += 2*n;
+            }
             njac++;
-            nfcn += 2*n;
+            MSXRosenbrockSolver.Njac++;
+            MSXRosenbrockSolver.Jfunc = func;
+            MSXRosenbrockSolver.Jn = n;
+            MSXRosenbrockSolver.Jage = 0;
+            MSXRosenbrockSolver.LUghinv = 0.0;
             ghinv1 = 0.0;
         }
 
-    // --- Update the Jacobian to reflect new step size
+    // --- Update the Jacobian to reflect new step size (a reused
+    //     Jacobian keeps its factorization while the step size is
+    //     unchanged)
 
         ghinv = -1.0 / (g*h);
-        dghinv = ghinv - ghinv1;
-        for (j=1; j<=n; j++)
+        if ( reuse )
+        {
+            if ( ghinv == MSXRosenbrockSolver.LUghinv ) MSXRosenbrockSolver.NfactorReused++;
+            else
+            {
+                for (i=1; i<=n; i++)
+                {
+                    for (j=1; j<=n; j++) MSXRosenbrockSolver.A[i][j] = MSXRosenbrockSolver.J[i][j];
+                    MSXRosenbrockSolver.A[i][i] += ghinv;
+                }
+                MSXRosenbrockSolver.LUghinv = 0.0;
+                if ( !factorize(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.Jindx) )
+                {
+                    MSXRosenbrockSolver.Jn = 0;
+                    return -1;
+                }
+                MSXRosenbrockSolver.LUghinv = ghinv;
+                MSXRosenbrockSolver.Nfactor++;
+            }
+        }
+        else
         {
-            MSXRosenbrockSolver.A[j][j] += dghinv;
+            dghinv = ghinv - ghinv1;
+            for (j=1; j<=n; j++)
+            {
+                MSXRosenbrockSolver.A[j][j] += dghinv;
+            }
+            ghinv1 = ghinv;
+            if ( !factorize(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.Jindx) ) return -1;
+            MSXRosenbrockSolver.Nfactor++;
         }
-        ghinv1 = ghinv;
-        if ( !factorize(MSXRosenbrockSolver.A, n, MSXRosenbrockSolver.K1, MSXRosenbrockSolver.Jindx) ) return -1;
 
     // --- Stage 1 solution
 
@@ -279,7 +381,9 @@ int ros2_integrate(double y[], int n, double t, double tnext,
         {
             isReject = 1;
             nreject++;
+            MSXRosenbrockSolver.Nrejects++;
             h = 0.5*h;
+            if ( reuse && MSXRosenbrockSolver.Jage > 0 ) MSXRosenbrockSolver.Jn = 0;
         }
         else
         {
@@ -292,6 +396,7 @@ int ros2_integrate(double y[], int n, double t, double tnext,
             if ( adjust ) *htry = h;
             t = tplus;    
             naccept++;
+            MSXRosenbrockSolver.Nsteps++;
         }
         
 // --- End of the time loop 
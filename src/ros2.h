@@ -16,6 +16,18 @@ typedef struct {
     int*    Jindx;                 // Jacobian column indexes
     int     Nmax;                  // Max. number of equations
     int     Adjust;                // use adjustable step size
+    double** J;                    // Saved Jacobian matrix
+    void    (*Jfunc)(double, double*, int, double*); // Function it belongs to
+    int     Jn;                    // Its number of equations (0 if none)
+    int     Jage;                  // Times it has been reused
+    int     Reuse;                 // Max. times it may be reused
+    double  LUghinv;               // Diagonal shift factorized in A (0 if none)
+    long    Njac;                  // Jacobians evaluated
+    long    Nreused;               // Steps that reused a saved Jacobian
+    long    Nfactor;               // Factorizations made
+    long    NfactorReused;         // Steps that reused a factorization
+    long    Nsteps;                // Steps accepted
+    long    Nrejects;              // Steps rejected
 }MSXRosenbrock;
 
 // Opens the ODE solver system
@@ -24,7 +36,18 @@ int  ros2_open(int n, int adjust);
 // Closes the ODE solver system
 void ros2_close(void);
 
+// Sets the number of steps that may reuse a Jacobian
+void ros2_setReuse(int maxuses);
+
+// Returns (and clears) the counts of Jacobians and factorizations
+// evaluated and reused
+void ros2_getStats(long *njac, long *nreused, long *nfactor, long *nfactorReused);
+
+// Returns (and clears) the counts of steps accepted and rejected
+void ros2_getSteps(long *nsteps, long *nrejects);
+
 // Applies the solver to integrate a specific system of ODEs
 int  ros2_integrate(double y[], int n, double t, double tnext,
                     double* htry, double atol[], double rtol[],
-                    void (*func)(double, double*, int, double*));
+                    void (*func)(double, double*, int, double*),
+                    void (*jac)(double, double*, int, double**));
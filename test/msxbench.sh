@@ -0,0 +1,234 @@
+#!/bin/sh
+# MSX benchmark script
+#
+# Usage: msxbench.sh runepanetmsx [outdir]
+#
+# Runs each example network under each solver, with and without the
+# COMPILER option, at each thread count, and then does the same for
+# copies of Net3 tiled up to each network size. One line of timings
+# is written to outdir/msxbench.csv for each run.
+#
+# Environment variables that change what is run:
+#   MSXBENCH_SOLVERS   solvers to use              (EUL RK5 ROS2)
+#   MSXBENCH_COMPILERS compiler options to use     (NONE GC)
+#   MSXBENCH_THREADS   OpenMP thread counts        (1 2 4)
+#   MSXBENCH_LINKS     sizes of the tiled networks (10000 50000 100000 500000)
+#   MSXBENCH_HOURS     duration of the tiled runs  (24)
+#   MSXBENCH_TILED     MSX file of the tiled runs  (Net3-NH2Cl/Net3-NH2CL.msx)
+
+exe=$1
+out=${2:-msxbench}
+if [ -z "$exe" ]; then
+  echo "usage: $0 runepanetmsx [outdir]"
+  exit 1
+fi
+case $exe in
+  /*) ;;
+  *) exe=`pwd`/$exe ;;
+esac
+
+testdir=`cd \`dirname $0\` && pwd`
+solvers=${MSXBENCH_SOLVERS:-"EUL RK5 ROS2"}
+compilers=${MSXBENCH_COMPILERS:-"NONE GC"}
+threads=${MSXBENCH_THREADS:-"1 2 4"}
+sizes=${MSXBENCH_LINKS:-"10000 50000 100000 500000"}
+hours=${MSXBENCH_HOURS:-24}
+tiled=${MSXBENCH_TILED:-Net3-NH2Cl/Net3-NH2CL.msx}
+
+mkdir -p "$out" || exit 1
+cd "$out" || exit 1
+csv=msxbench.csv
+
+# Choose a way to measure peak memory use
+if /usr/bin/time -f %M true >/dev/null 2>&1; then
+  timer=gnu
+elif /usr/bin/time -l true >/dev/null 2>&1; then
+  timer=bsd
+else
+  timer=none
+fi
+
+# Writes a copy of an MSX file that uses a given solver and compiler,
+# profiles the run and reports only a given node
+setoptions()
+{
+  awk -v solver=$2 -v compiler=$3 -v node=$4 '
+    { sub(/\r$/, "") }
+    /^[ \t]*\[/ { sec = toupper($1) }
+    sec == "[OPTIONS]" && toupper($1) ~ /^(SOLVER|COMPILER|PROFILE)$/ { next }
+    sec == "[REPORT]" && toupper($1) ~ /^(NODES|LINKS)$/ { next }
+    { print }
+    sec == "[OPTIONS]" && toupper($1) == "[OPTIONS]" {
+      print "SOLVER   " solver
+      print "COMPILER " compiler
+      print "PROFILE  YES"
+    }
+    END {
+      print "[REPORT]"
+      print "NODES " node
+    }' "$1"
+}
+
+# Writes the ID of the first junction in an EPANET input file
+firstnode()
+{
+  awk '
+    { sub(/\r$/, "") }
+    /^[ \t]*\[/ { sec = toupper($1); next }
+    sec == "[JUNCTIONS]" && $1 !~ /^;/ && NF > 0 { print $1; exit }' "$1"
+}
+
+# Writes n copies of an EPANET input (type inp) or MSX (type msx) file
+# as one file, appending _i to the ID of each node, link and rule of
+# copy i. Each copy keeps its own sources, tanks and reservoirs. The
+# tiled network runs for a given number of hours, reporting from the
+# start.
+tile()
+{
+  awk -v n=$2 -v type=$3 -v hours=$4 '
+    function id(x) { return x "_" t }
+    function tokens(    i, k) {
+      for (i = 1; i < NF; i++) {
+        k = toupper($i)
+        if (k ~ /^(NODE|LINK|JUNCTION|RESERVOIR|TANK|PIPE|PUMP|VALVE|RULE)$/)
+          $(i+1) = id($(i+1))
+      }
+    }
+    function lists(    i, m) {
+      for (i = 2; i <= NF; i++)
+        if (toupper($i) != "ALL" && toupper($i) != "NONE") { $i = id($i); m++ }
+      return m > 0
+    }
+    # returns 1 if the line belongs to every copy, after renaming its IDs
+    function copy(sec,    k) {
+      k = toupper($1)
+      if (type == "msx") {
+        if (sec == "[QUALITY]" || sec == "[PARAMETERS]") {
+          if (k == "GLOBAL") return 0
+          $2 = id($2)
+        }
+        else if (sec == "[SOURCES]") $2 = id($2)
+        else if (sec == "[REPORT]" && (k == "NODES" || k == "LINKS")) return lists()
+        else return 0
+        return 1
+      }
+      if (sec ~ /^\[(JUNCTIONS|RESERVOIRS|TANKS|EMITTERS|QUALITY|SOURCES|MIXING|COORDINATES|DEMANDS|STATUS|VERTICES)\]$/)
+        $1 = id($1)
+      else if (sec ~ /^\[(PIPES|PUMPS|VALVES)\]$/) {
+        $1 = id($1); $2 = id($2); $3 = id($3)
+      }
+      else if (sec == "[REACTIONS]" && k ~ /^(BULK|WALL|TANK)$/) $2 = id($2)
+      else if (sec == "[ENERGY]" && k == "PUMP") $2 = id($2)
+      else if (sec == "[TAGS]") $2 = id($2)
+      else if (sec == "[CONTROLS]" || sec == "[RULES]") tokens()
+      else if (sec == "[REPORT]" && (k == "NODES" || k == "LINKS")) return lists()
+      else return 0
+      return 1
+    }
+    { sub(/\r$/, "") }
+    /^[ \t]*\[/ {
+      sec = toupper($1)
+      if (!(sec in seen)) { seen[sec] = 1; order[++nsec] = sec }
+      next
+    }
+    { line[sec, ++nline[sec]] = $0 }
+    END {
+      for (s = 1; s <= nsec; s++) {
+        sec = order[s]
+        print sec
+        if (sec == "[LABELS]") { print ""; continue }
+        for (t = 1; t <= n; t++) {
+          for (j = 1; j <= nline[sec]; j++) {
+            $0 = line[sec, j]
+            sub(/;.*/, "")
+            if (NF == 0) {
+              if (t == 1) print line[sec, j]
+              continue
+            }
+            if (sec == "[TIMES]" && toupper($1) == "DURATION") $0 = "Duration " hours
+            if (sec == "[TIMES]" && toupper($1 " " $2) == "REPORT START") $0 = "Report Start 0"
+            if (copy(sec)) print
+            else if (t == 1) print
+          }
+        }
+        print ""
+      }
+    }' "$1"
+}
+
+# Counts the links in an EPANET input file
+countlinks()
+{
+  awk '
+    { sub(/\r$/, "") }
+    /^[ \t]*\[/ { sec = toupper($1); next }
+    sec ~ /^\[(PIPES|PUMPS|VALVES)\]$/ && $1 !~ /^;/ && NF > 0 { n++ }
+    END { print n + 0 }' "$1"
+}
+
+# Runs a model and appends its timings to the results file
+run()
+{
+  name=$1; links=$2; inp=$3; msx=$4
+  for solver in $solvers; do
+    for compiler in $compilers; do
+      setoptions "$msx" $solver $compiler `firstnode "$inp"` > bench.msx
+      for nt in $threads; do
+        tag=$name-$solver-$compiler-$nt
+        echo "$tag"
+        case $timer in
+          gnu) OMP_NUM_THREADS=$nt /usr/bin/time -f %M -o $tag.mem "$exe" "$inp" bench.msx $tag.rpt $tag.out > $tag.log 2>&1 ;;
+          bsd) OMP_NUM_THREADS=$nt /usr/bin/time -l "$exe" "$inp" bench.msx $tag.rpt $tag.out > $tag.log 2> $tag.mem ;;
+          *)   OMP_NUM_THREADS=$nt "$exe" "$inp" bench.msx $tag.rpt $tag.out > $tag.log 2>&1 ;;
+        esac
+        status=$?
+        rm -f $tag.out
+        awk -v model=$name -v links=$links -v solver=$solver \
+            -v compiler=$compiler -v threads=$nt -v status=$status \
+            -v timer=$timer -v mem=$tag.mem '
+          { sub(/\r$/, "") }
+          /^Run Profile/           { profile = 1 }
+          profile && $1 == "Total" { wall = $2; cpu = $3 }
+          /^Segment Steps:/        { segsteps = $3 }
+          /^Quality Time Steps:/   { qsteps = $4 }
+          /^Integrator Steps:/     { isteps = $3 }
+          END {
+            rss = "NA"
+            if (timer == "gnu") { if ((getline x < mem) > 0) rss = x }
+            else if (timer == "bsd") {
+              while ((getline x < mem) > 0)
+                if (x ~ /maximum resident set size/) { split(x, f, " "); rss = int(f[1] / 1024) }
+            }
+            sps = wall > 0 ? qsteps / wall : 0
+            ssps = wall > 0 ? segsteps / wall : 0
+            printf "%s,%d,%s,%s,%d,%d,%.3f,%.3f,%d,%.1f,%.0f,%.1f,%d,%s\n", model, links,
+              solver, compiler, threads, status, wall, cpu, qsteps, sps, segsteps,
+              ssps, isteps, rss
+          }' $tag.rpt >> $csv
+      done
+    done
+  done
+  rm -f bench.msx
+}
+
+echo "model,links,solver,compiler,threads,status,wall_s,cpu_s,quality_steps,steps_per_s,segment_steps,segment_steps_per_s,integrator_steps,peak_rss_kb" > $csv
+
+# Example networks
+t=$testdir
+run as5      `countlinks $t/As5Adsorb/example.inp`        $t/As5Adsorb/example.inp        $t/As5Adsorb/example.msx
+run batch    `countlinks $t/Batch-NH2Cl/batch-nh2cl.inp`  $t/Batch-NH2Cl/batch-nh2cl.inp  $t/Batch-NH2Cl/batch-nh2cl.msx
+run net2     `countlinks $t/Net2-CL2/net2-cl2.inp`        $t/Net2-CL2/net2-cl2.inp        $t/Net2-CL2/net2-cl2.msx
+run net3bio  `countlinks $t/Net3-Bio/net3-bio.inp`        $t/Net3-Bio/net3-bio.inp        $t/Net3-Bio/net3-bio.msx
+run net3nh2cl `countlinks $t/Net3-NH2Cl/Net3-NH2CL.inp`   $t/Net3-NH2Cl/Net3-NH2CL.inp    $t/Net3-NH2Cl/Net3-NH2CL.msx
+
+# Tiled copies of Net3
+per=`countlinks $t/Net3-NH2Cl/Net3-NH2CL.inp`
+for size in $sizes; do
+  n=`expr \( $size + $per - 1 \) / $per`
+  tile $t/Net3-NH2Cl/Net3-NH2CL.inp $n inp $hours > net3x$n.inp
+  tile $t/$tiled $n msx $hours > net3x$n.msx
+  run net3x$n `expr $n \* $per` net3x$n.inp net3x$n.msx
+  rm -f net3x$n.inp net3x$n.msx
+done
+
+echo "Timings written to $out/$csv"
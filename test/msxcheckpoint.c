@@ -0,0 +1,246 @@
+/*******************************************************************************
+**  MODULE:        MSXCHECKPOINT.C
+**  PROJECT:       EPANET-MSX
+**  DESCRIPTION:   Checks that a simulation restarted from a checkpoint
+**                 reproduces the uninterrupted simulation.
+**  COPYRIGHT:     Copyright (C) 2007 Feng Shang, Lewis Rossman, and James Uber.
+**                 All Rights Reserved. See license information in LICENSE.TXT.
+**  AUTHORS:       L. Rossman, US EPA - NRMRL
+**                 F. Shang, University of Cincinnati
+**                 J. Uber, University of Cincinnati
+**  VERSION:       1.1.00
+**  LAST UPDATE:   10/14/26
+**
+**  Usage: msxcheckpoint inpfile msxfile rptfile chkfile
+**
+**  The network's water quality is first simulated without interruption.
+**  A checkpoint is saved to chkfile at the first quality time step past
+**  the middle of the simulation that falls inside a hydraulic time step,
+**  and the quality of each species at every node and link is kept for
+**  each step after it. The simulation is then initialized again, restored
+**  from the checkpoint and run to its end, and the qualities it finds at
+**  each step must be identical to those of the first run.
+**
+**  Returns 0 if they are, 1 if they aren't or 2 if a run fails with an
+**  EPANET or EPANET-MSX error.
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "epanet2.h"                   // EPANET toolkit header file
+#include "epanetmsx.h"                 // EPANET-MSX toolkit header file
+
+typedef struct                         // QUALITY FOUND AFTER EACH TIME STEP
+{
+    long   *t;                         // time reached by each step (sec)
+    double *c;                         // quality of each species at each
+                                       //   node and link after each step
+    long   nsteps;                     // number of steps kept
+    long   size;                       // number of steps there's room for
+}   Sresults;
+
+static int  Nnodes, Nlinks, Nspecies;  // numbers of nodes, links and species
+
+static int  simulate(int restore, long hstep, char *chkfile, Sresults *r);
+static int  keepStep(Sresults *r, long t);
+static int  compare(Sresults *r1, Sresults *r2);
+
+int main(int argc, char *argv[])
+/*
+**  Purpose:
+**    main function of the checkpoint test.
+**
+**  Input:
+**    argc = number of command line arguments
+**    argv = array of command line arguments.
+**
+**  Returns:
+**    0 if the restarted run reproduces the uninterrupted one, 1 if it
+**    doesn't or 2 if a run fails.
+*/
+{
+    int  err;
+    long hstep = 0;
+    Sresults r1 = {NULL, NULL, 0, 0};
+    Sresults r2 = {NULL, NULL, 0, 0};
+
+    if ( argc < 5 )
+    {
+        printf("\n Too few command line arguments.\n");
+        return 1;
+    }
+
+// --- open the EPANET and MSX files and solve the hydraulics once
+
+    err = ENopen(argv[1], argv[3], "");
+    if ( !err ) err = MSXopen(argv[2]);
+    if ( !err ) err = MSXsolveH();
+    if ( !err ) err = ENgettimeparam(EN_HYDSTEP, &hstep);
+    if ( !err ) err = ENgetcount(EN_NODECOUNT, &Nnodes);
+    if ( !err ) err = ENgetcount(EN_LINKCOUNT, &Nlinks);
+    if ( !err ) err = MSXgetcount(MSX_SPECIES, &Nspecies);
+
+// --- run the simulation without interruption and again from its checkpoint
+
+    if ( !err ) err = simulate(0, hstep, argv[4], &r1);
+    if ( !err ) err = simulate(1, hstep, argv[4], &r2);
+    if ( err )
+    {
+        if ( err > 1 ) printf("\n%s: error code %d\n", argv[2], err);
+        err = 2;
+    }
+    else
+    {
+        printf("\n%s: ", argv[2]);
+        err = compare(&r1, &r2);
+    }
+    MSXclose();
+    ENclose();
+    remove(argv[4]);
+    free(r1.t);
+    free(r1.c);
+    free(r2.t);
+    free(r2.c);
+    return err;
+}
+
+//=============================================================================
+
+int simulate(int restore, long hstep, char *chkfile, Sresults *r)
+/*
+**  Purpose:
+**    simulates the network's water quality, keeping the quality
+**    found after each step that follows the checkpoint.
+**
+**  Input:
+**    restore = 1 if the simulation starts from the checkpoint or 0 if
+**              it runs from the start and saves the checkpoint
+**    hstep = hydraulic time step (sec)
+**    chkfile = name of the checkpoint file.
+**
+**  Output:
+**    r = quality found after each step.
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int  err, saved = restore;
+    long t = 0, tleft = 0;
+
+    err = MSXinit(0);
+    if ( !err && restore ) err = MSXrestorestate(chkfile);
+    if ( err ) return err;
+    do
+    {
+        err = MSXstep(&t, &tleft);
+        if ( !err && saved ) err = keepStep(r, t);
+        else if ( !err && tleft > 0 && t >= tleft &&
+                  (hstep <= 0 || t % hstep != 0) )
+        {
+            err = MSXsavestate(chkfile);
+            saved = 1;
+        }
+    } while ( !err && tleft > 0 );
+    if ( !err && r->nsteps == 0 )
+    {
+        printf("\n%s: no time steps follow the checkpoint\n", chkfile);
+        err = 1;
+    }
+    return err;
+}
+
+//=============================================================================
+
+int keepStep(Sresults *r, long t)
+/*
+**  Purpose:
+**    keeps the quality of each species at each node and link.
+**
+**  Input:
+**    r = quality found after each step
+**    t = time reached by the step (sec).
+**
+**  Returns:
+**    an error code (0 if no error).
+*/
+{
+    int    i, m, err = 0;
+    long   n = (long)(Nnodes + Nlinks) * Nspecies;
+    double *c;
+
+    if ( r->nsteps == r->size )
+    {
+        r->size = r->size ? 2 * r->size : 256;
+        r->t = (long *) realloc(r->t, r->size * sizeof(long));
+        r->c = (double *) realloc(r->c, r->size * n * sizeof(double));
+        if ( r->t == NULL || r->c == NULL ) return 101;  // out of memory
+    }
+    r->t[r->nsteps] = t;
+    c = r->c + r->nsteps * n;
+    for (i = 1; i <= Nnodes && !err; i++)
+    {
+        for (m = 1; m <= Nspecies && !err; m++)
+            err = MSXgetqual(MSX_NODE, i, m, c++);
+    }
+    for (i = 1; i <= Nlinks && !err; i++)
+    {
+        for (m = 1; m <= Nspecies && !err; m++)
+            err = MSXgetqual(MSX_LINK, i, m, c++);
+    }
+    r->nsteps++;
+    return err;
+}
+
+//=============================================================================
+
+int compare(Sresults *r1, Sresults *r2)
+/*
+**  Purpose:
+**    compares the qualities found by the uninterrupted and
+**    restarted runs.
+**
+**  Input:
+**    r1 = quality found by the uninterrupted run
+**    r2 = quality found by the restarted run.
+**
+**  Returns:
+**    0 if they are identical or 1 if not.
+*/
+{
+    long   i, k, first = -1;
+    long   n = (long)(Nnodes + Nlinks) * Nspecies;
+    double d, dmax = 0.0;
+
+    if ( r1->nsteps != r2->nsteps || r1->t[0] != r2->t[0] )
+    {
+        printf("restarted run has %ld steps from %ld sec, not %ld from %ld sec\n",
+               r2->nsteps, r2->t[0], r1->nsteps, r1->t[0]);
+        return 1;
+    }
+    for (k = 0; k < r1->nsteps; k++)
+    {
+        if ( r1->t[k] != r2->t[k] && first < 0 ) first = k;
+        for (i = 0; i < n && r1->t[k] == r2->t[k]; i++)
+        {
+            d = fabs(r1->c[k*n+i] - r2->c[k*n+i]);
+            if ( d > 0.0 || r1->c[k*n+i] != r2->c[k*n+i] )
+            {
+                if ( first < 0 ) first = k;
+                if ( d > dmax ) dmax = d;
+            }
+        }
+    }
+    if ( first >= 0 )
+    {
+        printf("restarted run differs from %ld sec, by up to %g\n",
+               r1->t[first], dmax);
+        return 1;
+    }
+    printf("restarted run at %ld sec matches for %ld steps\n",
+           r1->t[0], r1->nsteps);
+    return 0;
+}
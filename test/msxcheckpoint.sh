@@ -0,0 +1,84 @@
+#!/bin/sh
+# MSX checkpoint test script
+#
+# Usage: msxcheckpoint.sh msxcheckpoint [outdir]
+#
+# Runs msxcheckpoint (built from test/msxcheckpoint.c) on each example
+# network with its own options and again with each option below added,
+# at each thread count. Each run saves a checkpoint in the middle of a
+# hydraulic time step, restores it and must reproduce the uninterrupted
+# run exactly. Exits with the number of runs that failed.
+#
+# Environment variables that change what is run:
+#   MSXCHECK_OPTIONS   options added to each network (NONE MAXSEGMENTS REACTSTEP MASSCHECK)
+#   MSXCHECK_THREADS   OpenMP thread counts           (1 4)
+
+exe=$1
+out=${2:-msxcheckpoint}
+if [ -z "$exe" ]; then
+  echo "usage: $0 msxcheckpoint [outdir]"
+  exit 1
+fi
+case $exe in
+  /*) ;;
+  *) exe=`pwd`/$exe ;;
+esac
+
+testdir=`cd \`dirname $0\` && pwd`
+options=${MSXCHECK_OPTIONS:-"NONE MAXSEGMENTS REACTSTEP MASSCHECK"}
+threads=${MSXCHECK_THREADS:-"1 4"}
+
+mkdir -p "$out" || exit 1
+cd "$out" || exit 1
+failed=0
+
+# Writes a copy of an MSX file with an option line added, replacing
+# the file's own setting of that option
+addoption()
+{
+  awk -v line="$2" '
+    BEGIN { split(line, f, " "); key = toupper(f[1]) }
+    { sub(/\r$/, "") }
+    /^[ \t]*\[/ { sec = toupper($1) }
+    sec == "[OPTIONS]" && key != "" && toupper($1) == key { next }
+    { print }
+    sec == "[OPTIONS]" && toupper($1) == "[OPTIONS]" && line != "" { print line }' "$1"
+}
+
+# Runs the checkpoint test on a network under each option and thread count
+run()
+{
+  name=$1; inp=$2; msx=$3
+  for option in $options; do
+    case $option in
+      MAXSEGMENTS) line="MAXSEGMENTS 10" ;;
+      REACTSTEP)   line="REACTSTEP 1200" ;;
+      MASSCHECK)   line="MASSCHECK YES" ;;
+      *)           line="" ;;
+    esac
+    addoption "$msx" "$line" > check.msx
+    for nt in $threads; do
+      tag=$name-$option-$nt
+      OMP_NUM_THREADS=$nt "$exe" "$inp" check.msx $tag.rpt $tag.chk > $tag.log 2>&1
+      status=$?
+      if [ $status -eq 0 ]; then
+        echo "$tag: passed"
+      else
+        echo "$tag: FAILED"
+        cat $tag.log
+        failed=`expr $failed + 1`
+      fi
+    done
+  done
+  rm -f check.msx
+}
+
+t=$testdir
+run as5       $t/As5Adsorb/example.inp        $t/As5Adsorb/example.msx
+run batch     $t/Batch-NH2Cl/batch-nh2cl.inp  $t/Batch-NH2Cl/batch-nh2cl.msx
+run net2      $t/Net2-CL2/net2-cl2.inp        $t/Net2-CL2/net2-cl2.msx
+run net3bio   $t/Net3-Bio/net3-bio.inp        $t/Net3-Bio/net3-bio.msx
+run net3nh2cl $t/Net3-NH2Cl/Net3-NH2CL.inp    $t/Net3-NH2Cl/Net3-NH2CL.msx
+
+echo "$failed checkpoint runs failed"
+exit $failed